@@ -0,0 +1,352 @@
+/*
+*   TotalJustice
+*/
+
+// protocol benchmarks, the console library and the server run in one process over a socketpair.
+// nothing here needs a switch, so it can run on every change to catch regressions.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <random>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "fs.hpp"
+#include "nxusb.h"
+#include "nxusb_async.h"
+#include "nxusb_compress.h"
+#include "nxusb_dir.h"
+#include "nxusb_stats.h"
+#include "server.hpp"
+#include "transport.hpp"
+
+
+namespace
+{
+    struct Options
+    {
+        uint64_t ops = 20000;               // per metadata bench.
+        uint64_t file_size = 0x4000000;     // 64MiB moved per chunk size.
+        uint64_t dir_entries = 10000;
+    };
+
+    double now()
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // usb_alloc_aligned calls so far, from the library's stats.
+    uint64_t allocs()
+    {
+        static usb_stats_t stats;
+        usb_stats_snapshot(&stats);
+        return stats.allocs;
+    }
+
+    bool g_failed = false;
+
+    bool check(UsbRet ret, const char *what)
+    {
+        if (ret != UsbReturnCode_Success)
+        {
+            std::fprintf(stderr, "%s failed with 0x%X\n", what, ret);
+            g_failed = true;
+        }
+        return ret == UsbReturnCode_Success;
+    }
+
+    // times fn, which does count units of work and moves bytes, and prints a row for it.
+    template <typename Fn>
+    void bench(const char *name, uint64_t count, uint64_t bytes, Fn fn)
+    {
+        const auto allocs_before = allocs();
+        const auto start = now();
+        const bool ok = fn();
+        const auto secs = now() - start;
+        const auto allocs_used = allocs() - allocs_before;
+
+        if (!ok)
+        {
+            std::printf("%-36s %10s\n", name, "failed");
+            return;
+        }
+
+        std::printf("%-36s %10llu %9.3f %12.1f", name, static_cast<unsigned long long>(count), secs, count / secs);
+        if (bytes)
+            std::printf(" %10.1f", bytes / secs / (1024.0 * 1024.0));
+        else
+            std::printf(" %10s", "-");
+        std::printf(" %8llu\n", static_cast<unsigned long long>(allocs_used));
+    }
+
+    bool write_file(const std::string &path, uint64_t size, uint32_t seed)
+    {
+        const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+
+        std::mt19937_64 rng(seed);
+        std::vector<uint64_t> buf(0x20000);
+        bool ok = true;
+        for (uint64_t done = 0; ok && done < size;)
+        {
+            for (auto &v : buf)
+                v = rng();
+            const size_t chunk = size - done < buf.size() * 8 ? size - done : buf.size() * 8;
+            ok = write(fd, buf.data(), chunk) == static_cast<ssize_t>(chunk);
+            done += chunk;
+        }
+        close(fd);
+        return ok;
+    }
+
+    bool make_tree(const std::string &root, const Options &options)
+    {
+        if (!write_file(root + "/data", options.file_size, 1) || fs::touch_dir(root + "/many") != UsbReturnCode_Success)
+            return false;
+
+        static const char *exts[] = { ".txt", ".nsp", ".xci", ".nro" };
+        for (uint64_t i = 0; i < options.dir_entries; i++)
+        {
+            const auto path = root + "/many/file" + std::to_string(i) + exts[i % 4];
+            if (!write_file(path, i % 0x100, i))
+                return false;
+        }
+        return true;
+    }
+
+    void bench_metadata(const Options &options)
+    {
+        const auto n = options.ops;
+
+        bench("usb_ping", n, 0, [n]() {
+            for (uint64_t i = 0; i < n; i++)
+                if (!check(usb_ping(), "usb_ping"))
+                    return false;
+            return true;
+        });
+
+        bench("usb_get_file_size_from_path", n, 0, [n]() {
+            uint64_t size;
+            for (uint64_t i = 0; i < n; i++)
+                if (!check(usb_get_file_size_from_path("data", &size), "usb_get_file_size_from_path"))
+                    return false;
+            return true;
+        });
+
+        bench("usb_is_file", n, 0, [n]() {
+            for (uint64_t i = 0; i < n; i++)
+                if (!check(usb_is_file("data"), "usb_is_file"))
+                    return false;
+            return true;
+        });
+
+        bench("usb_get_change_token", n, 0, [n]() {
+            uint64_t token;
+            for (uint64_t i = 0; i < n; i++)
+                if (!check(usb_get_change_token("many", &token), "usb_get_change_token"))
+                    return false;
+            return true;
+        });
+
+        bench("usb_async_path size x16 inflight", n, 0, [n]() {
+            if (!check(usb_async_start(0x10), "usb_async_start"))
+                return false;
+
+            std::vector<usb_async_t *> reqs(0x10);
+            bool ok = true;
+            for (uint64_t i = 0; ok && i < n; i += reqs.size())
+            {
+                for (auto &req : reqs)
+                    ok &= check(usb_async_path(UsbMode_GetFileSizeFromPath, "data", &req), "usb_async_path");
+                for (auto &req : reqs)
+                    ok &= check(usb_async_wait(req, nullptr), "usb_async_wait");
+            }
+            return check(usb_async_stop(), "usb_async_stop") && ok;
+        });
+    }
+
+    void bench_files(const Options &options)
+    {
+        const uint64_t size = options.file_size;
+        static const size_t chunks[] = { 0x1000, 0x10000, 0x100000, 0x800000 };
+
+        auto buf = static_cast<uint8_t *>(usb_alloc_aligned(chunks[3]));
+        if (!buf)
+        {
+            check(UsbReturnCode_FailedAllocPool, "usb_alloc_aligned");
+            return;
+        }
+
+        for (const auto chunk : chunks)
+        {
+            const auto count = size / chunk;
+            char name[64];
+
+            std::snprintf(name, sizeof(name), "usb_read_file %zuKiB", chunk / 1024);
+            bench(name, count, count * chunk, [buf, chunk, count]() {
+                if (!check(usb_open_file("data", UsbMode_OpenFileReadBytes), "usb_open_file"))
+                    return false;
+                bool ok = true;
+                for (uint64_t i = 0; ok && i < count; i++)
+                    ok = check(usb_read_file(buf, chunk, i * chunk), "usb_read_file");
+                usb_close_file();
+                return ok;
+            });
+
+            std::snprintf(name, sizeof(name), "usb_write_to_file %zuKiB", chunk / 1024);
+            bench(name, count, count * chunk, [buf, chunk, count]() {
+                if (!check(usb_open_file("out", UsbMode_OpenFileWriteBytes), "usb_open_file"))
+                    return false;
+                bool ok = true;
+                for (uint64_t i = 0; ok && i < count; i++)
+                    ok = check(usb_write_to_file(buf, chunk, i * chunk), "usb_write_to_file");
+                usb_close_file();
+                return ok;
+            });
+        }
+
+        usb_free_aligned(buf);
+    }
+
+    void bench_dirs(const Options &options)
+    {
+        const auto n = options.dir_entries;
+
+        bench("usb_read_dir_from_path", n, 0, [n]() {
+            std::vector<usb_file_entry_t> entries(n);
+            return check(usb_read_dir_from_path(entries.data(), n, "many"), "usb_read_dir_from_path");
+        });
+
+        bench("usb_read_dir_compact", n, 0, [n]() {
+            usb_dir_list_t list;
+            if (!check(usb_read_dir_compact("many", &list), "usb_read_dir_compact"))
+                return false;
+            const bool ok = list.count == n;
+            usb_dir_list_free(&list);
+            return ok;
+        });
+
+        bench("usb_dir_cursor 256 per page", n, 0, [n]() {
+            usb_dir_cursor_t *cursor;
+            if (!check(usb_dir_cursor_open("many", 0x100, &cursor), "usb_dir_cursor_open"))
+                return false;
+
+            usb_dir_list_t page;
+            uint64_t total = 0;
+            bool ok = true;
+            do
+            {
+                ok = check(usb_dir_cursor_next(cursor, &page), "usb_dir_cursor_next");
+                total += ok ? page.count : 0;
+            } while (ok && page.count);
+
+            usb_dir_cursor_close(cursor);
+            return ok && total == n;
+        });
+
+        bench("usb_dir_query nsp / xci", n, 0, []() {
+            usb_dir_query_t query{};
+            usb_dir_query_add_ext(&query, USBFileExtentionType_Nsp);
+            usb_dir_query_add_ext(&query, USBFileExtentionType_Xci);
+
+            usb_dir_list_t list;
+            if (!check(usb_dir_query("many", &query, &list), "usb_dir_query"))
+                return false;
+            usb_dir_list_free(&list);
+            return true;
+        });
+    }
+
+    void print_usage(const char *name)
+    {
+        std::printf(
+            "usage: %s [options]\n"
+            "\n"
+            "  --quick              a smaller run, for a quick check.\n"
+            "  --ops <n>            calls per metadata bench (default 20000).\n"
+            "  --file-size <mib>    MiB moved per read / write chunk size (default 64).\n"
+            "  --entries <n>        files in the listed dir (default 10000).\n",
+            name);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    Options options;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!std::strcmp(argv[i], "--quick"))
+        {
+            options.ops = 2000;
+            options.file_size = 0x800000;
+            options.dir_entries = 1000;
+        }
+        else if (!std::strcmp(argv[i], "--ops") && i + 1 < argc)
+            options.ops = std::strtoull(argv[++i], nullptr, 0);
+        else if (!std::strcmp(argv[i], "--file-size") && i + 1 < argc)
+            options.file_size = std::strtoull(argv[++i], nullptr, 0) * 0x100000;
+        else if (!std::strcmp(argv[i], "--entries") && i + 1 < argc)
+            options.dir_entries = std::strtoull(argv[++i], nullptr, 0);
+        else
+        {
+            print_usage(argv[0]);
+            return !std::strcmp(argv[i], "--help") ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    // every chunk size has to fit at least once.
+    if (options.file_size < 0x800000)
+        options.file_size = 0x800000;
+
+    char root[] = "/tmp/nxusb-bench-XXXXXX";
+    if (!mkdtemp(root) || !make_tree(root, options))
+    {
+        std::fprintf(stderr, "failed to create the bench dir\n");
+        return EXIT_FAILURE;
+    }
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        std::fprintf(stderr, "failed to create the socketpair\n");
+        fs::delete_dir(root);
+        return EXIT_FAILURE;
+    }
+
+    FdTransport transport(fds[0], fds[0], true);
+    Server server(transport);
+    server.add_device("bench", root);
+    std::thread thread([&server]() { server.run(); });
+
+    usb_fd_transport_t console_fds = { fds[1], fds[1] };
+    usb_transport_t console;
+    usb_transport_fd(&console, &console_fds);
+    usb_set_transport(&console);
+
+    usb_stats_enable(true);
+    if (check(usb_init(), "usb_init"))
+    {
+        // raw numbers for the protocol, random data wouldn't compress anyway.
+        usb_set_compression(UsbCompression_None);
+
+        std::printf("%-36s %10s %9s %12s %10s %8s\n", "bench", "ops", "secs", "ops/s", "MiB/s", "allocs");
+        bench_metadata(options);
+        bench_files(options);
+        bench_dirs(options);
+    }
+
+    usb_exit();
+    close(fds[1]);
+    thread.join();
+    fs::delete_dir(root);
+
+    return g_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
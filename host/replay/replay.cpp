@@ -0,0 +1,346 @@
+/*
+*   TotalJustice
+*/
+
+// replays a trace recorded on the console with usb_trace_open.
+// the console side sends what the console wrote and reads what the host answered,
+// so a server can be driven without a switch. the host side does the opposite,
+// so the console can be driven without a server.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "nxusb_trace.h"
+#include "server.hpp"
+#include "transport.hpp"
+
+
+namespace
+{
+    struct Options
+    {
+        double speed = 0;       // 1 is the recorded speed, 0 is as fast as the link goes.
+        bool verify = false;    // compare what's read back with the trace.
+    };
+
+    struct Trace
+    {
+        FILE *file = nullptr;
+        usb_trace_header_t header{};
+        bool truncated = false;
+
+        ~Trace()
+        {
+            if (file)
+                std::fclose(file);
+        }
+    };
+
+    bool open_trace(Trace &trace, const char *path)
+    {
+        trace.file = std::fopen(path, "rb");
+        if (!trace.file)
+        {
+            std::fprintf(stderr, "failed to open %s\n", path);
+            return false;
+        }
+
+        if (std::fread(&trace.header, sizeof(trace.header), 1, trace.file) != 1 || trace.header.magic != USB_TRACE_MAGIC)
+        {
+            std::fprintf(stderr, "%s is not a trace\n", path);
+            return false;
+        }
+
+        if (trace.header.version != USB_TRACE_VERSION)
+        {
+            std::fprintf(stderr, "%s is trace version %u, only %u is supported\n", path, trace.header.version, USB_TRACE_VERSION);
+            return false;
+        }
+
+        return true;
+    }
+
+    // reads the next record and its payload, false at the end of the trace.
+    bool read_record(Trace &trace, usb_trace_record_t &record, std::vector<uint8_t> &payload)
+    {
+        if (std::fread(&record, sizeof(record), 1, trace.file) != 1)
+            return false;
+
+        payload.resize(record.payload ? record.moved : 0);
+        if (!payload.empty() && std::fread(payload.data(), 1, payload.size(), trace.file) != payload.size())
+        {
+            trace.truncated = true;
+            return false;
+        }
+        return true;
+    }
+
+    bool summary(Trace &trace)
+    {
+        struct ModeTotals
+        {
+            uint64_t reads, writes, bytes_read, bytes_written, link_ns, short_transfers;
+        };
+
+        std::vector<ModeTotals> modes(0x100);
+        usb_trace_record_t record{};
+        std::vector<uint8_t> payload;
+        uint64_t transfers = 0, end_ns = 0;
+
+        while (read_record(trace, record, payload))
+        {
+            auto &mode = modes[record.mode];
+            if (record.direction == UsbTraceDirection_Write)
+            {
+                mode.writes++;
+                mode.bytes_written += record.moved;
+            }
+            else
+            {
+                mode.reads++;
+                mode.bytes_read += record.moved;
+            }
+            mode.link_ns += record.duration_ns;
+            mode.short_transfers += record.moved != record.size;
+            end_ns = record.time_ns + record.duration_ns;
+            transfers++;
+        }
+
+        std::printf("trace version %u, %s, %llu transfers over %.3fs%s\n", trace.header.version,
+            trace.header.flags & UsbTraceFlag_Payload ? "with payloads" : "sizes only",
+            static_cast<unsigned long long>(transfers), end_ns / 1e9, trace.truncated ? ", truncated" : "");
+        std::printf("mode      reads    writes        read     written   link ms   short\n");
+
+        for (size_t i = 0; i < modes.size(); i++)
+        {
+            const auto &mode = modes[i];
+            if (!mode.reads && !mode.writes)
+                continue;
+
+            std::printf("0x%02zX %10llu %9llu %11llu %11llu %9.1f %7llu\n", i,
+                static_cast<unsigned long long>(mode.reads), static_cast<unsigned long long>(mode.writes),
+                static_cast<unsigned long long>(mode.bytes_read), static_cast<unsigned long long>(mode.bytes_written),
+                mode.link_ns / 1e6, static_cast<unsigned long long>(mode.short_transfers));
+        }
+
+        return !trace.truncated;
+    }
+
+    // plays one side of the trace over transport.
+    // tagged traffic only lines up if the other side answers in the recorded order.
+    bool replay(Trace &trace, Transport &transport, bool console, const Options &options)
+    {
+        if (!(trace.header.flags & UsbTraceFlag_Payload))
+        {
+            std::fprintf(stderr, "the trace was recorded without payloads, it can only be summarised\n");
+            return false;
+        }
+
+        usb_trace_record_t record{};
+        std::vector<uint8_t> payload, in;
+        uint64_t transfers = 0, bytes = 0, mismatches = 0;
+        bool ok = true;
+        const auto start = std::chrono::steady_clock::now();
+
+        while (read_record(trace, record, payload))
+        {
+            // what the console wrote is ours to send when playing the console.
+            const bool send = (record.direction == UsbTraceDirection_Write) == console;
+
+            if (send && options.speed > 0)
+            {
+                const auto at = std::chrono::nanoseconds(static_cast<uint64_t>(record.time_ns / options.speed));
+                std::this_thread::sleep_until(start + at);
+            }
+
+            size_t moved;
+            if (send)
+            {
+                moved = transport.write(payload.data(), payload.size());
+            }
+            else
+            {
+                in.resize(record.moved);
+                moved = transport.read(in.data(), in.size());
+                if (options.verify && moved == in.size() && std::memcmp(in.data(), payload.data(), in.size()))
+                {
+                    if (!mismatches)
+                        std::fprintf(stderr, "transfer %llu (mode 0x%02X) differs from the trace\n", static_cast<unsigned long long>(transfers), record.mode);
+                    mismatches++;
+                }
+            }
+
+            if (moved != record.moved)
+            {
+                std::fprintf(stderr, "the link dropped at transfer %llu (mode 0x%02X)\n", static_cast<unsigned long long>(transfers), record.mode);
+                ok = false;
+                break;
+            }
+
+            transfers++;
+            bytes += moved;
+
+            // the recorded session ended here.
+            if (record.moved != record.size)
+                break;
+        }
+
+        const auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::printf("replayed %llu transfers, %llu bytes in %.3fs (%.1f MiB/s)\n", static_cast<unsigned long long>(transfers),
+            static_cast<unsigned long long>(bytes), secs, bytes / secs / (1024.0 * 1024.0));
+
+        if (options.verify)
+            std::printf("%llu transfers differed from the trace\n", static_cast<unsigned long long>(mismatches));
+
+        if (trace.truncated)
+            std::fprintf(stderr, "the trace is truncated\n");
+
+        return ok && !trace.truncated && !mismatches;
+    }
+
+    // plays the console to a server in this process, over a socketpair.
+    bool replay_serve(Trace &trace, const char *dir, const Options &options)
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        {
+            std::fprintf(stderr, "failed to create the socketpair\n");
+            return false;
+        }
+
+        FdTransport server_transport(fds[0], fds[0], true);
+        Server server(server_transport);
+        if (!server.add_device("root", dir))
+        {
+            std::fprintf(stderr, "failed to add device %s\n", dir);
+            close(fds[1]);
+            return false;
+        }
+        std::thread thread([&server]() { server.run(); });
+
+        bool ok;
+        {
+            FdTransport console(fds[1], fds[1], true);
+            ok = replay(trace, console, true, options);
+        }
+
+        thread.join();
+        return ok;
+    }
+
+    void print_usage(const char *name)
+    {
+        std::printf(
+            "usage: %s [options] <trace>\n"
+            "\n"
+            "prints a summary of the trace if no target is given.\n"
+            "\n"
+            "play the console to a server:\n"
+            "  --serve <dir>        to a server in this process serving dir.\n"
+            "  --connect <path>     to a server on a unix socket (nxusb-server --unix).\n"
+            "\n"
+            "play the host to a console:\n"
+            "  --listen <path>      to the first console that connects to a unix socket.\n"
+#ifdef NXUSB_HAVE_LIBUSB
+            "  --usb                to a switch over usb.\n"
+#endif
+            "\n"
+            "  --speed <x>          1 replays at the recorded speed, 2 twice as fast, 0 as fast as possible (default).\n"
+            "  --verify             fail if what's read back differs from the trace.\n",
+            name);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    std::unique_ptr<Transport> transport;
+    const char *serve = nullptr;
+    const char *path = nullptr;
+    bool console = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!std::strcmp(argv[i], "--serve") && i + 1 < argc)
+        {
+            serve = argv[++i];
+        }
+        else if (!std::strcmp(argv[i], "--connect") && i + 1 < argc)
+        {
+            const int fd = unix_socket_connect(argv[++i]);
+            if (fd < 0)
+            {
+                std::fprintf(stderr, "failed to connect to %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            transport = std::make_unique<FdTransport>(fd, fd, true);
+            console = true;
+        }
+        else if (!std::strcmp(argv[i], "--listen") && i + 1 < argc)
+        {
+            const int fd = unix_socket_accept(argv[++i]);
+            if (fd < 0)
+            {
+                std::fprintf(stderr, "failed to accept on %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            transport = std::make_unique<FdTransport>(fd, fd, true);
+        }
+#ifdef NXUSB_HAVE_LIBUSB
+        else if (!std::strcmp(argv[i], "--usb"))
+        {
+            auto usb = std::make_unique<LibusbTransport>();
+            if (!usb->open())
+            {
+                std::fprintf(stderr, "failed to open usb device\n");
+                return EXIT_FAILURE;
+            }
+            transport = std::move(usb);
+        }
+#endif
+        else if (!std::strcmp(argv[i], "--speed") && i + 1 < argc)
+        {
+            options.speed = std::strtod(argv[++i], nullptr);
+        }
+        else if (!std::strcmp(argv[i], "--verify"))
+        {
+            options.verify = true;
+        }
+        else if (argv[i][0] == '-' || path)
+        {
+            print_usage(argv[0]);
+            return !std::strcmp(argv[i], "--help") ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        else
+        {
+            path = argv[i];
+        }
+    }
+
+    if (!path)
+    {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    Trace trace;
+    if (!open_trace(trace, path))
+        return EXIT_FAILURE;
+
+    bool ok;
+    if (serve)
+        ok = replay_serve(trace, serve, options);
+    else if (transport)
+        ok = replay(trace, *transport, console, options);
+    else
+        ok = summary(trace);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,335 @@
+/*
+*   TotalJustice
+*/
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include "fs.hpp"
+#include "nxusb_dir.h"
+#include "server.hpp"
+
+
+namespace
+{
+    struct ExtInfo
+    {
+        const char *ext;
+        uint8_t type;
+        uint8_t catagory;
+    };
+
+    constexpr ExtInfo EXT_INFO[] =
+    {
+        { "txt",    USBFileExtentionType_Txt,   UsbFileCatagory_Other },
+        { "ini",    USBFileExtentionType_Ini,   UsbFileCatagory_Other },
+        { "html",   USBFileExtentionType_Html,  UsbFileCatagory_Other },
+        { "htm",    USBFileExtentionType_Html,  UsbFileCatagory_Other },
+
+        { "zip",    USBFileExtentionType_Zip,   UsbFileCatagory_Compressed },
+        { "7z",     USBFileExtentionType_7zip,  UsbFileCatagory_Compressed },
+        { "rar",    USBFileExtentionType_Rar,   UsbFileCatagory_Compressed },
+
+        { "mp3",    USBFileExtentionType_Mp3,   UsbFileCatagory_Music },
+        { "mp4",    USBFileExtentionType_Mp4,   UsbFileCatagory_Movie },
+        { "mkv",    USBFileExtentionType_Mkv,   UsbFileCatagory_Movie },
+
+        { "nro",    USBFileExtentionType_Nro,   UsbFileCatagory_Homebrew },
+        { "nso",    USBFileExtentionType_Nso,   UsbFileCatagory_Homebrew },
+
+        { "nca",    USBFileExtentionType_Nca,   UsbFileCatagory_Game },
+        { "nsp",    USBFileExtentionType_Nsp,   UsbFileCatagory_Game },
+        { "xci",    USBFileExtentionType_Xci,   UsbFileCatagory_Game },
+        { "ncz",    USBFileExtentionType_Ncz,   UsbFileCatagory_Game },
+        { "nsz",    USBFileExtentionType_Nsz,   UsbFileCatagory_Game },
+        { "xcz",    USBFileExtentionType_Xcz,   UsbFileCatagory_Game },
+    };
+
+    // fat32 can't hold files of 4GiB or over.
+    constexpr uint64_t FAT32_FILE_MAX = 0xFFFFFFFF;
+
+    std::string join(const std::string &dir, const char *name)
+    {
+        if (!dir.empty() && dir.back() == '/')
+            return dir + name;
+        return dir + '/' + name;
+    }
+
+    bool is_dot(const char *name)
+    {
+        return !std::strcmp(name, ".") || !std::strcmp(name, "..");
+    }
+
+    // walks a dir without following symlinks, calling func with the path and stat of every entry.
+    template <typename Func>
+    bool walk(const std::string &path, bool recursive, Func &&func)
+    {
+        DIR *dir = opendir(path.c_str());
+        if (!dir)
+            return false;
+
+        while (const auto d = readdir(dir))
+        {
+            if (is_dot(d->d_name))
+                continue;
+
+            const auto full = join(path, d->d_name);
+            struct stat st;
+            if (lstat(full.c_str(), &st) < 0)
+                continue;
+
+            func(full, st);
+
+            if (recursive && S_ISDIR(st.st_mode))
+                walk(full, recursive, func);
+        }
+
+        closedir(dir);
+        return true;
+    }
+}
+
+namespace fs
+{
+    void pack_entries(const std::vector<usb_file_entry_t> &entries, size_t first, size_t last, std::vector<uint8_t> &out)
+    {
+        for (size_t i = first; i < last; i++)
+        {
+            const auto &entry = entries[i];
+            usb_dir_entry_packed_t packed{};
+            packed.file_size = entry.file_size;
+            packed.entry_type = entry.entry_type;
+            packed.ext_type = entry.ext_type;
+            packed.catagory = entry.catagory;
+            packed.size_type = entry.size_type;
+            packed.name_len = strnlen(entry.name, sizeof(entry.name));
+
+            const size_t name_len = packed.name_len;
+            from_le(packed);
+
+            const auto offset = out.size();
+            out.resize(offset + sizeof(packed) + name_len);
+            std::memcpy(out.data() + offset, &packed, sizeof(packed));
+            std::memcpy(out.data() + offset + sizeof(packed), entry.name, name_len);
+        }
+    }
+
+    bool make_entry(const std::string &path, const std::string &name, usb_file_entry_t &out)
+    {
+        struct stat st;
+        if (stat(path.c_str(), &st) < 0)
+            return false;
+
+        std::memset(&out, 0, sizeof(out));
+        std::strncpy(out.name, name.c_str(), sizeof(out.name) - 1);
+
+        if (S_ISDIR(st.st_mode))
+        {
+            out.entry_type = UsbFileEntryType_Dir;
+            out.ext_type = USBFileExtentionType_None;
+            out.catagory = UsbFileCatagory_Dir;
+            out.size_type = UsbFileSizeType_Dir;
+            return true;
+        }
+
+        out.entry_type = UsbFileEntryType_File;
+        out.ext_type = USBFileExtentionType_None;
+        out.catagory = UsbFileCatagory_Other;
+        out.size_type = static_cast<uint64_t>(st.st_size) > FAT32_FILE_MAX ? UsbFileSizeType_Large : UsbFileSizeType_Small;
+        out.file_size = st.st_size;
+
+        const auto dot = name.find_last_of('.');
+        if (dot != std::string::npos)
+        {
+            const auto ext = name.c_str() + dot + 1;
+            for (const auto &info : EXT_INFO)
+            {
+                if (!strcasecmp(ext, info.ext))
+                {
+                    out.ext_type = info.type;
+                    out.catagory = info.catagory;
+                    break;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    UsbRet list_dir(const std::string &path, std::vector<usb_file_entry_t> &out)
+    {
+        DIR *dir = opendir(path.c_str());
+        if (!dir)
+            return UsbReturnCode_FailedReadDir;
+
+        out.clear();
+        while (const auto d = readdir(dir))
+        {
+            if (is_dot(d->d_name))
+                continue;
+
+            usb_file_entry_t entry;
+            if (make_entry(join(path, d->d_name), d->d_name, entry))
+                out.push_back(entry);
+        }
+        closedir(dir);
+
+        std::sort(out.begin(), out.end(), [](const usb_file_entry_t &a, const usb_file_entry_t &b) {
+            return std::strcmp(a.name, b.name) < 0;
+        });
+
+        return UsbReturnCode_Success;
+    }
+
+    UsbRet get_dir_total(const std::string &path, bool recursive, uint64_t &out)
+    {
+        out = 0;
+        if (!walk(path, recursive, [&out](const std::string &, const struct stat &) { out++; }))
+            return UsbReturnCode_FailedGetDirTotal;
+        return UsbReturnCode_Success;
+    }
+
+    UsbRet get_dir_size(const std::string &path, bool recursive, uint64_t &out)
+    {
+        out = 0;
+        const auto func = [&out](const std::string &, const struct stat &st) {
+            if (S_ISREG(st.st_mode))
+                out += st.st_size;
+        };
+
+        if (!walk(path, recursive, func))
+            return recursive ? UsbReturnCode_FailedGetDirSizeRecursively : UsbReturnCode_FailedGetDirSize;
+        return UsbReturnCode_Success;
+    }
+
+    UsbRet get_file_size(const std::string &path, uint64_t &out)
+    {
+        struct stat st;
+        if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+            return UsbReturnCode_FailedGetFileSize;
+
+        out = st.st_size;
+        return UsbReturnCode_Success;
+    }
+
+    uint64_t mix(uint64_t x)
+    {
+        // splitmix64 finaliser.
+        x += 0x9E3779B97F4A7C15;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EB;
+        return x ^ (x >> 31);
+    }
+
+    UsbRet get_stat_hash(const std::string &path, uint64_t &out)
+    {
+        struct stat st;
+        if (stat(path.c_str(), &st) < 0)
+            return UsbReturnCode_FailedGetFileSize;
+
+        const uint64_t fields[] = {
+            static_cast<uint64_t>(st.st_dev), static_cast<uint64_t>(st.st_ino),
+            static_cast<uint64_t>(st.st_size), static_cast<uint64_t>(st.st_mode),
+            static_cast<uint64_t>(st.st_mtim.tv_sec), static_cast<uint64_t>(st.st_mtim.tv_nsec),
+            static_cast<uint64_t>(st.st_ctim.tv_sec), static_cast<uint64_t>(st.st_ctim.tv_nsec),
+        };
+
+        out = 0;
+        for (const auto field : fields)
+            out = mix(out ^ field);
+        return UsbReturnCode_Success;
+    }
+
+    uint64_t get_free_space(const std::string &path)
+    {
+        struct statvfs st;
+        if (statvfs(path.c_str(), &st) < 0)
+            return 0;
+        return static_cast<uint64_t>(st.f_bavail) * st.f_frsize;
+    }
+
+    bool is_file(const std::string &path)
+    {
+        struct stat st;
+        return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+    }
+
+    bool is_dir(const std::string &path)
+    {
+        struct stat st;
+        return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    }
+
+    UsbRet touch_file(const std::string &path)
+    {
+        const int fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+        if (fd < 0)
+            return UsbReturnCode_FailedTouchFile;
+
+        close(fd);
+        return UsbReturnCode_Success;
+    }
+
+    UsbRet touch_dir(const std::string &path)
+    {
+        if (mkdir(path.c_str(), 0755) < 0 && !is_dir(path))
+            return UsbReturnCode_FailedTouchDir;
+        return UsbReturnCode_Success;
+    }
+
+    UsbRet delete_file(const std::string &path)
+    {
+        if (unlink(path.c_str()) < 0 && errno != ENOENT)
+            return UsbReturnCode_FailedDeleteFile;
+        return UsbReturnCode_Success;
+    }
+
+    UsbRet delete_dir(const std::string &path)
+    {
+        struct stat st;
+        if (lstat(path.c_str(), &st) < 0)
+            return errno == ENOENT ? UsbReturnCode_Success : UsbReturnCode_FailedDeleteDir;
+
+        if (!S_ISDIR(st.st_mode))
+            return UsbReturnCode_NotDir;
+
+        DIR *dir = opendir(path.c_str());
+        if (!dir)
+            return UsbReturnCode_FailedDeleteDir;
+
+        UsbRet ret = UsbReturnCode_Success;
+        while (const auto d = readdir(dir))
+        {
+            if (is_dot(d->d_name))
+                continue;
+
+            const auto full = join(path, d->d_name);
+            if (lstat(full.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+                ret = delete_dir(full);
+            else if (unlink(full.c_str()) < 0)
+                ret = UsbReturnCode_FailedDeleteDir;
+
+            if (ret != UsbReturnCode_Success)
+                break;
+        }
+        closedir(dir);
+
+        if (ret == UsbReturnCode_Success && rmdir(path.c_str()) < 0)
+            ret = UsbReturnCode_FailedDeleteDir;
+        return ret;
+    }
+
+    UsbRet rename(const std::string &curr_path, const std::string &new_path, UsbRet fail)
+    {
+        if (::rename(curr_path.c_str(), new_path.c_str()) < 0)
+            return fail;
+        return UsbReturnCode_Success;
+    }
+}
@@ -0,0 +1,55 @@
+/*
+*   TotalJustice
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "nxusb.h"
+
+// filesystem helpers used by the server, every path here is already resolved.
+namespace fs
+{
+    // fills in the type, extention, catagory and size fields of an entry.
+    // returns false if the entry can't be stat'd.
+    bool make_entry(const std::string &path, const std::string &name, usb_file_entry_t &out);
+
+    // appends entries [first, last) in the packed format of nxusb_dir.h.
+    void pack_entries(const std::vector<usb_file_entry_t> &entries, size_t first, size_t last, std::vector<uint8_t> &out);
+
+    // lists a dir sorted by name, . and .. are skipped.
+    UsbRet list_dir(const std::string &path, std::vector<usb_file_entry_t> &out);
+
+    // number of entries in a dir, recursive counts every entry of every sub dir.
+    UsbRet get_dir_total(const std::string &path, bool recursive, uint64_t &out);
+
+    // sum of the file sizes in a dir.
+    UsbRet get_dir_size(const std::string &path, bool recursive, uint64_t &out);
+
+    UsbRet get_file_size(const std::string &path, uint64_t &out);
+
+    // hash of what stat says about the path, changes when the entry itself changes.
+    // a dir's stat changes when entries are added, removed or renamed, not when a file in it is written.
+    UsbRet get_stat_hash(const std::string &path, uint64_t &out);
+
+    // splitmix64 finaliser, for building hashes and tokens.
+    uint64_t mix(uint64_t x);
+
+    // free space of the filesystem the path lives on.
+    uint64_t get_free_space(const std::string &path);
+
+    bool is_file(const std::string &path);
+    bool is_dir(const std::string &path);
+
+    UsbRet touch_file(const std::string &path);
+    UsbRet touch_dir(const std::string &path);
+    UsbRet delete_file(const std::string &path);
+
+    // deletes a dir and everything in it.
+    UsbRet delete_dir(const std::string &path);
+
+    UsbRet rename(const std::string &curr_path, const std::string &new_path, UsbRet fail);
+}
@@ -0,0 +1,143 @@
+/*
+*   TotalJustice
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <unistd.h>
+
+#include "server.hpp"
+#include "transport.hpp"
+
+
+namespace
+{
+    void print_usage(const char *name)
+    {
+        std::printf(
+            "usage: %s [options] [device...]\n"
+            "\n"
+            "a device is a dir to serve, either path or name=path.\n"
+            "the current dir is served if no device is given.\n"
+            "\n"
+            "transport (default is stdio):\n"
+            "  --stdio              read from stdin, write to stdout.\n"
+            "  --unix <path>        listen on a unix socket and serve the first connection.\n"
+            "  --fifo <in> <out>    read from fifo in, write to fifo out.\n"
+#ifdef NXUSB_HAVE_LIBUSB
+            "  --usb                talk to a switch over usb.\n"
+#endif
+            "  --loop               keep serving new sessions until the link drops.\n",
+            name);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::unique_ptr<Transport> transport;
+    bool loop = false;
+    int device_args = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!std::strcmp(argv[i], "--stdio"))
+        {
+            transport = std::make_unique<FdTransport>(STDIN_FILENO, STDOUT_FILENO);
+        }
+        else if (!std::strcmp(argv[i], "--unix") && i + 1 < argc)
+        {
+            const int fd = unix_socket_accept(argv[++i]);
+            if (fd < 0)
+            {
+                std::fprintf(stderr, "failed to accept on %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            transport = std::make_unique<FdTransport>(fd, fd, true);
+        }
+        else if (!std::strcmp(argv[i], "--fifo") && i + 2 < argc)
+        {
+            const int in = open(argv[i + 1], O_RDONLY);
+            const int out = in < 0 ? -1 : open(argv[i + 2], O_WRONLY);
+            if (in < 0 || out < 0)
+            {
+                std::fprintf(stderr, "failed to open fifos %s %s\n", argv[i + 1], argv[i + 2]);
+                return EXIT_FAILURE;
+            }
+            transport = std::make_unique<FdTransport>(in, out, true);
+            i += 2;
+        }
+#ifdef NXUSB_HAVE_LIBUSB
+        else if (!std::strcmp(argv[i], "--usb"))
+        {
+            auto usb = std::make_unique<LibusbTransport>();
+            if (!usb->open())
+            {
+                std::fprintf(stderr, "failed to open usb device\n");
+                return EXIT_FAILURE;
+            }
+            transport = std::move(usb);
+        }
+#endif
+        else if (!std::strcmp(argv[i], "--loop"))
+        {
+            loop = true;
+        }
+        else if (argv[i][0] == '-')
+        {
+            print_usage(argv[0]);
+            return !std::strcmp(argv[i], "--help") ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        else
+        {
+            device_args++;
+        }
+    }
+
+    if (!transport)
+        transport = std::make_unique<FdTransport>(STDIN_FILENO, STDOUT_FILENO);
+
+    Server server(*transport);
+
+    for (int i = 1; i < argc && device_args; i++)
+    {
+        if (argv[i][0] == '-')
+        {
+            // skip the option and its arguments.
+            if (!std::strcmp(argv[i], "--unix"))
+                i++;
+            else if (!std::strcmp(argv[i], "--fifo"))
+                i += 2;
+            continue;
+        }
+
+        std::string arg = argv[i], name = arg, path = arg;
+        const auto eq = arg.find('=');
+        if (eq != std::string::npos)
+        {
+            name = arg.substr(0, eq);
+            path = arg.substr(eq + 1);
+        }
+
+        if (!server.add_device(name, path))
+        {
+            std::fprintf(stderr, "failed to add device %s\n", arg.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!device_args)
+        server.add_device("root", ".");
+
+    UsbRet ret;
+    do
+    {
+        ret = server.run();
+        std::fprintf(stderr, "session ended with %u\n", ret);
+    } while (loop && ret == UsbReturnCode_Success);
+
+    return ret == UsbReturnCode_Success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,1230 @@
+/*
+*   TotalJustice
+*/
+
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fs.hpp"
+#include "nxusb_async.h"
+#include "nxusb_batch.h"
+#include "nxusb_compress.h"
+#include "nxusb_dir.h"
+#include "nxusb_file.h"
+#include "nxusb_hash.h"
+#include "nxusb_resume.h"
+#include "server.hpp"
+
+
+namespace
+{
+    constexpr size_t BUFFER_SIZE = 0x100000;
+
+    // a device added with a trailing slash resolves the root with one, but its children without.
+    std::string dir_key(std::string path)
+    {
+        while (path.size() > 1 && path.back() == '/')
+            path.pop_back();
+        return path;
+    }
+}
+
+Server::Server(Transport &transport)
+    : m_transport(transport), m_buffer(BUFFER_SIZE), m_packed(USB_COMPRESS_BLOCK_SIZE)
+{
+}
+
+Server::~Server()
+{
+    close_file();
+    close_handles();
+}
+
+bool Server::add_device(const std::string &name, const std::string &path)
+{
+    char real[PATH_MAX];
+    if (!realpath(path.c_str(), real) || !fs::is_dir(real))
+        return false;
+
+    std::string dir = real;
+    if (dir.size() > 1 && dir.back() == '/')
+        dir.pop_back();
+
+    m_devices.push_back({ name, dir });
+    return true;
+}
+
+UsbRet Server::run()
+{
+    if (m_devices.empty())
+        return UsbReturnCode_FailedOpenDevice;
+
+    UsbRet ret = handshake();
+    if (ret != UsbReturnCode_Success)
+        return ret;
+
+    m_exit = false;
+    UsbPoll poll;
+
+    while (recv(&poll, sizeof(poll)))
+    {
+        from_le(poll);
+        if (poll.flags & USB_POLL_FLAG_TAGGED)
+        {
+            if (!handle_tagged(poll))
+                break;
+            continue;
+        }
+
+        wait_idle();
+        if (!handle_poll(poll))
+            break;
+    }
+
+    stop_workers();
+    close_file();
+    close_handles();
+    m_dir.clear();
+    m_cursors.clear();
+    m_index = DirIndex();
+    return m_exit ? UsbReturnCode_Success : UsbReturnCode_WrongSizeRead;
+}
+
+
+
+/*
+*   Link.
+*/
+
+bool Server::recv(void *out, size_t size)
+{
+    return m_transport.read(out, size) == size;
+}
+
+bool Server::send(const void *in, size_t size)
+{
+    return m_transport.write(in, size) == size;
+}
+
+bool Server::send_result(UsbRet ret)
+{
+    const auto wire = from_le(ret);
+    return send(&wire, sizeof(wire));
+}
+
+bool Server::send_value(UsbRet ret, uint64_t value)
+{
+    if (!send_result(ret))
+        return false;
+    if (ret != UsbReturnCode_Success)
+        return true;
+
+    value = from_le(value);
+    return send(&value, sizeof(value));
+}
+
+bool Server::send_entries(UsbRet ret, const std::vector<usb_file_entry_t> &entries, uint64_t count)
+{
+    if (!send_result(ret))
+        return false;
+    if (ret != UsbReturnCode_Success)
+        return true;
+
+    // the console asked for count entries, anything past the end is zeroed.
+    const uint64_t have = entries.size() < count ? entries.size() : count;
+    if (have && !send_le(entries.data(), have))
+        return false;
+
+    const usb_file_entry_t empty{};
+    for (uint64_t i = have; i < count; i++)
+    {
+        if (!send(&empty, sizeof(empty)))
+            return false;
+    }
+
+    return true;
+}
+
+bool Server::send_dir_list(UsbRet ret, const std::vector<usb_file_entry_t> &entries, size_t first, size_t last)
+{
+    if (!send_result(ret))
+        return false;
+    if (ret != UsbReturnCode_Success)
+        return true;
+
+    std::vector<uint8_t> data;
+    fs::pack_entries(entries, first, last, data);
+
+    usb_dir_list_header_t header = { last - first, data.size() };
+    from_le(header);
+    if (!send(&header, sizeof(header)))
+        return false;
+    return data.empty() || send(data.data(), data.size());
+}
+
+bool Server::send_block(const uint8_t *data, size_t size)
+{
+    // same rule as the console, only worth packing if it saves at least 1/16th.
+    const auto packed = usb_lz4_compress(data, size, m_packed.data(), size - size / 16);
+
+    const size_t packed_size = packed ? packed : size;
+    const uint8_t *payload = packed ? m_packed.data() : data;
+
+    usb_compress_block_t block{};
+    block.size = size;
+    block.packed_size = packed_size;
+    from_le(block);
+
+    if (!m_caps)
+        return send(&block, sizeof(block)) && send(payload, packed_size);
+
+    // the held back block goes out with this header, the first header goes on its own.
+    const auto header = reinterpret_cast<const uint8_t *>(&block);
+    m_chain.insert(m_chain.end(), header, header + sizeof(block));
+    if (!send(m_chain.data(), m_chain.size()))
+        return false;
+
+    m_chain.assign(payload, payload + packed_size);
+    return true;
+}
+
+bool Server::flush_blocks()
+{
+    if (m_chain.empty())
+        return true;
+
+    const bool ok = send(m_chain.data(), m_chain.size());
+    m_chain.clear();
+    return ok;
+}
+
+bool Server::recv_block(size_t size, UsbRet &ret)
+{
+    usb_compress_block_t block;
+    if (!recv(&block, sizeof(block)))
+        return false;
+    from_le(block);
+
+    // the framing can't be trusted past a bad header, so drop the link.
+    if (block.size != size || block.packed_size > size)
+        return false;
+
+    if (block.packed_size == size)
+        return recv(m_buffer.data(), size);
+
+    if (!recv(m_packed.data(), block.packed_size))
+        return false;
+
+    if (!usb_lz4_decompress(m_packed.data(), block.packed_size, m_buffer.data(), size) && ret == UsbReturnCode_Success)
+        ret = UsbReturnCode_BadCompressedBlock;
+    return true;
+}
+
+bool Server::recv_path(uint64_t size, std::string &out)
+{
+    if (size >= USB_FILE_NAME_MAX)
+        return false;
+
+    out.resize(size);
+    return recv(out.data(), size);
+}
+
+bool Server::skip(uint64_t size)
+{
+    while (size)
+    {
+        const size_t chunk = size < m_buffer.size() ? size : m_buffer.size();
+        if (!recv(m_buffer.data(), chunk))
+            return false;
+        size -= chunk;
+    }
+    return true;
+}
+
+UsbRet Server::handshake()
+{
+    UsbHeader console;
+    if (!recv(&console, sizeof(console)))
+        return UsbReturnCode_WrongSizeRead;
+
+    if (from_le(console.magic) != NXUSB_MAGIC)
+    {
+        send_result(UsbReturnCode_WrongHostMagic);
+        return UsbReturnCode_WrongHostMagic;
+    }
+
+    UsbHeader host{};
+    host.magic = from_le(NXUSB_MAGIC);
+    host.macro = NXUSB_VERSION_MACRO;
+    host.minor = NXUSB_VERSION_MINOR;
+    host.major = NXUSB_VERSION_MAJOR;
+    // the console only sends compressed transfers if lz4 is picked here, both kinds are always served.
+    host.compression = (console.compression & (1U << UsbCompression_Lz4)) ? UsbCompression_Lz4 : UsbCompression_None;
+
+    // consoles that don't ask for caps wouldn't read them.
+    usb_caps_t caps{};
+    m_caps = console.flags & USB_HEADER_FLAG_CAPS;
+    m_chain.clear();
+    if (m_caps)
+    {
+        host.flags = USB_HEADER_FLAG_CAPS;
+        caps.caps = from_le<uint64_t>(UsbCap_Framed | UsbCap_Tagged | UsbCap_Batch | UsbCap_FileHandles | UsbCap_Resume |
+            UsbCap_Hash | UsbCap_Delta | UsbCap_DirCompact | UsbCap_DirQuery | UsbCap_DirPacked | UsbCap_ChangeToken);
+        caps.max_transfer = from_le<uint32_t>(USB_ASYNC_SIZE_MAX);
+        caps.max_inflight = from_le<uint32_t>(USB_ASYNC_INFLIGHT_MAX);
+        caps.compression = from_le<uint32_t>(USB_COMPRESSION_SUPPORTED);
+        caps.max_handles = from_le<uint32_t>(USB_FILE_HANDLE_MAX);
+        caps.dir_format = from_le<uint32_t>(USB_DIR_LIST_FORMAT);
+    }
+
+    if (!send_result(UsbReturnCode_Success) || !send(&host, sizeof(host)))
+        return UsbReturnCode_WrongSizeWritten;
+    if ((host.flags & USB_HEADER_FLAG_CAPS) && !send(&caps, sizeof(caps)))
+        return UsbReturnCode_WrongSizeWritten;
+    return UsbReturnCode_Success;
+}
+
+
+
+/*
+*   Polls.
+*/
+
+bool Server::handle_poll(const UsbPoll &poll)
+{
+    uint64_t value = 0;
+    UsbRet ret;
+
+    switch (poll.mode)
+    {
+        case UsbMode_Exit:
+            m_exit = true;
+            return false;
+
+        case UsbMode_Ping:
+            return send_result(UsbReturnCode_Success);
+
+        case UsbMode_OpenFile:
+        case UsbMode_OpenFileReadBytes:
+        case UsbMode_OpenFileWrite:
+        case UsbMode_OpenFileWriteBytes:
+        case UsbMode_OpenFileAppend:
+        case UsbMode_OpenFileAppendBytes:
+        case UsbMode_TouchFile:
+        case UsbMode_DeleteFile:
+        case UsbMode_GetFileSizeFromPath:
+        case UsbMode_IsFile:
+        case UsbMode_OpenDir:
+        case UsbMode_TouchDir:
+        case UsbMode_DeleteDir:
+        case UsbMode_GetDirTotalFromPath:
+        case UsbMode_GetDirTotalRecursivelyFromPath:
+        case UsbMode_IsDir:
+        case UsbMode_GetDirSizeFromPath:
+        case UsbMode_GetDirSizeFromPathRecursively:
+        case UsbMode_ReadDirFromPath:
+        case UsbMode_ReadDirCompact:
+        case UsbMode_OpenDirCursor:
+        case UsbMode_GetChangeToken:
+        case UsbMode_OpenDevice:
+            return handle_path(poll);
+
+        case UsbMode_ReadDirCursor:
+        case UsbMode_CloseDirCursor:
+            return handle_dir_cursor(poll);
+
+        case UsbMode_QueryDir:
+            return handle_query(poll);
+
+        case UsbMode_ReadFile:
+        case UsbMode_ReadFileCompressed:
+        case UsbMode_ReadFileHandle:
+        case UsbMode_ReadFileHandleCompressed:
+        case UsbMode_ReadFileHandleChecked:
+            return handle_read_file(poll);
+
+        case UsbMode_WriteFile:
+        case UsbMode_WriteFileCompressed:
+        case UsbMode_WriteFileHandle:
+        case UsbMode_WriteFileHandleCompressed:
+        case UsbMode_WriteFileHandleChecked:
+            return handle_write_file(poll);
+
+        case UsbMode_OpenFileHandle:
+        case UsbMode_GetFileHandleSize:
+        case UsbMode_CloseFileHandle:
+        case UsbMode_GetFileHandleChecksums:
+        case UsbMode_SetFileHandleSize:
+        case UsbMode_GetFileHandleHash:
+            return handle_file_handle(poll);
+
+        case UsbMode_GetFileSignatures:
+        case UsbMode_ApplyFileDelta:
+        case UsbMode_GetFileDelta:
+            return handle_delta(poll);
+
+        case UsbMode_ReadDirPacked:
+            return handle_pack(poll);
+
+        case UsbMode_RenameFile:
+            return handle_rename(poll);
+
+        case UsbMode_RenameDir:
+            return handle_rename(poll);
+
+        case UsbMode_Batch:
+            return handle_batch(poll);
+
+        case UsbMode_GetFileSize:
+            ret = m_fd < 0 ? UsbReturnCode_FileNotOpen : get_fd_size(m_fd, value);
+            return send_value(ret, value);
+
+        case UsbMode_CloseFile:
+            close_file();
+            return true;
+
+        case UsbMode_ReadDir:
+        {
+            std::vector<usb_file_entry_t> entries;
+            ret = m_dir.empty() ? UsbReturnCode_DirNotOpen : fs::list_dir(m_dir, entries);
+            return send_entries(ret, entries, poll.size / sizeof(usb_file_entry_t));
+        }
+
+        case UsbMode_GetDirTotal:
+        case UsbMode_GetDirTotalRecursively:
+            ret = m_dir.empty() ? UsbReturnCode_DirNotOpen : fs::get_dir_total(m_dir, poll.mode == UsbMode_GetDirTotalRecursively, value);
+            return send_value(ret, value);
+
+        case UsbMode_GetDirSize:
+        case UsbMode_GetDirSizeRecursively:
+            ret = m_dir.empty() ? UsbReturnCode_DirNotOpen : fs::get_dir_size(m_dir, poll.mode == UsbMode_GetDirSizeRecursively, value);
+            return send_value(ret, value);
+
+        case UsbMode_GetTotalDevices:
+            return send_value(UsbReturnCode_Success, m_devices.size());
+
+        case UsbMode_ReadDevices:
+        {
+            std::vector<usb_file_entry_t> entries;
+            for (const auto &device : m_devices)
+            {
+                usb_file_entry_t entry;
+                fs::make_entry(device.path, device.name, entry);
+                entry.file_size = fs::get_free_space(device.path);
+                entries.push_back(entry);
+            }
+            return send_entries(UsbReturnCode_Success, entries, poll.size / sizeof(usb_file_entry_t));
+        }
+
+        default:
+            // there's no way to know how much data follows an unknown mode.
+            return send_result(UsbReturnCode_UnknownMode);
+    }
+}
+
+bool Server::handle_path(const UsbPoll &poll)
+{
+    // consoles with caps send how many entries they want ahead of the path, older ones once the dir is open.
+    const bool count_first = m_caps && poll.mode == UsbMode_ReadDirFromPath;
+    const uint64_t args_size = count_first ? sizeof(uint64_t) : 0;
+
+    if (poll.size < args_size || poll.size - args_size >= USB_FILE_NAME_MAX)
+    {
+        if (!skip(poll.size))
+            return false;
+        return send_result(UsbReturnCode_FileNameTooLarge);
+    }
+
+    uint64_t count = 0;
+    if (count_first)
+    {
+        if (!recv(&count, sizeof(count)))
+            return false;
+        count = from_le(count);
+    }
+
+    std::string path;
+    if (!recv_path(poll.size - args_size, path))
+        return false;
+
+    if (poll.mode == UsbMode_OpenDevice)
+        return send_result(open_device(path));
+
+    const auto full = resolve(path);
+    uint64_t value = 0;
+    UsbRet ret;
+
+    switch (poll.mode)
+    {
+        case UsbMode_TouchFile:
+        case UsbMode_DeleteFile:
+        case UsbMode_IsFile:
+        case UsbMode_TouchDir:
+        case UsbMode_DeleteDir:
+        case UsbMode_IsDir:
+            return send_result(simple_op(poll.mode, full, std::string()));
+
+        case UsbMode_GetFileSizeFromPath:
+        case UsbMode_GetChangeToken:
+        case UsbMode_GetDirTotalFromPath:
+        case UsbMode_GetDirTotalRecursivelyFromPath:
+        case UsbMode_GetDirSizeFromPath:
+        case UsbMode_GetDirSizeFromPathRecursively:
+            ret = path_value(poll.mode, full, value);
+            return send_value(ret, value);
+
+        case UsbMode_OpenDir:
+            m_dir = fs::is_dir(full) ? full : std::string();
+            return send_result(m_dir.empty() ? UsbReturnCode_FailedOpenDir : UsbReturnCode_Success);
+
+        case UsbMode_ReadDirCompact:
+        {
+            std::vector<usb_file_entry_t> entries;
+            ret = fs::list_dir(full, entries);
+            return send_dir_list(ret, entries, 0, entries.size());
+        }
+
+        case UsbMode_OpenDirCursor:
+        {
+            if (m_cursors.size() >= USB_DIR_CURSOR_MAX)
+                return send_result(UsbReturnCode_TooManyDirCursors);
+
+            DirCursor cursor;
+            ret = fs::list_dir(full, cursor.entries);
+            if (!send_result(ret))
+                return false;
+            if (ret != UsbReturnCode_Success)
+                return true;
+
+            cursor.id = m_next_cursor++;
+            usb_dir_cursor_info_t info = { cursor.id, 0, cursor.entries.size() };
+            from_le(info);
+            m_cursors.push_back(std::move(cursor));
+            return send(&info, sizeof(info));
+        }
+
+        case UsbMode_ReadDirFromPath:
+        {
+            std::vector<usb_file_entry_t> entries;
+            ret = fs::list_dir(full, entries);
+            if (ret != UsbReturnCode_Success)
+                ret = UsbReturnCode_FailedReadDirFromPath;
+            if (!send_result(ret))
+                return false;
+            if (ret != UsbReturnCode_Success)
+                return true;
+
+            if (!count_first)
+            {
+                if (!recv(&count, sizeof(count)))
+                    return false;
+                count = from_le(count);
+            }
+            return send_entries(ret, entries, count);
+        }
+
+        default:
+            close_file();
+            m_fd_path = full;
+            return send_result(open_file(poll.mode, full, m_fd));
+    }
+}
+
+bool Server::handle_dir_cursor(const UsbPoll &poll)
+{
+    usb_dir_cursor_read_t read{};
+    const size_t size = poll.mode == UsbMode_ReadDirCursor ? sizeof(read) : sizeof(read.cursor);
+    if (poll.size != size)
+    {
+        if (!skip(poll.size))
+            return false;
+        return send_result(UsbReturnCode_BadDirCursor);
+    }
+
+    if (!recv(&read, size))
+        return false;
+    from_le(read);
+
+    auto it = m_cursors.begin();
+    while (it != m_cursors.end() && it->id != read.cursor)
+        ++it;
+
+    if (it == m_cursors.end())
+        return send_result(UsbReturnCode_BadDirCursor);
+
+    if (poll.mode == UsbMode_CloseDirCursor)
+    {
+        m_cursors.erase(it);
+        return send_result(UsbReturnCode_Success);
+    }
+
+    const size_t first = it->pos;
+    const size_t left = it->entries.size() - first;
+    const size_t count = left < read.max_entries ? left : read.max_entries;
+    it->pos += count;
+    return send_dir_list(UsbReturnCode_Success, it->entries, first, first + count);
+}
+
+bool Server::handle_file_handle(const UsbPoll &poll)
+{
+    if (poll.mode == UsbMode_OpenFileHandle)
+    {
+        usb_file_open_t open;
+        if (poll.size < sizeof(open) || poll.size - sizeof(open) >= USB_FILE_NAME_MAX)
+        {
+            if (!skip(poll.size))
+                return false;
+            return send_result(UsbReturnCode_FileNameTooLarge);
+        }
+
+        std::string path;
+        if (!recv(&open, sizeof(open)) || !recv_path(poll.size - sizeof(open), path))
+            return false;
+
+        uint32_t id = 0;
+        const auto ret = open_handle(open.mode, resolve(path), id);
+        return send_value(ret, id);
+    }
+
+    if (poll.mode == UsbMode_GetFileHandleChecksums)
+        return handle_checksums(poll);
+
+    if (poll.mode == UsbMode_GetFileHandleHash)
+        return handle_hash(poll);
+
+    if (poll.mode == UsbMode_SetFileHandleSize)
+    {
+        UsbFileIo io;
+        FileRef file;
+        int fd;
+        UsbRet ret;
+        if (!recv_file_io(poll, io, file, fd, ret))
+            return false;
+
+        if (ret == UsbReturnCode_Success)
+        {
+            changed(file->path);
+            if (ftruncate(fd, io.size) < 0)
+                ret = UsbReturnCode_FailedWriteFile;
+        }
+        return send_result(ret);
+    }
+
+    // the poll size is the handle.
+    if (poll.mode == UsbMode_CloseFileHandle)
+        return send_result(close_handle(poll.size));
+
+    const auto file = find_file(poll.size);
+    uint64_t value = 0;
+    const auto ret = file ? get_fd_size(file->fd, value) : UsbReturnCode_BadFileHandle;
+    return send_value(ret, value);
+}
+
+bool Server::handle_checksums(const UsbPoll &poll)
+{
+    usb_file_checksum_t request;
+    if (poll.size != sizeof(request))
+    {
+        if (!skip(poll.size))
+            return false;
+        return send_result(UsbReturnCode_UnknownMode);
+    }
+
+    if (!recv(&request, sizeof(request)))
+        return false;
+    from_le(request);
+
+    const auto file = find_file(request.handle);
+    struct stat st;
+    if (!file || !request.chunk_size)
+        return send_result(UsbReturnCode_BadFileHandle);
+    if (fstat(file->fd, &st) < 0)
+        return send_result(UsbReturnCode_FailedReadFile);
+
+    // clamp the range to the file, and to the most checksums the console takes.
+    const uint64_t file_size = st.st_size;
+    const uint64_t start = request.offset < file_size ? request.offset : file_size;
+    uint64_t end = request.size < file_size - start ? start + request.size : file_size;
+    const uint64_t max = static_cast<uint64_t>(request.chunk_size) * USB_RESUME_CHECKSUMS_MAX;
+    if (end - start > max)
+        end = start + max;
+
+    std::vector<uint32_t> crcs;
+    for (uint64_t offset = start; offset < end; offset += request.chunk_size)
+    {
+        const uint64_t chunk_end = end - offset < request.chunk_size ? end : offset + request.chunk_size;
+        uint32_t crc = 0;
+
+        for (uint64_t pos = offset; pos < chunk_end;)
+        {
+            const size_t size = chunk_end - pos < m_buffer.size() ? chunk_end - pos : m_buffer.size();
+            if (pread(file->fd, m_buffer.data(), size, pos) != static_cast<ssize_t>(size))
+                return send_result(UsbReturnCode_FailedReadFile);
+
+            crc = usb_crc32c(crc, m_buffer.data(), size);
+            pos += size;
+        }
+
+        crcs.push_back(crc);
+    }
+
+    const uint64_t count = crcs.size();
+    if (!send_value(UsbReturnCode_Success, count))
+        return false;
+    return crcs.empty() || send_le(crcs.data(), crcs.size());
+}
+
+bool Server::handle_hash(const UsbPoll &poll)
+{
+    usb_file_hash_t request;
+    if (poll.size != sizeof(request))
+    {
+        if (!skip(poll.size))
+            return false;
+        return send_result(UsbReturnCode_UnknownMode);
+    }
+
+    if (!recv(&request, sizeof(request)))
+        return false;
+    from_le(request);
+
+    if (request.type != UsbHashType_Crc32c && request.type != UsbHashType_Sha256)
+        return send_result(UsbReturnCode_UnknownHashType);
+
+    const auto file = find_file(request.handle);
+    struct stat st;
+    if (!file)
+        return send_result(UsbReturnCode_BadFileHandle);
+    if (fstat(file->fd, &st) < 0)
+        return send_result(UsbReturnCode_FailedReadFile);
+
+    const uint64_t file_size = st.st_size;
+    const uint64_t start = request.offset < file_size ? request.offset : file_size;
+    const uint64_t end = request.size < file_size - start ? start + request.size : file_size;
+
+    uint32_t crc = 0;
+    usb_sha256_t sha;
+    usb_sha256_init(&sha);
+
+    for (uint64_t pos = start; pos < end;)
+    {
+        const size_t size = end - pos < m_buffer.size() ? end - pos : m_buffer.size();
+        if (pread(file->fd, m_buffer.data(), size, pos) != static_cast<ssize_t>(size))
+            return send_result(UsbReturnCode_FailedReadFile);
+
+        if (request.type == UsbHashType_Crc32c)
+            crc = usb_crc32c(crc, m_buffer.data(), size);
+        else
+            usb_sha256_update(&sha, m_buffer.data(), size);
+        pos += size;
+    }
+
+    usb_hash_digest_t digest{};
+    digest.size = end - start;
+    crc = from_le(crc);
+    if (request.type == UsbHashType_Crc32c)
+        std::memcpy(digest.digest, &crc, sizeof(crc));
+    else
+        usb_sha256_final(&sha, digest.digest);
+    from_le(digest);
+
+    return send_result(UsbReturnCode_Success) && send(&digest, sizeof(digest));
+}
+
+bool Server::recv_file_io(const UsbPoll &poll, UsbFileIo &io, FileRef &file, int &fd, UsbRet &ret)
+{
+    switch (poll.mode)
+    {
+        case UsbMode_ReadFileHandle:
+        case UsbMode_ReadFileHandleCompressed:
+        case UsbMode_ReadFileHandleChecked:
+        case UsbMode_WriteFileHandle:
+        case UsbMode_WriteFileHandleCompressed:
+        case UsbMode_WriteFileHandleChecked:
+        case UsbMode_SetFileHandleSize:
+        {
+            usb_file_io_t handle_io;
+            if (!recv(&handle_io, sizeof(handle_io)))
+                return false;
+            from_le(handle_io);
+
+            io.size = handle_io.size;
+            io.offset = handle_io.offset;
+            file = find_file(handle_io.handle);
+            fd = file ? file->fd : -1;
+            ret = fd < 0 ? UsbReturnCode_BadFileHandle : UsbReturnCode_Success;
+            return true;
+        }
+
+        default:
+            if (!recv(&io, sizeof(io)))
+                return false;
+            from_le(io);
+
+            fd = m_fd;
+            ret = fd < 0 ? UsbReturnCode_FileNotOpen : UsbReturnCode_Success;
+            return true;
+    }
+}
+
+bool Server::handle_read_file(const UsbPoll &poll)
+{
+    UsbFileIo io;
+    FileRef file;
+    int fd;
+    UsbRet ret;
+    if (!recv_file_io(poll, io, file, fd, ret))
+        return false;
+
+    struct stat st;
+    if (ret == UsbReturnCode_Success &&
+        (fstat(fd, &st) < 0 || io.offset > static_cast<uint64_t>(st.st_size) || io.size > st.st_size - io.offset))
+        ret = UsbReturnCode_FailedReadFile;
+
+    if (!send_result(ret))
+        return false;
+    if (ret != UsbReturnCode_Success)
+        return true;
+
+    const bool compressed = poll.mode == UsbMode_ReadFileCompressed || poll.mode == UsbMode_ReadFileHandleCompressed;
+    const bool checked = poll.mode == UsbMode_ReadFileHandleChecked;
+    const size_t max_chunk = compressed ? USB_COMPRESS_BLOCK_SIZE : m_buffer.size();
+    uint32_t crc = 0;
+
+    while (io.size)
+    {
+        const size_t chunk = io.size < max_chunk ? io.size : max_chunk;
+        const auto read = pread(fd, m_buffer.data(), chunk, io.offset);
+
+        // the result has already gone out, so if the file shrank the rest is zeroed.
+        // the checksum is taken over what was read, so the console sees the zeroes as a mismatch.
+        if (read < static_cast<ssize_t>(chunk))
+        {
+            if (checked)
+                crc = usb_crc32c(crc, m_buffer.data(), read > 0 ? read : 0) ^ 1;
+            std::memset(m_buffer.data() + (read > 0 ? read : 0), 0, chunk - (read > 0 ? read : 0));
+        }
+        else if (checked)
+            crc = usb_crc32c(crc, m_buffer.data(), chunk);
+
+        if (compressed ? !send_block(m_buffer.data(), chunk) : !send(m_buffer.data(), chunk))
+            return false;
+
+        io.size -= chunk;
+        io.offset += chunk;
+    }
+
+    if (compressed && !flush_blocks())
+        return false;
+
+    crc = from_le(crc);
+    return !checked || send(&crc, sizeof(crc));
+}
+
+bool Server::handle_write_file(const UsbPoll &poll)
+{
+    UsbFileIo io;
+    FileRef file;
+    int fd;
+    UsbRet ret;
+    if (!recv_file_io(poll, io, file, fd, ret))
+        return false;
+
+    if (poll.mode == UsbMode_WriteFileHandleChecked)
+        return handle_write_checked(io, fd, file ? file->path : m_fd_path, ret);
+
+    // the data is always sent, so drain it even if the write can't happen.
+    const bool compressed = poll.mode == UsbMode_WriteFileCompressed || poll.mode == UsbMode_WriteFileHandleCompressed;
+    const size_t max_chunk = compressed ? USB_COMPRESS_BLOCK_SIZE : m_buffer.size();
+
+    while (io.size)
+    {
+        const size_t chunk = io.size < max_chunk ? io.size : max_chunk;
+        if (compressed ? !recv_block(chunk, ret) : !recv(m_buffer.data(), chunk))
+            return false;
+
+        if (ret == UsbReturnCode_Success && pwrite(fd, m_buffer.data(), chunk, io.offset) != static_cast<ssize_t>(chunk))
+            ret = UsbReturnCode_FailedWriteFile;
+
+        io.size -= chunk;
+        io.offset += chunk;
+    }
+
+    if (fd >= 0)
+        changed(file ? file->path : m_fd_path);
+    return send_result(ret);
+}
+
+bool Server::handle_write_checked(UsbFileIo io, int fd, const std::string &path, UsbRet ret)
+{
+    // nothing is written until the checksum has been checked, so the whole write is held.
+    const bool fits = io.size <= USB_RESUME_CHECKED_MAX;
+    if (fits)
+        m_checked.resize(io.size);
+    else if (ret == UsbReturnCode_Success)
+        ret = UsbReturnCode_FailedWriteFile;
+
+    uint32_t crc = 0;
+    for (uint64_t done = 0; done < io.size;)
+    {
+        const size_t chunk = io.size - done < m_buffer.size() ? io.size - done : m_buffer.size();
+        uint8_t *data = fits ? m_checked.data() + done : m_buffer.data();
+        if (!recv(data, chunk))
+            return false;
+
+        crc = usb_crc32c(crc, data, chunk);
+        done += chunk;
+    }
+
+    uint32_t expected;
+    if (!recv(&expected, sizeof(expected)))
+        return false;
+
+    if (ret == UsbReturnCode_Success && crc != from_le(expected))
+        ret = UsbReturnCode_ChecksumMismatch;
+
+    if (ret == UsbReturnCode_Success)
+    {
+        changed(path);
+        if (pwrite(fd, m_checked.data(), io.size, io.offset) != static_cast<ssize_t>(io.size))
+            ret = UsbReturnCode_FailedWriteFile;
+    }
+
+    // don't hang on to a big buffer between writes.
+    if (m_checked.size() > m_buffer.size())
+        std::vector<uint8_t>().swap(m_checked);
+    return send_result(ret);
+}
+
+bool Server::handle_rename(const UsbPoll &poll)
+{
+    struct
+    {
+        uint64_t l1;
+        uint64_t l2;
+    } lens;
+
+    if (poll.size < sizeof(lens) || !recv(&lens, sizeof(lens)))
+        return false;
+    lens.l1 = from_le(lens.l1);
+    lens.l2 = from_le(lens.l2);
+
+    if (lens.l1 >= USB_FILE_NAME_MAX || lens.l2 >= USB_FILE_NAME_MAX || lens.l1 + lens.l2 + sizeof(lens) != poll.size)
+    {
+        if (!skip(poll.size - sizeof(lens)))
+            return false;
+        return send_result(UsbReturnCode_FileNameTooLarge);
+    }
+
+    std::string curr_name, new_name;
+    if (!recv_path(lens.l1, curr_name) || !recv_path(lens.l2, new_name))
+        return false;
+
+    return send_result(simple_op(poll.mode, resolve(curr_name), resolve(new_name)));
+}
+
+bool Server::handle_batch(const UsbPoll &poll)
+{
+    if (poll.size > USB_BATCH_SIZE_MAX || poll.size < sizeof(usb_batch_header_t))
+    {
+        if (!skip(poll.size))
+            return false;
+        return send_result(UsbReturnCode_BadBatch);
+    }
+
+    std::vector<uint8_t> data(poll.size);
+    if (!recv(data.data(), data.size()))
+        return false;
+
+    usb_batch_header_t header;
+    std::memcpy(&header, data.data(), sizeof(header));
+    from_le(header);
+
+    // every op is at least its header, so the count can't be more than fits in what was sent.
+    if (header.count > (poll.size - sizeof(header)) / sizeof(usb_batch_op_t))
+        return send_result(UsbReturnCode_BadBatch);
+
+    size_t offset = sizeof(header);
+
+    // check the whole batch is well formed before running any of it.
+    for (uint32_t i = 0; i < header.count; i++)
+    {
+        usb_batch_op_t op;
+        if (offset + sizeof(op) > data.size())
+            return send_result(UsbReturnCode_BadBatch);
+
+        std::memcpy(&op, data.data() + offset, sizeof(op));
+        from_le(op);
+        offset += sizeof(op) + op.len1 + op.len2;
+        if (offset > data.size() || op.len1 >= USB_FILE_NAME_MAX || op.len2 >= USB_FILE_NAME_MAX)
+            return send_result(UsbReturnCode_BadBatch);
+    }
+
+    std::vector<UsbRet> results;
+    results.reserve(header.count);
+
+    offset = sizeof(header);
+    for (uint32_t i = 0; i < header.count; i++)
+    {
+        usb_batch_op_t op;
+        std::memcpy(&op, data.data() + offset, sizeof(op));
+        from_le(op);
+        offset += sizeof(op);
+
+        const std::string str1(reinterpret_cast<const char *>(data.data() + offset), op.len1);
+        const std::string str2(reinterpret_cast<const char *>(data.data() + offset + op.len1), op.len2);
+        offset += op.len1 + op.len2;
+
+        const bool rename = op.mode == UsbMode_RenameFile || op.mode == UsbMode_RenameDir;
+        results.push_back(simple_op(op.mode, resolve(str1), rename ? resolve(str2) : std::string()));
+    }
+
+    if (!send_result(UsbReturnCode_Success))
+        return false;
+    return results.empty() || send_le(results.data(), results.size());
+}
+
+UsbRet Server::path_value(uint8_t mode, const std::string &path, uint64_t &out)
+{
+    UsbRet ret;
+
+    switch (mode)
+    {
+        case UsbMode_GetFileSizeFromPath:
+            return fs::get_file_size(path, out);
+
+        case UsbMode_GetChangeToken:
+            return change_token(path, out);
+
+        case UsbMode_GetDirTotalFromPath:
+        case UsbMode_GetDirTotalRecursivelyFromPath:
+            ret = fs::get_dir_total(path, mode == UsbMode_GetDirTotalRecursivelyFromPath, out);
+            return ret == UsbReturnCode_Success ? ret : UsbReturnCode_FailedGetDirTotalFromPath;
+
+        case UsbMode_GetDirSizeFromPath:
+            ret = fs::get_dir_size(path, false, out);
+            return ret == UsbReturnCode_Success ? ret : UsbReturnCode_FailedGetDirSizeFromPath;
+
+        case UsbMode_GetDirSizeFromPathRecursively:
+            ret = fs::get_dir_size(path, true, out);
+            return ret == UsbReturnCode_Success ? ret : UsbReturnCode_FailedGetDirSizeRecursivelyFromPath;
+
+        default:
+            return UsbReturnCode_UnknownMode;
+    }
+}
+
+void Server::changed(const std::string &path)
+{
+    const auto slash = path.find_last_of('/');
+    const auto dir = dir_key(slash == std::string::npos ? std::string() : path.substr(0, slash + 1));
+
+    std::lock_guard<std::mutex> lock(m_generations_lock);
+    m_generations[dir]++;
+}
+
+UsbRet Server::change_token(const std::string &path, uint64_t &out)
+{
+    const auto ret = fs::get_stat_hash(path, out);
+    if (ret != UsbReturnCode_Success)
+        return ret;
+
+    std::lock_guard<std::mutex> lock(m_generations_lock);
+    const auto it = m_generations.find(dir_key(path));
+    out = fs::mix(out ^ (it != m_generations.end() ? it->second : 0));
+    return ret;
+}
+
+UsbRet Server::simple_op(uint8_t mode, const std::string &path, const std::string &new_path)
+{
+    if (mode != UsbMode_IsFile && mode != UsbMode_IsDir)
+    {
+        changed(path);
+        if (!new_path.empty())
+            changed(new_path);
+    }
+
+    switch (mode)
+    {
+        case UsbMode_TouchFile:
+            return fs::touch_file(path);
+        case UsbMode_DeleteFile:
+            return fs::delete_file(path);
+        case UsbMode_IsFile:
+            return fs::is_file(path) ? UsbReturnCode_Success : UsbReturnCode_NotFile;
+        case UsbMode_RenameFile:
+            return fs::rename(path, new_path, UsbReturnCode_FailedRenameFile);
+        case UsbMode_TouchDir:
+            return fs::touch_dir(path);
+        case UsbMode_DeleteDir:
+            return fs::delete_dir(path);
+        case UsbMode_IsDir:
+            return fs::is_dir(path) ? UsbReturnCode_Success : UsbReturnCode_NotDir;
+        case UsbMode_RenameDir:
+            return fs::rename(path, new_path, UsbReturnCode_FailedRenameDir);
+        default:
+            return UsbReturnCode_UnknownMode;
+    }
+}
+
+
+
+/*
+*   State.
+*/
+
+std::string Server::resolve(const std::string &path) const
+{
+    const auto &root = m_devices[m_device].path;
+    std::string out = root;
+
+    size_t start = 0;
+    while (start <= path.size())
+    {
+        auto end = path.find('/', start);
+        if (end == std::string::npos)
+            end = path.size();
+
+        const auto part = path.substr(start, end - start);
+        start = end + 1;
+
+        if (part.empty() || part == ".")
+            continue;
+
+        if (part == "..")
+        {
+            if (out.size() > root.size())
+                out.erase(out.find_last_of('/'));
+            continue;
+        }
+
+        if (out.back() != '/')
+            out += '/';
+        out += part;
+    }
+
+    return out;
+}
+
+UsbRet Server::open_file(uint8_t mode, const std::string &path, int &fd)
+{
+    int flags;
+
+    switch (mode)
+    {
+        case UsbMode_OpenFile:
+        case UsbMode_OpenFileReadBytes:
+            flags = O_RDONLY;
+            break;
+        case UsbMode_OpenFileWrite:
+        case UsbMode_OpenFileWriteBytes:
+            flags = O_RDWR | O_CREAT | O_TRUNC;
+            break;
+        case UsbMode_OpenFileAppend:
+        case UsbMode_OpenFileAppendBytes:
+            flags = O_RDWR | O_CREAT | O_APPEND;
+            break;
+        case UsbMode_OpenFileReadWriteBytes:
+            flags = O_RDWR | O_CREAT;
+            break;
+        default:
+            return UsbReturnCode_UnknownMode;
+    }
+
+    if (flags != O_RDONLY)
+        changed(path);
+    fd = open(path.c_str(), flags, 0644);
+    if (fd < 0)
+        return UsbReturnCode_FailedOpenFile;
+    return UsbReturnCode_Success;
+}
+
+void Server::close_file()
+{
+    if (m_fd >= 0)
+        close(m_fd);
+    m_fd = -1;
+}
+
+Server::FileHandle::~FileHandle()
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+UsbRet Server::open_handle(uint8_t mode, const std::string &path, uint32_t &id)
+{
+    auto file = std::make_shared<FileHandle>();
+    const auto ret = open_file(mode, path, file->fd);
+    if (ret != UsbReturnCode_Success)
+        return ret;
+    file->path = path;
+
+    std::lock_guard<std::mutex> lock(m_files_lock);
+    if (m_files.size() >= USB_FILE_HANDLE_MAX)
+        return UsbReturnCode_TooManyFileHandles;
+
+    file->id = id = m_next_file++;
+    m_files.push_back(std::move(file));
+    return UsbReturnCode_Success;
+}
+
+UsbRet Server::close_handle(uint32_t id)
+{
+    std::lock_guard<std::mutex> lock(m_files_lock);
+    for (auto it = m_files.begin(); it != m_files.end(); ++it)
+    {
+        if ((*it)->id == id)
+        {
+            // the fd is closed once the last request using it lets go.
+            m_files.erase(it);
+            return UsbReturnCode_Success;
+        }
+    }
+    return UsbReturnCode_BadFileHandle;
+}
+
+void Server::close_handles()
+{
+    std::lock_guard<std::mutex> lock(m_files_lock);
+    m_files.clear();
+}
+
+Server::FileRef Server::find_file(uint32_t id)
+{
+    std::lock_guard<std::mutex> lock(m_files_lock);
+    for (const auto &file : m_files)
+    {
+        if (file->id == id)
+            return file;
+    }
+    return nullptr;
+}
+
+UsbRet Server::get_fd_size(int fd, uint64_t &out) const
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return UsbReturnCode_FailedGetFileSize;
+
+    out = st.st_size;
+    return UsbReturnCode_Success;
+}
+
+UsbRet Server::open_device(const std::string &name)
+{
+    for (size_t i = 0; i < m_devices.size(); i++)
+    {
+        if (m_devices[i].name == name)
+        {
+            m_device = i;
+            m_dir.clear();
+            return UsbReturnCode_Success;
+        }
+    }
+    return UsbReturnCode_FailedOpenDevice;
+}
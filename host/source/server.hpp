@@ -0,0 +1,455 @@
+/*
+*   TotalJustice
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "nxusb.h"
+#include "nxusb_async.h"
+#include "nxusb_batch.h"
+#include "nxusb_compress.h"
+#include "nxusb_delta.h"
+#include "nxusb_dir.h"
+#include "nxusb_file.h"
+#include "nxusb_hash.h"
+#include "nxusb_pack.h"
+#include "nxusb_resume.h"
+#include "transport.hpp"
+
+// these mirror the structs sent by source/nxusb.c.
+struct UsbHeader
+{
+    uint64_t magic;
+    uint8_t macro;
+    uint8_t minor;
+    uint8_t major;
+    uint8_t compression;
+    uint8_t flags;          // USB_HEADER_FLAG_CAPS.
+    uint8_t padding[0x3];
+};
+
+struct UsbPoll
+{
+    uint8_t mode;
+    uint8_t flags;          // USB_POLL_FLAG_TAGGED.
+    uint8_t padding[0x2];
+    uint32_t tag;
+    uint64_t size;
+};
+
+struct UsbFileIo
+{
+    uint64_t size;
+    uint64_t offset;
+};
+
+// the wire is little endian, this only swaps on big endian hosts.
+template <typename T>
+T from_le(T value)
+{
+    if constexpr (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    {
+        if constexpr (sizeof(T) == 8)
+            return static_cast<T>(__builtin_bswap64(value));
+        else if constexpr (sizeof(T) == 4)
+            return static_cast<T>(__builtin_bswap32(value));
+        else if constexpr (sizeof(T) == 2)
+            return static_cast<T>(__builtin_bswap16(value));
+    }
+    return value;
+}
+
+// the same for the headers every request starts with.
+inline void from_le(UsbPoll &poll)
+{
+    poll.tag = from_le(poll.tag);
+    poll.size = from_le(poll.size);
+}
+
+inline void from_le(UsbFileIo &io)
+{
+    io.size = from_le(io.size);
+    io.offset = from_le(io.offset);
+}
+
+inline void from_le(usb_file_io_t &io)
+{
+    io.handle = from_le(io.handle);
+    io.size = from_le(io.size);
+    io.offset = from_le(io.offset);
+}
+
+// and for the rest of the structs of nxusb_*.h, swapping is its own inverse so these encode replies too.
+inline void from_le(usb_file_entry_t &entry)
+{
+    entry.file_size = from_le(entry.file_size);
+}
+
+inline void from_le(usb_async_response_t &response)
+{
+    response.tag = from_le(response.tag);
+    response.result = from_le(response.result);
+    response.size = from_le(response.size);
+}
+
+inline void from_le(usb_batch_header_t &header)
+{
+    header.count = from_le(header.count);
+}
+
+inline void from_le(usb_batch_op_t &op)
+{
+    op.len1 = from_le(op.len1);
+    op.len2 = from_le(op.len2);
+}
+
+inline void from_le(usb_compress_block_t &block)
+{
+    block.size = from_le(block.size);
+    block.packed_size = from_le(block.packed_size);
+}
+
+inline void from_le(usb_dir_list_header_t &header)
+{
+    header.count = from_le(header.count);
+    header.size = from_le(header.size);
+}
+
+inline void from_le(usb_dir_entry_packed_t &entry)
+{
+    entry.file_size = from_le(entry.file_size);
+    entry.name_len = from_le(entry.name_len);
+}
+
+inline void from_le(usb_dir_cursor_info_t &info)
+{
+    info.cursor = from_le(info.cursor);
+    info.total = from_le(info.total);
+}
+
+inline void from_le(usb_dir_cursor_read_t &read)
+{
+    read.cursor = from_le(read.cursor);
+    read.max_entries = from_le(read.max_entries);
+}
+
+inline void from_le(usb_dir_query_t &query)
+{
+    query.min_size = from_le(query.min_size);
+    query.max_size = from_le(query.max_size);
+    query.offset = from_le(query.offset);
+    query.max_entries = from_le(query.max_entries);
+}
+
+inline void from_le(usb_file_hash_t &request)
+{
+    request.handle = from_le(request.handle);
+    request.size = from_le(request.size);
+    request.offset = from_le(request.offset);
+}
+
+inline void from_le(usb_hash_digest_t &digest)
+{
+    digest.size = from_le(digest.size);
+}
+
+inline void from_le(usb_file_checksum_t &request)
+{
+    request.handle = from_le(request.handle);
+    request.chunk_size = from_le(request.chunk_size);
+    request.size = from_le(request.size);
+    request.offset = from_le(request.offset);
+}
+
+inline void from_le(usb_delta_sig_t &sig)
+{
+    sig.weak = from_le(sig.weak);
+}
+
+inline void from_le(usb_delta_op_t &op)
+{
+    op.count = from_le(op.count);
+    op.index = from_le(op.index);
+}
+
+inline void from_le(usb_delta_request_t &request)
+{
+    request.block_size = from_le(request.block_size);
+    request.count = from_le(request.count);
+}
+
+inline void from_le(usb_delta_sig_header_t &header)
+{
+    header.file_size = from_le(header.file_size);
+    header.block_size = from_le(header.block_size);
+    header.count = from_le(header.count);
+}
+
+inline void from_le(usb_pack_request_t &request)
+{
+    request.max_file_size = from_le(request.max_file_size);
+}
+
+inline void from_le(usb_pack_block_t &block)
+{
+    block.size = from_le(block.size);
+    block.count = from_le(block.count);
+    block.result = from_le(block.result);
+}
+
+inline void from_le(usb_pack_entry_t &entry)
+{
+    entry.path_len = from_le(entry.path_len);
+    entry.size = from_le(entry.size);
+}
+
+static_assert(sizeof(UsbHeader) == 0x10);
+static_assert(sizeof(UsbPoll) == USB_POLL_SIZE);
+static_assert(sizeof(UsbFileIo) == 0x10);
+static_assert(sizeof(usb_file_entry_t) == 0x210 && offsetof(usb_file_entry_t, file_size) == 0x208);
+static_assert(sizeof(usb_file_io_t) == 0x18 && offsetof(usb_file_io_t, size) == 0x8 && offsetof(usb_file_io_t, offset) == 0x10);
+static_assert(sizeof(usb_caps_t) == USB_CAPS_SIZE);
+static_assert(sizeof(usb_async_response_t) == 0x10 && offsetof(usb_async_response_t, result) == 0x4 && offsetof(usb_async_response_t, size) == 0x8);
+static_assert(sizeof(usb_batch_header_t) == 0x8);
+static_assert(sizeof(usb_batch_op_t) == 0x8 && offsetof(usb_batch_op_t, len1) == 0x2 && offsetof(usb_batch_op_t, len2) == 0x4);
+static_assert(sizeof(usb_compress_block_t) == 0x8 && offsetof(usb_compress_block_t, packed_size) == 0x4);
+static_assert(sizeof(usb_dir_list_header_t) == 0x10);
+static_assert(sizeof(usb_dir_entry_packed_t) == 0x10 && offsetof(usb_dir_entry_packed_t, entry_type) == 0x8 && offsetof(usb_dir_entry_packed_t, name_len) == 0xC);
+static_assert(sizeof(usb_dir_cursor_info_t) == 0x10 && offsetof(usb_dir_cursor_info_t, total) == 0x8);
+static_assert(sizeof(usb_dir_cursor_read_t) == 0x8 && offsetof(usb_dir_cursor_read_t, max_entries) == 0x4);
+static_assert(offsetof(usb_dir_query_t, offset) == 0x10 && offsetof(usb_dir_query_t, catagory_mask) == 0x18);
+static_assert(offsetof(usb_dir_query_t, ext_mask) == 0x20 && offsetof(usb_dir_query_t, prefix) == 0x40);
+static_assert(sizeof(usb_file_open_t) == 0x8);
+static_assert(sizeof(usb_file_hash_t) == 0x18 && offsetof(usb_file_hash_t, type) == 0x4 && offsetof(usb_file_hash_t, size) == 0x8 && offsetof(usb_file_hash_t, offset) == 0x10);
+static_assert(sizeof(usb_hash_digest_t) == 0x8 + USB_HASH_DIGEST_SIZE);
+static_assert(sizeof(usb_file_checksum_t) == 0x18 && offsetof(usb_file_checksum_t, chunk_size) == 0x4 && offsetof(usb_file_checksum_t, size) == 0x8 && offsetof(usb_file_checksum_t, offset) == 0x10);
+static_assert(sizeof(usb_delta_sig_t) == 0x4 + USB_DELTA_STRONG_SIZE);
+static_assert(sizeof(usb_delta_op_t) == 0x10 && offsetof(usb_delta_op_t, count) == 0x4 && offsetof(usb_delta_op_t, index) == 0x8);
+static_assert(sizeof(usb_delta_request_t) == 0x10 && offsetof(usb_delta_request_t, compressed) == 0x8);
+static_assert(sizeof(usb_delta_sig_header_t) == 0x10 && offsetof(usb_delta_sig_header_t, count) == 0xC);
+static_assert(sizeof(usb_pack_request_t) == 0x10 && offsetof(usb_pack_request_t, compressed) == 0x8);
+static_assert(sizeof(usb_pack_block_t) == 0x10 && offsetof(usb_pack_block_t, result) == 0x8 && offsetof(usb_pack_block_t, last) == 0xC);
+static_assert(sizeof(usb_pack_entry_t) == 0x10 && offsetof(usb_pack_entry_t, path_len) == 0x2 && offsetof(usb_pack_entry_t, size) == 0x8);
+
+// serves the nxusb protocol against the local filesystem.
+// every path from the console is relative to the open device, and can't climb out of it.
+class Server
+{
+public:
+    explicit Server(Transport &transport);
+    ~Server();
+
+    // adds a device (a dir to serve), the first device added is open when the session starts.
+    bool add_device(const std::string &name, const std::string &path);
+
+    // runs the handshake then answers polls until the console exits or the link drops.
+    UsbRet run();
+
+private:
+    struct Device
+    {
+        std::string name;
+        std::string path;
+    };
+
+    // snapshot of a dir listing, handed out a page at a time.
+    struct DirCursor
+    {
+        uint32_t id = 0;
+        std::vector<usb_file_entry_t> entries;
+        size_t pos = 0;
+    };
+
+    // shared with every request still using it, so closing the handle can't pull the fd out from under one.
+    struct FileHandle
+    {
+        ~FileHandle();
+
+        uint32_t id = 0;
+        int fd = -1;
+        std::string path;
+    };
+    using FileRef = std::shared_ptr<FileHandle>;
+
+    // the last dir queried, sorted by name, reused while its change token holds.
+    struct DirIndex
+    {
+        std::string path;
+        uint64_t token = 0;
+        std::vector<usb_file_entry_t> entries;
+    };
+
+    // a block of a packed dir read (nxusb_pack.h) being filled in.
+    struct PackBlock
+    {
+        std::vector<uint8_t> data;
+        uint32_t count = 0;
+        UsbRet result = UsbReturnCode_Success;
+        uint64_t max_file_size = 0;
+        bool compressed = false;
+    };
+
+    struct TaggedJob
+    {
+        UsbPoll poll;
+        std::vector<uint8_t> body;
+    };
+
+    // link.
+    bool recv(void *out, size_t size);
+    bool send(const void *in, size_t size);
+    bool send_result(UsbRet ret);
+    bool send_value(UsbRet ret, uint64_t value);
+    // sends count values or structs, swapped to little endian on a copy if the host isn't.
+    template <typename T>
+    bool send_le(const T *data, size_t count);
+    bool send_entries(UsbRet ret, const std::vector<usb_file_entry_t> &entries, uint64_t count);
+    // sends entries [first, last) in the packed format of nxusb_dir.h.
+    bool send_dir_list(UsbRet ret, const std::vector<usb_file_entry_t> &entries, size_t first, size_t last);
+    // sends one block of a compressed transfer, raw if it doesn't shrink.
+    // consoles with caps get the blocks chained (see nxusb_compress.h), so each block is held back
+    // until the next one's header can go with it. flush_blocks sends the last one.
+    bool send_block(const uint8_t *data, size_t size);
+    bool flush_blocks();
+    // receives one block of a compressed transfer into m_buffer, ret is set if it doesn't decode.
+    bool recv_block(size_t size, UsbRet &ret);
+    bool recv_path(uint64_t size, std::string &out);
+    bool skip(uint64_t size);
+
+    UsbRet handshake();
+
+    // returns false once the session is over.
+    bool handle_poll(const UsbPoll &poll);
+
+    bool handle_read_file(const UsbPoll &poll);
+    bool handle_write_file(const UsbPoll &poll);
+    bool handle_rename(const UsbPoll &poll);
+    bool handle_path(const UsbPoll &poll);
+    bool handle_batch(const UsbPoll &poll);
+    bool handle_dir_cursor(const UsbPoll &poll);
+    bool handle_file_handle(const UsbPoll &poll);
+    bool handle_checksums(const UsbPoll &poll);
+    bool handle_hash(const UsbPoll &poll);
+    // receives a checksummed write, only writing it once it matches.
+    bool handle_write_checked(UsbFileIo io, int fd, const std::string &path, UsbRet ret);
+
+    // reads the size / offset header of a read or write and finds the file it's for.
+    // ret is set if there isn't one, the data still has to be moved either way.
+    bool recv_file_io(const UsbPoll &poll, UsbFileIo &io, FileRef &file, int &fd, UsbRet &ret);
+
+    // tagged requests (nxusb_async.h) are queued to a pool of workers and answered as they finish.
+    // an untagged poll waits for every tagged request to be answered first, so the two never share the link.
+    bool handle_tagged(const UsbPoll &poll);
+    void run_worker();
+    UsbRet run_tagged(uint8_t mode, const std::vector<uint8_t> &body, std::vector<uint8_t> &out);
+    bool send_tagged(uint32_t tag, UsbRet ret, const std::vector<uint8_t> &out);
+    void wait_idle();
+    void stop_workers();
+
+    // delta sync (nxusb_delta.h), the side with the new file works out the ops and the other applies them.
+    bool handle_delta(const UsbPoll &poll);
+    bool send_signatures(const std::string &path, uint32_t block_size);
+    bool apply_delta(const std::string &path, const usb_delta_request_t &request, UsbRet ret);
+    bool send_delta(const std::string &path, const usb_delta_request_t &request, const std::vector<usb_delta_sig_t> &sigs);
+    bool send_delta_op(const usb_delta_op_t &op, const uint8_t *data, bool compressed);
+
+    // filtered, sorted listings (usb_dir_query_t).
+    bool handle_query(const UsbPoll &poll);
+    UsbRet load_index(const std::string &path, const DirIndex *&out);
+
+    // packed dir reads (nxusb_pack.h), the walk is sent a block at a time as it goes.
+    bool handle_pack(const UsbPoll &poll);
+    bool pack_dir(const std::string &full, const std::string &rel, PackBlock &block);
+    // fd is only read for UsbPackEntry_File.
+    bool add_pack_entry(PackBlock &block, uint8_t type, const std::string &rel, uint64_t size, int fd);
+    bool send_pack_block(PackBlock &block, bool last);
+
+    // ops that take one or two paths and only reply with a result, shared by single and batched polls.
+    UsbRet simple_op(uint8_t mode, const std::string &path, const std::string &new_path);
+    // ops that take a path and reply with a value.
+    UsbRet path_value(uint8_t mode, const std::string &path, uint64_t &out);
+
+    // bumps the generation of the dir holding path, call it whenever path is changed over usb.
+    void changed(const std::string &path);
+    // the dir's own stat mixed with its generation.
+    UsbRet change_token(const std::string &path, uint64_t &out);
+
+    // resolves a console path against the open device.
+    std::string resolve(const std::string &path) const;
+
+    // opens path with one of the UsbMode_OpenFile modes.
+    UsbRet open_file(uint8_t mode, const std::string &path, int &fd);
+    void close_file();
+    UsbRet open_handle(uint8_t mode, const std::string &path, uint32_t &id);
+    UsbRet close_handle(uint32_t id);
+    void close_handles();
+    // returns nullptr if there's no open handle with that id.
+    FileRef find_file(uint32_t id);
+    UsbRet get_fd_size(int fd, uint64_t &out) const;
+    UsbRet open_device(const std::string &name);
+
+private:
+    Transport &m_transport;
+    std::vector<Device> m_devices;
+    size_t m_device = 0;
+
+    int m_fd = -1;              // the open file.
+    std::string m_fd_path;
+    std::vector<FileRef> m_files;
+    std::mutex m_files_lock;
+    uint32_t m_next_file = 1;
+    std::string m_dir;          // the open dir, empty if none.
+    std::vector<DirCursor> m_cursors;
+    DirIndex m_index;
+    uint32_t m_next_cursor = 1;
+
+    // per dir count of changes made through the server, mixed into change tokens so
+    // writing a file changes its dir's token even though the dir's stat doesn't change.
+    std::unordered_map<std::string, uint64_t> m_generations;
+    std::mutex m_generations_lock;
+
+    std::vector<uint8_t> m_buffer;
+    std::vector<uint8_t> m_packed;  // compressed side of a block.
+    std::vector<uint8_t> m_chain;   // the block held back by send_block.
+    std::vector<uint8_t> m_checked; // a checksummed write, held until it's checked.
+    bool m_exit = false;
+    bool m_caps = false;            // the console asked for caps, so it sends the newer request layouts.
+
+    std::vector<std::thread> m_workers;
+    std::deque<TaggedJob> m_jobs;
+    size_t m_jobs_active = 0;
+    bool m_workers_exit = false;
+    std::mutex m_jobs_lock;
+    std::condition_variable m_jobs_cond;
+    std::mutex m_send_lock;
+};
+
+template <typename T>
+bool Server::send_le(const T *data, size_t count)
+{
+    if constexpr (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    {
+        std::vector<T> wire(data, data + count);
+        for (auto &value : wire)
+        {
+            if constexpr (std::is_arithmetic_v<T>)
+                value = from_le(value);
+            else
+                from_le(value);
+        }
+        return send(wire.data(), count * sizeof(T));
+    }
+    return send(data, count * sizeof(T));
+}
@@ -0,0 +1,281 @@
+/*
+*   TotalJustice
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nxusb_compress.h"
+#include "nxusb_delta.h"
+#include "server.hpp"
+
+
+namespace
+{
+    constexpr const char *TEMP_SUFFIX = ".nxusb-delta";
+
+    UsbRet read_fd(void *user, void *out, size_t size, size_t *read_size)
+    {
+        const auto got = read(*static_cast<int *>(user), out, size);
+        *read_size = got > 0 ? got : 0;
+        return got < 0 ? UsbReturnCode_FailedReadFile : UsbReturnCode_Success;
+    }
+
+    struct Emitter
+    {
+        Server *server;
+        bool compressed;
+        bool link_failed;
+    };
+}
+
+
+
+/*
+*   Delta.
+*/
+
+bool Server::handle_delta(const UsbPoll &poll)
+{
+    usb_delta_request_t request;
+    if (poll.size < sizeof(request) || !recv(&request, sizeof(request)))
+        return false;
+    from_le(request);
+
+    // only UsbMode_GetFileDelta sends signatures.
+    const uint64_t sigs_size = poll.mode == UsbMode_GetFileDelta ? static_cast<uint64_t>(request.count) * sizeof(usb_delta_sig_t) : 0;
+    const uint64_t left = poll.size - sizeof(request);
+    if (sigs_size > left || left - sigs_size >= USB_FILE_NAME_MAX || request.count > USB_DELTA_SIGS_MAX)
+    {
+        if (!skip(left))
+            return false;
+        return send_result(UsbReturnCode_FileNameTooLarge);
+    }
+
+    std::string path;
+    if (!recv_path(left - sigs_size, path))
+        return false;
+
+    std::vector<usb_delta_sig_t> sigs(sigs_size ? request.count : 0);
+    if (sigs_size && !recv(sigs.data(), sigs_size))
+        return false;
+    for (auto &sig : sigs)
+        from_le(sig);
+
+    const bool block_ok = request.block_size >= USB_DELTA_BLOCK_MIN && request.block_size <= USB_DELTA_BLOCK_MAX;
+
+    switch (poll.mode)
+    {
+        case UsbMode_GetFileSignatures:
+            return block_ok ? send_signatures(resolve(path), request.block_size) : send_result(UsbReturnCode_BadDelta);
+        case UsbMode_ApplyFileDelta:
+            return apply_delta(resolve(path), request, block_ok ? UsbReturnCode_Success : UsbReturnCode_BadDelta);
+        default:
+            return block_ok ? send_delta(resolve(path), request, sigs) : send_result(UsbReturnCode_BadDelta);
+    }
+}
+
+bool Server::send_signatures(const std::string &path, uint32_t block_size)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        if (fd >= 0)
+            close(fd);
+        return send_result(UsbReturnCode_FailedOpenFile);
+    }
+
+    const uint64_t blocks = st.st_size / block_size;
+    std::vector<usb_delta_sig_t> sigs(blocks < USB_DELTA_SIGS_MAX ? blocks : USB_DELTA_SIGS_MAX);
+
+    size_t count = 0;
+    const auto ret = usb_delta_sign(read_fd, &fd, block_size, sigs.data(), sigs.size(), &count);
+    close(fd);
+    if (ret != UsbReturnCode_Success)
+        return send_result(ret);
+
+    usb_delta_sig_header_t header{};
+    header.file_size = st.st_size;
+    header.block_size = block_size;
+    header.count = count;
+    from_le(header);
+
+    return send_result(UsbReturnCode_Success) && send(&header, sizeof(header)) &&
+        (!count || send_le(sigs.data(), count));
+}
+
+bool Server::apply_delta(const std::string &path, const usb_delta_request_t &request, UsbRet ret)
+{
+    // the new file is built next to the old one, and only replaces it once its hash checks out.
+    // the whole op stream is read whatever happens, so the link stays in step.
+    const auto temp = path + TEMP_SUFFIX;
+    const int basis = open(path.c_str(), O_RDONLY);
+    const int out = ret == UsbReturnCode_Success ? open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (out < 0 && ret == UsbReturnCode_Success)
+        ret = UsbReturnCode_FailedOpenFile;
+
+    struct stat st;
+    const uint64_t basis_blocks = basis >= 0 && fstat(basis, &st) == 0 ? st.st_size / request.block_size : 0;
+
+    usb_sha256_t sha;
+    usb_sha256_init(&sha);
+    uint64_t size = 0;
+
+    const auto write_out = [&](const uint8_t *data, size_t len)
+    {
+        if (ret == UsbReturnCode_Success && write(out, data, len) != static_cast<ssize_t>(len))
+            ret = UsbReturnCode_FailedWriteFile;
+        usb_sha256_update(&sha, data, len);
+        size += len;
+    };
+
+    const auto finish = [&](bool link)
+    {
+        if (basis >= 0)
+            close(basis);
+        if (out >= 0)
+        {
+            close(out);
+            changed(path);
+            if (ret != UsbReturnCode_Success || rename(temp.c_str(), path.c_str()) < 0)
+            {
+                unlink(temp.c_str());
+                if (ret == UsbReturnCode_Success)
+                    ret = UsbReturnCode_FailedWriteFile;
+            }
+        }
+        return link;
+    };
+
+    for (;;)
+    {
+        usb_delta_op_t op;
+        if (!recv(&op, sizeof(op)))
+            return finish(false);
+        from_le(op);
+
+        if (op.type == UsbDeltaOp_End)
+        {
+            uint8_t expected[USB_SHA256_SIZE], digest[USB_SHA256_SIZE];
+            if (op.count != sizeof(expected) || !recv(expected, sizeof(expected)))
+                return finish(false);
+
+            usb_sha256_final(&sha, digest);
+            if (ret == UsbReturnCode_Success && (op.index != size || std::memcmp(digest, expected, sizeof(digest))))
+                ret = UsbReturnCode_ChecksumMismatch;
+            return finish(true) && send_result(ret);
+        }
+
+        if (op.type == UsbDeltaOp_Copy)
+        {
+            if (op.index > basis_blocks || op.count > basis_blocks - op.index)
+            {
+                if (ret == UsbReturnCode_Success)
+                    ret = UsbReturnCode_BadDelta;
+                continue;
+            }
+
+            uint64_t offset = op.index * request.block_size;
+            uint64_t left = static_cast<uint64_t>(op.count) * request.block_size;
+            while (left)
+            {
+                const size_t chunk = left < m_buffer.size() ? left : m_buffer.size();
+                if (pread(basis, m_buffer.data(), chunk, offset) != static_cast<ssize_t>(chunk))
+                {
+                    if (ret == UsbReturnCode_Success)
+                        ret = UsbReturnCode_FailedReadFile;
+                    break;
+                }
+
+                write_out(m_buffer.data(), chunk);
+                offset += chunk;
+                left -= chunk;
+            }
+            continue;
+        }
+
+        // the framing can't be trusted past a bad op, so drop the link.
+        if (op.type != UsbDeltaOp_Literal || op.count > USB_DELTA_LITERAL_MAX)
+            return finish(false);
+
+        const size_t max_chunk = request.compressed ? USB_COMPRESS_BLOCK_SIZE : m_buffer.size();
+        for (size_t left = op.count; left;)
+        {
+            const size_t chunk = left < max_chunk ? left : max_chunk;
+            if (request.compressed ? !recv_block(chunk, ret) : !recv(m_buffer.data(), chunk))
+                return finish(false);
+
+            write_out(m_buffer.data(), chunk);
+            left -= chunk;
+        }
+    }
+}
+
+bool Server::send_delta(const std::string &path, const usb_delta_request_t &request, const std::vector<usb_delta_sig_t> &sigs)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        if (fd >= 0)
+            close(fd);
+        return send_result(UsbReturnCode_FailedOpenFile);
+    }
+
+    if (!send_result(UsbReturnCode_Success))
+    {
+        close(fd);
+        return false;
+    }
+
+    Emitter emitter{this, request.compressed != 0, false};
+    const auto emit = [](void *user, const usb_delta_op_t *op, const void *data) -> UsbRet
+    {
+        auto e = static_cast<Emitter *>(user);
+        e->link_failed = !e->server->send_delta_op(*op, static_cast<const uint8_t *>(data), e->compressed);
+        return e->link_failed ? UsbReturnCode_Failure : UsbReturnCode_Success;
+    };
+
+    const auto ret = usb_delta_generate(sigs.data(), sigs.size(), request.block_size, read_fd, &fd, emit, &emitter);
+    close(fd);
+
+    if (ret == UsbReturnCode_Success)
+        return true;
+    if (emitter.link_failed)
+        return false;
+
+    // the file failed part way, end with a hash that won't match so the console drops what it got.
+    const uint8_t digest[USB_SHA256_SIZE]{};
+    usb_delta_op_t op{};
+    op.type = UsbDeltaOp_End;
+    op.count = sizeof(digest);
+    return send_delta_op(op, digest, false);
+}
+
+bool Server::send_delta_op(const usb_delta_op_t &op, const uint8_t *data, bool compressed)
+{
+    auto wire = op;
+    from_le(wire);
+    if (!send(&wire, sizeof(wire)))
+        return false;
+
+    if (op.type == UsbDeltaOp_End)
+        return send(data, op.count);
+    if (op.type != UsbDeltaOp_Literal)
+        return true;
+    if (!compressed)
+        return send(data, op.count);
+
+    for (size_t done = 0; done < op.count;)
+    {
+        const size_t chunk = op.count - done < USB_COMPRESS_BLOCK_SIZE ? op.count - done : USB_COMPRESS_BLOCK_SIZE;
+        if (!send_block(data + done, chunk))
+            return false;
+        done += chunk;
+    }
+    return flush_blocks();
+}
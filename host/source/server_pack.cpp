@@ -0,0 +1,169 @@
+/*
+*   TotalJustice
+*/
+
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fs.hpp"
+#include "nxusb_compress.h"
+#include "nxusb_pack.h"
+#include "server.hpp"
+
+
+namespace
+{
+    void set_result(UsbRet &result, UsbRet ret)
+    {
+        if (result == UsbReturnCode_Success)
+            result = ret;
+    }
+}
+
+
+
+/*
+*   Pack.
+*/
+
+bool Server::handle_pack(const UsbPoll &poll)
+{
+    usb_pack_request_t request;
+    if (poll.size < sizeof(request) || !recv(&request, sizeof(request)))
+        return false;
+    from_le(request);
+
+    std::string path;
+    const uint64_t left = poll.size - sizeof(request);
+    if (left >= USB_FILE_NAME_MAX)
+    {
+        if (!skip(left))
+            return false;
+        return send_result(UsbReturnCode_FileNameTooLarge);
+    }
+    if (!recv_path(left, path))
+        return false;
+
+    const auto root = resolve(path);
+    if (!fs::is_dir(root))
+        return send_result(UsbReturnCode_NotDir);
+    if (!send_result(UsbReturnCode_Success))
+        return false;
+
+    PackBlock block;
+    block.max_file_size = request.max_file_size < USB_PACK_FILE_MAX ? request.max_file_size : USB_PACK_FILE_MAX;
+    block.compressed = request.compressed != 0;
+    block.data.reserve(USB_PACK_BLOCK_SIZE);
+
+    return pack_dir(root, std::string(), block) && send_pack_block(block, true);
+}
+
+bool Server::pack_dir(const std::string &full, const std::string &rel, PackBlock &block)
+{
+    std::vector<usb_file_entry_t> entries;
+    const auto ret = fs::list_dir(full, entries);
+    if (ret != UsbReturnCode_Success)
+    {
+        set_result(block.result, ret);
+        return true;
+    }
+
+    for (const auto &entry : entries)
+    {
+        const auto child_full = full + "/" + entry.name;
+        const auto child_rel = rel.empty() ? std::string(entry.name) : rel + "/" + entry.name;
+        if (child_rel.size() >= USB_FILE_NAME_MAX)
+        {
+            set_result(block.result, UsbReturnCode_FileNameTooLarge);
+            continue;
+        }
+
+        if (entry.entry_type == UsbFileEntryType_Dir)
+        {
+            if (!add_pack_entry(block, UsbPackEntry_Dir, child_rel, 0, -1) || !pack_dir(child_full, child_rel, block))
+                return false;
+            continue;
+        }
+
+        // the size is taken from the open file, so the data always matches the header.
+        const int fd = open(child_full.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0)
+        {
+            if (fd >= 0)
+                close(fd);
+            set_result(block.result, UsbReturnCode_FailedOpenFile);
+            continue;
+        }
+
+        const uint64_t size = st.st_size;
+        const bool large = size > block.max_file_size;
+        const bool sent = add_pack_entry(block, large ? UsbPackEntry_Large : UsbPackEntry_File, child_rel, size, large ? -1 : fd);
+        close(fd);
+        if (!sent)
+            return false;
+    }
+
+    return true;
+}
+
+bool Server::add_pack_entry(PackBlock &block, uint8_t type, const std::string &rel, uint64_t size, int fd)
+{
+    const uint64_t data_size = type == UsbPackEntry_File ? size : 0;
+    const size_t entry_size = sizeof(usb_pack_entry_t) + rel.size() + data_size;
+    if (block.data.size() + entry_size > USB_PACK_BLOCK_SIZE && !send_pack_block(block, false))
+        return false;
+
+    usb_pack_entry_t entry{};
+    entry.type = type;
+    entry.path_len = rel.size();
+    entry.size = size;
+    from_le(entry);
+
+    const auto start = block.data.size();
+    block.data.resize(start + entry_size);
+    std::memcpy(block.data.data() + start, &entry, sizeof(entry));
+    std::memcpy(block.data.data() + start + sizeof(entry), rel.data(), rel.size());
+
+    // a file that can't be read is left out, rather than sent with data it doesn't have.
+    if (data_size && pread(fd, block.data.data() + start + sizeof(entry) + rel.size(), data_size, 0) != static_cast<ssize_t>(data_size))
+    {
+        block.data.resize(start);
+        set_result(block.result, UsbReturnCode_FailedReadFile);
+        return true;
+    }
+
+    block.count++;
+    return true;
+}
+
+bool Server::send_pack_block(PackBlock &block, bool last)
+{
+    usb_pack_block_t header{};
+    header.size = block.data.size();
+    header.count = block.count;
+    header.result = last ? block.result : UsbReturnCode_Success;
+    header.last = last;
+    from_le(header);
+
+    if (!send(&header, sizeof(header)))
+        return false;
+
+    for (size_t done = 0; done < block.data.size();)
+    {
+        const size_t left = block.data.size() - done;
+        const size_t chunk = block.compressed && left > USB_COMPRESS_BLOCK_SIZE ? USB_COMPRESS_BLOCK_SIZE : left;
+        if (!(block.compressed ? send_block(block.data.data() + done, chunk) : send(block.data.data() + done, chunk)))
+            return false;
+        done += chunk;
+    }
+
+    if (block.compressed && !flush_blocks())
+        return false;
+
+    block.data.clear();
+    block.count = 0;
+    return true;
+}
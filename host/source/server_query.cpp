@@ -0,0 +1,163 @@
+/*
+*   TotalJustice
+*/
+
+#include <algorithm>
+#include <cstring>
+#include <strings.h>
+
+#include "fs.hpp"
+#include "nxusb_dir.h"
+#include "server.hpp"
+
+
+namespace
+{
+    bool has_bit(const uint8_t *mask, size_t bytes, uint8_t bit)
+    {
+        if (std::all_of(mask, mask + bytes, [](uint8_t b) { return b == 0; }))
+            return true;
+        return bit / 8 < bytes && (mask[bit / 8] & (1 << (bit % 8)));
+    }
+
+    bool matches(const usb_dir_query_t &query, const usb_file_entry_t &entry, size_t prefix_len)
+    {
+        if (!has_bit(&query.catagory_mask, sizeof(query.catagory_mask), entry.catagory))
+            return false;
+
+        if (prefix_len)
+        {
+            const bool nocase = query.flags & UsbDirQueryFlag_IgnoreCase;
+            if ((nocase ? strncasecmp(entry.name, query.prefix, prefix_len) : std::strncmp(entry.name, query.prefix, prefix_len)) != 0)
+                return false;
+        }
+
+        if (entry.entry_type == UsbFileEntryType_Dir)
+            return true;
+
+        return has_bit(query.ext_mask, sizeof(query.ext_mask), entry.ext_type) &&
+            entry.file_size >= query.min_size && (!query.max_size || entry.file_size <= query.max_size);
+    }
+
+    // strict weak ordering for the sort the query asks for, ties are broken by name.
+    bool less(const usb_dir_query_t &query, const usb_file_entry_t &a, const usb_file_entry_t &b)
+    {
+        if (query.flags & UsbDirQueryFlag_DirsFirst)
+        {
+            const bool a_dir = a.entry_type == UsbFileEntryType_Dir;
+            const bool b_dir = b.entry_type == UsbFileEntryType_Dir;
+            if (a_dir != b_dir)
+                return a_dir;
+        }
+
+        const bool descending = query.flags & UsbDirQueryFlag_Descending;
+        const auto &x = descending ? b : a;
+        const auto &y = descending ? a : b;
+
+        switch (query.sort)
+        {
+            case UsbDirSort_Size:
+                if (x.file_size != y.file_size)
+                    return x.file_size < y.file_size;
+                break;
+            case UsbDirSort_Type:
+                if (x.ext_type != y.ext_type)
+                    return x.ext_type < y.ext_type;
+                break;
+        }
+        return std::strcmp(x.name, y.name) < 0;
+    }
+}
+
+
+
+/*
+*   Query.
+*/
+
+bool Server::handle_query(const UsbPoll &poll)
+{
+    usb_dir_query_t query;
+    if (poll.size < sizeof(query) || !recv(&query, sizeof(query)))
+        return false;
+    from_le(query);
+
+    std::string path;
+    const uint64_t left = poll.size - sizeof(query);
+    if (left >= USB_FILE_NAME_MAX)
+    {
+        if (!skip(left))
+            return false;
+        return send_result(UsbReturnCode_FileNameTooLarge);
+    }
+    if (!recv_path(left, path))
+        return false;
+
+    const auto prefix_len = strnlen(query.prefix, sizeof(query.prefix));
+    if (prefix_len == sizeof(query.prefix) || query.sort > UsbDirSort_Type)
+        return send_result(UsbReturnCode_UnknownMode);
+
+    const DirIndex *index;
+    const auto ret = load_index(resolve(path), index);
+    if (ret != UsbReturnCode_Success)
+        return send_result(ret);
+
+    // the index is sorted by name, so a case sensitive prefix narrows it down to one run of it.
+    auto first = index->entries.begin();
+    auto last = index->entries.end();
+    if (prefix_len && !(query.flags & UsbDirQueryFlag_IgnoreCase))
+    {
+        const std::string prefix(query.prefix, prefix_len);
+        first = std::lower_bound(first, last, prefix, [](const usb_file_entry_t &e, const std::string &p) {
+            return std::strcmp(e.name, p.c_str()) < 0;
+        });
+        last = std::find_if(first, last, [&prefix](const usb_file_entry_t &e) {
+            return std::strncmp(e.name, prefix.c_str(), prefix.size()) != 0;
+        });
+    }
+
+    std::vector<usb_file_entry_t> found;
+    for (auto it = first; it != last; ++it)
+    {
+        if (matches(query, *it, prefix_len))
+            found.push_back(*it);
+    }
+
+    // the index is already in name order.
+    if (query.sort != UsbDirSort_Name || (query.flags & (UsbDirQueryFlag_Descending | UsbDirQueryFlag_DirsFirst)))
+        std::stable_sort(found.begin(), found.end(), [&query](const usb_file_entry_t &a, const usb_file_entry_t &b) {
+            return less(query, a, b);
+        });
+
+    const size_t begin = query.offset < found.size() ? query.offset : found.size();
+    size_t end = found.size();
+    if (query.max_entries && query.max_entries < end - begin)
+        end = begin + query.max_entries;
+
+    return send_dir_list(UsbReturnCode_Success, found, begin, end);
+}
+
+UsbRet Server::load_index(const std::string &path, const DirIndex *&out)
+{
+    if (!fs::is_dir(path))
+        return UsbReturnCode_NotDir;
+
+    uint64_t token = 0;
+    auto ret = change_token(path, token);
+    if (ret != UsbReturnCode_Success)
+        return ret;
+
+    if (m_index.path != path || m_index.token != token)
+    {
+        m_index.path.clear();
+        ret = fs::list_dir(path, m_index.entries);
+        if (ret != UsbReturnCode_Success)
+            return ret;
+
+        m_index.path = path;
+        m_index.token = token;
+    }
+
+    out = &m_index;
+    return UsbReturnCode_Success;
+}
@@ -0,0 +1,290 @@
+/*
+*   TotalJustice
+*/
+
+#include <cstring>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fs.hpp"
+#include "nxusb_async.h"
+#include "nxusb_dir.h"
+#include "nxusb_file.h"
+#include "server.hpp"
+
+
+namespace
+{
+    constexpr size_t WORKER_COUNT = 4;
+
+    // walks the body of a tagged request.
+    class BodyReader
+    {
+    public:
+        explicit BodyReader(const std::vector<uint8_t> &body) : m_body(body) {}
+
+        bool read(void *out, size_t size)
+        {
+            if (size > m_body.size() - m_pos)
+                return false;
+            std::memcpy(out, m_body.data() + m_pos, size);
+            m_pos += size;
+            return true;
+        }
+
+        bool read_path(size_t size, std::string &out)
+        {
+            if (size >= USB_FILE_NAME_MAX || size > m_body.size() - m_pos)
+                return false;
+            out.assign(reinterpret_cast<const char *>(m_body.data() + m_pos), size);
+            m_pos += size;
+            return true;
+        }
+
+        // the rest of the body.
+        const uint8_t *data() const { return m_body.data() + m_pos; }
+        size_t left() const { return m_body.size() - m_pos; }
+
+    private:
+        const std::vector<uint8_t> &m_body;
+        size_t m_pos = 0;
+    };
+
+    void put_value(std::vector<uint8_t> &out, uint64_t value)
+    {
+        value = from_le(value);
+        out.resize(sizeof(value));
+        std::memcpy(out.data(), &value, sizeof(value));
+    }
+}
+
+
+
+/*
+*   Tagged.
+*/
+
+bool Server::handle_tagged(const UsbPoll &poll)
+{
+    if (m_workers.empty())
+    {
+        m_workers_exit = false;
+        for (size_t i = 0; i < WORKER_COUNT; i++)
+            m_workers.emplace_back(&Server::run_worker, this);
+    }
+
+    if (poll.size > USB_ASYNC_SIZE_MAX + sizeof(usb_file_io_t))
+    {
+        if (!skip(poll.size))
+            return false;
+        return send_tagged(poll.tag, UsbReturnCode_UnknownMode, {});
+    }
+
+    TaggedJob job;
+    job.poll = poll;
+    job.body.resize(poll.size);
+    if (!job.body.empty() && !recv(job.body.data(), job.body.size()))
+        return false;
+
+    std::lock_guard<std::mutex> lock(m_jobs_lock);
+    m_jobs.push_back(std::move(job));
+    m_jobs_cond.notify_one();
+    return true;
+}
+
+void Server::run_worker()
+{
+    std::vector<uint8_t> out;
+
+    for (;;)
+    {
+        std::unique_lock<std::mutex> lock(m_jobs_lock);
+        m_jobs_cond.wait(lock, [this]() { return m_workers_exit || !m_jobs.empty(); });
+        if (m_jobs.empty())
+            return;
+
+        auto job = std::move(m_jobs.front());
+        m_jobs.pop_front();
+        m_jobs_active++;
+        lock.unlock();
+
+        out.clear();
+        const auto ret = run_tagged(job.poll.mode, job.body, out);
+        send_tagged(job.poll.tag, ret, out);
+
+        lock.lock();
+        m_jobs_active--;
+        m_jobs_cond.notify_all();
+    }
+}
+
+bool Server::send_tagged(uint32_t tag, UsbRet ret, const std::vector<uint8_t> &out)
+{
+    const uint64_t size = ret == UsbReturnCode_Success ? out.size() : 0;
+
+    usb_async_response_t response{};
+    response.tag = tag;
+    response.result = ret;
+    response.size = size;
+    from_le(response);
+
+    std::lock_guard<std::mutex> lock(m_send_lock);
+    if (!send(&response, sizeof(response)))
+        return false;
+    return !size || send(out.data(), size);
+}
+
+void Server::wait_idle()
+{
+    std::unique_lock<std::mutex> lock(m_jobs_lock);
+    m_jobs_cond.wait(lock, [this]() { return m_jobs.empty() && !m_jobs_active; });
+}
+
+void Server::stop_workers()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_jobs_lock);
+        m_workers_exit = true;
+        m_jobs_cond.notify_all();
+    }
+
+    // workers finish the queue before they exit.
+    for (auto &worker : m_workers)
+        worker.join();
+    m_workers.clear();
+}
+
+UsbRet Server::run_tagged(uint8_t mode, const std::vector<uint8_t> &body, std::vector<uint8_t> &out)
+{
+    BodyReader reader(body);
+    std::string path, new_path;
+    uint64_t value = 0;
+    UsbRet ret;
+
+    switch (mode)
+    {
+        case UsbMode_Ping:
+            return UsbReturnCode_Success;
+
+        case UsbMode_TouchFile:
+        case UsbMode_DeleteFile:
+        case UsbMode_IsFile:
+        case UsbMode_TouchDir:
+        case UsbMode_DeleteDir:
+        case UsbMode_IsDir:
+            if (!reader.read_path(body.size(), path))
+                return UsbReturnCode_FileNameTooLarge;
+            return simple_op(mode, resolve(path), std::string());
+
+        case UsbMode_GetFileSizeFromPath:
+        case UsbMode_GetChangeToken:
+        case UsbMode_GetDirTotalFromPath:
+        case UsbMode_GetDirTotalRecursivelyFromPath:
+        case UsbMode_GetDirSizeFromPath:
+        case UsbMode_GetDirSizeFromPathRecursively:
+            if (!reader.read_path(body.size(), path))
+                return UsbReturnCode_FileNameTooLarge;
+            ret = path_value(mode, resolve(path), value);
+            put_value(out, value);
+            return ret;
+
+        case UsbMode_ReadDirCompact:
+        {
+            if (!reader.read_path(body.size(), path))
+                return UsbReturnCode_FileNameTooLarge;
+
+            std::vector<usb_file_entry_t> entries;
+            ret = fs::list_dir(resolve(path), entries);
+            if (ret != UsbReturnCode_Success)
+                return ret;
+
+            std::vector<uint8_t> data;
+            fs::pack_entries(entries, 0, entries.size(), data);
+
+            usb_dir_list_header_t header = { entries.size(), data.size() };
+            from_le(header);
+            out.resize(sizeof(header));
+            std::memcpy(out.data(), &header, sizeof(header));
+            out.insert(out.end(), data.begin(), data.end());
+            return UsbReturnCode_Success;
+        }
+
+        case UsbMode_RenameFile:
+        case UsbMode_RenameDir:
+        {
+            struct
+            {
+                uint64_t l1;
+                uint64_t l2;
+            } lens;
+
+            if (!reader.read(&lens, sizeof(lens)))
+                return UsbReturnCode_FileNameTooLarge;
+            lens.l1 = from_le(lens.l1);
+            lens.l2 = from_le(lens.l2);
+
+            if (!reader.read_path(lens.l1, path) || !reader.read_path(lens.l2, new_path))
+                return UsbReturnCode_FileNameTooLarge;
+            return simple_op(mode, resolve(path), resolve(new_path));
+        }
+
+        case UsbMode_OpenFileHandle:
+        {
+            usb_file_open_t open;
+            if (!reader.read(&open, sizeof(open)) || !reader.read_path(reader.left(), path))
+                return UsbReturnCode_FileNameTooLarge;
+
+            uint32_t id = 0;
+            ret = open_handle(open.mode, resolve(path), id);
+            put_value(out, id);
+            return ret;
+        }
+
+        case UsbMode_ReadFileHandle:
+        case UsbMode_WriteFileHandle:
+        case UsbMode_GetFileHandleSize:
+        case UsbMode_CloseFileHandle:
+            break;
+
+        default:
+            return UsbReturnCode_UnknownMode;
+    }
+
+    usb_file_io_t io;
+    if (!reader.read(&io, sizeof(io)))
+        return UsbReturnCode_BadFileHandle;
+    from_le(io);
+
+    if (mode == UsbMode_CloseFileHandle)
+        return close_handle(io.handle);
+
+    // holds the fd open until this request is done, even if another closes the handle.
+    const auto file = find_file(io.handle);
+    if (!file)
+        return UsbReturnCode_BadFileHandle;
+
+    if (mode == UsbMode_GetFileHandleSize)
+    {
+        ret = get_fd_size(file->fd, value);
+        put_value(out, value);
+        return ret;
+    }
+
+    if (mode == UsbMode_WriteFileHandle)
+    {
+        changed(file->path);
+        if (io.size != reader.left() || pwrite(file->fd, reader.data(), io.size, io.offset) != static_cast<ssize_t>(io.size))
+            return UsbReturnCode_FailedWriteFile;
+        return UsbReturnCode_Success;
+    }
+
+    struct stat st;
+    if (io.size > USB_ASYNC_SIZE_MAX || fstat(file->fd, &st) < 0 ||
+        io.offset > static_cast<uint64_t>(st.st_size) || io.size > st.st_size - io.offset)
+        return UsbReturnCode_FailedReadFile;
+
+    out.resize(io.size);
+    if (pread(file->fd, out.data(), io.size, io.offset) != static_cast<ssize_t>(io.size))
+        return UsbReturnCode_FailedReadFile;
+    return UsbReturnCode_Success;
+}
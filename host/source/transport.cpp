@@ -0,0 +1,125 @@
+/*
+*   TotalJustice
+*/
+
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "transport.hpp"
+
+
+/*
+*   FdTransport.
+*/
+
+FdTransport::FdTransport(int read_fd, int write_fd, bool owned)
+    : m_read_fd(read_fd), m_write_fd(write_fd), m_owned(owned)
+{
+}
+
+FdTransport::~FdTransport()
+{
+    if (!m_owned)
+        return;
+
+    close(m_read_fd);
+    if (m_write_fd != m_read_fd)
+        close(m_write_fd);
+}
+
+size_t FdTransport::read(void *out, size_t size)
+{
+    auto dst = static_cast<uint8_t *>(out);
+    size_t done = 0;
+
+    while (done < size)
+    {
+        const auto ret = ::read(m_read_fd, dst + done, size - done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        done += ret;
+    }
+
+    return done;
+}
+
+size_t FdTransport::write(const void *in, size_t size)
+{
+    auto src = static_cast<const uint8_t *>(in);
+    size_t done = 0;
+
+    while (done < size)
+    {
+        const auto ret = ::write(m_write_fd, src + done, size - done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        done += ret;
+    }
+
+    return done;
+}
+
+int unix_socket_accept(const std::string &path)
+{
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path))
+        return -1;
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size());
+    unlink(path.c_str());
+
+    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 || listen(fd, 1) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    int client;
+    do
+    {
+        client = accept(fd, nullptr, nullptr);
+    } while (client < 0 && errno == EINTR);
+
+    close(fd);
+    unlink(path.c_str());
+    return client;
+}
+
+int unix_socket_connect(const std::string &path)
+{
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path))
+        return -1;
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+    int ret;
+    do
+    {
+        ret = connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
@@ -0,0 +1,80 @@
+/*
+*   TotalJustice
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// the byte transport the server talks over.
+// read / write return the number of bytes moved, anything short of size means the link is gone.
+class Transport
+{
+public:
+    virtual ~Transport() = default;
+
+    virtual size_t read(void *out, size_t size) = 0;
+    virtual size_t write(const void *in, size_t size) = 0;
+};
+
+// transport over a pair of file descriptors (socketpair, pipes, fifos, stdio).
+// the fds are closed on destruction if owned.
+class FdTransport final : public Transport
+{
+public:
+    FdTransport(int read_fd, int write_fd, bool owned = false);
+    ~FdTransport() override;
+
+    size_t read(void *out, size_t size) override;
+    size_t write(const void *in, size_t size) override;
+
+private:
+    int m_read_fd;
+    int m_write_fd;
+    bool m_owned;
+};
+
+// listens on a unix socket and returns the first connection, -1 on error.
+int unix_socket_accept(const std::string &path);
+
+// connects to a unix socket, -1 on error.
+int unix_socket_connect(const std::string &path);
+
+#ifdef NXUSB_HAVE_LIBUSB
+struct libusb_context;
+struct libusb_device_handle;
+
+// transport over the usbComms bulk endpoints of a switch.
+class LibusbTransport final : public Transport
+{
+public:
+    static constexpr uint16_t DEFAULT_VID = 0x057E;
+    static constexpr uint16_t DEFAULT_PID = 0x3000;
+    // a whole number of packets at every usb speed, the most a small read asks for.
+    static constexpr size_t READ_BUFFER_SIZE = 0x10000;
+
+    ~LibusbTransport() override;
+
+    // opens the first device matching vid / pid and claims its first interface.
+    bool open(uint16_t vid = DEFAULT_VID, uint16_t pid = DEFAULT_PID);
+
+    size_t read(void *out, size_t size) override;
+    size_t write(const void *in, size_t size) override;
+
+private:
+    libusb_context *m_ctx = nullptr;
+    libusb_device_handle *m_handle = nullptr;
+    uint8_t m_ep_in = 0;
+    uint8_t m_ep_out = 0;
+    uint16_t m_max_packet = 0;      // of the in endpoint.
+    int m_interface = -1;
+
+    // the rest of a transfer that was bigger than the read that took it.
+    std::vector<unsigned char> m_buffer;
+    size_t m_buffer_pos = 0;
+    size_t m_buffer_len = 0;
+};
+#endif
@@ -0,0 +1,142 @@
+/*
+*   TotalJustice
+*/
+
+#ifdef NXUSB_HAVE_LIBUSB
+
+#include <cstring>
+#include <libusb.h>
+
+#include "transport.hpp"
+
+
+LibusbTransport::~LibusbTransport()
+{
+    if (m_handle)
+    {
+        if (m_interface >= 0)
+            libusb_release_interface(m_handle, m_interface);
+        libusb_close(m_handle);
+    }
+
+    if (m_ctx)
+        libusb_exit(m_ctx);
+}
+
+bool LibusbTransport::open(uint16_t vid, uint16_t pid)
+{
+    if (libusb_init(&m_ctx) != LIBUSB_SUCCESS)
+        return false;
+
+    m_handle = libusb_open_device_with_vid_pid(m_ctx, vid, pid);
+    if (!m_handle)
+        return false;
+
+    libusb_config_descriptor *config = nullptr;
+    if (libusb_get_active_config_descriptor(libusb_get_device(m_handle), &config) != LIBUSB_SUCCESS)
+        return false;
+
+    // usbComms exposes one interface with a bulk in and a bulk out endpoint.
+    if (config->bNumInterfaces && config->interface[0].num_altsetting)
+    {
+        const auto &desc = config->interface[0].altsetting[0];
+        m_interface = desc.bInterfaceNumber;
+
+        for (uint8_t i = 0; i < desc.bNumEndpoints; i++)
+        {
+            const auto &ep = desc.endpoint[i];
+            if ((ep.bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_BULK)
+                continue;
+
+            if (ep.bEndpointAddress & LIBUSB_ENDPOINT_IN)
+            {
+                m_ep_in = ep.bEndpointAddress;
+                m_max_packet = ep.wMaxPacketSize & 0x7FF;
+            }
+            else
+                m_ep_out = ep.bEndpointAddress;
+        }
+    }
+    libusb_free_config_descriptor(config);
+
+    if (m_interface < 0 || !m_ep_in || !m_ep_out || !m_max_packet)
+        return false;
+
+    libusb_set_auto_detach_kernel_driver(m_handle, 1);
+    if (libusb_claim_interface(m_handle, m_interface) != LIBUSB_SUCCESS)
+    {
+        m_interface = -1;
+        return false;
+    }
+
+    return true;
+}
+
+// the console sends a request and its args in one transfer, but the server reads them a piece at a time.
+// so small reads go through a buffer that keeps what's left of a transfer for the next read,
+// which also means a transfer can never overflow the buffer it lands in.
+// usbComms never ends a transfer with a zero length packet, so a transfer that ends on a packet boundary
+// only completes a read that asked for no more than that. reads are rounded up to the packet holding
+// the last byte wanted and never past it.
+size_t LibusbTransport::read(void *out, size_t size)
+{
+    auto dst = static_cast<unsigned char *>(out);
+    size_t done = 0;
+
+    while (done < size)
+    {
+        if (m_buffer_pos < m_buffer_len)
+        {
+            const size_t chunk = size - done < m_buffer_len - m_buffer_pos ? size - done : m_buffer_len - m_buffer_pos;
+            std::memcpy(dst + done, m_buffer.data() + m_buffer_pos, chunk);
+            m_buffer_pos += chunk;
+            done += chunk;
+            continue;
+        }
+
+        int transferred = 0;
+        int ret;
+
+        // big reads go straight to out, in whole packets so they end on a packet boundary.
+        if (size - done >= READ_BUFFER_SIZE)
+        {
+            const size_t left = (size - done) - (size - done) % m_max_packet;
+            const int chunk = left > 0x800000 ? 0x800000 : static_cast<int>(left);
+            ret = libusb_bulk_transfer(m_handle, m_ep_in, dst + done, chunk, &transferred, 0);
+            done += transferred;
+        }
+        else
+        {
+            const size_t chunk = (size - done + m_max_packet - 1) / m_max_packet * m_max_packet;
+            m_buffer.resize(READ_BUFFER_SIZE);
+            ret = libusb_bulk_transfer(m_handle, m_ep_in, m_buffer.data(), static_cast<int>(chunk), &transferred, 0);
+            m_buffer_pos = 0;
+            m_buffer_len = transferred;
+        }
+
+        if (ret != LIBUSB_SUCCESS || !transferred)
+            break;
+    }
+
+    return done;
+}
+
+size_t LibusbTransport::write(const void *in, size_t size)
+{
+    auto src = static_cast<unsigned char *>(const_cast<void *>(in));
+    size_t done = 0;
+
+    while (done < size)
+    {
+        int transferred = 0;
+        const int chunk = size - done > 0x800000 ? 0x800000 : static_cast<int>(size - done);
+        const int ret = libusb_bulk_transfer(m_handle, m_ep_out, src + done, chunk, &transferred, 0);
+        done += transferred;
+        if (ret != LIBUSB_SUCCESS || !transferred)
+            break;
+    }
+
+    return done;
+}
+
+#endif
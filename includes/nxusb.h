@@ -2,6 +2,12 @@
 #define _NXUSB_H_
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 #define NXUSB_MAGIC         0x4E58555342 // might have to reverse it.
 #define NXUSB_VERSION_MAJOR 0x0
@@ -9,10 +15,20 @@
 #define NXUSB_VERSION_MACRO 0x1
 
 #define USB_POLL_SIZE       0x10
+#define USB_CAPS_SIZE       0x20
 #define USB_FILE_NAME_MAX   0x200
 
+#define USB_TRANSFER_ALIGN          0x1000      // usbComms wants page aligned buffers.
+#define USB_POOL_BUFFER_SIZE        0x100000    // default size of each pooled transfer buffer (1MiB).
+#define USB_POOL_BUFFER_COUNT       0x2         // default number of pooled transfer buffers.
+#define USB_POOL_BUFFER_COUNT_MAX   0x20
+
 typedef uint32_t UsbRet;    // return type
 
+// set in the handshake headers of both sides when the host's usb_caps_t follows its header.
+// older hosts leave it clear, older consoles never ask.
+#define USB_HEADER_FLAG_CAPS    0x1
+
 
 
 typedef enum
@@ -26,6 +42,7 @@ typedef enum
     UsbMode_OpenFileWriteBytes              = 0x13,
     UsbMode_OpenFileAppend                  = 0x14,
     UsbMode_OpenFileAppendBytes             = 0x15,
+    UsbMode_OpenFileReadWriteBytes          = 0x16,
 
     UsbMode_ReadFile                        = 0x20,
     UsbMode_WriteFile                       = 0x21,
@@ -36,6 +53,8 @@ typedef enum
     UsbMode_GetFileSizeFromPath             = 0x26,
     UsbMode_IsFile                          = 0x27,
     UsbMode_CloseFile                       = 0x28,
+    UsbMode_ReadFileCompressed              = 0x29,
+    UsbMode_WriteFileCompressed             = 0x2A,
 
     UsbMode_OpenDir                         = 0x30,
     UsbMode_ReadDir                         = 0x31,
@@ -45,16 +64,45 @@ typedef enum
     UsbMode_GetDirTotalRecursively          = 0x35,
     UsbMode_RenameDir                       = 0x36,
     UsbMode_GetDirSize                      = 0x37,
-    UsbMode_GetDirSizeRecursively           = 0x37,
-    UsbMode_GetDirSizeFromPath              = 0x37,
-    UsbMode_GetDirSizeFromPathRecursively   = 0x37,
     UsbMode_GetDirTotalFromPath             = 0x38,
     UsbMode_GetDirTotalRecursivelyFromPath  = 0x39,
     UsbMode_IsDir                           = 0x3A,
+    UsbMode_GetDirSizeRecursively           = 0x3B,
+    UsbMode_GetDirSizeFromPath              = 0x3C,
+    UsbMode_GetDirSizeFromPathRecursively   = 0x3D,
+    UsbMode_ReadDirFromPath                 = 0x3E,
+    UsbMode_ReadDirCompact                  = 0x3F,
 
     UsbMode_OpenDevice                      = 0x40,
     UsbMode_ReadDevices                     = 0x41,
     UsbMode_GetTotalDevices                 = 0x42,
+
+    UsbMode_Batch                           = 0x50,
+
+    UsbMode_OpenDirCursor                   = 0x60,
+    UsbMode_ReadDirCursor                   = 0x61,
+    UsbMode_CloseDirCursor                  = 0x62,
+    UsbMode_GetChangeToken                  = 0x63,
+    UsbMode_QueryDir                        = 0x64,
+
+    UsbMode_OpenFileHandle                  = 0x70,
+    UsbMode_ReadFileHandle                  = 0x71,
+    UsbMode_WriteFileHandle                 = 0x72,
+    UsbMode_GetFileHandleSize               = 0x73,
+    UsbMode_CloseFileHandle                 = 0x74,
+    UsbMode_ReadFileHandleCompressed        = 0x75,
+    UsbMode_WriteFileHandleCompressed       = 0x76,
+    UsbMode_ReadFileHandleChecked           = 0x77,
+    UsbMode_WriteFileHandleChecked          = 0x78,
+    UsbMode_GetFileHandleChecksums          = 0x79,
+    UsbMode_SetFileHandleSize               = 0x7A,
+    UsbMode_GetFileHandleHash               = 0x7B,
+
+    UsbMode_GetFileSignatures               = 0x80,
+    UsbMode_ApplyFileDelta                  = 0x81,
+    UsbMode_GetFileDelta                    = 0x82,
+
+    UsbMode_ReadDirPacked                   = 0x90,
 } UsbMode;
 
 typedef enum
@@ -69,9 +117,21 @@ typedef enum
     UsbReturnCode_WrongClientMagic      = 0x6,
     UsbReturnCode_UnsupportedHosttVer   = 0x7,
     UsbReturnCode_UnsupportedCleintVer  = 0x8,
+    UsbReturnCode_FailedAllocPool       = 0x9,
+    UsbReturnCode_NoFreeBuffer          = 0xA,
+    UsbReturnCode_UnalignedBuffer       = 0xB,
+    UsbReturnCode_UnknownMode           = 0xC,
+    UsbReturnCode_StreamFull            = 0xD,
+    UsbReturnCode_BadBatch              = 0xE,
+    UsbReturnCode_CompressionUnsupported    = 0xF,
 
     UsbReturnCode_FileNameTooLarge      = 0x10,
     UsbReturnCode_EmptyField            = 0x11,
+    UsbReturnCode_AsyncNotRunning       = 0x12,
+    UsbReturnCode_BadResponse           = 0x13,
+    UsbReturnCode_UnknownHashType       = 0x14,
+    UsbReturnCode_BadDelta              = 0x15,
+    UsbReturnCode_UnsupportedByHost     = 0x16,
 
     UsbReturnCode_FailedOpenFile        = 0x20,
     UsbReturnCode_FailedRenameFile      = 0x21,
@@ -80,7 +140,16 @@ typedef enum
     UsbReturnCode_FailedGetFileSize     = 0x24,
     UsbReturnCode_FileNotOpen           = 0x25,
     UsbReturnCode_FailedReadFile        = 0x26,
-    
+    UsbReturnCode_FailedWriteFile       = 0x27,
+    UsbReturnCode_NotFile               = 0x28,
+    UsbReturnCode_BadCompressedBlock    = 0x29,
+    UsbReturnCode_BadFileHandle         = 0x2A,
+    UsbReturnCode_TooManyFileHandles    = 0x2B,
+    UsbReturnCode_FailedOpenLocalFile   = 0x2C,
+    UsbReturnCode_FailedReadLocalFile   = 0x2D,
+    UsbReturnCode_FailedWriteLocalFile  = 0x2E,
+    UsbReturnCode_ChecksumMismatch      = 0x2F,
+
 
     UsbReturnCode_FailedOpenDir         = 0x30,
     UsbReturnCode_FailedRenameDir       = 0x31,
@@ -93,6 +162,15 @@ typedef enum
     UsbReturnCode_FailedGetDirSizeRecursively   = 0x38,
     UsbReturnCode_FailedGetDirSizeFromPath      = 0x39,
     UsbReturnCode_FailedGetDirSizeRecursivelyFromPath   = 0x3A,
+    UsbReturnCode_FailedDeleteDir       = 0x3B,
+    UsbReturnCode_DirNotOpen            = 0x3C,
+    UsbReturnCode_NotDir                = 0x3D,
+    UsbReturnCode_BadDirCursor          = 0x3E,
+    UsbReturnCode_TooManyDirCursors     = 0x3F,
+
+    UsbReturnCode_FailedOpenDevice      = 0x40,
+    UsbReturnCode_FailedOpenLocalDir    = 0x41,
+    UsbReturnCode_FailedTouchLocalDir   = 0x42,
 
     UsbReturnCode_Failure       = 0xFF,
 } UsbReturnCode;
@@ -148,6 +226,35 @@ typedef enum
     UsbFileSizeType_Small,
     UsbFileSizeType_Large   // too large for fat32.
 } UsbFileSizeType;
+
+// features the host advertises in usb_caps_t.
+typedef enum
+{
+    UsbCap_Framed       = 1 << 0,   // takes a poll, its args and data in one transfer.
+    UsbCap_Tagged       = 1 << 1,   // nxusb_async.h.
+    UsbCap_Batch        = 1 << 2,   // nxusb_batch.h.
+    UsbCap_FileHandles  = 1 << 3,   // nxusb_file.h.
+    UsbCap_Resume       = 1 << 4,   // checked reads / writes and checksums, nxusb_resume.h.
+    UsbCap_Hash         = 1 << 5,   // nxusb_hash.h.
+    UsbCap_Delta        = 1 << 6,   // nxusb_delta.h.
+    UsbCap_DirCompact   = 1 << 7,   // compact listings and dir cursors, nxusb_dir.h.
+    UsbCap_DirQuery     = 1 << 8,   // usb_dir_query.
+    UsbCap_DirPacked    = 1 << 9,   // nxusb_pack.h.
+    UsbCap_ChangeToken  = 1 << 10,  // usb_get_change_token and the cache, nxusb_dir.h.
+} UsbCap;
+
+// sent by the host after its handshake header, see USB_HEADER_FLAG_CAPS.
+typedef struct
+{
+    uint64_t caps;                  // UsbCap.
+    uint32_t max_transfer;          // biggest read / write one request can move, 0 for no limit.
+    uint32_t max_inflight;          // tagged requests the host takes at once.
+    uint32_t compression;           // bitmask of the UsbCompression codecs the host serves.
+    uint32_t max_handles;           // file handles the host keeps open at once.
+    uint32_t dir_format;            // USB_DIR_LIST_FORMAT of the compact listings the host sends.
+    uint32_t padding;
+} usb_caps_t;
+
 typedef struct
 {
     char name[USB_FILE_NAME_MAX];   // 1kb.
@@ -160,6 +267,45 @@ typedef struct
 
 
 
+/*
+*   Transport Functions.
+*/
+
+// the byte transport that sits under usb_read / usb_write.
+// read / write return the number of bytes moved, anything short of size is treated as an error.
+// init and exit are optional.
+typedef struct
+{
+    UsbRet (*init)(void *user);
+    void (*exit)(void *user);
+    size_t (*read)(void *user, void *out, size_t size);
+    size_t (*write)(void *user, const void *in, size_t size);
+    void *user;
+} usb_transport_t;
+
+// sets the transport used by usb_init and every transfer after it, the struct is copied.
+// must be called before usb_init.
+// passing NULL restores the default, which is usbComms on switch and nothing elsewhere.
+void usb_set_transport(const usb_transport_t *transport);
+
+#ifdef __SWITCH__
+// libnx usbComms transport, this is the default.
+void usb_transport_nx(usb_transport_t *out);
+#else
+typedef struct
+{
+    int read_fd;
+    int write_fd;
+} usb_fd_transport_t;
+
+// transport over a pair of file descriptors, such as a socketpair, two pipes or two fifos.
+// read_fd and write_fd can be the same fd (socketpair).
+// fds must stay valid until usb_exit, they are not closed by the transport.
+void usb_transport_fd(usb_transport_t *out, usb_fd_transport_t *fds);
+#endif
+
+
+
 /*
 *   Core Functions.
 */
@@ -169,8 +315,15 @@ typedef struct
 // checks the result of the pc client to see if magic matches and version is supported.
 // receives data from pc client conatining magic and client version.
 // todo: checks to see if client version in supported.
+// allocates the transfer buffer pool with the default size and count.
 UsbRet usb_init(void);
 
+// same as usb_init, but lets the caller size the transfer buffer pool.
+// every usb_read / usb_write bounces through one of these buffers, so no heap calls are made per transfer.
+// transfers larger than buffer_size are split into buffer_size chunks.
+// buffer_size is rounded up to USB_TRANSFER_ALIGN, count must be between 1 and USB_POOL_BUFFER_COUNT_MAX.
+UsbRet usb_init_ex(size_t buffer_size, uint32_t count);
+
 // read into void *out return size of data read.
 // returns UsbReturnCode_Success if the size read is equal to the given size.
 UsbRet usb_read(void *out, size_t size);
@@ -179,6 +332,19 @@ UsbRet usb_read(void *out, size_t size);
 // returns UsbReturnCode_Success if the size written is equal to the given size.
 UsbRet usb_write(const void *in, size_t size);
 
+// same as usb_read / usb_write, but the buffer is handed straight to usb with no staging copy.
+// the buffer must be USB_TRANSFER_ALIGN aligned, returns UsbReturnCode_UnalignedBuffer otherwise.
+// for reads, the buffer should come from usb_alloc_aligned so the whole page is owned by the caller.
+// note: usb_read / usb_write already take this path when given an aligned buffer.
+UsbRet usb_read_aligned(void *out, size_t size);
+UsbRet usb_write_aligned(const void *in, size_t size);
+
+// allocates a buffer that can be used with usb_read_aligned / usb_write_aligned.
+// the size is rounded up to USB_TRANSFER_ALIGN.
+// free with usb_free_aligned.
+void *usb_alloc_aligned(size_t size);
+void usb_free_aligned(void *buf);
+
 // this gets called for every command.
 // it will write 0x10 bytes to usb.
 // this will tell the usb the mode to be in and how much data to receive / send (depending on mode).
@@ -189,6 +355,13 @@ UsbRet usb_poll(uint8_t mode, size_t size);
 // writes the version number of the client to the given inputs.
 void usb_get_client_version(uint8_t *macro, uint8_t *minor, uint8_t *major);
 
+// what the host advertised in usb_init, all zero for hosts older than capabilities.
+// the library already checks these, requests the host can't serve fail with UsbReturnCode_UnsupportedByHost.
+void usb_get_host_caps(usb_caps_t *out);
+
+// true if the host advertised every bit of caps (UsbCap).
+bool usb_host_has_caps(uint64_t caps);
+
 // this function will be called by other usb functions without decent error handling.
 // an example would be on the function usb_open_file, poll and write could succeed, but the actual opening of the file in python might fail.
 // this function gets called to read 4 bytes from the python client, which should be 0 (UsbReturnCode_Success) if no errors.
@@ -202,7 +375,11 @@ bool usb_failed(UsbRet ret);
 // if the value is UsbReturnCode_Success, return true.
 bool usb_succeeded(UsbRet ret);
 
+// sends a ping, the host replies with UsbReturnCode_Success.
+UsbRet usb_ping(void);
+
 // call this to exit usb comms.
+// frees the transfer buffer pool.
 void usb_exit(void);
 
 
@@ -215,6 +392,10 @@ void usb_exit(void);
 // the mode should be the open file mode you want, i.e. read, write, append.
 UsbRet usb_open_file(const char *name, uint8_t mode);
 
+// check if entry is a file.
+// returns 0 if true.
+UsbRet usb_is_file(const char *path);
+
 // create a file from the given name.
 // calls usb_get_result after.
 // should return UsbReturnCode_Success if the file was created OR is the file already exists.
@@ -228,9 +409,12 @@ UsbRet usb_rename_file(const char *curr_name, const char *new_name);
 UsbRet usb_delete_file(const char *name);
 
 // read into out until size.
+// no copy is made if out is from usb_alloc_aligned and size is a multiple of USB_TRANSFER_ALIGN,
+// any other size reads through a pool buffer.
 UsbRet usb_read_file(void *out, size_t size, uint64_t offset);
 
 // write to in to usb until size.
+// no copy is made if in is USB_TRANSFER_ALIGN aligned.
 UsbRet usb_write_to_file(const void *in, size_t size, uint64_t offset);
 
 // get the size of an open file.
@@ -268,10 +452,13 @@ UsbRet usb_touch_dir(const char *path);
 
 // get the total number of entries from a dir.
 UsbRet usb_get_dir_total(uint64_t *out);
+UsbRet usb_get_dir_total_recursively(uint64_t *out);
 UsbRet usb_get_dir_total_from_path(const char *path, uint64_t *out);
+UsbRet usb_get_dir_total_recursively_from_path(const char *path, uint64_t *out);
 
 // reads dir into out * count.
 // this should be called after getting dir total. 
+// if the dir has less than count entries, the remaining entries are zeroed.
 UsbRet usb_read_dir(usb_file_entry_t *out, uint64_t count);
 UsbRet usb_read_dir_from_path(usb_file_entry_t *out, uint64_t count, const char *path);
 
@@ -281,4 +468,24 @@ UsbRet usb_get_dir_size_recursively(size_t *out);
 UsbRet usb_get_dir_size_from_path(const char *path, size_t *out);
 UsbRet usb_get_dir_size_recursively_from_path(const char *path, size_t *out);
 
+
+
+/*
+*   Device Functions.
+*/
+
+// a device is one of the roots the host is serving, paths are relative to the open device.
+// the host starts with its first device open.
+UsbRet usb_open_device(const char *name);
+
+// get the total number of devices on the host.
+UsbRet usb_get_device_total(uint64_t *out);
+
+// reads devices into out * count, file_size is the free space of the device.
+UsbRet usb_read_devices(usb_file_entry_t *out, uint64_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
\ No newline at end of file
@@ -0,0 +1,89 @@
+#ifndef _NXUSB_ASYNC_H_
+#define _NXUSB_ASYNC_H_
+
+#include "nxusb.h"
+#include "nxusb_file.h"
+#include "nxusb_dir.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define USB_ASYNC_INFLIGHT_DEFAULT  0x10
+#define USB_ASYNC_INFLIGHT_MAX      0x100
+#define USB_ASYNC_SIZE_MAX          0x1000000   // biggest read / write of one request (16MiB).
+
+// set in the poll flags of a tagged request.
+// the poll tag names the request, and poll size is the size of the body that follows in full.
+#define USB_POLL_FLAG_TAGGED        0x1
+
+// sent by the host once a tagged request is done, followed by size bytes of body.
+// responses come back in whatever order the host finishes them.
+typedef struct
+{
+    uint32_t tag;
+    UsbRet result;
+    uint64_t size;
+} usb_async_response_t;
+
+typedef struct usb_async usb_async_t;
+
+// called on the receiver thread when a request completes, value is set by the value returning requests.
+typedef void (*usb_async_cb_t)(UsbRet ret, uint64_t value, void *user);
+
+
+
+/*
+*   Async Functions.
+*/
+
+// starts the dispatcher and receiver threads, from here on requests from any thread share the link.
+// up to max_inflight requests are sent before waiting on a response.
+// the async layer owns the link until usb_async_stop(), don't call the blocking usb functions in between.
+UsbRet usb_async_start(uint32_t max_inflight);
+
+// waits for every request to complete, then stops the threads.
+// returns the error that broke the link, if any.
+UsbRet usb_async_stop(void);
+
+// blocks until the request completes, returns its result and frees it.
+// value is optional.
+UsbRet usb_async_wait(usb_async_t *req, uint64_t *value);
+
+// calls callback once the request completes (right away if it already has), then frees it.
+void usb_async_then(usb_async_t *req, usb_async_cb_t callback, void *user);
+
+
+
+/*
+*   Async Requests.
+*/
+
+// every request is queued and returns straight away, its result comes from usb_async_wait / usb_async_then.
+// buffers passed in must stay valid until the request completes.
+
+UsbRet usb_async_ping(usb_async_t **out);
+
+// mode is one of the single path polls: touch, delete or is for a file or dir,
+// or get file size / dir total / dir size / change token from path, which complete with a value.
+UsbRet usb_async_path(uint8_t mode, const char *path, usb_async_t **out);
+
+// same as usb_read_dir_compact(), list is filled in once the request completes successfully.
+// the list must be freed with usb_dir_list_free.
+UsbRet usb_async_dir_list(const char *path, usb_dir_list_t *list, usb_async_t **out);
+
+// mode is UsbMode_RenameFile or UsbMode_RenameDir.
+UsbRet usb_async_rename(uint8_t mode, const char *curr_name, const char *new_name, usb_async_t **out);
+
+// completes with the handle as the value.
+UsbRet usb_async_file_open(const char *path, uint8_t mode, usb_async_t **out);
+UsbRet usb_async_file_read(usb_file_t file, void *data, size_t size, uint64_t offset, usb_async_t **out);
+UsbRet usb_async_file_write(usb_file_t file, const void *data, size_t size, uint64_t offset, usb_async_t **out);
+UsbRet usb_async_file_get_size(usb_file_t file, usb_async_t **out);
+UsbRet usb_async_file_close(usb_file_t file, usb_async_t **out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
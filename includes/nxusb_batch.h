@@ -0,0 +1,64 @@
+#ifndef _NXUSB_BATCH_H_
+#define _NXUSB_BATCH_H_
+
+#include "nxusb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define USB_BATCH_SIZE_MAX  0x100000    // max payload of one batch request, bigger batches are split.
+
+// sent after a UsbMode_Batch poll, followed by count ops.
+typedef struct
+{
+    uint32_t count;
+    uint32_t padding;
+} usb_batch_header_t;
+
+// one op in a batch, followed by len1 bytes of path and len2 bytes of new path (rename only).
+typedef struct
+{
+    uint8_t mode;
+    uint8_t padding;
+    uint16_t len1;
+    uint16_t len2;
+    uint16_t padding2;
+} usb_batch_op_t;
+
+typedef struct usb_batch usb_batch_t;
+
+
+
+/*
+*   Batch Functions.
+*/
+
+// queues ops client side and sends them all in one request, with one result per op coming back.
+// only ops that take a path and return a result can be batched:
+// touch, delete, is and rename, for both files and dirs.
+UsbRet usb_batch_create(usb_batch_t **out);
+void usb_batch_free(usb_batch_t *batch);
+
+// queues an op that takes a single path, such as UsbMode_DeleteFile.
+UsbRet usb_batch_add(usb_batch_t *batch, uint8_t mode, const char *path);
+
+// queues UsbMode_RenameFile or UsbMode_RenameDir.
+UsbRet usb_batch_add_rename(usb_batch_t *batch, uint8_t mode, const char *curr_name, const char *new_name);
+
+// number of queued ops.
+uint32_t usb_batch_count(const usb_batch_t *batch);
+
+// sends every queued op, results must hold usb_batch_count entries.
+// results[i] is the result of the i'th op, the returned value is for the request itself.
+// the batch is cleared once sent.
+UsbRet usb_batch_submit(usb_batch_t *batch, UsbRet *results);
+
+// drops every queued op.
+void usb_batch_clear(usb_batch_t *batch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef _NXUSB_COMPRESS_H_
+#define _NXUSB_COMPRESS_H_
+
+#include "nxusb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define USB_COMPRESS_BLOCK_SIZE     0x20000 // raw bytes per compressed block (128KiB).
+#define USB_COMPRESS_SKIP_BLOCKS    0x8     // blocks sent raw after one that didn't shrink.
+
+typedef enum
+{
+    UsbCompression_None = 0x0,
+    UsbCompression_Lz4  = 0x1,
+} UsbCompression;
+
+// bitmask of the codecs the console offers in the handshake header, the host replies with the one it picked.
+#define USB_COMPRESSION_SUPPORTED   (1U << UsbCompression_Lz4)
+
+// sent before every block of a compressed transfer, followed by packed_size bytes.
+// packed_size == size means the block is raw, which is how incompressible data (nsz, ncz...) is sent.
+// with UsbCap_Framed the console sends a header and its block in one transfer, and the host sends
+// the first header on its own then each block with the next block's header, so the console can size every read.
+typedef struct
+{
+    uint32_t size;
+    uint32_t packed_size;
+} usb_compress_block_t;
+
+
+/*
+*   Codec, shared with the host.
+*/
+
+// compresses src into an lz4 block.
+// returns the packed size, or 0 if it wouldn't fit in capacity (the data doesn't compress).
+size_t usb_lz4_compress(const void *src, size_t size, void *dst, size_t capacity);
+
+// decompresses an lz4 block, fails unless it decodes to exactly size bytes.
+// every offset and length is checked, so this is safe to call on data from the other side.
+bool usb_lz4_decompress(const void *src, size_t packed_size, void *dst, size_t size);
+
+
+/*
+*   Compression Functions.
+*/
+
+// sets the codec used by usb_read_file() and usb_write_to_file(), and everything built on them.
+// the codec picked in the handshake is used by default, UsbCompression_None turns it off.
+// returns UsbReturnCode_CompressionUnsupported if the host didn't agree to it.
+UsbRet usb_set_compression(UsbCompression compression);
+
+UsbCompression usb_get_compression(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
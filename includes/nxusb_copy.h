@@ -0,0 +1,110 @@
+#ifndef _NXUSB_COPY_H_
+#define _NXUSB_COPY_H_
+
+#include "nxusb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define USB_COPY_CHUNK_MIN      0x10000     // 64KiB.
+#define USB_COPY_CHUNK_MAX      0x800000    // 8MiB.
+#define USB_COPY_CHUNK_START    0x100000    // 1MiB.
+
+#define USB_COPY_TREE_FILES     0x10        // files in flight at once, under the host's USB_FILE_HANDLE_MAX.
+#define USB_COPY_TREE_DIRS      0x4         // dirs being listed at once.
+#define USB_COPY_TREE_CHUNK     0x100000    // biggest read / write of a file in a tree copy (1MiB).
+
+// chunk size tuner, models each transfer as time = latency + size / bandwidth and fits that to what it measures.
+// chunks are sized so the fixed latency is at most 1/16th of a transfer, rounded to a power of 2.
+// the fit decays over time, so it follows a host or cable that changes speed.
+typedef struct
+{
+    size_t min;
+    size_t max;
+    size_t chunk;               // size of the next transfer.
+    uint32_t count;             // transfers reported.
+
+    // decayed sums for the least squares fit of time (ns) against size (bytes).
+    double n;
+    double sx;
+    double sy;
+    double sxx;
+    double sxy;
+} usb_chunk_tuner_t;
+
+typedef void (*usb_copy_progress_t)(uint64_t done, uint64_t total, void *user);
+
+typedef struct
+{
+    size_t min_chunk;           // 0 for USB_COPY_CHUNK_MIN.
+    size_t max_chunk;           // 0 for USB_COPY_CHUNK_MAX, this is also the memory the copy allocates.
+    usb_copy_progress_t progress;   // optional, called after every chunk.
+    void *user;
+} usb_copy_config_t;
+
+typedef struct
+{
+    uint64_t size;              // bytes copied.
+    uint64_t usb_ns;            // time spent on usb transfers.
+    uint64_t total_ns;          // time for the whole copy.
+    size_t last_chunk;          // chunk size the tuner settled on.
+} usb_copy_stats_t;
+
+typedef struct
+{
+    uint64_t files;
+    uint64_t dirs;
+    uint64_t size;              // bytes copied.
+    uint64_t total_ns;
+} usb_copy_tree_stats_t;
+
+
+
+/*
+*   Chunk Tuner Functions.
+*/
+
+// min and max are rounded to USB_TRANSFER_ALIGN.
+void usb_chunk_tuner_init(usb_chunk_tuner_t *tuner, size_t min, size_t max);
+
+// size of the next transfer.
+size_t usb_chunk_tuner_next(const usb_chunk_tuner_t *tuner);
+
+// reports how long a transfer of size bytes took.
+void usb_chunk_tuner_report(usb_chunk_tuner_t *tuner, size_t size, uint64_t ns);
+
+
+
+/*
+*   Copy Functions.
+*/
+
+// copies a whole file from the host to local_path (e.g. "sdmc:/file"), config and stats are optional.
+UsbRet usb_copy_file_from_host(const char *host_path, const char *local_path, const usb_copy_config_t *config, usb_copy_stats_t *stats);
+
+// copies a whole local file to the host, replacing host_path.
+UsbRet usb_copy_file_to_host(const char *local_path, const char *host_path, const usb_copy_config_t *config, usb_copy_stats_t *stats);
+
+
+
+/*
+*   Tree Copy Functions.
+*/
+
+// copies the dir host_path and everything in it to local_path, creating dirs as it goes.
+// the walk and the data are pipelined through the async layer: dir listings, opens, reads and closes
+// of up to USB_COPY_TREE_FILES files are in flight at once, so small files don't each wait on a round trip.
+// the async layer is started for the copy if it isn't already running.
+// config->max_chunk is the memory shared by the files in flight, progress is given the bytes copied so far
+// and the bytes found so far, which grows as the walk goes on. config and stats are optional.
+UsbRet usb_copy_dir_from_host(const char *host_path, const char *local_path, const usb_copy_config_t *config, usb_copy_tree_stats_t *stats);
+
+// same as above, the other way around. files that already exist on the host are replaced.
+UsbRet usb_copy_dir_to_host(const char *local_path, const char *host_path, const usb_copy_config_t *config, usb_copy_tree_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef _NXUSB_DELTA_H_
+#define _NXUSB_DELTA_H_
+
+#include "nxusb.h"
+#include "nxusb_hash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define USB_DELTA_BLOCK_MIN     0x800       // 2KiB.
+#define USB_DELTA_BLOCK_MAX     0x20000     // 128KiB.
+#define USB_DELTA_STRONG_SIZE   0xC         // bytes of sha256 kept per block.
+#define USB_DELTA_SIGS_MAX      0x100000    // signatures per file, 16MiB of them.
+#define USB_DELTA_LITERAL_MAX   0x100000    // 1MiB, the most data one literal op carries.
+
+// rsync style delta: the side with the old file (the basis) sends a signature of each block of it,
+// the side with the new file finds those blocks in it with a rolling checksum, and sends
+// copy ops for the blocks it found and literal ops for everything else.
+
+typedef enum
+{
+    UsbDeltaOp_End      = 0x0,      // index is the size of the new file, count bytes of sha256 of it follow.
+    UsbDeltaOp_Copy     = 0x1,      // blocks [index, index + count) of the basis.
+    UsbDeltaOp_Literal  = 0x2,      // count bytes follow, as compressed blocks if the request said so.
+} UsbDeltaOp;
+
+typedef struct
+{
+    uint32_t weak;          // rolling checksum.
+    uint8_t strong[USB_DELTA_STRONG_SIZE];
+} usb_delta_sig_t;
+
+typedef struct
+{
+    uint8_t type;           // UsbDeltaOp.
+    uint8_t padding[0x3];
+    uint32_t count;
+    uint64_t index;
+} usb_delta_op_t;
+
+// sent after a UsbMode_GetFileSignatures, UsbMode_ApplyFileDelta or UsbMode_GetFileDelta poll, followed by the path.
+// for UsbMode_GetFileDelta, the console's signatures follow the path.
+typedef struct
+{
+    uint32_t block_size;
+    uint32_t count;         // signatures after the path.
+    uint8_t compressed;     // literal data is sent as compressed blocks.
+    uint8_t padding[0x7];
+} usb_delta_request_t;
+
+// the host's reply to UsbMode_GetFileSignatures, followed by the signatures.
+typedef struct
+{
+    uint64_t file_size;
+    uint32_t block_size;
+    uint32_t count;
+} usb_delta_sig_header_t;
+
+typedef struct
+{
+    uint64_t size;          // size of the new file.
+    uint64_t copied;        // bytes reused from the old file.
+    uint64_t literal;       // bytes sent.
+} usb_delta_stats_t;
+
+// reads up to size bytes, sets read to 0 at the end.
+typedef UsbRet (*usb_delta_read_t)(void *user, void *out, size_t size, size_t *read);
+// data is the literal data, or the sha256 for UsbDeltaOp_End.
+typedef UsbRet (*usb_delta_emit_t)(void *user, const usb_delta_op_t *op, const void *data);
+
+
+
+/*
+*   Delta Functions.
+*/
+
+// picks a block size of about the square root of the file size.
+uint32_t usb_delta_block_size(uint64_t file_size);
+
+// rolling checksum of a block.
+uint32_t usb_delta_weak(const uint8_t *data, size_t size);
+
+// signs every whole block of the file read with read, out has room for max signatures.
+UsbRet usb_delta_sign(usb_delta_read_t read, void *user, uint32_t block_size, usb_delta_sig_t *out, size_t max, size_t *count);
+
+// reads the new file with read and emits the ops that rebuild it from a basis with those signatures.
+UsbRet usb_delta_generate(const usb_delta_sig_t *sigs, size_t count, uint32_t block_size,
+    usb_delta_read_t read, void *read_user, usb_delta_emit_t emit, void *emit_user);
+
+
+
+/*
+*   Sync Functions.
+*/
+
+// updates host_path to match local_path, only sending the parts of it the host doesn't already have.
+// the host builds the new file next to the old one and swaps it in once its sha256 matches.
+UsbRet usb_sync_file_to_host(const char *local_path, const char *host_path, usb_delta_stats_t *stats);
+
+// the other way around, local_path is replaced the same way.
+UsbRet usb_sync_file_from_host(const char *host_path, const char *local_path, usb_delta_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
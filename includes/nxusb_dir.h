@@ -0,0 +1,193 @@
+#ifndef _NXUSB_DIR_H_
+#define _NXUSB_DIR_H_
+
+#include "nxusb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define USB_DIR_LIST_FORMAT     0x1     // layout of compact listings, see usb_caps_t.
+
+// sent after the result of a compact listing, followed by size bytes of packed entries.
+typedef struct
+{
+    uint64_t count;
+    uint64_t size;
+} usb_dir_list_header_t;
+
+// one packed entry on the wire, followed by name_len bytes of name (no null terminator).
+typedef struct
+{
+    uint64_t file_size;
+    uint8_t entry_type;             // see UsbFileEntryType.
+    uint8_t ext_type;               // USBFileExtentionType.
+    uint8_t catagory;               // UsbFileCatagory.
+    uint8_t size_type;              // see UsbFileSizeType.
+    uint16_t name_len;
+    uint16_t padding;
+} usb_dir_entry_packed_t;
+
+// a decoded entry, the name points into the arena of the list it came from.
+typedef struct
+{
+    const char *name;               // null terminated.
+    uint64_t file_size;
+    uint16_t name_len;
+    uint8_t entry_type;
+    uint8_t ext_type;
+    uint8_t catagory;
+    uint8_t size_type;
+} usb_dir_entry_t;
+
+typedef struct
+{
+    usb_dir_entry_t *entries;
+    uint64_t count;
+    void *arena;                    // backs entries and every name, freed by usb_dir_list_free.
+} usb_dir_list_t;
+
+// sent after the result of UsbMode_OpenDirCursor.
+typedef struct
+{
+    uint32_t cursor;
+    uint32_t padding;
+    uint64_t total;                 // entries in the dir when the cursor was opened.
+} usb_dir_cursor_info_t;
+
+// sent after a UsbMode_ReadDirCursor poll, the reply is a compact listing of up to max_entries.
+typedef struct
+{
+    uint32_t cursor;
+    uint32_t max_entries;
+} usb_dir_cursor_read_t;
+
+typedef struct usb_dir_cursor usb_dir_cursor_t;
+
+#define USB_DIR_QUERY_PREFIX_MAX    0x40
+
+typedef enum
+{
+    UsbDirSort_Name     = 0x0,
+    UsbDirSort_Size     = 0x1,
+    UsbDirSort_Type     = 0x2,      // by USBFileExtentionType, then by name.
+} UsbDirSort;
+
+typedef enum
+{
+    UsbDirQueryFlag_Descending  = 0x1,
+    UsbDirQueryFlag_DirsFirst   = 0x2,  // dirs before files whatever the sort.
+    UsbDirQueryFlag_IgnoreCase  = 0x4,  // for the prefix, ascii only.
+} UsbDirQueryFlag;
+
+// sent after a UsbMode_QueryDir poll, followed by the path. the reply is a compact listing of the matches.
+// the extension and size filters only apply to files, dirs are only filtered by catagory and prefix.
+typedef struct
+{
+    uint64_t min_size;
+    uint64_t max_size;              // 0 for no limit.
+    uint32_t offset;                // matches skipped, for paging through a big dir.
+    uint32_t max_entries;           // 0 for every match.
+    uint8_t catagory_mask;          // bit per UsbFileCatagory, 0 matches any.
+    uint8_t sort;                   // UsbDirSort.
+    uint8_t flags;                  // UsbDirQueryFlag.
+    uint8_t padding[0x5];
+    uint8_t ext_mask[0x20];         // bit per USBFileExtentionType, all clear matches any.
+    char prefix[USB_DIR_QUERY_PREFIX_MAX];  // of the name, null terminated, empty matches any.
+} usb_dir_query_t;
+
+#define USB_DIR_CURSOR_MAX      0x10    // cursors the host keeps open at once.
+
+#define USB_CACHE_ENTRIES_DEFAULT   0x40
+#define USB_CACHE_SIZE_DEFAULT      0x400000    // bytes of packed listings kept (4MiB).
+
+
+
+/*
+*   Compact Dir Functions.
+*/
+
+// lists a dir using length prefixed names instead of usb_file_entry_t.
+// an entry costs 0x10 bytes plus its name on the wire, rather than sizeof(usb_file_entry_t).
+// entries are sorted by name, the list must be freed with usb_dir_list_free.
+UsbRet usb_read_dir_compact(const char *path, usb_dir_list_t *out);
+
+// decodes size bytes of count packed entries into out.
+// used by the listing functions, exposed for callers that receive packed entries some other way.
+UsbRet usb_dir_list_decode(const void *data, size_t size, uint64_t count, usb_dir_list_t *out);
+
+void usb_dir_list_free(usb_dir_list_t *list);
+
+
+
+/*
+*   Dir Cursor Functions.
+*/
+
+// opens a cursor that streams a dir in pages of at most page_size entries.
+// the host snapshots the listing on open, the console only ever holds one page.
+// every buffer the cursor needs is allocated here, reading pages doesn't allocate.
+UsbRet usb_dir_cursor_open(const char *path, uint32_t page_size, usb_dir_cursor_t **out);
+
+// number of entries in the dir when the cursor was opened.
+uint64_t usb_dir_cursor_total(const usb_dir_cursor_t *cursor);
+
+// reads the next page into page, which is valid until the next call or close.
+// page->count is 0 once every entry has been read.
+// the page belongs to the cursor, don't call usb_dir_list_free on it.
+UsbRet usb_dir_cursor_next(usb_dir_cursor_t *cursor, usb_dir_list_t *page);
+
+// closes the cursor on the host and frees it.
+void usb_dir_cursor_close(usb_dir_cursor_t *cursor);
+
+
+
+/*
+*   Dir Query Functions.
+*/
+
+// lists only the entries of a dir that match query, in the order it asks for.
+// the host keeps the last dir it was asked about sorted by name, so paging through it with
+// offset doesn't list it again, and a case sensitive prefix is found with a binary search.
+// the list must be freed with usb_dir_list_free.
+UsbRet usb_dir_query(const char *path, const usb_dir_query_t *query, usb_dir_list_t *out);
+
+// adds an extension / catagory to the ones a query matches.
+void usb_dir_query_add_ext(usb_dir_query_t *query, uint8_t ext_type);
+void usb_dir_query_add_catagory(usb_dir_query_t *query, uint8_t catagory);
+
+
+
+/*
+*   Cache Functions.
+*/
+
+// caches dir totals, dir sizes and listings by path, off by default.
+// every cached call first asks the host for the path's change token (one small round trip),
+// and only walks the host again if the token changed.
+// covers usb_get_dir_total_from_path, usb_get_dir_size_from_path, usb_read_dir_from_path and
+// usb_read_dir_compact, the recursive versions always go to the host.
+// hosts without UsbCap_ChangeToken are never cached.
+// max_entries caps the number of paths kept, max_size caps the bytes of listings kept.
+// the least recently used entries are dropped first.
+UsbRet usb_cache_enable(uint32_t max_entries, size_t max_size);
+
+// turns the cache off and frees it.
+void usb_cache_disable(void);
+
+// drops every cached entry.
+void usb_cache_clear(void);
+
+// gets a token that changes whenever the entry at path changes.
+// the host builds it from the entry's own stat (size, mtime, inode) and a count of the changes made
+// over usb to the entries in it, so it's as cheap as a stat.
+// files added, removed or renamed on the host side change a dir's token, but a file written in place
+// on the host side doesn't, so a cached size (in a listing or usb_get_dir_size_from_path) can lag
+// until the dir itself changes.
+UsbRet usb_get_change_token(const char *path, uint64_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
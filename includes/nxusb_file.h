@@ -0,0 +1,56 @@
+#ifndef _NXUSB_FILE_H_
+#define _NXUSB_FILE_H_
+
+#include "nxusb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define USB_FILE_HANDLE_MAX     0x20    // files the host keeps open at once, on top of the current open file.
+
+// a file opened with usb_file_open, 0 is never a valid handle.
+typedef uint32_t usb_file_t;
+
+// sent after a UsbMode_OpenFileHandle poll, followed by the path.
+typedef struct
+{
+    uint8_t mode;           // one of the UsbMode_OpenFile modes.
+    uint8_t padding[0x7];
+} usb_file_open_t;
+
+// sent after a read / write handle poll, the data then moves the same as usb_read_file / usb_write_to_file.
+typedef struct
+{
+    uint32_t handle;
+    uint32_t padding;
+    uint64_t size;
+    uint64_t offset;
+} usb_file_io_t;
+
+
+
+/*
+*   File Handle Functions.
+*/
+
+// handles let several files be open at once, so reads and writes to them can be interleaved.
+// they're separate from the current open file of usb_open_file(), which keeps working as before.
+// every handle is closed by the host when the session ends.
+
+// opens path with one of the UsbMode_OpenFile modes.
+UsbRet usb_file_open(usb_file_t *out, const char *path, uint8_t mode);
+
+// same as usb_read_file() / usb_write_to_file(), compression included.
+UsbRet usb_file_read(usb_file_t file, void *out, size_t size, uint64_t offset);
+UsbRet usb_file_write(usb_file_t file, const void *in, size_t size, uint64_t offset);
+
+UsbRet usb_file_get_size(usb_file_t file, uint64_t *out);
+
+UsbRet usb_file_close(usb_file_t file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef _NXUSB_HASH_H_
+#define _NXUSB_HASH_H_
+
+#include "nxusb.h"
+#include "nxusb_file.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define USB_SHA256_SIZE         0x20
+#define USB_SHA256_BLOCK_SIZE   0x40
+#define USB_HASH_DIGEST_SIZE    0x20    // big enough for any UsbHashType.
+
+typedef enum
+{
+    UsbHashType_Crc32c  = 0x0,      // 4 bytes, little endian.
+    UsbHashType_Sha256  = 0x1,
+} UsbHashType;
+
+typedef struct
+{
+    uint32_t state[0x8];
+    uint64_t total;
+    uint8_t block[USB_SHA256_BLOCK_SIZE];
+    size_t used;
+} usb_sha256_t;
+
+// sent after a UsbMode_GetFileHandleHash poll.
+typedef struct
+{
+    uint32_t handle;
+    uint8_t type;           // UsbHashType.
+    uint8_t padding[0x3];
+    uint64_t size;          // clamped to the end of the file.
+    uint64_t offset;
+} usb_file_hash_t;
+
+// the reply, after the result.
+typedef struct
+{
+    uint64_t size;          // bytes hashed.
+    uint8_t digest[USB_HASH_DIGEST_SIZE];   // unused bytes are 0.
+} usb_hash_digest_t;
+
+
+
+/*
+*   Hash Functions.
+*/
+
+// crc32c of data, pass 0 as crc to start, or a previous result to continue it.
+// uses the armv8 crc32 instructions on the switch.
+uint32_t usb_crc32c(uint32_t crc, const void *data, size_t size);
+
+// sha256, uses the armv8 sha2 instructions on the switch.
+void usb_sha256_init(usb_sha256_t *ctx);
+void usb_sha256_update(usb_sha256_t *ctx, const void *data, size_t size);
+void usb_sha256_final(usb_sha256_t *ctx, uint8_t out[USB_SHA256_SIZE]);
+void usb_sha256(const void *data, size_t size, uint8_t out[USB_SHA256_SIZE]);
+
+
+
+/*
+*   Remote Hash Functions.
+*/
+
+// the host hashes [offset, offset + size) of the file and only sends back the digest.
+// the range is clamped to the end of the file, out->size is what was hashed.
+UsbRet usb_file_get_hash(usb_file_t file, uint8_t type, uint64_t offset, uint64_t size, usb_hash_digest_t *out);
+
+// same as above for a local file, so the two can be compared.
+UsbRet usb_hash_local_file(const char *path, uint8_t type, uint64_t offset, uint64_t size, usb_hash_digest_t *out);
+
+// sets match if the local and host files are the same size and hash.
+UsbRet usb_verify_file(const char *local_path, const char *host_path, uint8_t type, bool *match);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef _NXUSB_PACK_H_
+#define _NXUSB_PACK_H_
+
+#include "nxusb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define USB_PACK_BLOCK_SIZE     0x100000    // most entry bytes in one block (1MiB).
+#define USB_PACK_FILE_MAX       (USB_PACK_BLOCK_SIZE - sizeof(usb_pack_entry_t) - USB_FILE_NAME_MAX)
+
+// a packed dir read walks a host dir and sends every entry of it as one stream of blocks,
+// so a tree of small files costs a few transfers per MiB, rather than an open / read / close per file.
+// files bigger than the request's max_file_size are only named in the stream, for the console to fetch on its own.
+
+typedef enum
+{
+    UsbPackEntry_Dir    = 0x0,
+    UsbPackEntry_File   = 0x1,      // size bytes of data follow the path.
+    UsbPackEntry_Large  = 0x2,      // a file too big to pack, no data follows.
+} UsbPackEntry;
+
+// sent after a UsbMode_ReadDirPacked poll, followed by the path.
+typedef struct
+{
+    uint64_t max_file_size; // clamped to USB_PACK_FILE_MAX.
+    uint8_t compressed;     // blocks are sent as compressed blocks.
+    uint8_t padding[0x7];
+} usb_pack_request_t;
+
+// sent before each block, the stream ends with a block that has last set.
+typedef struct
+{
+    uint32_t size;          // bytes of entries that follow.
+    uint32_t count;         // entries in the block.
+    uint32_t result;        // on the last block, the first error of the walk. entries that failed are left out.
+    uint8_t last;
+    uint8_t padding[0x3];
+} usb_pack_block_t;
+
+// each entry of a block, followed by path_len bytes of path relative to the dir read, then the data.
+// parents always come before what's in them.
+typedef struct
+{
+    uint8_t type;           // UsbPackEntry.
+    uint8_t padding;
+    uint16_t path_len;
+    uint8_t padding2[0x4];
+    uint64_t size;
+} usb_pack_entry_t;
+
+typedef struct
+{
+    uint64_t files;
+    uint64_t dirs;
+    uint64_t packed;        // files that came over in the stream.
+    uint64_t blocks;
+    uint64_t size;          // bytes of file data copied.
+    uint64_t total_ns;
+} usb_pack_stats_t;
+
+
+
+/*
+*   Pack Functions.
+*/
+
+// copies the dir host_path and everything in it to local_path with one packed dir read.
+// files up to max_file_size come over in the stream, 0 picks USB_PACK_FILE_MAX.
+// bigger files are copied afterwards with usb_copy_file_from_host. stats is optional.
+// hosts without UsbCap_DirPacked are copied with usb_copy_dir_from_host instead.
+UsbRet usb_pack_copy_dir_from_host(const char *host_path, const char *local_path, uint64_t max_file_size, usb_pack_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef _NXUSB_RESUME_H_
+#define _NXUSB_RESUME_H_
+
+#include "nxusb.h"
+#include "nxusb_file.h"
+#include "nxusb_hash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define USB_RESUME_CHUNK_DEFAULT    0x100000    // 1MiB, the range each checksum covers.
+#define USB_RESUME_CHECKSUMS_MAX    0x400       // checksums the host sends per request.
+#define USB_RESUME_CHECKED_MAX      0x1000000   // 16MiB, the biggest checksummed write the host takes.
+
+// sent after a UsbMode_GetFileHandleChecksums poll.
+// the host replies with a u64 count, then a u32 crc32c for each chunk_size range
+// of [offset, offset + size), the last one is short if the file ends first.
+typedef struct
+{
+    uint32_t handle;
+    uint32_t chunk_size;
+    uint64_t size;
+    uint64_t offset;
+} usb_file_checksum_t;
+
+typedef struct
+{
+    uint64_t size;              // size of the finished file.
+    uint64_t verified;          // bytes that were already there and matched.
+    uint64_t transferred;       // bytes sent over usb.
+} usb_resume_stats_t;
+
+
+
+/*
+*   Checksum Functions.
+*/
+
+// reads / writes the same as usb_file_read() / usb_file_write(), uncompressed, with a crc32c after the data.
+// returns UsbReturnCode_ChecksumMismatch if it doesn't match, a failed write leaves the file untouched.
+// writes are at most USB_RESUME_CHECKED_MAX, as the host holds the data until it's checked.
+UsbRet usb_file_read_checked(usb_file_t file, void *out, size_t size, uint64_t offset);
+UsbRet usb_file_write_checked(usb_file_t file, const void *in, size_t size, uint64_t offset);
+
+// fills out with the crc32c of each chunk_size range of the host file, starting at offset.
+// count is the number of ranges to check, at most USB_RESUME_CHECKSUMS_MAX, out_count is how many the host had.
+UsbRet usb_file_get_checksums(usb_file_t file, uint32_t chunk_size, uint64_t offset, uint32_t *out, size_t count, size_t *out_count);
+
+// truncates or extends the host file.
+UsbRet usb_file_set_size(usb_file_t file, uint64_t size);
+
+
+
+/*
+*   Resume Functions.
+*/
+
+// copies a host file to local_path, keeping whatever of an earlier copy is already there.
+// the local file is checked a chunk at a time against the host, and only missing or
+// mismatched chunks are fetched. if this fails, calling it again carries on where it stopped.
+// chunk_size is 0 for USB_RESUME_CHUNK_DEFAULT and at most USB_RESUME_CHECKED_MAX, stats is optional.
+UsbRet usb_resume_file_from_host(const char *host_path, const char *local_path, size_t chunk_size, usb_resume_stats_t *stats);
+
+// same as above, the other way around.
+UsbRet usb_resume_file_to_host(const char *local_path, const char *host_path, size_t chunk_size, usb_resume_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
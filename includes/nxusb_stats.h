@@ -0,0 +1,72 @@
+#ifndef _NXUSB_STATS_H_
+#define _NXUSB_STATS_H_
+
+#include "nxusb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define USB_STATS_MODES     0x100   // one slot per UsbMode.
+#define USB_STATS_BUCKETS   0x40    // bucket i counts ops that took [2^i, 2^(i + 1)) ns.
+
+// everything done under one UsbMode. an op starts at its poll and ends with the last transfer
+// before the next poll on the same thread, transfers before the first poll (the handshake) count under mode 0.
+// link_ns is time inside the transport, wait_ns is the part of it spent in usb_get_result waiting on
+// the host to answer, copy_ns is time copying through the bounce buffers on the console.
+// so a slow host shows up in wait_ns, a stalled link in link_ns - wait_ns, and the console in copy_ns.
+typedef struct
+{
+    uint64_t count;                 // polls sent.
+    uint64_t errors;                // short reads / writes.
+    uint64_t allocs;                // usb_alloc_aligned calls.
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t link_ns;
+    uint64_t wait_ns;
+    uint64_t copy_ns;
+    uint64_t latency_ns;            // sum of every op's latency.
+    uint64_t max_ns;
+    uint64_t latency[USB_STATS_BUCKETS];
+} usb_op_stats_t;
+
+typedef struct
+{
+    usb_op_stats_t ops[USB_STATS_MODES];
+    uint64_t allocs;
+    uint64_t bounced;               // transfers staged through the buffer pool.
+    uint64_t direct;                // transfers straight from the caller's buffer.
+    uint64_t pool_misses;           // transfers that failed with UsbReturnCode_NoFreeBuffer.
+    uint64_t short_reads;
+    uint64_t short_writes;
+} usb_stats_t;
+
+
+
+/*
+*   Stats Functions.
+*/
+
+// starts / stops counting, off by default. when off every hook is a single branch.
+// counters are updated atomically, so the async threads can count at the same time.
+void usb_stats_enable(bool enable);
+bool usb_stats_enabled(void);
+
+// zeroes every counter.
+void usb_stats_reset(void);
+
+// copies every counter into out, ending the op in progress on the calling thread first.
+// usb_stats_t is large (~150KiB), so it's best not put on the stack.
+void usb_stats_snapshot(usb_stats_t *out);
+
+// the latency under which p (0 to 1) of the ops finished, rounded up to a bucket.
+uint64_t usb_stats_percentile(const usb_op_stats_t *op, double p);
+
+// appends a snapshot to the file at path as a table, one row per mode that was used.
+UsbRet usb_stats_dump(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
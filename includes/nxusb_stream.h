@@ -0,0 +1,73 @@
+#ifndef _NXUSB_STREAM_H_
+#define _NXUSB_STREAM_H_
+
+#include "nxusb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define USB_STREAM_DEPTH_MIN    0x2
+#define USB_STREAM_DEPTH_MAX    0x10
+
+typedef struct usb_read_stream usb_read_stream_t;
+typedef struct usb_write_stream usb_write_stream_t;
+
+
+
+/*
+*   Read Stream Functions.
+*/
+
+// opens a stream over the current open file, reading size bytes starting from offset.
+// a worker thread keeps reading chunk_size chunks ahead into depth buffers while the caller processes the current one.
+// depth is clamped between USB_STREAM_DEPTH_MIN and USB_STREAM_DEPTH_MAX, 2 is double buffering.
+// chunk_size should be a multiple of USB_TRANSFER_ALIGN so chunks are read without a copy.
+// the stream owns the link until it's closed, don't call any other usb function in between.
+UsbRet usb_read_stream_open(usb_read_stream_t **out, uint64_t offset, uint64_t size, size_t chunk_size, uint32_t depth);
+
+// waits for the next chunk and hands it to the caller.
+// data is valid until the next call to usb_read_stream_next or usb_read_stream_close.
+// once every chunk has been read, size is set to 0 and UsbReturnCode_Success is returned.
+// if a transfer failed, its error is returned when the caller reaches that chunk and on every call after.
+UsbRet usb_read_stream_next(usb_read_stream_t *stream, const void **data, size_t *size);
+
+// stops the worker after its current transfer and frees the stream.
+void usb_read_stream_close(usb_read_stream_t *stream);
+
+
+
+
+/*
+*   Write Stream Functions.
+*/
+
+// opens a stream that writes to the current open file, starting at offset.
+// the caller queues chunks of up to chunk_size into a ring of depth buffers and a worker thread drains them to the host.
+// the stream owns the link until it's closed, don't call any other usb function in between.
+UsbRet usb_write_stream_open(usb_write_stream_t **out, uint64_t offset, size_t chunk_size, uint32_t depth);
+
+// copies size bytes (at most chunk_size) into a free buffer and queues it.
+// chunks are written back to back, each one starts where the last one ended.
+// returns UsbReturnCode_StreamFull without blocking if every buffer is queued,
+// the caller can do other work and try again, or block with usb_write_stream_wait.
+// once a write fails, its error is returned by every call after.
+UsbRet usb_write_stream_submit(usb_write_stream_t *stream, const void *data, size_t size);
+
+// same as submit, but without the copy.
+// acquire hands out a free chunk_size buffer for the caller to fill, commit queues size bytes of it.
+UsbRet usb_write_stream_acquire(usb_write_stream_t *stream, void **data);
+UsbRet usb_write_stream_commit(usb_write_stream_t *stream, size_t size);
+
+// blocks until a buffer is free, returns early if a write failed.
+UsbRet usb_write_stream_wait(usb_write_stream_t *stream);
+
+// waits for every queued chunk to be written, then frees the stream.
+// returns the first error from the worker, if any.
+UsbRet usb_write_stream_close(usb_write_stream_t *stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef _NXUSB_TRACE_H_
+#define _NXUSB_TRACE_H_
+
+#include "nxusb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define USB_TRACE_MAGIC     0x435254425355584EULL   // NXUSBTRC.
+#define USB_TRACE_VERSION   0x1
+
+// a trace is a usb_trace_header_t then one usb_trace_record_t per transfer,
+// each followed by its data if the trace was opened with UsbTraceFlag_Payload.
+// host/ has nxusb-replay, which prints a summary of a trace or replays either side of it.
+
+typedef enum
+{
+    UsbTraceFlag_Payload    = 0x1,  // record the data of every transfer, not just its size.
+} UsbTraceFlag;
+
+typedef enum
+{
+    UsbTraceDirection_Read  = 0x0,  // host to console.
+    UsbTraceDirection_Write = 0x1,  // console to host.
+} UsbTraceDirection;
+
+typedef struct
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;                 // UsbTraceFlag.
+} usb_trace_header_t;
+
+typedef struct
+{
+    uint64_t time_ns;               // start of the transfer, from when the trace was opened.
+    uint32_t size;                  // bytes asked for.
+    uint32_t moved;                 // bytes the transport moved, short of size if the link broke.
+    uint32_t duration_ns;           // clamped to ~4s.
+    uint8_t direction;              // UsbTraceDirection.
+    uint8_t mode;                   // UsbMode of the poll the transfer belongs to, 0 for the handshake.
+    uint8_t payload;                // moved bytes of data follow.
+    uint8_t padding;
+} usb_trace_record_t;
+
+typedef struct usb_trace usb_trace_t;
+
+
+
+/*
+*   Trace Functions.
+*/
+
+// opens a trace at path that records every transfer made through inner, which is copied.
+// transfers are written from whichever thread makes them, so the async layer can be traced too.
+UsbRet usb_trace_open(usb_trace_t **out, const char *path, uint32_t flags, const usb_transport_t *inner);
+
+// fills out with a transport that records into trace, then calls the inner one.
+// pass it to usb_set_transport before usb_init so the handshake is in the trace.
+void usb_trace_transport(usb_trace_t *trace, usb_transport_t *out);
+
+// flushes and closes the trace, call it after usb_exit.
+UsbRet usb_trace_close(usb_trace_t *trace);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
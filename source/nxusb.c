@@ -5,11 +5,13 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
 #include <malloc.h>
-#include <switch.h>
 
 #include "nxusb.h"
+#include "nxusb_async.h"
+#include "usb_internal.h"
 
 
 /*
@@ -22,23 +24,109 @@ typedef struct
     uint8_t macro;
     uint8_t minor;
     uint8_t major;
-    uint8_t padding[0x5];
+    uint8_t compression;    // codecs offered by the console, the one picked by the host in the reply.
+    uint8_t flags;          // USB_HEADER_FLAG_CAPS.
+    uint8_t padding[0x3];
 } nxusb_header;
+_Static_assert(sizeof(nxusb_header) == 0x10, "nxusb_header must match the host's UsbHeader");
+
+// the poll as it goes on the wire, little endian.
+typedef struct
+{
+    uint8_t mode;
+    uint8_t flags;          // USB_POLL_FLAG_TAGGED.
+    uint8_t padding[0x2];
+    uint32_t tag;
+    uint64_t size;
+} usb_poll_t;
+_Static_assert(sizeof(usb_poll_t) == USB_POLL_SIZE, "usb_poll_t must match the host's UsbPoll");
+_Static_assert(sizeof(usb_file_entry_t) == 0x210, "usb_file_entry_t must match the host");
+_Static_assert(offsetof(usb_file_entry_t, file_size) == 0x208, "usb_file_entry_t must match the host");
+_Static_assert(sizeof(usb_caps_t) == USB_CAPS_SIZE, "usb_caps_t must match the host");
 nxusb_header g_host;  // will store the client info.
 nxusb_header g_client;  // will store the client info.
+usb_caps_t g_caps;      // what the host supports, zeroed for older hosts.
+usb_transport_t g_transport;
 
 
-UsbRet usb_init(void)
+typedef struct
 {
-    if (R_FAILED(usbCommsInitialize()))
-        return UsbReturnCode_FailedToInitComms;
-    
-    g_host.magic = NXUSB_MAGIC;
+    uint8_t *mem;           // one aligned block that backs every buffer.
+    size_t buffer_size;
+    uint32_t count;
+    uint32_t used;          // bitmask of the buffers currently handed out, updated atomically.
+} usb_pool_t;
+usb_pool_t g_pool;
+
+
+UsbRet __usb_pool_init(size_t buffer_size, uint32_t count)
+{
+    if (!buffer_size || !count || count > USB_POOL_BUFFER_COUNT_MAX)
+        return UsbReturnCode_FailedAllocPool;
+
+    buffer_size = (buffer_size + USB_TRANSFER_ALIGN - 1) & ~(size_t)(USB_TRANSFER_ALIGN - 1);
+
+    // re-use the pool from a previous session if it's the same shape.
+    if (g_pool.mem && g_pool.buffer_size == buffer_size && g_pool.count == count)
+    {
+        g_pool.used = 0;
+        return UsbReturnCode_Success;
+    }
+
+    free(g_pool.mem);
+    memset(&g_pool, 0, sizeof(g_pool));
+
+    g_pool.mem = memalign(USB_TRANSFER_ALIGN, buffer_size * count);
+    if (!g_pool.mem)
+        return UsbReturnCode_FailedAllocPool;
+
+    g_pool.buffer_size = buffer_size;
+    g_pool.count = count;
+    return UsbReturnCode_Success;
+}
+
+void __usb_pool_exit(void)
+{
+    free(g_pool.mem);
+    memset(&g_pool, 0, sizeof(g_pool));
+}
+
+// the async layer reads and writes from two threads at once, so buffers are claimed with a cas.
+void *__usb_pool_acquire(void)
+{
+    uint32_t used = __atomic_load_n(&g_pool.used, __ATOMIC_ACQUIRE);
+
+    for (;;)
+    {
+        uint32_t i = 0;
+        while (i < g_pool.count && (used & (1U << i)))
+            i++;
+        if (i == g_pool.count)
+            return NULL;
+
+        if (__atomic_compare_exchange_n(&g_pool.used, &used, used | (1U << i), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return g_pool.mem + i * g_pool.buffer_size;
+    }
+}
+
+void __usb_pool_release(void *buf)
+{
+    size_t i = ((uint8_t *)buf - g_pool.mem) / g_pool.buffer_size;
+    __atomic_and_fetch(&g_pool.used, ~(1U << i), __ATOMIC_RELEASE);
+}
+
+// swaps headers with the host, and its caps if it has them.
+UsbRet __usb_handshake(void)
+{
+    UsbRet ret;
+
+    g_host.magic = __usb_le64(NXUSB_MAGIC);
     g_host.major = NXUSB_VERSION_MAJOR;
     g_host.minor = NXUSB_VERSION_MINOR;
     g_host.macro = NXUSB_VERSION_MACRO;
-
-    UsbRet ret;
+    g_host.compression = USB_COMPRESSION_SUPPORTED;
+    g_host.flags = USB_HEADER_FLAG_CAPS;
+    memset(&g_caps, 0, sizeof(g_caps));
 
     ret = usb_write(&g_host, 0x10);
     if (usb_failed(ret))
@@ -52,55 +140,367 @@ UsbRet usb_init(void)
     if (usb_failed(ret))
         return ret;
     
-    if (g_client.magic != NXUSB_MAGIC)
+    if (g_client.magic != __usb_le64(NXUSB_MAGIC))
         return UsbReturnCode_WrongClientMagic;
 
+    // older hosts don't send caps, so they get none of the newer features.
+    if (g_client.flags & USB_HEADER_FLAG_CAPS)
+    {
+        ret = usb_read(&g_caps, sizeof(g_caps));
+        if (usb_failed(ret))
+            return ret;
+
+        g_caps.caps = __usb_le64(g_caps.caps);
+        g_caps.max_transfer = __usb_le32(g_caps.max_transfer);
+        g_caps.max_inflight = __usb_le32(g_caps.max_inflight);
+        g_caps.compression = __usb_le32(g_caps.compression);
+        g_caps.max_handles = __usb_le32(g_caps.max_handles);
+        g_caps.dir_format = __usb_le32(g_caps.dir_format);
+
+        // a listing layout this console can't read is as good as none.
+        if (g_caps.dir_format != USB_DIR_LIST_FORMAT)
+            g_caps.caps &= ~(uint64_t)(UsbCap_DirCompact | UsbCap_DirQuery);
+    }
+
     return UsbReturnCode_Success;
 }
 
-UsbRet usb_read(void *out, size_t size)
+UsbRet usb_init(void)
 {
-    void *buf = memalign(0x1000, size);
-    size_t ret = usbCommsRead(buf, size);
-    memcpy(out, buf, size);
-    free(buf);
-    
-    if (ret != size)
+    return usb_init_ex(USB_POOL_BUFFER_SIZE, USB_POOL_BUFFER_COUNT);
+}
+
+UsbRet usb_init_ex(size_t buffer_size, uint32_t count)
+{
+    UsbRet ret;
+
+    ret = __usb_pool_init(buffer_size, count);
+    if (usb_failed(ret))
+        return ret;
+
+    // fall back to the default transport if none was set.
+    if (!g_transport.read || !g_transport.write)
+        usb_set_transport(NULL);
+
+    if (!g_transport.read || !g_transport.write ||
+        (g_transport.init && usb_failed(g_transport.init(g_transport.user))))
+    {
+        __usb_pool_exit();
+        return UsbReturnCode_FailedToInitComms;
+    }
+
+    ret = __usb_handshake();
+    if (usb_failed(ret))
+    {
+        if (g_transport.exit)
+            g_transport.exit(g_transport.user);
+        __usb_pool_exit();
+        return ret;
+    }
+
+    // older hosts leave this zeroed, which is no compression.
+    __usb_compress_init(g_client.compression);
+    return UsbReturnCode_Success;
+}
+
+void usb_set_transport(const usb_transport_t *transport)
+{
+    if (transport)
+    {
+        g_transport = *transport;
+        return;
+    }
+
+    memset(&g_transport, 0, sizeof(g_transport));
+    #ifdef __SWITCH__
+    usb_transport_nx(&g_transport);
+    #endif
+}
+
+bool __usb_is_aligned(const void *ptr)
+{
+    return ((uintptr_t)ptr & (USB_TRANSFER_ALIGN - 1)) == 0;
+}
+
+UsbRet usb_read_aligned(void *out, size_t size)
+{
+    if (!__usb_is_aligned(out))
+        return UsbReturnCode_UnalignedBuffer;
+
+    const uint64_t start = __usb_stats_start();
+    const size_t read = g_transport.read(g_transport.user, out, size);
+    __usb_stats_transfer(true, size, read, start);
+    if (read != size)
         return UsbReturnCode_WrongSizeRead;
     return UsbReturnCode_Success;
 }
 
-UsbRet usb_write(const void *in, size_t size)
+UsbRet usb_write_aligned(const void *in, size_t size)
 {
-    void *buf = memalign(0x1000, size);
-    memcpy(buf, in, size);
-    size_t ret = usbCommsWrite(buf, size);
-    free(buf);
+    if (!__usb_is_aligned(in))
+        return UsbReturnCode_UnalignedBuffer;
 
-    if (ret != size)
+    const uint64_t start = __usb_stats_start();
+    const size_t written = g_transport.write(g_transport.user, in, size);
+    __usb_stats_transfer(false, size, written, start);
+    if (written != size)
         return UsbReturnCode_WrongSizeWritten;
     return UsbReturnCode_Success;
 }
 
-UsbRet usb_poll(uint8_t mode, size_t size)
+void *usb_alloc_aligned(size_t size)
 {
-    struct
+    __usb_stats_alloc();
+    size = (size + USB_TRANSFER_ALIGN - 1) & ~(size_t)(USB_TRANSFER_ALIGN - 1);
+    return memalign(USB_TRANSFER_ALIGN, size ? size : USB_TRANSFER_ALIGN);
+}
+
+void usb_free_aligned(void *buf)
+{
+    free(buf);
+}
+
+UsbRet usb_read(void *out, size_t size)
+{
+    // the dcache is invalidated over the whole buffer, so only skip the bounce
+    // if the buffer can't share a page with anything else.
+    const bool direct = __usb_is_aligned(out) && !(size & (USB_TRANSFER_ALIGN - 1));
+    __usb_stats_bounce(!direct);
+    if (direct)
+        return usb_read_aligned(out, size);
+
+    uint8_t *buf = __usb_pool_acquire();
+    if (!buf)
     {
-        uint8_t m;
-        uint8_t p[0x7];
-        size_t sz;
-    } poll = { mode, {0}, size };
+        __usb_stats_pool_miss();
+        return UsbReturnCode_NoFreeBuffer;
+    }
 
-    if (usb_failed(usb_write(&poll, USB_POLL_SIZE)))
-        return UsbReturnCode_PollError;
+    UsbRet ret = UsbReturnCode_Success;
+    uint8_t *dst = out;
+
+    while (size)
+    {
+        size_t chunk = size < g_pool.buffer_size ? size : g_pool.buffer_size;
+        uint64_t start = __usb_stats_start();
+        size_t read = g_transport.read(g_transport.user, buf, chunk);
+        __usb_stats_transfer(true, chunk, read, start);
+
+        start = __usb_stats_start();
+        memcpy(dst, buf, read < chunk ? read : chunk);
+        __usb_stats_copy(start);
+
+        if (read != chunk)
+        {
+            ret = UsbReturnCode_WrongSizeRead;
+            break;
+        }
+
+        dst += chunk;
+        size -= chunk;
+    }
+
+    __usb_pool_release(buf);
+    return ret;
+}
+
+UsbRet usb_write(const void *in, size_t size)
+{
+    __usb_stats_bounce(!__usb_is_aligned(in));
+    if (__usb_is_aligned(in))
+        return usb_write_aligned(in, size);
+
+    uint8_t *buf = __usb_pool_acquire();
+    if (!buf)
+    {
+        __usb_stats_pool_miss();
+        return UsbReturnCode_NoFreeBuffer;
+    }
+
+    UsbRet ret = UsbReturnCode_Success;
+    const uint8_t *src = in;
+
+    while (size)
+    {
+        size_t chunk = size < g_pool.buffer_size ? size : g_pool.buffer_size;
+        uint64_t start = __usb_stats_start();
+        memcpy(buf, src, chunk);
+        __usb_stats_copy(start);
+
+        start = __usb_stats_start();
+        const size_t written = g_transport.write(g_transport.user, buf, chunk);
+        __usb_stats_transfer(false, chunk, written, start);
+        if (written != chunk)
+        {
+            ret = UsbReturnCode_WrongSizeWritten;
+            break;
+        }
+
+        src += chunk;
+        size -= chunk;
+    }
+
+    __usb_pool_release(buf);
+    return ret;
+}
+
+UsbRet __usb_discard(uint64_t size)
+{
+    uint8_t buf[0x200];
+
+    while (size)
+    {
+        const size_t chunk = size < sizeof(buf) ? size : sizeof(buf);
+        UsbRet ret = usb_read(buf, chunk);
+        if (usb_failed(ret))
+            return ret;
+        size -= chunk;
+    }
     return UsbReturnCode_Success;
 }
 
+UsbRet usb_poll(uint8_t mode, size_t size)
+{
+    return __usb_request_ex(mode, 0, 0, size, NULL, 0, NULL, 0);
+}
+
+uint16_t __usb_le16(uint16_t value)
+{
+    #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap16(value);
+    #else
+    return value;
+    #endif
+}
+
+uint32_t __usb_le32(uint32_t value)
+{
+    #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap32(value);
+    #else
+    return value;
+    #endif
+}
+
+uint64_t __usb_le64(uint64_t value)
+{
+    #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap64(value);
+    #else
+    return value;
+    #endif
+}
+
+UsbRet __usb_read_u64(uint64_t *out)
+{
+    UsbRet ret = usb_read(out, sizeof(*out));
+    if (usb_failed(ret))
+        return ret;
+
+    *out = __usb_le64(*out);
+    return UsbReturnCode_Success;
+}
+
+// writes out what's been built up in a request's buffer.
+UsbRet __usb_request_flush(uint8_t *buf, size_t *used, bool *sent)
+{
+    UsbRet ret = usb_write_aligned(buf, *used);
+    if (usb_failed(ret))
+        return *sent ? ret : UsbReturnCode_PollError;
+
+    *used = 0;
+    *sent = true;
+    return UsbReturnCode_Success;
+}
+
+UsbRet __usb_request_ex(uint8_t mode, uint8_t flags, uint32_t tag, uint64_t size, const void *args, size_t args_size, const void *data, size_t data_size)
+{
+    __usb_stats_poll(mode, flags & USB_POLL_FLAG_TAGGED);
+
+    uint8_t *buf = __usb_pool_acquire();
+    if (!buf)
+    {
+        __usb_stats_pool_miss();
+        return UsbReturnCode_PollError;
+    }
+    __usb_stats_bounce(true);
+
+    usb_poll_t *poll = (usb_poll_t *)buf;
+    memset(poll, 0, sizeof(*poll));
+    poll->mode = mode;
+    poll->flags = flags;
+    poll->tag = __usb_le32(tag);
+    poll->size = __usb_le64(size);
+
+    const uint8_t *parts[] = { args, data };
+    const size_t sizes[] = { args_size, data_size };
+    const bool framed = usb_host_has_caps(UsbCap_Framed);
+    size_t used = sizeof(*poll);
+    bool sent = false;
+    UsbRet ret = UsbReturnCode_Success;
+
+    for (size_t i = 0; i < 2 && usb_succeeded(ret); i++)
+    {
+        const uint8_t *src = parts[i];
+        size_t left = sizes[i];
+
+        // hosts that read each part with its own transfer get them one transfer apiece.
+        if (!framed && left && used)
+        {
+            ret = __usb_request_flush(buf, &used, &sent);
+            if (usb_failed(ret))
+                break;
+        }
+
+        // an aligned part too big to fit goes out straight from the caller's buffer.
+        if (left > g_pool.buffer_size - used && __usb_is_aligned(src))
+        {
+            ret = __usb_request_flush(buf, &used, &sent);
+            if (usb_succeeded(ret))
+                ret = usb_write_aligned(src, left);
+            continue;
+        }
+
+        while (left && usb_succeeded(ret))
+        {
+            if (used == g_pool.buffer_size)
+            {
+                ret = __usb_request_flush(buf, &used, &sent);
+                continue;
+            }
+
+            const size_t chunk = left < g_pool.buffer_size - used ? left : g_pool.buffer_size - used;
+            const uint64_t start = __usb_stats_start();
+            memcpy(buf + used, src, chunk);
+            __usb_stats_copy(start);
+
+            used += chunk;
+            src += chunk;
+            left -= chunk;
+        }
+    }
+
+    if (usb_succeeded(ret) && used)
+        ret = __usb_request_flush(buf, &used, &sent);
+
+    __usb_pool_release(buf);
+    return ret;
+}
+
+UsbRet __usb_request(uint8_t mode, uint64_t size, const void *args, size_t args_size)
+{
+    return __usb_request_ex(mode, 0, 0, size, args, args_size, NULL, 0);
+}
+
 UsbRet usb_get_result(void)
 {
     UsbRet ret;
-    usb_read(&ret, sizeof(UsbRet));
-    return ret;
+    const uint64_t start = __usb_stats_start();
+    UsbRet read_ret = usb_read(&ret, sizeof(UsbRet));
+    __usb_stats_wait(start);
+    if (usb_failed(read_ret))
+        return read_ret;
+    return __usb_le32(ret);
 }
 
 void usb_get_client_version(uint8_t *macro, uint8_t *minor, uint8_t *major)
@@ -110,6 +510,17 @@ void usb_get_client_version(uint8_t *macro, uint8_t *minor, uint8_t *major)
     *major = g_client.major;
 }
 
+void usb_get_host_caps(usb_caps_t *out)
+{
+    if (out)
+        *out = g_caps;
+}
+
+bool usb_host_has_caps(uint64_t caps)
+{
+    return (g_caps.caps & caps) == caps;
+}
+
 bool usb_failed(UsbRet ret)
 {
     if (ret == UsbReturnCode_Success)
@@ -119,15 +530,28 @@ bool usb_failed(UsbRet ret)
 
 bool usb_succeeded(UsbRet ret)
 {
-    if (ret != UsbReturnCode_Success)
+    if (ret == UsbReturnCode_Success)
         return true;
     return false;
 }
 
+UsbRet usb_ping(void)
+{
+    UsbRet ret = usb_poll(UsbMode_Ping, 0);
+    if (usb_failed(ret))
+        return ret;
+
+    return usb_get_result();
+}
+
 void usb_exit(void)
 {
     usb_poll(UsbMode_Exit, 0);
-    usbCommsExit();
+    if (g_transport.exit)
+        g_transport.exit(g_transport.user);
+    usb_cache_disable();
+    __usb_compress_exit();
+    __usb_pool_exit();
 }
 
 
@@ -145,13 +569,7 @@ UsbRet __usb_open_file(uint8_t mode, const char *path)
     if (size >= USB_FILE_NAME_MAX)
         return UsbReturnCode_FileNameTooLarge;
 
-    UsbRet ret;
-
-    ret = usb_poll(mode, size);
-    if (usb_failed(ret))
-        return ret;
-
-    ret = usb_write(path, size);
+    UsbRet ret = __usb_request(mode, size, path, size);
     if (usb_failed(ret))
         return ret;
 
@@ -167,13 +585,7 @@ UsbRet __usb_is_file(uint8_t mode, const char *path)
     if (size >= USB_FILE_NAME_MAX)
         return UsbReturnCode_FileNameTooLarge;
 
-    UsbRet ret;
-
-    ret = usb_poll(mode, size);
-    if (usb_failed(ret))
-        return ret;
-
-    ret = usb_write(path, size);
+    UsbRet ret = __usb_request(mode, size, path, size);
     if (usb_failed(ret))
         return ret;
 
@@ -189,14 +601,7 @@ UsbRet __usb_touch_file(uint8_t mode, const char *path)
     if (size >= USB_FILE_NAME_MAX)
         return UsbReturnCode_FileNameTooLarge;
 
-    UsbRet ret;
-
-    ret = usb_poll(UsbMode_TouchFile, size);
-
-    if (usb_failed(ret))
-        return ret;
-
-    ret = usb_write(path, size);
+    UsbRet ret = __usb_request(mode, size, path, size);
     if (usb_failed(ret))
         return ret;
 
@@ -214,24 +619,20 @@ UsbRet __usb_rename_file(uint8_t mode, const char *curr_name, const char *new_na
     if (str1_len >= USB_FILE_NAME_MAX || str2_len >= USB_FILE_NAME_MAX)
         return UsbReturnCode_FileNameTooLarge;
 
-    UsbRet ret;
-
-    ret = usb_poll(mode, str1_len + str2_len + 0x10);
-    if (usb_failed(ret))
-        return ret;
-
-    const struct
+    // both lengths followed by both strings, sent in the same transfer as the poll.
+    struct
     {
-        size_t l1;
-        size_t l2;
-        const char *str1;
-        const char *str2;
-    } send = { str1_len, str2_len, curr_name, new_name };
-
-    ret = usb_write(&send, str1_len + str2_len + 0x10);
+        uint64_t l1;
+        uint64_t l2;
+        char str[USB_FILE_NAME_MAX * 2];
+    } send = { __usb_le64(str1_len), __usb_le64(str2_len), {0} };
+    memcpy(send.str, curr_name, str1_len);
+    memcpy(send.str + str1_len, new_name, str2_len);
+
+    UsbRet ret = __usb_request(mode, str1_len + str2_len + 0x10, &send, str1_len + str2_len + 0x10);
     if (usb_failed(ret))
         return ret;
-    
+
     return usb_get_result();
 }
 
@@ -240,42 +641,44 @@ UsbRet __usb_delete_file(uint8_t mode, const char *path)
     if (!path)
         return UsbReturnCode_EmptyField;
 
-    UsbRet ret;
     size_t size = strlen(path);
+    if (size >= USB_FILE_NAME_MAX)
+        return UsbReturnCode_FileNameTooLarge;
 
-    ret = usb_poll(mode, size);
-    if (usb_failed(ret))
-        return ret;
-
-    ret = usb_write(path, size);
+    UsbRet ret = __usb_request(mode, size, path, size);
     if (usb_failed(ret))
         return ret;
 
     return usb_get_result();
 }
 
-UsbRet __usb_file_io(uint8_t mode, void *data, size_t size, uint64_t offset)
+UsbRet __usb_file_io(uint8_t mode, size_t size, uint64_t offset, const void *data)
 {
-    if (!data || !size)
-        return UsbReturnCode_EmptyField;
+    const struct
+    {
+        uint64_t sz;
+        uint64_t off;
+    } send = { __usb_le64(size), __usb_le64(offset) };
 
-    UsbRet ret;
+    return __usb_request_ex(mode, 0, 0, size, &send, sizeof(send), data, data ? size : 0);
+}
 
-    ret = usb_poll(mode, size);
+UsbRet __usb_read_data(void *out, size_t size, bool compressed)
+{
+    UsbRet ret = usb_get_result();
     if (usb_failed(ret))
         return ret;
 
-    const struct
-    {
-        size_t sz;
-        uint64_t off;
-    } send = { size, offset};
+    return compressed ? __usb_read_blocks(out, size) : usb_read(out, size);
+}
 
-    ret = usb_write(&send, 0x10);
+UsbRet __usb_write_data(const void *in, size_t size, bool compressed)
+{
+    UsbRet ret = compressed ? __usb_write_blocks(in, size) : usb_write(in, size);
     if (usb_failed(ret))
         return ret;
-    
-    return usb_write(data, size);
+
+    return usb_get_result();
 }
 
 UsbRet __usb_get_file_size(uint8_t mode, uint64_t *out)
@@ -285,15 +688,15 @@ UsbRet __usb_get_file_size(uint8_t mode, uint64_t *out)
 
     UsbRet ret;
 
-    ret = usb_poll(mode, sizeof(uint64_t));
+    ret = usb_poll(mode, 0);
     if (usb_failed(ret))
         return ret;
 
-    ret = usb_read(out, sizeof(uint64_t));
+    ret = usb_get_result();
     if (usb_failed(ret))
         return ret;
 
-    return out > 0 ? ret : UsbReturnCode_FailedGetFileSize;
+    return __usb_read_u64(out);
 }
 
 UsbRet __usb_get_file_size_from_path(uint8_t mode, const char *name, uint64_t *out)
@@ -305,21 +708,15 @@ UsbRet __usb_get_file_size_from_path(uint8_t mode, const char *name, uint64_t *o
     if (size >= USB_FILE_NAME_MAX)
         return UsbReturnCode_FileNameTooLarge;
 
-    UsbRet ret;
-
-    ret = usb_poll(UsbMode_GetFileSize, size);
-    if (usb_failed(ret))
-        return ret;
-
-    ret = usb_write(name, size);
+    UsbRet ret = __usb_request(mode, size, name, size);
     if (usb_failed(ret))
         return ret;
 
-    ret = usb_read(out, sizeof(uint64_t));
+    ret = usb_get_result();
     if (usb_failed(ret))
         return ret;
 
-    return out > 0 ? ret : UsbReturnCode_FailedGetFileSize;
+    return __usb_read_u64(out);
 }
 
 UsbRet __usb_get_total(uint8_t mode, uint64_t *out)
@@ -329,13 +726,15 @@ UsbRet __usb_get_total(uint8_t mode, uint64_t *out)
 
     UsbRet ret;
 
-    ret = usb_poll(UsbMode_GetDirTotalFromPath, 0);
-    
-    ret = usb_read(out, sizeof(uint64_t));
+    ret = usb_poll(mode, 0);
     if (usb_failed(ret))
         return ret;
 
-    return UsbReturnCode_Success;
+    ret = usb_get_result();
+    if (usb_failed(ret))
+        return ret;
+
+    return __usb_read_u64(out);
 }
 
 UsbRet __usb_get_total_from_path(uint8_t mode, const char *path, uint64_t *out)
@@ -347,18 +746,30 @@ UsbRet __usb_get_total_from_path(uint8_t mode, const char *path, uint64_t *out)
     if (size >= USB_FILE_NAME_MAX)
         return UsbReturnCode_FileNameTooLarge;
 
-    UsbRet ret;
+    UsbRet ret = __usb_request(mode, size, path, size);
+    if (usb_failed(ret))
+        return ret;
 
-    ret = usb_poll(mode, size);
-    
-    ret = usb_write(path, size);
+    ret = usb_get_result();
     if (usb_failed(ret))
         return ret;
     
-    ret = usb_read(out, sizeof(uint64_t));
+    return __usb_read_u64(out);
+}
+
+// reads count entries after the poll has been sent.
+UsbRet __usb_read_entries(usb_file_entry_t *out, uint64_t count)
+{
+    UsbRet ret = usb_get_result();
+    if (usb_failed(ret))
+        return ret;
+
+    ret = usb_read(out, count * sizeof(usb_file_entry_t));
     if (usb_failed(ret))
         return ret;
 
+    for (uint64_t i = 0; i < count; i++)
+        out[i].file_size = __usb_le64(out[i].file_size);
     return UsbReturnCode_Success;
 }
 
@@ -396,12 +807,31 @@ UsbRet usb_delete_file(const char *name)
 
 UsbRet usb_read_file(void *out, size_t size, uint64_t offset)
 {
-    return __usb_file_io(UsbMode_ReadFile, out, size, offset);
+    if (!out || !size)
+        return UsbReturnCode_EmptyField;
+
+    const bool compressed = usb_get_compression() != UsbCompression_None;
+
+    UsbRet ret = __usb_file_io(compressed ? UsbMode_ReadFileCompressed : UsbMode_ReadFile, size, offset, NULL);
+    if (usb_failed(ret))
+        return ret;
+
+    return __usb_read_data(out, size, compressed);
 }
 
 UsbRet usb_write_to_file(const void *in, size_t size, uint64_t offset)
 {
-    return __usb_file_io(UsbMode_WriteFile, in, size, offset);
+    if (!in || !size)
+        return UsbReturnCode_EmptyField;
+
+    const bool compressed = usb_get_compression() != UsbCompression_None;
+
+    // uncompressed data goes out in the same transfer as the request.
+    UsbRet ret = __usb_file_io(compressed ? UsbMode_WriteFileCompressed : UsbMode_WriteFile, size, offset, compressed ? NULL : in);
+    if (usb_failed(ret))
+        return ret;
+
+    return compressed ? __usb_write_data(in, size, true) : usb_get_result();
 }
 
 UsbRet usb_get_file_size(uint64_t *out)
@@ -442,12 +872,12 @@ UsbRet usb_delete_dir(const char *path)
 
 UsbRet usb_rename_dir(const char *curr_name, const char *new_name)
 {
-    return __usb_rename_file(UsbMode_RenameFile, curr_name, new_name);
+    return __usb_rename_file(UsbMode_RenameDir, curr_name, new_name);
 }
 
 UsbRet usb_touch_dir(const char *path)
 {
-    return __usb_touch_file(UsbMode_TouchFile, path);
+    return __usb_touch_file(UsbMode_TouchDir, path);
 }
 
 UsbRet usb_get_dir_total(uint64_t *out)
@@ -455,9 +885,20 @@ UsbRet usb_get_dir_total(uint64_t *out)
     return __usb_get_total(UsbMode_GetDirTotal, out);
 }
 
+UsbRet usb_get_dir_total_recursively(uint64_t *out)
+{
+    return __usb_get_total(UsbMode_GetDirTotalRecursively, out);
+}
+
 UsbRet usb_get_dir_total_from_path(const char *path, uint64_t *out)
 {
-    return __usb_get_total_from_path(UsbMode_GetDirTotalFromPath, path, out);
+    return __usb_cache_value(UsbMode_GetDirTotalFromPath, path, out, __usb_get_total_from_path);
+}
+
+UsbRet usb_get_dir_total_recursively_from_path(const char *path, uint64_t *out)
+{
+    // a change token only covers the dir itself, so recursive results are never cached.
+    return __usb_get_total_from_path(UsbMode_GetDirTotalRecursivelyFromPath, path, out);
 }
 
 UsbRet usb_read_dir(usb_file_entry_t *out, uint64_t count)
@@ -467,12 +908,35 @@ UsbRet usb_read_dir(usb_file_entry_t *out, uint64_t count)
 
     UsbRet ret;
 
-    ret = usb_poll(UsbMode_GetDirTotalFromPath, count * sizeof(usb_file_entry_t));
+    ret = usb_poll(UsbMode_ReadDir, count * sizeof(usb_file_entry_t));
+    if (usb_failed(ret))
+        return ret;
 
-    ret = usb_read(out, count * sizeof(usb_file_entry_t));
+    return __usb_read_entries(out, count);
+}
+
+// fills out from a cached compact listing.
+UsbRet __usb_read_dir_from_cache(usb_file_entry_t *out, uint64_t count, const char *path)
+{
+    usb_dir_list_t list;
+    UsbRet ret = __usb_cache_list(path, &list);
     if (usb_failed(ret))
         return ret;
 
+    memset(out, 0, count * sizeof(usb_file_entry_t));
+    for (uint64_t i = 0; i < count && i < list.count; i++)
+    {
+        const usb_dir_entry_t *entry = &list.entries[i];
+        memcpy(out[i].name, entry->name, entry->name_len < USB_FILE_NAME_MAX ? entry->name_len : USB_FILE_NAME_MAX - 1);
+        out[i].entry_type = entry->entry_type;
+        out[i].ext_type = entry->ext_type;
+        out[i].catagory = entry->catagory;
+        out[i].size_type = entry->size_type;
+        out[i].file_size = entry->file_size;
+    }
+
+    usb_dir_list_free(&list);
+    return UsbReturnCode_Success;
 }
 
 UsbRet usb_read_dir_from_path(usb_file_entry_t *out, uint64_t count, const char *path)
@@ -484,28 +948,34 @@ UsbRet usb_read_dir_from_path(usb_file_entry_t *out, uint64_t count, const char
     if (size >= USB_FILE_NAME_MAX)
         return UsbReturnCode_FileNameTooLarge;
 
-    UsbRet ret;
+    if (__usb_cache_enabled())
+        return __usb_read_dir_from_cache(out, count, path);
 
-    ret = usb_poll(UsbMode_GetDirTotalFromPath, size);
-    
-    ret = usb_write(path, size);
-    if (usb_failed(ret))
-        return ret;
-    
-    ret = usb_get_result();
-    if (usb_failed(ret))
-        return ret;
+    // hosts with caps take the count ahead of the path, counted in the poll's size.
+    // older ones take it once the dir is open.
+    const uint64_t in = __usb_le64(count);
+    const bool framed = usb_host_has_caps(UsbCap_Framed);
 
-    uint64_t in = count;    // going to re write this to be less...shit.
-    ret = usb_write(&in, sizeof(uint64_t));
+    UsbRet ret;
+    if (framed)
+        ret = __usb_request_ex(UsbMode_ReadDirFromPath, 0, 0, sizeof(in) + size, &in, sizeof(in), path, size);
+    else
+        ret = __usb_request(UsbMode_ReadDirFromPath, size, path, size);
     if (usb_failed(ret))
         return ret;
 
-    ret = usb_read(out, count * sizeof(usb_file_entry_t));
+    ret = usb_get_result();
     if (usb_failed(ret))
         return ret;
 
-    return UsbReturnCode_Success;
+    if (!framed)
+    {
+        ret = usb_write(&in, sizeof(in));
+        if (usb_failed(ret))
+            return ret;
+    }
+
+    return __usb_read_entries(out, count);
 }
 
 UsbRet usb_get_dir_size(size_t *out)
@@ -520,7 +990,7 @@ UsbRet usb_get_dir_size_recursively(size_t *out)
 
 UsbRet usb_get_dir_size_from_path(const char *path, size_t *out)
 {
-    return __usb_get_file_size_from_path(UsbMode_GetDirSizeFromPath, path, out);
+    return __usb_cache_value(UsbMode_GetDirSizeFromPath, path, out, __usb_get_file_size_from_path);
 }
 
 UsbRet usb_get_dir_size_recursively_from_path(const char *path, size_t *out)
@@ -536,15 +1006,24 @@ UsbRet usb_get_dir_size_recursively_from_path(const char *path, size_t *out)
 
 UsbRet usb_open_device(const char *name)
 {
-
+    return __usb_open_file(UsbMode_OpenDevice, name);
 }
 
 UsbRet usb_get_device_total(uint64_t *out)
 {
-
+    return __usb_get_total(UsbMode_GetTotalDevices, out);
 }
 
-UsbRet usb_read_device()
+UsbRet usb_read_devices(usb_file_entry_t *out, uint64_t count)
 {
+    if (!out || !count)
+        return UsbReturnCode_EmptyField;
+
+    UsbRet ret;
 
-}
\ No newline at end of file
+    ret = usb_poll(UsbMode_ReadDevices, count * sizeof(usb_file_entry_t));
+    if (usb_failed(ret))
+        return ret;
+
+    return __usb_read_entries(out, count);
+}
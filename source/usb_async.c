@@ -0,0 +1,691 @@
+/*
+*   TotalJustice
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "nxusb.h"
+#include "nxusb_async.h"
+#include "usb_internal.h"
+
+_Static_assert(sizeof(usb_async_response_t) == 0x10, "usb_async_response_t must match the host");
+_Static_assert(offsetof(usb_async_response_t, result) == 0x4, "usb_async_response_t must match the host");
+_Static_assert(offsetof(usb_async_response_t, size) == 0x8, "usb_async_response_t must match the host");
+
+
+struct usb_async
+{
+    usb_async_t *next;          // send queue or inflight list.
+    uint32_t tag;
+    uint8_t mode;
+
+    // body sent after the poll, head is copied in, data is sent from the caller's buffer.
+    uint8_t head[sizeof(uint64_t) * 2 + USB_FILE_NAME_MAX * 2];
+    size_t head_size;
+    const void *data;
+    size_t data_size;
+
+    // where the response body goes, the response has to fill it exactly.
+    void *out;
+    size_t out_size;
+    uint64_t value;
+
+    // set for dir listings, the body is any size and is decoded into it.
+    usb_dir_list_t *list;
+
+    uint64_t start;             // for the stats, from submit to completion.
+    UsbRet ret;
+    bool done;
+    usb_async_cb_t callback;
+    void *user;
+};
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // broadcast on every queue, inflight or completion change.
+    pthread_t dispatcher;
+    pthread_t receiver;
+
+    bool running;
+    bool stopping;
+    UsbRet error;               // set once the link breaks, every request after fails with it.
+
+    usb_async_t *queue_head;    // waiting to be sent, in order.
+    usb_async_t *queue_tail;
+    usb_async_t *inflight;      // sent, waiting on a response.
+    uint32_t inflight_count;
+    uint32_t max_inflight;
+    uint32_t next_tag;
+} usb_async_state_t;
+usb_async_state_t g_async;
+
+
+usb_async_t *__usb_async_alloc(uint8_t mode)
+{
+    usb_async_t *req = calloc(1, sizeof(usb_async_t));
+    if (req)
+        req->mode = mode;
+    return req;
+}
+
+void __usb_async_push_head(usb_async_t *req, const void *data, size_t size)
+{
+    memcpy(req->head + req->head_size, data, size);
+    req->head_size += size;
+}
+
+// lock must be held.
+void __usb_async_enqueue(usb_async_t *req)
+{
+    if (!++g_async.next_tag)
+        g_async.next_tag++;
+    req->tag = g_async.next_tag;
+
+    if (g_async.queue_tail)
+        g_async.queue_tail->next = req;
+    else
+        g_async.queue_head = req;
+    g_async.queue_tail = req;
+
+    pthread_cond_broadcast(&g_async.cond);
+}
+
+UsbRet __usb_async_submit(usb_async_t *req, usb_async_t **out)
+{
+    req->start = __usb_stats_start();
+    pthread_mutex_lock(&g_async.lock);
+
+    UsbRet ret = UsbReturnCode_Success;
+    if (!g_async.running || g_async.stopping)
+        ret = UsbReturnCode_AsyncNotRunning;
+    else if (usb_failed(g_async.error))
+        ret = g_async.error;
+    else
+        __usb_async_enqueue(req);
+
+    pthread_mutex_unlock(&g_async.lock);
+
+    if (usb_failed(ret))
+    {
+        free(req);
+        return ret;
+    }
+
+    *out = req;
+    return UsbReturnCode_Success;
+}
+
+void __usb_async_complete(usb_async_t *req, UsbRet ret)
+{
+    __usb_stats_latency(req->mode, req->start);
+    pthread_mutex_lock(&g_async.lock);
+    req->ret = ret;
+    req->done = true;
+    const usb_async_cb_t callback = req->callback;
+    pthread_cond_broadcast(&g_async.cond);
+    pthread_mutex_unlock(&g_async.lock);
+
+    // without a callback, the waiter owns the request now.
+    if (callback)
+    {
+        callback(ret, req->value, req->user);
+        free(req);
+    }
+}
+
+// fails every queued and inflight request once the link is broken.
+void __usb_async_fail(UsbRet ret)
+{
+    pthread_mutex_lock(&g_async.lock);
+    if (usb_succeeded(g_async.error))
+        g_async.error = ret;
+
+    usb_async_t *inflight = g_async.inflight;
+    usb_async_t *queue = g_async.queue_head;
+    g_async.inflight = g_async.queue_head = g_async.queue_tail = NULL;
+    g_async.inflight_count = 0;
+    pthread_cond_broadcast(&g_async.cond);
+    pthread_mutex_unlock(&g_async.lock);
+
+    usb_async_t *lists[] = { inflight, queue };
+    for (int i = 0; i < 2; i++)
+    {
+        while (lists[i])
+        {
+            usb_async_t *req = lists[i];
+            lists[i] = req->next;
+            __usb_async_complete(req, ret);
+        }
+    }
+}
+
+// the request can complete (and be freed) as soon as its last byte is out, so nothing in it is touched after that.
+UsbRet __usb_async_send(const usb_async_t *req)
+{
+    const void *data = req->data;
+    const size_t data_size = req->data_size;
+    const size_t head_size = req->head_size;
+
+    return __usb_request_ex(req->mode, USB_POLL_FLAG_TAGGED, req->tag, head_size + data_size, req->head, head_size, data, data_size);
+}
+
+void *__usb_async_dispatch_thread(void *arg)
+{
+    pthread_mutex_lock(&g_async.lock);
+
+    for (;;)
+    {
+        while (usb_succeeded(g_async.error) && !(g_async.stopping && !g_async.queue_head) &&
+               (!g_async.queue_head || g_async.inflight_count >= g_async.max_inflight))
+            pthread_cond_wait(&g_async.cond, &g_async.lock);
+
+        if (usb_failed(g_async.error) || !g_async.queue_head)
+            break;
+
+        // moved to inflight before it's sent, so the response always finds it.
+        usb_async_t *req = g_async.queue_head;
+        g_async.queue_head = req->next;
+        if (!g_async.queue_head)
+            g_async.queue_tail = NULL;
+        req->next = g_async.inflight;
+        g_async.inflight = req;
+        g_async.inflight_count++;
+        pthread_mutex_unlock(&g_async.lock);
+
+        UsbRet ret = __usb_async_send(req);
+        if (usb_failed(ret))
+        {
+            __usb_async_fail(ret);
+            return NULL;
+        }
+
+        pthread_mutex_lock(&g_async.lock);
+    }
+
+    pthread_mutex_unlock(&g_async.lock);
+    return NULL;
+}
+
+// reads the body of a listing and decodes it into the request's list.
+// returns an error only if the link broke, result is set to the outcome of the request.
+UsbRet __usb_async_read_list(usb_async_t *req, uint64_t size, UsbRet *result)
+{
+    if (usb_failed(*result))
+        return size ? __usb_discard(size) : UsbReturnCode_Success;
+
+    if (size < sizeof(usb_dir_list_header_t) || size > USB_ASYNC_SIZE_MAX)
+    {
+        *result = UsbReturnCode_BadResponse;
+        return __usb_discard(size);
+    }
+
+    uint8_t *body = malloc(size);
+    if (!body)
+    {
+        *result = UsbReturnCode_FailedAllocPool;
+        return __usb_discard(size);
+    }
+
+    UsbRet ret = usb_read(body, size);
+    if (usb_succeeded(ret))
+    {
+        usb_dir_list_header_t header;
+        memcpy(&header, body, sizeof(header));
+        header.count = __usb_le64(header.count);
+        header.size = __usb_le64(header.size);
+
+        if (header.size != size - sizeof(header))
+            *result = UsbReturnCode_BadResponse;
+        else
+            *result = usb_dir_list_decode(body + sizeof(header), header.size, header.count, req->list);
+    }
+
+    free(body);
+    return ret;
+}
+
+void *__usb_async_receive_thread(void *arg)
+{
+    for (;;)
+    {
+        pthread_mutex_lock(&g_async.lock);
+        const bool finished = usb_failed(g_async.error) ||
+            (g_async.stopping && !g_async.queue_head && !g_async.inflight_count);
+        pthread_mutex_unlock(&g_async.lock);
+
+        if (finished)
+            break;
+
+        usb_async_response_t response;
+        UsbRet ret = usb_read(&response, sizeof(response));
+        if (usb_failed(ret))
+        {
+            __usb_async_fail(ret);
+            break;
+        }
+
+        response.tag = __usb_le32(response.tag);
+        response.result = __usb_le32(response.result);
+        response.size = __usb_le64(response.size);
+
+        pthread_mutex_lock(&g_async.lock);
+        usb_async_t **link = &g_async.inflight;
+        while (*link && (*link)->tag != response.tag)
+            link = &(*link)->next;
+
+        usb_async_t *req = *link;
+        if (req)
+        {
+            *link = req->next;
+            g_async.inflight_count--;
+            pthread_cond_broadcast(&g_async.cond);
+        }
+        pthread_mutex_unlock(&g_async.lock);
+
+        // a tag that was never sent means the link is out of sync.
+        if (!req)
+        {
+            __usb_async_fail(UsbReturnCode_BadResponse);
+            break;
+        }
+
+        __usb_stats_set_op(req->mode);
+
+        if (req->list)
+        {
+            ret = __usb_async_read_list(req, response.size, &response.result);
+            __usb_async_complete(req, usb_failed(ret) ? ret : response.result);
+            if (usb_failed(ret))
+            {
+                __usb_async_fail(ret);
+                break;
+            }
+            continue;
+        }
+
+        if (response.size && response.size != req->out_size)
+        {
+            ret = __usb_discard(response.size);
+            if (usb_failed(ret))
+            {
+                __usb_async_complete(req, ret);
+                __usb_async_fail(ret);
+                break;
+            }
+            __usb_async_complete(req, UsbReturnCode_BadResponse);
+            continue;
+        }
+
+        if (response.size)
+        {
+            ret = usb_read(req->out, response.size);
+            if (usb_failed(ret))
+            {
+                __usb_async_complete(req, ret);
+                __usb_async_fail(ret);
+                break;
+            }
+
+            if (req->out == &req->value)
+                req->value = __usb_le64(req->value);
+        }
+        else if (usb_succeeded(response.result) && req->out_size)
+            response.result = UsbReturnCode_BadResponse;
+
+        __usb_async_complete(req, response.result);
+    }
+
+    return NULL;
+}
+
+void __usb_async_discard_callback(UsbRet ret, uint64_t value, void *user)
+{
+}
+
+bool __usb_async_is_value_mode(uint8_t mode)
+{
+    switch (mode)
+    {
+        case UsbMode_GetFileSizeFromPath:
+        case UsbMode_GetChangeToken:
+        case UsbMode_GetDirTotalFromPath:
+        case UsbMode_GetDirTotalRecursivelyFromPath:
+        case UsbMode_GetDirSizeFromPath:
+        case UsbMode_GetDirSizeFromPathRecursively:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool __usb_async_is_path_mode(uint8_t mode)
+{
+    switch (mode)
+    {
+        case UsbMode_TouchFile:
+        case UsbMode_DeleteFile:
+        case UsbMode_IsFile:
+        case UsbMode_TouchDir:
+        case UsbMode_DeleteDir:
+        case UsbMode_IsDir:
+            return true;
+        default:
+            return __usb_async_is_value_mode(mode);
+    }
+}
+
+UsbRet __usb_async_file_op(uint8_t mode, usb_file_t file, uint64_t size, uint64_t offset, usb_async_t **out, usb_async_t **req_out)
+{
+    if (!out)
+        return UsbReturnCode_EmptyField;
+
+    usb_async_t *req = __usb_async_alloc(mode);
+    if (!req)
+        return UsbReturnCode_Failure;
+
+    const usb_file_io_t io = { __usb_le32(file), 0, __usb_le64(size), __usb_le64(offset) };
+    __usb_async_push_head(req, &io, sizeof(io));
+    *req_out = req;
+    return UsbReturnCode_Success;
+}
+
+
+
+bool __usb_async_running(void)
+{
+    return g_async.running;
+}
+
+
+
+/*
+*   Async Functions.
+*/
+
+UsbRet usb_async_start(uint32_t max_inflight)
+{
+    if (g_async.running)
+        return UsbReturnCode_Success;
+
+    usb_caps_t caps;
+    usb_get_host_caps(&caps);
+    if (!(caps.caps & UsbCap_Tagged))
+        return UsbReturnCode_UnsupportedByHost;
+
+    memset(&g_async, 0, sizeof(g_async));
+    g_async.max_inflight = max_inflight ? max_inflight : USB_ASYNC_INFLIGHT_DEFAULT;
+    if (g_async.max_inflight > USB_ASYNC_INFLIGHT_MAX)
+        g_async.max_inflight = USB_ASYNC_INFLIGHT_MAX;
+    if (caps.max_inflight && g_async.max_inflight > caps.max_inflight)
+        g_async.max_inflight = caps.max_inflight;
+
+    pthread_mutex_init(&g_async.lock, NULL);
+    pthread_cond_init(&g_async.cond, NULL);
+
+    if (pthread_create(&g_async.dispatcher, NULL, __usb_async_dispatch_thread, NULL))
+        goto fail;
+
+    if (pthread_create(&g_async.receiver, NULL, __usb_async_receive_thread, NULL))
+    {
+        pthread_mutex_lock(&g_async.lock);
+        g_async.stopping = true;
+        pthread_cond_broadcast(&g_async.cond);
+        pthread_mutex_unlock(&g_async.lock);
+        pthread_join(g_async.dispatcher, NULL);
+        goto fail;
+    }
+
+    g_async.running = true;
+    return UsbReturnCode_Success;
+
+fail:
+    pthread_cond_destroy(&g_async.cond);
+    pthread_mutex_destroy(&g_async.lock);
+    return UsbReturnCode_AsyncNotRunning;
+}
+
+UsbRet usb_async_stop(void)
+{
+    if (!g_async.running)
+        return UsbReturnCode_AsyncNotRunning;
+
+    // a last ping wakes the receiver, it exits once every response is in.
+    usb_async_t *last = __usb_async_alloc(UsbMode_Ping);
+
+    pthread_mutex_lock(&g_async.lock);
+    if (last && usb_succeeded(g_async.error))
+    {
+        last->callback = __usb_async_discard_callback;
+        __usb_async_enqueue(last);
+        last = NULL;
+    }
+    g_async.stopping = true;
+    pthread_cond_broadcast(&g_async.cond);
+    pthread_mutex_unlock(&g_async.lock);
+
+    free(last);
+    pthread_join(g_async.dispatcher, NULL);
+    pthread_join(g_async.receiver, NULL);
+
+    const UsbRet ret = g_async.error;
+    pthread_cond_destroy(&g_async.cond);
+    pthread_mutex_destroy(&g_async.lock);
+    memset(&g_async, 0, sizeof(g_async));
+    return ret;
+}
+
+UsbRet usb_async_wait(usb_async_t *req, uint64_t *value)
+{
+    if (!req)
+        return UsbReturnCode_EmptyField;
+
+    pthread_mutex_lock(&g_async.lock);
+    while (!req->done)
+        pthread_cond_wait(&g_async.cond, &g_async.lock);
+    pthread_mutex_unlock(&g_async.lock);
+
+    const UsbRet ret = req->ret;
+    if (value)
+        *value = req->value;
+    free(req);
+    return ret;
+}
+
+void usb_async_then(usb_async_t *req, usb_async_cb_t callback, void *user)
+{
+    if (!req)
+        return;
+
+    if (!callback)
+        callback = __usb_async_discard_callback;
+
+    pthread_mutex_lock(&g_async.lock);
+    const bool done = req->done;
+    req->callback = callback;
+    req->user = user;
+    pthread_mutex_unlock(&g_async.lock);
+
+    if (done)
+    {
+        callback(req->ret, req->value, user);
+        free(req);
+    }
+}
+
+
+
+/*
+*   Async Requests.
+*/
+
+UsbRet usb_async_ping(usb_async_t **out)
+{
+    if (!out)
+        return UsbReturnCode_EmptyField;
+
+    usb_async_t *req = __usb_async_alloc(UsbMode_Ping);
+    if (!req)
+        return UsbReturnCode_Failure;
+
+    return __usb_async_submit(req, out);
+}
+
+UsbRet usb_async_path(uint8_t mode, const char *path, usb_async_t **out)
+{
+    if (!path || !out)
+        return UsbReturnCode_EmptyField;
+
+    if (!__usb_async_is_path_mode(mode))
+        return UsbReturnCode_UnknownMode;
+
+    const size_t len = strlen(path);
+    if (len >= USB_FILE_NAME_MAX)
+        return UsbReturnCode_FileNameTooLarge;
+
+    usb_async_t *req = __usb_async_alloc(mode);
+    if (!req)
+        return UsbReturnCode_Failure;
+
+    __usb_async_push_head(req, path, len);
+    if (__usb_async_is_value_mode(mode))
+    {
+        req->out = &req->value;
+        req->out_size = sizeof(req->value);
+    }
+
+    return __usb_async_submit(req, out);
+}
+
+UsbRet usb_async_dir_list(const char *path, usb_dir_list_t *list, usb_async_t **out)
+{
+    if (!path || !list || !out)
+        return UsbReturnCode_EmptyField;
+
+    const size_t len = strlen(path);
+    if (len >= USB_FILE_NAME_MAX)
+        return UsbReturnCode_FileNameTooLarge;
+
+    usb_async_t *req = __usb_async_alloc(UsbMode_ReadDirCompact);
+    if (!req)
+        return UsbReturnCode_Failure;
+
+    memset(list, 0, sizeof(*list));
+    __usb_async_push_head(req, path, len);
+    req->list = list;
+    return __usb_async_submit(req, out);
+}
+
+UsbRet usb_async_rename(uint8_t mode, const char *curr_name, const char *new_name, usb_async_t **out)
+{
+    if (!curr_name || !new_name || !out)
+        return UsbReturnCode_EmptyField;
+
+    if (mode != UsbMode_RenameFile && mode != UsbMode_RenameDir)
+        return UsbReturnCode_UnknownMode;
+
+    const size_t l1 = strlen(curr_name);
+    const size_t l2 = strlen(new_name);
+
+    if (l1 >= USB_FILE_NAME_MAX || l2 >= USB_FILE_NAME_MAX)
+        return UsbReturnCode_FileNameTooLarge;
+
+    usb_async_t *req = __usb_async_alloc(mode);
+    if (!req)
+        return UsbReturnCode_Failure;
+
+    const struct
+    {
+        uint64_t l1;
+        uint64_t l2;
+    } lens = { __usb_le64(l1), __usb_le64(l2) };
+
+    __usb_async_push_head(req, &lens, sizeof(lens));
+    __usb_async_push_head(req, curr_name, l1);
+    __usb_async_push_head(req, new_name, l2);
+    return __usb_async_submit(req, out);
+}
+
+UsbRet usb_async_file_open(const char *path, uint8_t mode, usb_async_t **out)
+{
+    if (!path || !out)
+        return UsbReturnCode_EmptyField;
+
+    const size_t len = strlen(path);
+    if (len >= USB_FILE_NAME_MAX)
+        return UsbReturnCode_FileNameTooLarge;
+
+    usb_async_t *req = __usb_async_alloc(UsbMode_OpenFileHandle);
+    if (!req)
+        return UsbReturnCode_Failure;
+
+    const usb_file_open_t open = { mode, {0} };
+    __usb_async_push_head(req, &open, sizeof(open));
+    __usb_async_push_head(req, path, len);
+    req->out = &req->value;
+    req->out_size = sizeof(req->value);
+    return __usb_async_submit(req, out);
+}
+
+UsbRet usb_async_file_read(usb_file_t file, void *data, size_t size, uint64_t offset, usb_async_t **out)
+{
+    if (!data || !size)
+        return UsbReturnCode_EmptyField;
+
+    if (size > USB_ASYNC_SIZE_MAX)
+        return UsbReturnCode_FailedReadFile;
+
+    usb_async_t *req;
+    UsbRet ret = __usb_async_file_op(UsbMode_ReadFileHandle, file, size, offset, out, &req);
+    if (usb_failed(ret))
+        return ret;
+
+    req->out = data;
+    req->out_size = size;
+    return __usb_async_submit(req, out);
+}
+
+UsbRet usb_async_file_write(usb_file_t file, const void *data, size_t size, uint64_t offset, usb_async_t **out)
+{
+    if (!data || !size)
+        return UsbReturnCode_EmptyField;
+
+    if (size > USB_ASYNC_SIZE_MAX)
+        return UsbReturnCode_FailedWriteFile;
+
+    usb_async_t *req;
+    UsbRet ret = __usb_async_file_op(UsbMode_WriteFileHandle, file, size, offset, out, &req);
+    if (usb_failed(ret))
+        return ret;
+
+    req->data = data;
+    req->data_size = size;
+    return __usb_async_submit(req, out);
+}
+
+UsbRet usb_async_file_get_size(usb_file_t file, usb_async_t **out)
+{
+    usb_async_t *req;
+    UsbRet ret = __usb_async_file_op(UsbMode_GetFileHandleSize, file, 0, 0, out, &req);
+    if (usb_failed(ret))
+        return ret;
+
+    req->out = &req->value;
+    req->out_size = sizeof(req->value);
+    return __usb_async_submit(req, out);
+}
+
+UsbRet usb_async_file_close(usb_file_t file, usb_async_t **out)
+{
+    usb_async_t *req;
+    UsbRet ret = __usb_async_file_op(UsbMode_CloseFileHandle, file, 0, 0, out, &req);
+    if (usb_failed(ret))
+        return ret;
+
+    return __usb_async_submit(req, out);
+}
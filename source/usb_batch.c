@@ -0,0 +1,242 @@
+/*
+*   TotalJustice
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "nxusb.h"
+#include "nxusb_batch.h"
+#include "usb_internal.h"
+
+_Static_assert(sizeof(usb_batch_header_t) == 0x8, "usb_batch_header_t must match the host");
+_Static_assert(sizeof(usb_batch_op_t) == 0x8, "usb_batch_op_t must match the host");
+_Static_assert(offsetof(usb_batch_op_t, len1) == 0x2, "usb_batch_op_t must match the host");
+_Static_assert(offsetof(usb_batch_op_t, len2) == 0x4, "usb_batch_op_t must match the host");
+
+
+struct usb_batch
+{
+    uint8_t *data;          // every op back to back, without the header.
+    size_t size;
+    size_t capacity;
+    uint32_t count;
+};
+
+bool __usb_batch_mode_supported(uint8_t mode)
+{
+    switch (mode)
+    {
+        case UsbMode_TouchFile:
+        case UsbMode_DeleteFile:
+        case UsbMode_IsFile:
+        case UsbMode_RenameFile:
+        case UsbMode_TouchDir:
+        case UsbMode_DeleteDir:
+        case UsbMode_IsDir:
+        case UsbMode_RenameDir:
+            return true;
+        default:
+            return false;
+    }
+}
+
+UsbRet __usb_batch_push(usb_batch_t *batch, uint8_t mode, const char *str1, size_t len1, const char *str2, size_t len2)
+{
+    const size_t size = sizeof(usb_batch_op_t) + len1 + len2;
+
+    if (batch->size + size > batch->capacity)
+    {
+        size_t capacity = batch->capacity ? batch->capacity * 2 : 0x1000;
+        while (capacity < batch->size + size)
+            capacity *= 2;
+
+        uint8_t *data = realloc(batch->data, capacity);
+        if (!data)
+            return UsbReturnCode_FailedAllocPool;
+
+        batch->data = data;
+        batch->capacity = capacity;
+    }
+
+    // ops are kept as they go on the wire.
+    const usb_batch_op_t op = { mode, 0, __usb_le16(len1), __usb_le16(len2), 0 };
+    uint8_t *dst = batch->data + batch->size;
+    memcpy(dst, &op, sizeof(op));
+    memcpy(dst + sizeof(op), str1, len1);
+    if (len2)
+        memcpy(dst + sizeof(op) + len1, str2, len2);
+
+    batch->size += size;
+    batch->count++;
+    return UsbReturnCode_Success;
+}
+
+// sends each op as its own request, for hosts without UsbCap_Batch.
+UsbRet __usb_batch_send_each(const uint8_t *data, uint32_t count, UsbRet *results)
+{
+    // renames carry both lengths before the strings, the same as usb_rename_file.
+    struct
+    {
+        uint64_t l1;
+        uint64_t l2;
+        char str[USB_FILE_NAME_MAX * 2];
+    } buf;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        usb_batch_op_t op;
+        memcpy(&op, data, sizeof(op));
+        op.len1 = __usb_le16(op.len1);
+        op.len2 = __usb_le16(op.len2);
+
+        const bool rename = op.mode == UsbMode_RenameFile || op.mode == UsbMode_RenameDir;
+        const size_t head = rename ? 0x10 : 0;
+        buf.l1 = __usb_le64(op.len1);
+        buf.l2 = __usb_le64(op.len2);
+        memcpy(buf.str, data + sizeof(op), op.len1 + op.len2);
+        data += sizeof(op) + op.len1 + op.len2;
+
+        UsbRet ret = __usb_request(op.mode, head + op.len1 + op.len2, (uint8_t *)&buf + 0x10 - head, head + op.len1 + op.len2);
+        if (usb_failed(ret))
+            return ret;
+
+        results[i] = usb_get_result();
+        if (results[i] == UsbReturnCode_WrongSizeRead)
+            return results[i];
+    }
+
+    return UsbReturnCode_Success;
+}
+
+// sends ops [0, count) of data, which is size bytes.
+UsbRet __usb_batch_send(const uint8_t *data, size_t size, uint32_t count, UsbRet *results)
+{
+    if (!usb_host_has_caps(UsbCap_Batch))
+        return __usb_batch_send_each(data, count, results);
+
+    UsbRet ret;
+    const usb_batch_header_t header = { __usb_le32(count), 0 };
+
+    ret = __usb_request_ex(UsbMode_Batch, 0, 0, sizeof(header) + size, &header, sizeof(header), data, size);
+    if (usb_failed(ret))
+        return ret;
+
+    ret = usb_get_result();
+    if (usb_failed(ret))
+        return ret;
+
+    ret = usb_read(results, count * sizeof(UsbRet));
+    if (usb_failed(ret))
+        return ret;
+
+    for (uint32_t i = 0; i < count; i++)
+        results[i] = __usb_le32(results[i]);
+    return UsbReturnCode_Success;
+}
+
+UsbRet usb_batch_create(usb_batch_t **out)
+{
+    if (!out)
+        return UsbReturnCode_EmptyField;
+
+    *out = calloc(1, sizeof(usb_batch_t));
+    if (!*out)
+        return UsbReturnCode_FailedAllocPool;
+    return UsbReturnCode_Success;
+}
+
+void usb_batch_free(usb_batch_t *batch)
+{
+    if (!batch)
+        return;
+
+    free(batch->data);
+    free(batch);
+}
+
+UsbRet usb_batch_add(usb_batch_t *batch, uint8_t mode, const char *path)
+{
+    if (!batch || !path)
+        return UsbReturnCode_EmptyField;
+
+    if (!__usb_batch_mode_supported(mode) || mode == UsbMode_RenameFile || mode == UsbMode_RenameDir)
+        return UsbReturnCode_UnknownMode;
+
+    const size_t len = strlen(path);
+    if (len >= USB_FILE_NAME_MAX)
+        return UsbReturnCode_FileNameTooLarge;
+
+    return __usb_batch_push(batch, mode, path, len, NULL, 0);
+}
+
+UsbRet usb_batch_add_rename(usb_batch_t *batch, uint8_t mode, const char *curr_name, const char *new_name)
+{
+    if (!batch || !curr_name || !new_name)
+        return UsbReturnCode_EmptyField;
+
+    if (mode != UsbMode_RenameFile && mode != UsbMode_RenameDir)
+        return UsbReturnCode_UnknownMode;
+
+    const size_t len1 = strlen(curr_name);
+    const size_t len2 = strlen(new_name);
+    if (len1 >= USB_FILE_NAME_MAX || len2 >= USB_FILE_NAME_MAX)
+        return UsbReturnCode_FileNameTooLarge;
+
+    return __usb_batch_push(batch, mode, curr_name, len1, new_name, len2);
+}
+
+uint32_t usb_batch_count(const usb_batch_t *batch)
+{
+    return batch ? batch->count : 0;
+}
+
+UsbRet usb_batch_submit(usb_batch_t *batch, UsbRet *results)
+{
+    if (!batch || !results)
+        return UsbReturnCode_EmptyField;
+
+    UsbRet ret = UsbReturnCode_Success;
+    size_t start = 0, offset = 0;
+    uint32_t first = 0, count = 0;
+
+    // split into requests of at most USB_BATCH_SIZE_MAX.
+    while (offset < batch->size)
+    {
+        usb_batch_op_t op;
+        memcpy(&op, batch->data + offset, sizeof(op));
+        const size_t size = sizeof(op) + __usb_le16(op.len1) + __usb_le16(op.len2);
+
+        if (count && offset + size - start + sizeof(usb_batch_header_t) > USB_BATCH_SIZE_MAX)
+        {
+            ret = __usb_batch_send(batch->data + start, offset - start, count, results + first);
+            if (usb_failed(ret))
+                break;
+
+            first += count;
+            count = 0;
+            start = offset;
+        }
+
+        offset += size;
+        count++;
+    }
+
+    if (usb_succeeded(ret) && count)
+        ret = __usb_batch_send(batch->data + start, offset - start, count, results + first);
+
+    usb_batch_clear(batch);
+    return ret;
+}
+
+void usb_batch_clear(usb_batch_t *batch)
+{
+    if (!batch)
+        return;
+
+    batch->size = 0;
+    batch->count = 0;
+}
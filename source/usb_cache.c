@@ -0,0 +1,247 @@
+/*
+*   TotalJustice
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "nxusb.h"
+#include "nxusb_dir.h"
+#include "usb_internal.h"
+
+
+typedef struct
+{
+    bool used;
+    uint8_t mode;               // the poll that produced this, UsbMode_ReadDirCompact for listings.
+    char path[USB_FILE_NAME_MAX];
+    uint64_t token;
+    uint64_t last_used;
+
+    uint64_t value;             // for value modes.
+    usb_dir_list_header_t header;   // for listings.
+    void *data;
+} usb_cache_entry_t;
+
+typedef struct
+{
+    usb_cache_entry_t *entries;
+    uint32_t max_entries;
+    size_t max_size;
+    size_t size;                // bytes of listings held.
+    uint64_t tick;
+} usb_cache_t;
+usb_cache_t g_cache;
+
+
+void __usb_cache_drop(usb_cache_entry_t *entry)
+{
+    g_cache.size -= entry->header.size;
+    usb_free_aligned(entry->data);
+    memset(entry, 0, sizeof(*entry));
+}
+
+usb_cache_entry_t *__usb_cache_find(uint8_t mode, const char *path)
+{
+    for (uint32_t i = 0; i < g_cache.max_entries; i++)
+    {
+        usb_cache_entry_t *entry = &g_cache.entries[i];
+        if (entry->used && entry->mode == mode && !strcmp(entry->path, path))
+            return entry;
+    }
+    return NULL;
+}
+
+// returns a free slot, evicting the least recently used entries until size bytes of listing fit.
+usb_cache_entry_t *__usb_cache_alloc(size_t size)
+{
+    for (;;)
+    {
+        usb_cache_entry_t *free_entry = NULL, *oldest = NULL;
+
+        for (uint32_t i = 0; i < g_cache.max_entries; i++)
+        {
+            usb_cache_entry_t *entry = &g_cache.entries[i];
+            if (!entry->used)
+            {
+                if (!free_entry)
+                    free_entry = entry;
+            }
+            else if (!oldest || entry->last_used < oldest->last_used)
+                oldest = entry;
+        }
+
+        if (free_entry && g_cache.size + size <= g_cache.max_size)
+            return free_entry;
+        if (!oldest)
+            return NULL;
+
+        __usb_cache_drop(oldest);
+    }
+}
+
+// looks up mode + path and checks it against the host's token.
+// the token is always returned so a miss can be stored under it.
+usb_cache_entry_t *__usb_cache_lookup(uint8_t mode, const char *path, uint64_t *token, UsbRet *ret)
+{
+    *ret = usb_get_change_token(path, token);
+    if (usb_failed(*ret))
+        return NULL;
+
+    usb_cache_entry_t *entry = __usb_cache_find(mode, path);
+    if (!entry)
+        return NULL;
+
+    if (entry->token != *token)
+    {
+        __usb_cache_drop(entry);
+        return NULL;
+    }
+
+    entry->last_used = ++g_cache.tick;
+    return entry;
+}
+
+usb_cache_entry_t *__usb_cache_insert(uint8_t mode, const char *path, uint64_t token, size_t size)
+{
+    usb_cache_entry_t *entry = __usb_cache_alloc(size);
+    if (!entry)
+        return NULL;
+
+    entry->used = true;
+    entry->mode = mode;
+    strcpy(entry->path, path);
+    entry->token = token;
+    entry->last_used = ++g_cache.tick;
+    return entry;
+}
+
+// entries are checked with change tokens and listings are cached compact, hosts without both are never cached.
+bool __usb_cache_enabled(void)
+{
+    return g_cache.entries != NULL && usb_host_has_caps(UsbCap_ChangeToken | UsbCap_DirCompact);
+}
+
+UsbRet __usb_cache_value(uint8_t mode, const char *path, uint64_t *out, usb_cache_fetch_t fetch)
+{
+    if (!__usb_cache_enabled() || !path || !out || strlen(path) >= USB_FILE_NAME_MAX)
+        return fetch(mode, path, out);
+
+    uint64_t token;
+    UsbRet ret;
+    usb_cache_entry_t *entry = __usb_cache_lookup(mode, path, &token, &ret);
+
+    if (entry)
+    {
+        *out = entry->value;
+        return UsbReturnCode_Success;
+    }
+
+    // hosts without change tokens just don't get cached.
+    const bool cache = usb_succeeded(ret);
+
+    ret = fetch(mode, path, out);
+    if (usb_succeeded(ret) && cache && (entry = __usb_cache_insert(mode, path, token, 0)))
+        entry->value = *out;
+
+    return ret;
+}
+
+UsbRet __usb_cache_list(const char *path, usb_dir_list_t *out)
+{
+    if (strlen(path) >= USB_FILE_NAME_MAX)
+        return UsbReturnCode_FileNameTooLarge;
+
+    uint64_t token;
+    UsbRet ret;
+    usb_cache_entry_t *entry = __usb_cache_lookup(UsbMode_ReadDirCompact, path, &token, &ret);
+
+    if (entry)
+        return usb_dir_list_decode(entry->data, entry->header.size, entry->header.count, out);
+
+    const bool cache = usb_succeeded(ret);
+    usb_dir_list_header_t header;
+    void *data;
+
+    ret = __usb_dir_list_fetch(path, &header, &data);
+    if (usb_failed(ret))
+        return ret;
+
+    ret = usb_dir_list_decode(data, header.size, header.count, out);
+
+    // the cache takes the packed data if there's room for it, decoding again on every hit is cheap.
+    if (usb_succeeded(ret) && cache && header.size <= g_cache.max_size &&
+        (entry = __usb_cache_insert(UsbMode_ReadDirCompact, path, token, header.size)))
+    {
+        entry->header = header;
+        entry->data = data;
+        g_cache.size += header.size;
+        return ret;
+    }
+
+    usb_free_aligned(data);
+    return ret;
+}
+
+
+
+/*
+*   Cache Functions.
+*/
+
+UsbRet usb_cache_enable(uint32_t max_entries, size_t max_size)
+{
+    usb_cache_disable();
+
+    if (!max_entries)
+        return UsbReturnCode_EmptyField;
+
+    g_cache.entries = calloc(max_entries, sizeof(usb_cache_entry_t));
+    if (!g_cache.entries)
+        return UsbReturnCode_FailedAllocPool;
+
+    g_cache.max_entries = max_entries;
+    g_cache.max_size = max_size;
+    return UsbReturnCode_Success;
+}
+
+void usb_cache_disable(void)
+{
+    usb_cache_clear();
+    free(g_cache.entries);
+    memset(&g_cache, 0, sizeof(g_cache));
+}
+
+void usb_cache_clear(void)
+{
+    for (uint32_t i = 0; i < g_cache.max_entries; i++)
+    {
+        if (g_cache.entries[i].used)
+            __usb_cache_drop(&g_cache.entries[i]);
+    }
+}
+
+UsbRet usb_get_change_token(const char *path, uint64_t *out)
+{
+    if (!path || !out)
+        return UsbReturnCode_EmptyField;
+
+    if (!usb_host_has_caps(UsbCap_ChangeToken))
+        return UsbReturnCode_UnsupportedByHost;
+
+    size_t size = strlen(path);
+    if (size >= USB_FILE_NAME_MAX)
+        return UsbReturnCode_FileNameTooLarge;
+
+    UsbRet ret = __usb_request(UsbMode_GetChangeToken, size, path, size);
+    if (usb_failed(ret))
+        return ret;
+
+    ret = usb_get_result();
+    if (usb_failed(ret))
+        return ret;
+
+    return __usb_read_u64(out);
+}
@@ -0,0 +1,211 @@
+/*
+*   TotalJustice
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "nxusb.h"
+#include "nxusb_compress.h"
+#include "usb_internal.h"
+
+_Static_assert(sizeof(usb_compress_block_t) == 0x8, "usb_compress_block_t must match the host");
+_Static_assert(offsetof(usb_compress_block_t, packed_size) == 0x4, "usb_compress_block_t must match the host");
+
+
+typedef struct
+{
+    UsbCompression negotiated;  // what the host agreed to in the handshake.
+    UsbCompression active;
+    uint32_t skip;              // blocks left to send raw after one that didn't shrink.
+    uint8_t *buf;               // a block header followed by a block, or a block followed by the next header.
+} usb_compress_t;
+usb_compress_t g_compress;
+
+
+void __usb_compress_init(uint8_t host_compression)
+{
+    __usb_compress_exit();
+
+    if (host_compression != UsbCompression_Lz4)
+        return;
+
+    g_compress.buf = usb_alloc_aligned(sizeof(usb_compress_block_t) + USB_COMPRESS_BLOCK_SIZE);
+    if (!g_compress.buf)
+        return;
+
+    g_compress.negotiated = g_compress.active = host_compression;
+}
+
+void __usb_compress_exit(void)
+{
+    usb_free_aligned(g_compress.buf);
+    memset(&g_compress, 0, sizeof(g_compress));
+}
+
+// blocks are only sent packed if that saves at least 1/16th, otherwise unpacking isn't worth it.
+size_t __usb_compress_block(const void *src, size_t size, void *dst)
+{
+    if (g_compress.skip)
+    {
+        g_compress.skip--;
+        return 0;
+    }
+
+    const size_t packed = usb_lz4_compress(src, size, dst, size - size / 16);
+    if (!packed || packed >= size)
+    {
+        g_compress.skip = USB_COMPRESS_SKIP_BLOCKS;
+        return 0;
+    }
+    return packed;
+}
+
+// hosts with caps chain the blocks they send: the first header comes on its own, then each block comes
+// with the header of the one after it, so every block is one transfer of a size known up front.
+UsbRet __usb_read_blocks(void *out, size_t size)
+{
+    UsbRet ret;
+    usb_compress_block_t block;
+    uint8_t *packed = g_compress.buf;
+    uint8_t *dst = out;
+    const bool chained = usb_host_has_caps(UsbCap_Framed);
+
+    if (chained && size)
+    {
+        ret = usb_read(&block, sizeof(block));
+        if (usb_failed(ret))
+            return ret;
+    }
+
+    while (size)
+    {
+        const size_t chunk = size < USB_COMPRESS_BLOCK_SIZE ? size : USB_COMPRESS_BLOCK_SIZE;
+
+        if (!chained)
+        {
+            ret = usb_read(&block, sizeof(block));
+            if (usb_failed(ret))
+                return ret;
+        }
+
+        const uint32_t packed_size = __usb_le32(block.packed_size);
+        if (__usb_le32(block.size) != chunk || packed_size > chunk)
+            return UsbReturnCode_BadCompressedBlock;
+
+        const size_t trailer = chained && size > chunk ? sizeof(block) : 0;
+        uint8_t *src = packed;
+
+        // raw blocks land straight in out, the next header in the space of the block after it.
+        // that's only safe if its whole page is out's, otherwise it goes through packed.
+        if (packed_size == chunk && !trailer)
+        {
+            ret = usb_read(dst, chunk);
+            src = dst;
+        }
+        else if (packed_size == chunk && __usb_is_aligned(dst) && size - chunk >= USB_TRANSFER_ALIGN)
+        {
+            ret = usb_read_aligned(dst, chunk + trailer);
+            src = dst;
+        }
+        else
+        {
+            ret = usb_read_aligned(packed, packed_size + trailer);
+        }
+
+        if (usb_failed(ret))
+            return ret;
+
+        if (trailer)
+            memcpy(&block, src + packed_size, sizeof(block));
+
+        if (src == packed && packed_size == chunk)
+        {
+            const uint64_t start = __usb_stats_start();
+            memcpy(dst, packed, chunk);
+            __usb_stats_copy(start);
+        }
+        else if (src == packed && !usb_lz4_decompress(packed, packed_size, dst, chunk))
+        {
+            return UsbReturnCode_BadCompressedBlock;
+        }
+
+        dst += chunk;
+        size -= chunk;
+    }
+
+    return UsbReturnCode_Success;
+}
+
+UsbRet __usb_write_blocks(const void *in, size_t size)
+{
+    UsbRet ret;
+    usb_compress_block_t *block = (usb_compress_block_t *)g_compress.buf;
+    uint8_t *packed = g_compress.buf + sizeof(*block);
+    const uint8_t *src = in;
+    const bool framed = usb_host_has_caps(UsbCap_Framed);
+
+    while (size)
+    {
+        const size_t chunk = size < USB_COMPRESS_BLOCK_SIZE ? size : USB_COMPRESS_BLOCK_SIZE;
+        const size_t packed_size = __usb_compress_block(src, chunk, packed);
+        const size_t send_size = packed_size ? packed_size : chunk;
+
+        block->size = __usb_le32(chunk);
+        block->packed_size = __usb_le32(send_size);
+
+        // hosts with caps take the header and the block in one transfer, so a raw block is copied in behind it.
+        if (framed)
+        {
+            if (!packed_size)
+            {
+                const uint64_t start = __usb_stats_start();
+                memcpy(packed, src, chunk);
+                __usb_stats_copy(start);
+            }
+
+            ret = usb_write_aligned(block, sizeof(*block) + send_size);
+            if (usb_failed(ret))
+                return ret;
+        }
+        else
+        {
+            ret = usb_write_aligned(block, sizeof(*block));
+            if (usb_failed(ret))
+                return ret;
+
+            ret = usb_write(packed_size ? packed : src, send_size);
+            if (usb_failed(ret))
+                return ret;
+        }
+
+        src += chunk;
+        size -= chunk;
+    }
+
+    return UsbReturnCode_Success;
+}
+
+
+
+/*
+*   Compression Functions.
+*/
+
+UsbRet usb_set_compression(UsbCompression compression)
+{
+    if (compression != UsbCompression_None && compression != g_compress.negotiated)
+        return UsbReturnCode_CompressionUnsupported;
+
+    g_compress.active = compression;
+    g_compress.skip = 0;
+    return UsbReturnCode_Success;
+}
+
+UsbCompression usb_get_compression(void)
+{
+    return g_compress.active;
+}
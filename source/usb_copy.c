@@ -0,0 +1,289 @@
+/*
+*   TotalJustice
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "nxusb.h"
+#include "nxusb_copy.h"
+#include "nxusb_file.h"
+#include "usb_internal.h"
+
+#define USB_TUNER_DECAY         0.9     // weight kept by older samples on every report.
+#define USB_TUNER_OVERHEAD      15      // transfer time per unit of latency, latency ends up 1/16th.
+#define USB_TUNER_PROBE         0x10    // every 16th transfer tries half the size, so the fit always sees two sizes.
+
+
+uint64_t __usb_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+size_t __usb_tuner_clamp(const usb_chunk_tuner_t *tuner, double size)
+{
+    if (size <= (double)tuner->min)
+        return tuner->min;
+    if (size >= (double)tuner->max)
+        return tuner->max;
+
+    // next power of 2 up, so the size doesn't wander with noise.
+    size_t chunk = tuner->min;
+    while (chunk < size && chunk < tuner->max)
+        chunk <<= 1;
+    return chunk < tuner->max ? chunk : tuner->max;
+}
+
+size_t __usb_align_up(size_t size)
+{
+    return (size + USB_TRANSFER_ALIGN - 1) & ~(size_t)(USB_TRANSFER_ALIGN - 1);
+}
+
+
+
+/*
+*   Chunk Tuner Functions.
+*/
+
+void usb_chunk_tuner_init(usb_chunk_tuner_t *tuner, size_t min, size_t max)
+{
+    memset(tuner, 0, sizeof(*tuner));
+    tuner->min = __usb_align_up(min ? min : USB_TRANSFER_ALIGN);
+    tuner->max = __usb_align_up(max > tuner->min ? max : tuner->min);
+    tuner->chunk = __usb_tuner_clamp(tuner, USB_COPY_CHUNK_START);
+}
+
+size_t usb_chunk_tuner_next(const usb_chunk_tuner_t *tuner)
+{
+    return tuner->chunk;
+}
+
+void usb_chunk_tuner_report(usb_chunk_tuner_t *tuner, size_t size, uint64_t ns)
+{
+    const double x = (double)size;
+    const double y = (double)ns;
+
+    tuner->n = tuner->n * USB_TUNER_DECAY + 1;
+    tuner->sx = tuner->sx * USB_TUNER_DECAY + x;
+    tuner->sy = tuner->sy * USB_TUNER_DECAY + y;
+    tuner->sxx = tuner->sxx * USB_TUNER_DECAY + x * x;
+    tuner->sxy = tuner->sxy * USB_TUNER_DECAY + x * y;
+    tuner->count++;
+
+    // y = latency + x * cost, solved with least squares.
+    const double det = tuner->n * tuner->sxx - tuner->sx * tuner->sx;
+    const bool fit = det > tuner->n * tuner->sxx * 1e-6;
+    const double cost = fit ? (tuner->n * tuner->sxy - tuner->sx * tuner->sy) / det : 0;
+    const double latency = fit ? (tuner->sy - cost * tuner->sx) / tuner->n : 0;
+
+    size_t target;
+    if (!fit)
+    {
+        // every sample so far is one size, try a bigger one to learn the curve.
+        target = __usb_tuner_clamp(tuner, (double)tuner->chunk * 4);
+        if (target == tuner->chunk)
+            target = __usb_tuner_clamp(tuner, (double)tuner->chunk / 4);
+    }
+    else if (cost <= 0)
+        target = tuner->max;
+    else if (latency <= 0)
+        target = tuner->min;
+    else
+        target = __usb_tuner_clamp(tuner, latency * USB_TUNER_OVERHEAD / cost);
+
+    if (fit && !(tuner->count % USB_TUNER_PROBE) && target > tuner->min)
+        target >>= 1;
+
+    tuner->chunk = target;
+}
+
+
+
+/*
+*   Copy Functions.
+*/
+
+void __usb_copy_config(const usb_copy_config_t *config, usb_copy_config_t *out)
+{
+    memset(out, 0, sizeof(*out));
+    if (config)
+        *out = *config;
+
+    if (!out->min_chunk)
+        out->min_chunk = USB_COPY_CHUNK_MIN;
+    if (!out->max_chunk)
+        out->max_chunk = USB_COPY_CHUNK_MAX;
+
+    // never ask for more than the host moves in one request.
+    usb_caps_t caps;
+    usb_get_host_caps(&caps);
+    if (caps.max_transfer && out->max_chunk > caps.max_transfer)
+        out->max_chunk = caps.max_transfer;
+    if (out->min_chunk > out->max_chunk)
+        out->min_chunk = out->max_chunk;
+}
+
+UsbRet usb_copy_file_from_host(const char *host_path, const char *local_path, const usb_copy_config_t *config, usb_copy_stats_t *stats)
+{
+    if (!host_path || !local_path)
+        return UsbReturnCode_EmptyField;
+
+    usb_copy_config_t cfg;
+    __usb_copy_config(config, &cfg);
+
+    usb_chunk_tuner_t tuner;
+    usb_chunk_tuner_init(&tuner, cfg.min_chunk, cfg.max_chunk);
+
+    usb_copy_stats_t st = {0};
+    const uint64_t start = __usb_time_ns();
+
+    usb_file_t file;
+    UsbRet ret = usb_file_open(&file, host_path, UsbMode_OpenFileReadBytes);
+    if (usb_failed(ret))
+        return ret;
+
+    uint64_t size = 0;
+    uint8_t *buf = NULL;
+    FILE *local = NULL;
+
+    ret = usb_file_get_size(file, &size);
+    if (usb_failed(ret))
+        goto done;
+
+    buf = usb_alloc_aligned(tuner.max);
+    if (!buf)
+    {
+        ret = UsbReturnCode_FailedAllocPool;
+        goto done;
+    }
+
+    local = fopen(local_path, "wb");
+    if (!local)
+    {
+        ret = UsbReturnCode_FailedOpenLocalFile;
+        goto done;
+    }
+
+    while (st.size < size)
+    {
+        const size_t chunk = usb_chunk_tuner_next(&tuner);
+        const size_t todo = size - st.size < chunk ? size - st.size : chunk;
+
+        const uint64_t t0 = __usb_time_ns();
+        ret = usb_file_read(file, buf, todo, st.size);
+        const uint64_t ns = __usb_time_ns() - t0;
+        if (usb_failed(ret))
+            goto done;
+
+        // the tail is smaller than asked for, it would skew the fit.
+        if (todo == chunk)
+            usb_chunk_tuner_report(&tuner, todo, ns);
+
+        if (fwrite(buf, 1, todo, local) != todo)
+        {
+            ret = UsbReturnCode_FailedWriteLocalFile;
+            goto done;
+        }
+
+        st.size += todo;
+        st.usb_ns += ns;
+        st.last_chunk = chunk;
+        if (cfg.progress)
+            cfg.progress(st.size, size, cfg.user);
+    }
+
+done:
+    if (local && fclose(local) && usb_succeeded(ret))
+        ret = UsbReturnCode_FailedWriteLocalFile;
+    usb_free_aligned(buf);
+    usb_file_close(file);
+
+    st.total_ns = __usb_time_ns() - start;
+    if (stats)
+        *stats = st;
+    return ret;
+}
+
+UsbRet usb_copy_file_to_host(const char *local_path, const char *host_path, const usb_copy_config_t *config, usb_copy_stats_t *stats)
+{
+    if (!host_path || !local_path)
+        return UsbReturnCode_EmptyField;
+
+    usb_copy_config_t cfg;
+    __usb_copy_config(config, &cfg);
+
+    usb_chunk_tuner_t tuner;
+    usb_chunk_tuner_init(&tuner, cfg.min_chunk, cfg.max_chunk);
+
+    usb_copy_stats_t st = {0};
+    const uint64_t start = __usb_time_ns();
+
+    FILE *local = fopen(local_path, "rb");
+    if (!local)
+        return UsbReturnCode_FailedOpenLocalFile;
+
+    uint64_t size = 0;
+    if (fseek(local, 0, SEEK_END) || (int64_t)(size = ftell(local)) < 0 || fseek(local, 0, SEEK_SET))
+    {
+        fclose(local);
+        return UsbReturnCode_FailedReadLocalFile;
+    }
+
+    usb_file_t file;
+    UsbRet ret = usb_file_open(&file, host_path, UsbMode_OpenFileWriteBytes);
+    if (usb_failed(ret))
+    {
+        fclose(local);
+        return ret;
+    }
+
+    uint8_t *buf = usb_alloc_aligned(tuner.max);
+    if (!buf)
+    {
+        ret = UsbReturnCode_FailedAllocPool;
+        goto done;
+    }
+
+    while (st.size < size)
+    {
+        const size_t chunk = usb_chunk_tuner_next(&tuner);
+        const size_t todo = size - st.size < chunk ? size - st.size : chunk;
+
+        if (fread(buf, 1, todo, local) != todo)
+        {
+            ret = UsbReturnCode_FailedReadLocalFile;
+            goto done;
+        }
+
+        const uint64_t t0 = __usb_time_ns();
+        ret = usb_file_write(file, buf, todo, st.size);
+        const uint64_t ns = __usb_time_ns() - t0;
+        if (usb_failed(ret))
+            goto done;
+
+        if (todo == chunk)
+            usb_chunk_tuner_report(&tuner, todo, ns);
+
+        st.size += todo;
+        st.usb_ns += ns;
+        st.last_chunk = chunk;
+        if (cfg.progress)
+            cfg.progress(st.size, size, cfg.user);
+    }
+
+done:
+    usb_free_aligned(buf);
+    usb_file_close(file);
+    fclose(local);
+
+    st.total_ns = __usb_time_ns() - start;
+    if (stats)
+        *stats = st;
+    return ret;
+}
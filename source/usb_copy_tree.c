@@ -0,0 +1,502 @@
+/*
+*   TotalJustice
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "nxusb.h"
+#include "nxusb_async.h"
+#include "nxusb_copy.h"
+#include "nxusb_dir.h"
+#include "nxusb_file.h"
+#include "usb_internal.h"
+
+
+typedef enum
+{
+    UsbTreeStep_List,       // listing the host dir, or creating it when copying to the host.
+    UsbTreeStep_Open,
+    UsbTreeStep_Data,
+    UsbTreeStep_Close,
+} UsbTreeStep;
+
+typedef struct usb_tree usb_tree_t;
+typedef struct usb_tree_job usb_tree_job_t;
+
+// a dir or file of the tree, it has at most one request in flight.
+struct usb_tree_job
+{
+    usb_tree_job_t *next;
+    usb_tree_t *tree;
+    bool dir;
+    uint8_t step;
+    char *src;
+    char *dst;
+
+    uint64_t size;
+    uint64_t offset;
+    size_t pending;         // size of the read / write in flight.
+    usb_file_t handle;
+    FILE *local;
+    uint8_t *buf;
+    size_t buf_size;
+    usb_dir_list_t list;
+
+    // set by the completion callback.
+    UsbRet ret;
+    uint64_t value;
+};
+
+typedef struct
+{
+    usb_tree_job_t *head;
+    usb_tree_job_t *tail;
+} usb_tree_queue_t;
+
+struct usb_tree
+{
+    bool to_host;
+    usb_copy_config_t config;
+    usb_copy_tree_stats_t stats;
+    uint64_t found;         // bytes of files found so far.
+    UsbRet ret;             // the first error, nothing new is started once it's set.
+
+    // completed jobs, pushed by the receiver thread and handled on the caller's.
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    usb_tree_queue_t done;
+
+    usb_tree_queue_t dirs;
+    usb_tree_queue_t files;
+    uint32_t active_dirs;
+    uint32_t active_files;
+    size_t memory_used;
+};
+
+
+void __usb_tree_push(usb_tree_queue_t *queue, usb_tree_job_t *job)
+{
+    job->next = NULL;
+    if (queue->tail)
+        queue->tail->next = job;
+    else
+        queue->head = job;
+    queue->tail = job;
+}
+
+usb_tree_job_t *__usb_tree_pop(usb_tree_queue_t *queue)
+{
+    usb_tree_job_t *job = queue->head;
+    if (job)
+    {
+        queue->head = job->next;
+        if (!queue->head)
+            queue->tail = NULL;
+    }
+    return job;
+}
+
+void __usb_tree_free_queue(usb_tree_queue_t *queue)
+{
+    usb_tree_job_t *job;
+    while ((job = __usb_tree_pop(queue)))
+    {
+        free(job->src);
+        free(job);
+    }
+}
+
+// joins a dir and a name, an empty dir is the root of the host device.
+char *__usb_tree_join(const char *dir, const char *name)
+{
+    const size_t dir_len = strlen(dir);
+    const bool slash = dir_len && dir[dir_len - 1] != '/';
+    char *out = malloc(dir_len + slash + strlen(name) + 1);
+    if (out)
+    {
+        memcpy(out, dir, dir_len);
+        out[dir_len] = '/';
+        strcpy(out + dir_len + slash, name);
+    }
+    return out;
+}
+
+// src and dst share one allocation, freed with src.
+usb_tree_job_t *__usb_tree_job(usb_tree_t *tree, bool dir, const char *src_dir, const char *dst_dir, const char *name, uint64_t size)
+{
+    char *src = name ? __usb_tree_join(src_dir, name) : strdup(src_dir);
+    char *dst = name ? __usb_tree_join(dst_dir, name) : strdup(dst_dir);
+    usb_tree_job_t *job = NULL;
+    char *paths = NULL;
+
+    if (src && dst)
+        paths = malloc(strlen(src) + strlen(dst) + 2);
+    if (paths)
+        job = calloc(1, sizeof(*job));
+
+    if (job)
+    {
+        const size_t src_len = strlen(src) + 1;
+        memcpy(paths, src, src_len);
+        strcpy(paths + src_len, dst);
+        job->tree = tree;
+        job->dir = dir;
+        job->src = paths;
+        job->dst = paths + src_len;
+        job->size = size;
+    }
+    else
+        free(paths);
+
+    free(src);
+    free(dst);
+    return job;
+}
+
+void __usb_tree_fail(usb_tree_t *tree, UsbRet ret)
+{
+    if (usb_succeeded(tree->ret))
+        tree->ret = ret;
+}
+
+void __usb_tree_done(UsbRet ret, uint64_t value, void *user)
+{
+    usb_tree_job_t *job = user;
+    usb_tree_t *tree = job->tree;
+
+    pthread_mutex_lock(&tree->lock);
+    job->ret = ret;
+    job->value = value;
+    __usb_tree_push(&tree->done, job);
+    pthread_cond_signal(&tree->cond);
+    pthread_mutex_unlock(&tree->lock);
+}
+
+// hands the job's request to the async layer, or completes it now if it couldn't be queued.
+void __usb_tree_then(usb_tree_job_t *job, uint8_t step, UsbRet ret, usb_async_t *req)
+{
+    job->step = step;
+    if (usb_succeeded(ret))
+        usb_async_then(req, __usb_tree_done, job);
+    else
+        __usb_tree_done(ret, 0, job);
+}
+
+void __usb_tree_finish(usb_tree_job_t *job)
+{
+    usb_tree_t *tree = job->tree;
+
+    if (job->dir)
+        tree->active_dirs--;
+    else
+    {
+        if (job->local && fclose(job->local) && !tree->to_host)
+            __usb_tree_fail(tree, UsbReturnCode_FailedWriteLocalFile);
+        tree->active_files--;
+        tree->memory_used -= job->buf_size;
+        usb_free_aligned(job->buf);
+    }
+
+    usb_dir_list_free(&job->list);
+    free(job->src);
+    free(job);
+}
+
+void __usb_tree_close(usb_tree_job_t *job)
+{
+    usb_async_t *req = NULL;
+    const UsbRet ret = usb_async_file_close(job->handle, &req);
+    __usb_tree_then(job, UsbTreeStep_Close, ret, req);
+}
+
+// sends the next read / write of a file, or closes it once it's all moved.
+void __usb_tree_next_chunk(usb_tree_job_t *job)
+{
+    usb_tree_t *tree = job->tree;
+
+    if (job->offset >= job->size || usb_failed(tree->ret))
+    {
+        __usb_tree_close(job);
+        return;
+    }
+
+    job->pending = job->size - job->offset < job->buf_size ? job->size - job->offset : job->buf_size;
+
+    usb_async_t *req = NULL;
+    UsbRet ret;
+    if (tree->to_host)
+    {
+        if (fread(job->buf, 1, job->pending, job->local) != job->pending)
+        {
+            __usb_tree_fail(tree, UsbReturnCode_FailedReadLocalFile);
+            __usb_tree_close(job);
+            return;
+        }
+        ret = usb_async_file_write(job->handle, job->buf, job->pending, job->offset, &req);
+    }
+    else
+        ret = usb_async_file_read(job->handle, job->buf, job->pending, job->offset, &req);
+
+    __usb_tree_then(job, UsbTreeStep_Data, ret, req);
+}
+
+// queues a job for every entry of a dir.
+UsbRet __usb_tree_add_entry(usb_tree_t *tree, const usb_tree_job_t *parent, const char *name, bool dir, uint64_t size)
+{
+    usb_tree_job_t *job = __usb_tree_job(tree, dir, parent->src, parent->dst, name, size);
+    if (!job)
+        return UsbReturnCode_FailedAllocPool;
+
+    if (dir)
+        __usb_tree_push(&tree->dirs, job);
+    else
+    {
+        tree->found += size;
+        __usb_tree_push(&tree->files, job);
+    }
+    return UsbReturnCode_Success;
+}
+
+UsbRet __usb_tree_add_host_entries(usb_tree_t *tree, const usb_tree_job_t *job)
+{
+    for (uint64_t i = 0; i < job->list.count; i++)
+    {
+        const usb_dir_entry_t *entry = &job->list.entries[i];
+        const bool dir = entry->entry_type == UsbFileEntryType_Dir;
+        UsbRet ret = __usb_tree_add_entry(tree, job, entry->name, dir, dir ? 0 : entry->file_size);
+        if (usb_failed(ret))
+            return ret;
+    }
+    return UsbReturnCode_Success;
+}
+
+UsbRet __usb_tree_add_local_entries(usb_tree_t *tree, const usb_tree_job_t *job)
+{
+    DIR *dir = opendir(job->src);
+    if (!dir)
+        return UsbReturnCode_FailedOpenLocalDir;
+
+    UsbRet ret = UsbReturnCode_Success;
+    struct dirent *d;
+    while (usb_succeeded(ret) && (d = readdir(dir)))
+    {
+        if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+            continue;
+
+        char *path = __usb_tree_join(job->src, d->d_name);
+        struct stat st;
+        if (!path)
+            ret = UsbReturnCode_FailedAllocPool;
+        else if (stat(path, &st))
+            ret = UsbReturnCode_FailedReadLocalFile;
+        else if (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))
+            ret = __usb_tree_add_entry(tree, job, d->d_name, S_ISDIR(st.st_mode), S_ISDIR(st.st_mode) ? 0 : st.st_size);
+        free(path);
+    }
+
+    closedir(dir);
+    return ret;
+}
+
+void __usb_tree_start_dir(usb_tree_job_t *job)
+{
+    usb_tree_t *tree = job->tree;
+    usb_async_t *req = NULL;
+    UsbRet ret;
+
+    tree->active_dirs++;
+    if (tree->to_host)
+        ret = usb_async_path(UsbMode_TouchDir, job->dst, &req);
+    else if (mkdir(job->dst, 0777) && errno != EEXIST)
+        ret = UsbReturnCode_FailedTouchLocalDir;
+    else
+        ret = usb_async_dir_list(job->src, &job->list, &req);
+
+    __usb_tree_then(job, UsbTreeStep_List, ret, req);
+}
+
+void __usb_tree_start_file(usb_tree_job_t *job)
+{
+    usb_tree_t *tree = job->tree;
+    usb_async_t *req = NULL;
+    UsbRet ret = UsbReturnCode_Success;
+
+    tree->active_files++;
+    job->buf_size = job->size < USB_COPY_TREE_CHUNK ? job->size : USB_COPY_TREE_CHUNK;
+    if (job->buf_size > tree->config.max_chunk)
+        job->buf_size = tree->config.max_chunk;
+    tree->memory_used += job->buf_size;
+
+    job->local = fopen(tree->to_host ? job->src : job->dst, tree->to_host ? "rb" : "wb");
+    if (!job->local)
+        ret = UsbReturnCode_FailedOpenLocalFile;
+    else if (job->buf_size && !(job->buf = usb_alloc_aligned(job->buf_size)))
+        ret = UsbReturnCode_FailedAllocPool;
+
+    if (usb_succeeded(ret))
+        ret = usb_async_file_open(tree->to_host ? job->dst : job->src, tree->to_host ? UsbMode_OpenFileWriteBytes : UsbMode_OpenFileReadBytes, &req);
+
+    __usb_tree_then(job, UsbTreeStep_Open, ret, req);
+}
+
+void __usb_tree_step(usb_tree_job_t *job)
+{
+    usb_tree_t *tree = job->tree;
+
+    switch (job->step)
+    {
+        case UsbTreeStep_List:
+            if (usb_succeeded(job->ret))
+                job->ret = tree->to_host ? __usb_tree_add_local_entries(tree, job) : __usb_tree_add_host_entries(tree, job);
+            if (usb_succeeded(job->ret))
+                tree->stats.dirs++;
+            else
+                __usb_tree_fail(tree, job->ret);
+            __usb_tree_finish(job);
+            break;
+
+        case UsbTreeStep_Open:
+            if (usb_failed(job->ret))
+            {
+                __usb_tree_fail(tree, job->ret);
+                __usb_tree_finish(job);
+                break;
+            }
+
+            job->handle = (usb_file_t)job->value;
+            __usb_tree_next_chunk(job);
+            break;
+
+        case UsbTreeStep_Data:
+            if (usb_succeeded(job->ret) && !tree->to_host && fwrite(job->buf, 1, job->pending, job->local) != job->pending)
+                job->ret = UsbReturnCode_FailedWriteLocalFile;
+
+            if (usb_failed(job->ret))
+                __usb_tree_fail(tree, job->ret);
+            else
+            {
+                job->offset += job->pending;
+                tree->stats.size += job->pending;
+                if (tree->config.progress)
+                    tree->config.progress(tree->stats.size, tree->found, tree->config.user);
+            }
+
+            __usb_tree_next_chunk(job);
+            break;
+
+        case UsbTreeStep_Close:
+            if (usb_failed(job->ret))
+                __usb_tree_fail(tree, job->ret);
+            else if (job->offset >= job->size)
+                tree->stats.files++;
+            __usb_tree_finish(job);
+            break;
+    }
+}
+
+// files wait while the memory is spoken for, unless nothing else is in flight.
+bool __usb_tree_can_start_file(const usb_tree_t *tree)
+{
+    const usb_tree_job_t *job = tree->files.head;
+    if (!job || tree->active_files >= USB_COPY_TREE_FILES)
+        return false;
+
+    const size_t size = job->size < USB_COPY_TREE_CHUNK ? job->size : USB_COPY_TREE_CHUNK;
+    return !tree->active_files || tree->memory_used + size <= tree->config.max_chunk;
+}
+
+UsbRet __usb_tree_run(bool to_host, const char *src, const char *dst, const usb_copy_config_t *config, usb_copy_tree_stats_t *stats)
+{
+    if (!src || !dst)
+        return UsbReturnCode_EmptyField;
+
+    const uint64_t start = __usb_time_ns();
+    usb_tree_t tree = {0};
+    tree.to_host = to_host;
+    if (config)
+        tree.config = *config;
+    if (!tree.config.max_chunk)
+        tree.config.max_chunk = USB_COPY_CHUNK_MAX;
+
+    // the tree needs the async layer, but leaves it as it found it.
+    const bool started = !__usb_async_running();
+    if (started)
+    {
+        UsbRet ret = usb_async_start(USB_COPY_TREE_FILES + USB_COPY_TREE_DIRS);
+        if (usb_failed(ret))
+            return ret;
+    }
+
+    pthread_mutex_init(&tree.lock, NULL);
+    pthread_cond_init(&tree.cond, NULL);
+
+    usb_tree_job_t *root = __usb_tree_job(&tree, true, src, dst, NULL, 0);
+    if (root)
+        __usb_tree_push(&tree.dirs, root);
+    else
+        tree.ret = UsbReturnCode_FailedAllocPool;
+
+    for (;;)
+    {
+        // dirs first, so the walk stays ahead of the data.
+        while (usb_succeeded(tree.ret) && tree.dirs.head && tree.active_dirs < USB_COPY_TREE_DIRS)
+            __usb_tree_start_dir(__usb_tree_pop(&tree.dirs));
+        while (usb_succeeded(tree.ret) && __usb_tree_can_start_file(&tree))
+            __usb_tree_start_file(__usb_tree_pop(&tree.files));
+
+        if (!tree.active_dirs && !tree.active_files)
+            break;
+
+        pthread_mutex_lock(&tree.lock);
+        while (!tree.done.head)
+            pthread_cond_wait(&tree.cond, &tree.lock);
+        usb_tree_queue_t done = tree.done;
+        tree.done.head = tree.done.tail = NULL;
+        pthread_mutex_unlock(&tree.lock);
+
+        usb_tree_job_t *job;
+        while ((job = __usb_tree_pop(&done)))
+            __usb_tree_step(job);
+    }
+
+    // whatever didn't get started because of an error.
+    __usb_tree_free_queue(&tree.dirs);
+    __usb_tree_free_queue(&tree.files);
+    pthread_cond_destroy(&tree.cond);
+    pthread_mutex_destroy(&tree.lock);
+
+    if (started)
+    {
+        const UsbRet ret = usb_async_stop();
+        __usb_tree_fail(&tree, ret);
+    }
+
+    tree.stats.total_ns = __usb_time_ns() - start;
+    if (stats)
+        *stats = tree.stats;
+    return tree.ret;
+}
+
+
+
+/*
+*   Tree Copy Functions.
+*/
+
+UsbRet usb_copy_dir_from_host(const char *host_path, const char *local_path, const usb_copy_config_t *config, usb_copy_tree_stats_t *stats)
+{
+    return __usb_tree_run(false, host_path, local_path, config, stats);
+}
+
+UsbRet usb_copy_dir_to_host(const char *local_path, const char *host_path, const usb_copy_config_t *config, usb_copy_tree_stats_t *stats)
+{
+    return __usb_tree_run(true, local_path, host_path, config, stats);
+}
@@ -0,0 +1,310 @@
+/*
+*   TotalJustice
+*/
+
+// rsync style delta encoding, shared by the library and the host tools.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "nxusb.h"
+#include "nxusb_delta.h"
+#include "nxusb_hash.h"
+
+#define USB_DELTA_NONE  UINT32_MAX
+
+
+typedef struct
+{
+    const usb_delta_sig_t *sigs;
+    uint32_t *head;             // first signature of each bucket.
+    uint32_t *next;             // next signature in the same bucket.
+    uint32_t bits;
+    usb_delta_emit_t emit;
+    void *user;
+
+    // consecutive copies are sent as one op.
+    uint64_t run_index;
+    uint32_t run_count;
+} usb_delta_gen_t;
+
+
+uint32_t __usb_delta_bucket(uint32_t weak, uint32_t bits)
+{
+    return (weak * 0x9E3779B1) >> (32 - bits);
+}
+
+void __usb_delta_strong(const uint8_t *data, size_t size, uint8_t out[USB_DELTA_STRONG_SIZE])
+{
+    uint8_t digest[USB_SHA256_SIZE];
+    usb_sha256(data, size, digest);
+    memcpy(out, digest, USB_DELTA_STRONG_SIZE);
+}
+
+UsbRet __usb_delta_flush_run(usb_delta_gen_t *gen)
+{
+    if (!gen->run_count)
+        return UsbReturnCode_Success;
+
+    const usb_delta_op_t op = { UsbDeltaOp_Copy, {0}, gen->run_count, gen->run_index };
+    gen->run_count = 0;
+    return gen->emit(gen->user, &op, NULL);
+}
+
+UsbRet __usb_delta_literal(usb_delta_gen_t *gen, const uint8_t *data, size_t size)
+{
+    if (!size)
+        return UsbReturnCode_Success;
+
+    UsbRet ret = __usb_delta_flush_run(gen);
+    if (ret != UsbReturnCode_Success)
+        return ret;
+
+    const usb_delta_op_t op = { UsbDeltaOp_Literal, {0}, size, 0 };
+    return gen->emit(gen->user, &op, data);
+}
+
+UsbRet __usb_delta_copy(usb_delta_gen_t *gen, uint32_t index)
+{
+    if (gen->run_count && gen->run_index + gen->run_count == index && gen->run_count < UINT32_MAX)
+    {
+        gen->run_count++;
+        return UsbReturnCode_Success;
+    }
+
+    UsbRet ret = __usb_delta_flush_run(gen);
+    gen->run_index = index;
+    gen->run_count = 1;
+    return ret;
+}
+
+// returns the basis block that matches data, or USB_DELTA_NONE.
+uint32_t __usb_delta_find(const usb_delta_gen_t *gen, uint32_t weak, const uint8_t *data, size_t size)
+{
+    const uint64_t expected = gen->run_index + gen->run_count;
+    uint8_t strong[USB_DELTA_STRONG_SIZE];
+    bool have_strong = false;
+    uint32_t found = USB_DELTA_NONE;
+
+    for (uint32_t i = gen->head[__usb_delta_bucket(weak, gen->bits)]; i != USB_DELTA_NONE; i = gen->next[i])
+    {
+        if (gen->sigs[i].weak != weak)
+            continue;
+
+        if (!have_strong)
+        {
+            __usb_delta_strong(data, size, strong);
+            have_strong = true;
+        }
+
+        if (memcmp(gen->sigs[i].strong, strong, sizeof(strong)))
+            continue;
+
+        // a block repeated in the basis (zeroes for one), prefer the one that carries on the current run.
+        if (found == USB_DELTA_NONE || i == expected)
+            found = i;
+        if (i == expected)
+            break;
+    }
+
+    return found;
+}
+
+
+
+/*
+*   Delta Functions.
+*/
+
+uint32_t usb_delta_block_size(uint64_t file_size)
+{
+    uint32_t block_size = USB_DELTA_BLOCK_MIN;
+    while (block_size < USB_DELTA_BLOCK_MAX &&
+        ((uint64_t)block_size * block_size < file_size || file_size / block_size > USB_DELTA_SIGS_MAX))
+        block_size <<= 1;
+    return block_size;
+}
+
+uint32_t usb_delta_weak(const uint8_t *data, size_t size)
+{
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        a += data[i];
+        b += (uint32_t)(size - i) * data[i];
+    }
+    return (a & 0xFFFF) | (b << 16);
+}
+
+UsbRet usb_delta_sign(usb_delta_read_t read, void *user, uint32_t block_size, usb_delta_sig_t *out, size_t max, size_t *count)
+{
+    if (!read || !count || (max && !out) || block_size < USB_DELTA_BLOCK_MIN || block_size > USB_DELTA_BLOCK_MAX)
+        return UsbReturnCode_BadDelta;
+
+    uint8_t *buf = malloc(block_size);
+    if (!buf)
+        return UsbReturnCode_FailedAllocPool;
+
+    UsbRet ret = UsbReturnCode_Success;
+    *count = 0;
+
+    // a short last block is left unsigned, it goes over as a literal.
+    while (*count < max)
+    {
+        size_t size = 0, got = 1;
+        while (size < block_size && got)
+        {
+            ret = read(user, buf + size, block_size - size, &got);
+            if (ret != UsbReturnCode_Success)
+                goto done;
+            size += got;
+        }
+
+        if (size < block_size)
+            break;
+
+        out[*count].weak = usb_delta_weak(buf, block_size);
+        __usb_delta_strong(buf, block_size, out[*count].strong);
+        (*count)++;
+    }
+
+done:
+    free(buf);
+    return ret;
+}
+
+UsbRet usb_delta_generate(const usb_delta_sig_t *sigs, size_t count, uint32_t block_size,
+    usb_delta_read_t read, void *read_user, usb_delta_emit_t emit, void *emit_user)
+{
+    if (!read || !emit || (count && !sigs) || count > USB_DELTA_SIGS_MAX ||
+        block_size < USB_DELTA_BLOCK_MIN || block_size > USB_DELTA_BLOCK_MAX)
+        return UsbReturnCode_BadDelta;
+
+    usb_delta_gen_t gen = {0};
+    gen.sigs = sigs;
+    gen.emit = emit;
+    gen.user = emit_user;
+    gen.bits = 4;
+    while (((size_t)1 << gen.bits) < count * 2)
+        gen.bits++;
+
+    gen.head = malloc(sizeof(uint32_t) << gen.bits);
+    gen.next = malloc(sizeof(uint32_t) * (count ? count : 1));
+    uint8_t *buf = malloc(USB_DELTA_LITERAL_MAX);
+    UsbRet ret = UsbReturnCode_Success;
+
+    if (!gen.head || !gen.next || !buf)
+    {
+        ret = UsbReturnCode_FailedAllocPool;
+        goto done;
+    }
+
+    // filled backwards so each bucket lists its blocks in file order.
+    memset(gen.head, 0xFF, sizeof(uint32_t) << gen.bits);
+    for (size_t i = count; i--;)
+    {
+        const uint32_t bucket = __usb_delta_bucket(sigs[i].weak, gen.bits);
+        gen.next[i] = gen.head[bucket];
+        gen.head[bucket] = i;
+    }
+
+    usb_sha256_t sha;
+    usb_sha256_init(&sha);
+
+    // [start, pos) is literal data not yet sent, [pos, pos + block_size) is the window being matched.
+    size_t start = 0, pos = 0, end = 0;
+    uint64_t total = 0;
+    bool eof = false, have_weak = false;
+    uint32_t a = 0, b = 0;
+
+    for (;;)
+    {
+        if (end - pos < block_size && !eof)
+        {
+            // send the pending literal so the buffer can be refilled from the window on.
+            ret = __usb_delta_literal(&gen, buf + start, pos - start);
+            if (ret != UsbReturnCode_Success)
+                goto done;
+
+            memmove(buf, buf + pos, end - pos);
+            end -= pos;
+            start = pos = 0;
+
+            while (end < USB_DELTA_LITERAL_MAX && !eof)
+            {
+                size_t got;
+                ret = read(read_user, buf + end, USB_DELTA_LITERAL_MAX - end, &got);
+                if (ret != UsbReturnCode_Success)
+                    goto done;
+
+                usb_sha256_update(&sha, buf + end, got);
+                eof = !got;
+                end += got;
+                total += got;
+            }
+            continue;
+        }
+
+        // what's left is shorter than a block.
+        if (end - pos < block_size)
+            break;
+
+        if (!have_weak)
+        {
+            a = b = 0;
+            for (size_t i = 0; i < block_size; i++)
+            {
+                a += buf[pos + i];
+                b += (block_size - i) * buf[pos + i];
+            }
+            have_weak = true;
+        }
+
+        const uint32_t weak = (a & 0xFFFF) | (b << 16);
+        const uint32_t found = count ? __usb_delta_find(&gen, weak, buf + pos, block_size) : USB_DELTA_NONE;
+        if (found != USB_DELTA_NONE)
+        {
+            ret = __usb_delta_literal(&gen, buf + start, pos - start);
+            if (ret == UsbReturnCode_Success)
+                ret = __usb_delta_copy(&gen, found);
+            if (ret != UsbReturnCode_Success)
+                goto done;
+
+            pos += block_size;
+            start = pos;
+            have_weak = false;
+            continue;
+        }
+
+        // roll the window on a byte, the checksum is redone after a refill.
+        if (pos + block_size < end)
+        {
+            const uint32_t out = buf[pos];
+            a += buf[pos + block_size] - out;
+            b += a - block_size * out;
+        }
+        else
+            have_weak = false;
+        pos++;
+    }
+
+    ret = __usb_delta_literal(&gen, buf + start, end - start);
+    if (ret == UsbReturnCode_Success)
+        ret = __usb_delta_flush_run(&gen);
+    if (ret == UsbReturnCode_Success)
+    {
+        uint8_t digest[USB_SHA256_SIZE];
+        usb_sha256_final(&sha, digest);
+
+        const usb_delta_op_t op = { UsbDeltaOp_End, {0}, sizeof(digest), total };
+        ret = emit(emit_user, &op, digest);
+    }
+
+done:
+    free(buf);
+    free(gen.next);
+    free(gen.head);
+    return ret;
+}
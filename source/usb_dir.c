@@ -0,0 +1,393 @@
+/*
+*   TotalJustice
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "nxusb.h"
+#include "nxusb_dir.h"
+#include "usb_internal.h"
+
+_Static_assert(sizeof(usb_dir_list_header_t) == 0x10, "usb_dir_list_header_t must match the host");
+_Static_assert(sizeof(usb_dir_entry_packed_t) == 0x10, "usb_dir_entry_packed_t must match the host");
+_Static_assert(offsetof(usb_dir_entry_packed_t, entry_type) == 0x8, "usb_dir_entry_packed_t must match the host");
+_Static_assert(offsetof(usb_dir_entry_packed_t, name_len) == 0xC, "usb_dir_entry_packed_t must match the host");
+_Static_assert(sizeof(usb_dir_cursor_info_t) == 0x10, "usb_dir_cursor_info_t must match the host");
+_Static_assert(offsetof(usb_dir_cursor_info_t, total) == 0x8, "usb_dir_cursor_info_t must match the host");
+_Static_assert(sizeof(usb_dir_cursor_read_t) == 0x8, "usb_dir_cursor_read_t must match the host");
+_Static_assert(offsetof(usb_dir_cursor_read_t, max_entries) == 0x4, "usb_dir_cursor_read_t must match the host");
+_Static_assert(offsetof(usb_dir_query_t, offset) == 0x10, "usb_dir_query_t must match the host");
+_Static_assert(offsetof(usb_dir_query_t, catagory_mask) == 0x18, "usb_dir_query_t must match the host");
+_Static_assert(offsetof(usb_dir_query_t, ext_mask) == 0x20, "usb_dir_query_t must match the host");
+_Static_assert(offsetof(usb_dir_query_t, prefix) == 0x40, "usb_dir_query_t must match the host");
+
+
+/*
+*   Compact Dir Functions.
+*/
+
+// arena size needed to decode size bytes of count entries.
+// names shrink by the header and grow by a null terminator, so this is an upper bound.
+size_t __usb_dir_arena_size(size_t size, uint64_t count)
+{
+    return count * sizeof(usb_dir_entry_t) + size + 1;
+}
+
+// decodes into a caller owned arena of at least __usb_dir_arena_size bytes.
+UsbRet __usb_dir_list_decode_into(const void *data, size_t size, uint64_t count, uint8_t *arena, usb_dir_list_t *out)
+{
+    memset(out, 0, sizeof(*out));
+
+    const size_t entries_size = count * sizeof(usb_dir_entry_t);
+
+    usb_dir_entry_t *entries = (usb_dir_entry_t *)arena;
+    char *names = (char *)arena + entries_size;
+    const uint8_t *src = data;
+    size_t offset = 0;
+
+    for (uint64_t i = 0; i < count; i++)
+    {
+        usb_dir_entry_packed_t packed;
+        if (offset + sizeof(packed) > size)
+            break;
+
+        memcpy(&packed, src + offset, sizeof(packed));
+        packed.file_size = __usb_le64(packed.file_size);
+        packed.name_len = __usb_le16(packed.name_len);
+        offset += sizeof(packed);
+        if (offset + packed.name_len > size)
+            break;
+
+        memcpy(names, src + offset, packed.name_len);
+        names[packed.name_len] = '\0';
+        offset += packed.name_len;
+
+        entries[i].name = names;
+        entries[i].file_size = packed.file_size;
+        entries[i].name_len = packed.name_len;
+        entries[i].entry_type = packed.entry_type;
+        entries[i].ext_type = packed.ext_type;
+        entries[i].catagory = packed.catagory;
+        entries[i].size_type = packed.size_type;
+        names += packed.name_len + 1;
+        out->count++;
+    }
+
+    if (out->count != count)
+    {
+        memset(out, 0, sizeof(*out));
+        return UsbReturnCode_FailedReadDir;
+    }
+
+    out->entries = entries;
+    return UsbReturnCode_Success;
+}
+
+UsbRet usb_dir_list_decode(const void *data, size_t size, uint64_t count, usb_dir_list_t *out)
+{
+    if ((!data && size) || !out)
+        return UsbReturnCode_EmptyField;
+
+    memset(out, 0, sizeof(*out));
+    if (count > size / sizeof(usb_dir_entry_packed_t))
+        return UsbReturnCode_FailedReadDir;
+
+    uint8_t *arena = malloc(__usb_dir_arena_size(size, count));
+    if (!arena)
+        return UsbReturnCode_FailedAllocPool;
+
+    UsbRet ret = __usb_dir_list_decode_into(data, size, count, arena, out);
+    if (usb_failed(ret))
+    {
+        free(arena);
+        return ret;
+    }
+
+    out->arena = arena;
+    return UsbReturnCode_Success;
+}
+
+UsbRet __usb_dir_read_header(usb_dir_list_header_t *header)
+{
+    UsbRet ret = usb_read(header, sizeof(*header));
+    if (usb_failed(ret))
+        return ret;
+
+    header->count = __usb_le64(header->count);
+    header->size = __usb_le64(header->size);
+    return UsbReturnCode_Success;
+}
+
+// reads the result and the compact listing that follows it, data is as in __usb_dir_list_fetch.
+UsbRet __usb_dir_list_recv(usb_dir_list_header_t *header, void **data)
+{
+    UsbRet ret;
+    *data = NULL;
+
+    ret = usb_get_result();
+    if (usb_failed(ret))
+        return ret;
+
+    ret = __usb_dir_read_header(header);
+    if (usb_failed(ret) || !header->size)
+        return ret;
+
+    *data = usb_alloc_aligned(header->size);
+    if (!*data)
+    {
+        ret = __usb_discard(header->size);
+        return usb_failed(ret) ? ret : UsbReturnCode_FailedAllocPool;
+    }
+
+    ret = usb_read(*data, header->size);
+    if (usb_failed(ret))
+    {
+        usb_free_aligned(*data);
+        *data = NULL;
+    }
+    return ret;
+}
+
+UsbRet __usb_dir_list_fetch(const char *path, usb_dir_list_header_t *header, void **data)
+{
+    if (!usb_host_has_caps(UsbCap_DirCompact))
+        return UsbReturnCode_UnsupportedByHost;
+
+    size_t size = strlen(path);
+    if (size >= USB_FILE_NAME_MAX)
+        return UsbReturnCode_FileNameTooLarge;
+
+    UsbRet ret;
+    *data = NULL;
+
+    ret = __usb_request(UsbMode_ReadDirCompact, size, path, size);
+    if (usb_failed(ret))
+        return ret;
+
+    return __usb_dir_list_recv(header, data);
+}
+
+UsbRet usb_read_dir_compact(const char *path, usb_dir_list_t *out)
+{
+    if (!path || !out)
+        return UsbReturnCode_EmptyField;
+
+    if (__usb_cache_enabled())
+        return __usb_cache_list(path, out);
+
+    usb_dir_list_header_t header;
+    void *data;
+
+    UsbRet ret = __usb_dir_list_fetch(path, &header, &data);
+    if (usb_failed(ret))
+        return ret;
+
+    ret = usb_dir_list_decode(data, header.size, header.count, out);
+    usb_free_aligned(data);
+    return ret;
+}
+
+void usb_dir_list_free(usb_dir_list_t *list)
+{
+    if (!list)
+        return;
+
+    free(list->arena);
+    memset(list, 0, sizeof(*list));
+}
+
+
+
+/*
+*   Dir Query Functions.
+*/
+
+UsbRet usb_dir_query(const char *path, const usb_dir_query_t *query, usb_dir_list_t *out)
+{
+    if (!path || !query || !out)
+        return UsbReturnCode_EmptyField;
+
+    if (!usb_host_has_caps(UsbCap_DirQuery))
+        return UsbReturnCode_UnsupportedByHost;
+
+    const size_t size = strlen(path);
+    if (size >= USB_FILE_NAME_MAX)
+        return UsbReturnCode_FileNameTooLarge;
+
+    if (!memchr(query->prefix, 0, sizeof(query->prefix)))
+        return UsbReturnCode_FileNameTooLarge;
+
+    struct
+    {
+        usb_dir_query_t query;
+        char path[USB_FILE_NAME_MAX];
+    } buf = { *query, {0} };
+    memcpy(buf.path, path, size);
+    buf.query.min_size = __usb_le64(query->min_size);
+    buf.query.max_size = __usb_le64(query->max_size);
+    buf.query.offset = __usb_le32(query->offset);
+    buf.query.max_entries = __usb_le32(query->max_entries);
+
+    UsbRet ret = __usb_request(UsbMode_QueryDir, sizeof(buf.query) + size, &buf, sizeof(buf.query) + size);
+    if (usb_failed(ret))
+        return ret;
+
+    usb_dir_list_header_t header;
+    void *data;
+
+    ret = __usb_dir_list_recv(&header, &data);
+    if (usb_failed(ret))
+        return ret;
+
+    ret = usb_dir_list_decode(data, header.size, header.count, out);
+    usb_free_aligned(data);
+    return ret;
+}
+
+void usb_dir_query_add_ext(usb_dir_query_t *query, uint8_t ext_type)
+{
+    query->ext_mask[ext_type / 8] |= 1 << (ext_type % 8);
+}
+
+void usb_dir_query_add_catagory(usb_dir_query_t *query, uint8_t catagory)
+{
+    if (catagory < 8)
+        query->catagory_mask |= 1 << catagory;
+}
+
+
+
+/*
+*   Dir Cursor Functions.
+*/
+
+struct usb_dir_cursor
+{
+    uint32_t id;
+    uint32_t page_size;
+    uint64_t total;
+    uint8_t *data;          // packed page as it comes off the wire.
+    size_t data_size;
+    uint8_t *arena;         // decoded page.
+};
+
+UsbRet __usb_dir_cursor_open(const char *path, size_t size, usb_dir_cursor_t *cursor)
+{
+    if (!usb_host_has_caps(UsbCap_DirCompact))
+        return UsbReturnCode_UnsupportedByHost;
+
+    UsbRet ret = __usb_request(UsbMode_OpenDirCursor, size, path, size);
+    if (usb_failed(ret))
+        return ret;
+
+    ret = usb_get_result();
+    if (usb_failed(ret))
+        return ret;
+
+    usb_dir_cursor_info_t info;
+    ret = usb_read(&info, sizeof(info));
+    if (usb_failed(ret))
+        return ret;
+
+    cursor->id = __usb_le32(info.cursor);
+    cursor->total = __usb_le64(info.total);
+    return UsbReturnCode_Success;
+}
+
+void __usb_dir_cursor_free(usb_dir_cursor_t *cursor)
+{
+    usb_free_aligned(cursor->data);
+    free(cursor->arena);
+    free(cursor);
+}
+
+UsbRet usb_dir_cursor_open(const char *path, uint32_t page_size, usb_dir_cursor_t **out)
+{
+    if (!path || !page_size || !out)
+        return UsbReturnCode_EmptyField;
+
+    size_t size = strlen(path);
+    if (size >= USB_FILE_NAME_MAX)
+        return UsbReturnCode_FileNameTooLarge;
+
+    usb_dir_cursor_t *cursor = calloc(1, sizeof(usb_dir_cursor_t));
+    if (!cursor)
+        return UsbReturnCode_FailedAllocPool;
+
+    cursor->page_size = page_size;
+    cursor->data_size = page_size * (sizeof(usb_dir_entry_packed_t) + USB_FILE_NAME_MAX);
+    cursor->data = usb_alloc_aligned(cursor->data_size);
+    cursor->arena = malloc(__usb_dir_arena_size(cursor->data_size, page_size));
+
+    UsbRet ret = UsbReturnCode_FailedAllocPool;
+    if (cursor->data && cursor->arena)
+        ret = __usb_dir_cursor_open(path, size, cursor);
+
+    if (usb_failed(ret))
+    {
+        __usb_dir_cursor_free(cursor);
+        return ret;
+    }
+
+    *out = cursor;
+    return UsbReturnCode_Success;
+}
+
+uint64_t usb_dir_cursor_total(const usb_dir_cursor_t *cursor)
+{
+    return cursor ? cursor->total : 0;
+}
+
+UsbRet usb_dir_cursor_next(usb_dir_cursor_t *cursor, usb_dir_list_t *page)
+{
+    if (!cursor || !page)
+        return UsbReturnCode_EmptyField;
+
+    memset(page, 0, sizeof(*page));
+
+    const usb_dir_cursor_read_t read = { __usb_le32(cursor->id), __usb_le32(cursor->page_size) };
+    UsbRet ret = __usb_request(UsbMode_ReadDirCursor, sizeof(read), &read, sizeof(read));
+    if (usb_failed(ret))
+        return ret;
+
+    ret = usb_get_result();
+    if (usb_failed(ret))
+        return ret;
+
+    usb_dir_list_header_t header;
+    ret = __usb_dir_read_header(&header);
+    if (usb_failed(ret))
+        return ret;
+
+    // the host never sends more than asked for, but don't trust it with the buffer.
+    if (header.count > cursor->page_size || header.size > cursor->data_size)
+    {
+        ret = __usb_discard(header.size);
+        return usb_failed(ret) ? ret : UsbReturnCode_FailedReadDir;
+    }
+
+    if (header.size)
+    {
+        ret = usb_read(cursor->data, header.size);
+        if (usb_failed(ret))
+            return ret;
+    }
+
+    return __usb_dir_list_decode_into(cursor->data, header.size, header.count, cursor->arena, page);
+}
+
+void usb_dir_cursor_close(usb_dir_cursor_t *cursor)
+{
+    if (!cursor)
+        return;
+
+    const uint32_t id = __usb_le32(cursor->id);
+    if (usb_succeeded(__usb_request(UsbMode_CloseDirCursor, sizeof(id), &id, sizeof(id))))
+        usb_get_result();
+
+    __usb_dir_cursor_free(cursor);
+}
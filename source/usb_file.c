@@ -0,0 +1,123 @@
+/*
+*   TotalJustice
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "nxusb.h"
+#include "nxusb_file.h"
+#include "usb_internal.h"
+
+_Static_assert(sizeof(usb_file_open_t) == 0x8, "usb_file_open_t must match the host");
+_Static_assert(sizeof(usb_file_io_t) == 0x18, "usb_file_io_t must match the host");
+_Static_assert(offsetof(usb_file_io_t, size) == 0x8, "usb_file_io_t must match the host");
+_Static_assert(offsetof(usb_file_io_t, offset) == 0x10, "usb_file_io_t must match the host");
+
+
+UsbRet __usb_file_handle_io(uint8_t mode, usb_file_t file, size_t size, uint64_t offset, const void *data)
+{
+    const usb_file_io_t io = { __usb_le32(file), 0, __usb_le64(size), __usb_le64(offset) };
+    return __usb_request_ex(mode, 0, 0, 0, &io, sizeof(io), data, data ? size : 0);
+}
+
+
+
+/*
+*   File Handle Functions.
+*/
+
+UsbRet usb_file_open(usb_file_t *out, const char *path, uint8_t mode)
+{
+    if (!out || !path)
+        return UsbReturnCode_EmptyField;
+
+    if (!usb_host_has_caps(UsbCap_FileHandles))
+        return UsbReturnCode_UnsupportedByHost;
+
+    const size_t len = strlen(path);
+    if (len >= USB_FILE_NAME_MAX)
+        return UsbReturnCode_FileNameTooLarge;
+
+    // the header and path go out in one transfer.
+    struct
+    {
+        usb_file_open_t header;
+        char path[USB_FILE_NAME_MAX];
+    } request = { { mode, {0} }, {0} };
+    memcpy(request.path, path, len);
+
+    UsbRet ret = __usb_request(UsbMode_OpenFileHandle, sizeof(request.header) + len, &request, sizeof(request.header) + len);
+    if (usb_failed(ret))
+        return ret;
+
+    ret = usb_get_result();
+    if (usb_failed(ret))
+        return ret;
+
+    uint64_t handle;
+    ret = __usb_read_u64(&handle);
+    if (usb_failed(ret))
+        return ret;
+
+    *out = (usb_file_t)handle;
+    return UsbReturnCode_Success;
+}
+
+UsbRet usb_file_read(usb_file_t file, void *out, size_t size, uint64_t offset)
+{
+    if (!out || !size)
+        return UsbReturnCode_EmptyField;
+
+    const bool compressed = usb_get_compression() != UsbCompression_None;
+
+    UsbRet ret = __usb_file_handle_io(compressed ? UsbMode_ReadFileHandleCompressed : UsbMode_ReadFileHandle, file, size, offset, NULL);
+    if (usb_failed(ret))
+        return ret;
+
+    return __usb_read_data(out, size, compressed);
+}
+
+UsbRet usb_file_write(usb_file_t file, const void *in, size_t size, uint64_t offset)
+{
+    if (!in || !size)
+        return UsbReturnCode_EmptyField;
+
+    const bool compressed = usb_get_compression() != UsbCompression_None;
+
+    // uncompressed data goes out in the same transfer as the request.
+    UsbRet ret = __usb_file_handle_io(compressed ? UsbMode_WriteFileHandleCompressed : UsbMode_WriteFileHandle, file, size, offset, compressed ? NULL : in);
+    if (usb_failed(ret))
+        return ret;
+
+    return compressed ? __usb_write_data(in, size, true) : usb_get_result();
+}
+
+UsbRet usb_file_get_size(usb_file_t file, uint64_t *out)
+{
+    if (!out)
+        return UsbReturnCode_EmptyField;
+
+    // the poll size carries the handle.
+    UsbRet ret = usb_poll(UsbMode_GetFileHandleSize, file);
+    if (usb_failed(ret))
+        return ret;
+
+    ret = usb_get_result();
+    if (usb_failed(ret))
+        return ret;
+
+    return __usb_read_u64(out);
+}
+
+UsbRet usb_file_close(usb_file_t file)
+{
+    UsbRet ret = usb_poll(UsbMode_CloseFileHandle, file);
+    if (usb_failed(ret))
+        return ret;
+
+    return usb_get_result();
+}
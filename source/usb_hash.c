@@ -0,0 +1,175 @@
+/*
+*   TotalJustice
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "nxusb.h"
+#include "nxusb_file.h"
+#include "nxusb_hash.h"
+#include "usb_internal.h"
+
+_Static_assert(sizeof(usb_file_hash_t) == 0x18, "usb_file_hash_t must match the host");
+_Static_assert(offsetof(usb_file_hash_t, type) == 0x4, "usb_file_hash_t must match the host");
+_Static_assert(offsetof(usb_file_hash_t, size) == 0x8, "usb_file_hash_t must match the host");
+_Static_assert(offsetof(usb_file_hash_t, offset) == 0x10, "usb_file_hash_t must match the host");
+_Static_assert(sizeof(usb_hash_digest_t) == 0x8 + USB_HASH_DIGEST_SIZE, "usb_hash_digest_t must match the host");
+
+
+// running hash of either type.
+typedef struct
+{
+    uint8_t type;
+    uint32_t crc;
+    usb_sha256_t sha;
+} usb_hasher_t;
+
+
+bool __usb_hasher_init(usb_hasher_t *hasher, uint8_t type)
+{
+    hasher->type = type;
+    hasher->crc = 0;
+
+    switch (type)
+    {
+        case UsbHashType_Crc32c:
+            return true;
+        case UsbHashType_Sha256:
+            usb_sha256_init(&hasher->sha);
+            return true;
+        default:
+            return false;
+    }
+}
+
+void __usb_hasher_update(usb_hasher_t *hasher, const void *data, size_t size)
+{
+    if (hasher->type == UsbHashType_Crc32c)
+        hasher->crc = usb_crc32c(hasher->crc, data, size);
+    else
+        usb_sha256_update(&hasher->sha, data, size);
+}
+
+void __usb_hasher_final(usb_hasher_t *hasher, uint8_t out[USB_HASH_DIGEST_SIZE])
+{
+    memset(out, 0, USB_HASH_DIGEST_SIZE);
+
+    if (hasher->type == UsbHashType_Crc32c)
+    {
+        for (size_t i = 0; i < sizeof(hasher->crc); i++)
+            out[i] = (uint8_t)(hasher->crc >> (i * 8));
+    }
+    else
+        usb_sha256_final(&hasher->sha, out);
+}
+
+
+
+/*
+*   Remote Hash Functions.
+*/
+
+UsbRet usb_file_get_hash(usb_file_t file, uint8_t type, uint64_t offset, uint64_t size, usb_hash_digest_t *out)
+{
+    if (!out)
+        return UsbReturnCode_EmptyField;
+
+    if (!usb_host_has_caps(UsbCap_Hash))
+        return UsbReturnCode_UnsupportedByHost;
+
+    const usb_file_hash_t request = { __usb_le32(file), type, {0}, __usb_le64(size), __usb_le64(offset) };
+
+    UsbRet ret = __usb_request(UsbMode_GetFileHandleHash, sizeof(request), &request, sizeof(request));
+    if (usb_failed(ret))
+        return ret;
+
+    ret = usb_get_result();
+    if (usb_failed(ret))
+        return ret;
+
+    ret = usb_read(out, sizeof(*out));
+    if (usb_failed(ret))
+        return ret;
+
+    out->size = __usb_le64(out->size);
+    return UsbReturnCode_Success;
+}
+
+UsbRet usb_hash_local_file(const char *path, uint8_t type, uint64_t offset, uint64_t size, usb_hash_digest_t *out)
+{
+    if (!path || !out)
+        return UsbReturnCode_EmptyField;
+
+    usb_hasher_t hasher;
+    if (!__usb_hasher_init(&hasher, type))
+        return UsbReturnCode_UnknownHashType;
+
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return UsbReturnCode_FailedOpenLocalFile;
+
+    uint8_t *buf = malloc(USB_POOL_BUFFER_SIZE);
+    if (!buf)
+    {
+        fclose(f);
+        return UsbReturnCode_FailedAllocPool;
+    }
+
+    UsbRet ret = UsbReturnCode_Success;
+    out->size = 0;
+
+    if (fseek(f, offset, SEEK_SET))
+        ret = UsbReturnCode_FailedReadLocalFile;
+
+    // stops at the end of the file, same as the host.
+    while (usb_succeeded(ret) && out->size < size)
+    {
+        const size_t want = size - out->size < USB_POOL_BUFFER_SIZE ? size - out->size : USB_POOL_BUFFER_SIZE;
+        const size_t got = fread(buf, 1, want, f);
+        __usb_hasher_update(&hasher, buf, got);
+        out->size += got;
+
+        if (got < want)
+        {
+            if (ferror(f))
+                ret = UsbReturnCode_FailedReadLocalFile;
+            break;
+        }
+    }
+
+    __usb_hasher_final(&hasher, out->digest);
+    free(buf);
+    fclose(f);
+    return ret;
+}
+
+UsbRet usb_verify_file(const char *local_path, const char *host_path, uint8_t type, bool *match)
+{
+    if (!local_path || !host_path || !match)
+        return UsbReturnCode_EmptyField;
+
+    *match = false;
+
+    usb_file_t file;
+    UsbRet ret = usb_file_open(&file, host_path, UsbMode_OpenFileReadBytes);
+    if (usb_failed(ret))
+        return ret;
+
+    usb_hash_digest_t host, local;
+    ret = usb_file_get_hash(file, type, 0, UINT64_MAX, &host);
+    usb_file_close(file);
+    if (usb_failed(ret))
+        return ret;
+
+    ret = usb_hash_local_file(local_path, type, 0, UINT64_MAX, &local);
+    if (usb_failed(ret))
+        return ret;
+
+    *match = host.size == local.size && !memcmp(host.digest, local.digest, sizeof(host.digest));
+    return UsbReturnCode_Success;
+}
@@ -0,0 +1,133 @@
+#ifndef _USB_INTERNAL_H_
+#define _USB_INTERNAL_H_
+
+// functions shared between the source files of the library, these are not part of the api.
+
+#include <stdio.h>
+
+#include "nxusb.h"
+#include "nxusb_dir.h"
+#include "nxusb_compress.h"
+#include "nxusb_file.h"
+
+
+/*
+*   Core.
+*/
+
+// monotonic clock in nanoseconds.
+uint64_t __usb_time_ns(void);
+
+// true if ptr is USB_TRANSFER_ALIGN aligned.
+bool __usb_is_aligned(const void *ptr);
+
+// the wire is little endian, these only swap on big endian builds.
+uint16_t __usb_le16(uint16_t value);
+uint32_t __usb_le32(uint32_t value);
+uint64_t __usb_le64(uint64_t value);
+
+// reads a little endian uint64 sent by the host.
+UsbRet __usb_read_u64(uint64_t *out);
+
+// sends a request as one transfer: the poll, then args, then data, built up in a pool buffer.
+// size is the poll's size field, flags and tag are for tagged requests (see nxusb_async.h).
+// whatever doesn't fit in the pool buffer follows in more transfers, so the host sees the same stream.
+// hosts without UsbCap_Framed get the poll, args and data as separate transfers.
+UsbRet __usb_request_ex(uint8_t mode, uint8_t flags, uint32_t tag, uint64_t size, const void *args, size_t args_size, const void *data, size_t data_size);
+// a plain request with args and no data.
+UsbRet __usb_request(uint8_t mode, uint64_t size, const void *args, size_t args_size);
+
+// reads and throws away size bytes, so a reply that can't be used doesn't desync the link.
+UsbRet __usb_discard(uint64_t size);
+
+// sends the poll and the size / offset header of a read or write.
+// data, if not NULL, is the uncompressed data of a write and goes out in the same transfer,
+// otherwise the caller moves the data.
+UsbRet __usb_file_io(uint8_t mode, size_t size, uint64_t offset, const void *data);
+
+// reads the host's result then the data, or sends the data then reads the result.
+// compressed picks the block framing of nxusb_compress.h.
+UsbRet __usb_read_data(void *out, size_t size, bool compressed);
+UsbRet __usb_write_data(const void *in, size_t size, bool compressed);
+
+
+/*
+*   File.
+*/
+
+// sends the poll and the usb_file_io_t header of a handle op, data is the same as __usb_file_io.
+UsbRet __usb_file_handle_io(uint8_t mode, usb_file_t file, size_t size, uint64_t offset, const void *data);
+
+// the size of a local file, leaves it at the start.
+bool __usb_local_size(FILE *f, uint64_t *out);
+
+
+/*
+*   Async.
+*/
+
+// true between usb_async_start() and usb_async_stop().
+bool __usb_async_running(void);
+
+
+/*
+*   Dir.
+*/
+
+// sends a compact listing request for path and reads the raw packed entries.
+// on success data is allocated with usb_alloc_aligned, or NULL if the listing is empty.
+UsbRet __usb_dir_list_fetch(const char *path, usb_dir_list_header_t *header, void **data);
+
+
+/*
+*   Stats.
+*/
+
+// a start time for the hooks below, 0 while stats are off so the clock isn't read.
+uint64_t __usb_stats_start(void);
+
+// starts counting an op on this thread, tagged ops are timed by the async layer.
+void __usb_stats_poll(uint8_t mode, bool tagged);
+// counts what this thread moves next under mode, without starting an op.
+void __usb_stats_set_op(uint8_t mode);
+// the mode of the op in progress on this thread, tracked even while stats are off.
+uint8_t __usb_stats_mode(void);
+
+void __usb_stats_transfer(bool read, size_t size, size_t moved, uint64_t start);
+void __usb_stats_copy(uint64_t start);
+void __usb_stats_wait(uint64_t start);
+void __usb_stats_latency(uint8_t mode, uint64_t start);
+void __usb_stats_bounce(bool bounced);
+void __usb_stats_pool_miss(void);
+void __usb_stats_alloc(void);
+
+
+/*
+*   Cache.
+*/
+
+typedef UsbRet (*usb_cache_fetch_t)(uint8_t mode, const char *path, uint64_t *out);
+
+// returns the cached value for mode + path if the host's change token still matches,
+// otherwise calls fetch and caches the result. calls fetch directly if the cache is off.
+UsbRet __usb_cache_value(uint8_t mode, const char *path, uint64_t *out, usb_cache_fetch_t fetch);
+
+// same as above for compact listings, out must be freed with usb_dir_list_free.
+UsbRet __usb_cache_list(const char *path, usb_dir_list_t *out);
+
+bool __usb_cache_enabled(void);
+
+
+/*
+*   Compression.
+*/
+
+// picks the codec from the host's handshake header.
+void __usb_compress_init(uint8_t host_compression);
+void __usb_compress_exit(void);
+
+// moves the data of a compressed read / write, once the host has accepted it.
+UsbRet __usb_read_blocks(void *out, size_t size);
+UsbRet __usb_write_blocks(const void *in, size_t size);
+
+#endif
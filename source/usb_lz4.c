@@ -0,0 +1,204 @@
+/*
+*   TotalJustice
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "nxusb_compress.h"
+
+// see https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+#define LZ4_MIN_MATCH       4
+#define LZ4_LAST_LITERALS   5   // the last 5 bytes are always literals.
+#define LZ4_MF_LIMIT        12  // the last match has to start at least 12 bytes before the end.
+#define LZ4_MAX_OFFSET      0xFFFF
+#define LZ4_HASH_LOG        12
+#define LZ4_SKIP_TRIGGER    6   // step up the search after 2^6 misses, so incompressible data is skipped quickly.
+
+
+uint32_t __usb_lz4_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t __usb_lz4_hash(uint32_t seq)
+{
+    return (seq * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+uint8_t *__usb_lz4_write_length(uint8_t *op, size_t len)
+{
+    for (; len >= 0xFF; len -= 0xFF)
+        *op++ = 0xFF;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// worst case size of a sequence, used to bail out before writing past the end.
+size_t __usb_lz4_sequence_bound(size_t literals, size_t match)
+{
+    return 1 + literals / 0xFF + 1 + literals + 2 + match / 0xFF + 1;
+}
+
+size_t usb_lz4_compress(const void *src, size_t size, void *dst, size_t capacity)
+{
+    const uint8_t *const in = src;
+    const uint8_t *const end = in + size;
+    const uint8_t *ip = in;
+    const uint8_t *anchor = in;
+    uint8_t *op = dst;
+    uint8_t *const oend = op + capacity;
+
+    if (size > LZ4_MF_LIMIT)
+    {
+        const uint8_t *const mf_limit = end - LZ4_MF_LIMIT;
+        const uint8_t *const match_limit = end - LZ4_LAST_LITERALS;
+        uint32_t table[1 << LZ4_HASH_LOG];
+        uint32_t misses = 0;
+
+        memset(table, 0, sizeof(table));
+        ip++;
+
+        while (ip < mf_limit)
+        {
+            const uint32_t seq = __usb_lz4_read32(ip);
+            const uint32_t h = __usb_lz4_hash(seq);
+            const uint8_t *ref = in + table[h];
+            table[h] = (uint32_t)(ip - in);
+
+            if (ip - ref > LZ4_MAX_OFFSET || __usb_lz4_read32(ref) != seq)
+            {
+                ip += 1 + (misses++ >> LZ4_SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+
+            // grow the match backwards into the pending literals, then forwards.
+            while (ip > anchor && ref > in && ip[-1] == ref[-1])
+            {
+                ip--;
+                ref--;
+            }
+
+            const uint8_t *mp = ip + LZ4_MIN_MATCH;
+            const uint8_t *rp = ref + LZ4_MIN_MATCH;
+            while (mp < match_limit && *mp == *rp)
+            {
+                mp++;
+                rp++;
+            }
+
+            const size_t literals = ip - anchor;
+            const size_t match = mp - ip - LZ4_MIN_MATCH;
+            if (__usb_lz4_sequence_bound(literals, match) > (size_t)(oend - op))
+                return 0;
+
+            uint8_t *token = op++;
+            *token = (uint8_t)((literals < 0xF ? literals : 0xF) << 4);
+            if (literals >= 0xF)
+                op = __usb_lz4_write_length(op, literals - 0xF);
+            memcpy(op, anchor, literals);
+            op += literals;
+
+            const uint16_t offset = (uint16_t)(ip - ref);
+            *op++ = (uint8_t)offset;
+            *op++ = (uint8_t)(offset >> 8);
+
+            *token |= (uint8_t)(match < 0xF ? match : 0xF);
+            if (match >= 0xF)
+                op = __usb_lz4_write_length(op, match - 0xF);
+
+            ip = anchor = mp;
+
+            // index the end of the match so runs keep matching.
+            if (ip - 2 > in && ip < mf_limit)
+                table[__usb_lz4_hash(__usb_lz4_read32(ip - 2))] = (uint32_t)(ip - 2 - in);
+        }
+    }
+
+    const size_t literals = end - anchor;
+    if (1 + literals / 0xFF + 1 + literals > (size_t)(oend - op))
+        return 0;
+
+    *op++ = (uint8_t)((literals < 0xF ? literals : 0xF) << 4);
+    if (literals >= 0xF)
+        op = __usb_lz4_write_length(op, literals - 0xF);
+    memcpy(op, anchor, literals);
+    op += literals;
+
+    return op - (uint8_t *)dst;
+}
+
+bool __usb_lz4_read_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+    uint8_t b;
+    do
+    {
+        if (*ip >= iend)
+            return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 0xFF);
+    return true;
+}
+
+bool usb_lz4_decompress(const void *src, size_t packed_size, void *dst, size_t size)
+{
+    const uint8_t *ip = src;
+    const uint8_t *const iend = ip + packed_size;
+    uint8_t *const out = dst;
+    uint8_t *op = out;
+    uint8_t *const oend = op + size;
+
+    for (;;)
+    {
+        if (ip >= iend)
+            return false;
+
+        const uint8_t token = *ip++;
+
+        size_t literals = token >> 4;
+        if (literals == 0xF && !__usb_lz4_read_length(&ip, iend, &literals))
+            return false;
+        if (literals > (size_t)(iend - ip) || literals > (size_t)(oend - op))
+            return false;
+
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+
+        // the last sequence is literals only.
+        if (ip == iend)
+            return op == oend;
+
+        if (iend - ip < 2)
+            return false;
+        const size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (!offset || offset > (size_t)(op - out))
+            return false;
+
+        size_t match = token & 0xF;
+        if (match == 0xF && !__usb_lz4_read_length(&ip, iend, &match))
+            return false;
+        match += LZ4_MIN_MATCH;
+        if (match > (size_t)(oend - op))
+            return false;
+
+        const uint8_t *ref = op - offset;
+        if (offset >= match)
+        {
+            memcpy(op, ref, match);
+            op += match;
+        }
+        else
+        {
+            // overlapping copy, repeats the last offset bytes.
+            while (match--)
+                *op++ = *ref++;
+        }
+    }
+}
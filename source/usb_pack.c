@@ -0,0 +1,287 @@
+/*
+*   TotalJustice
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "nxusb.h"
+#include "nxusb_compress.h"
+#include "nxusb_copy.h"
+#include "nxusb_pack.h"
+#include "usb_internal.h"
+
+_Static_assert(sizeof(usb_pack_request_t) == 0x10, "usb_pack_request_t must match the host");
+_Static_assert(offsetof(usb_pack_request_t, compressed) == 0x8, "usb_pack_request_t must match the host");
+_Static_assert(sizeof(usb_pack_block_t) == 0x10, "usb_pack_block_t must match the host");
+_Static_assert(offsetof(usb_pack_block_t, result) == 0x8, "usb_pack_block_t must match the host");
+_Static_assert(offsetof(usb_pack_block_t, last) == 0xC, "usb_pack_block_t must match the host");
+_Static_assert(sizeof(usb_pack_entry_t) == 0x10, "usb_pack_entry_t must match the host");
+_Static_assert(offsetof(usb_pack_entry_t, path_len) == 0x2, "usb_pack_entry_t must match the host");
+_Static_assert(offsetof(usb_pack_entry_t, size) == 0x8, "usb_pack_entry_t must match the host");
+
+
+// paths of the files too big to pack, each ends with a 0.
+typedef struct
+{
+    char *data;
+    size_t size;
+    size_t capacity;
+} usb_pack_large_t;
+
+
+// joins a dir and a path, an empty dir is the root of the host device.
+char *__usb_pack_join(const char *dir, const char *path, size_t path_len)
+{
+    const size_t dir_len = strlen(dir);
+    const bool slash = dir_len && dir[dir_len - 1] != '/';
+    char *out = malloc(dir_len + slash + path_len + 1);
+    if (out)
+    {
+        memcpy(out, dir, dir_len);
+        out[dir_len] = '/';
+        memcpy(out + dir_len + slash, path, path_len);
+        out[dir_len + slash + path_len] = 0;
+    }
+    return out;
+}
+
+// the host only sends paths inside the dir read, anything else means the stream is broken.
+bool __usb_pack_path_ok(const char *path, size_t len)
+{
+    if (!len || len >= USB_FILE_NAME_MAX || path[0] == '/' || memchr(path, 0, len))
+        return false;
+
+    for (size_t start = 0; start < len;)
+    {
+        const char *end = memchr(path + start, '/', len - start);
+        const size_t part = end ? (size_t)(end - path) - start : len - start;
+        if (!part || (part == 1 && path[start] == '.') || (part == 2 && path[start] == '.' && path[start + 1] == '.'))
+            return false;
+        start += part + 1;
+    }
+    return true;
+}
+
+UsbRet __usb_pack_add_large(usb_pack_large_t *large, const char *path, size_t len)
+{
+    if (large->size + len + 1 > large->capacity)
+    {
+        const size_t capacity = large->capacity ? large->capacity * 2 + len + 1 : USB_FILE_NAME_MAX * 0x10;
+        char *data = realloc(large->data, capacity);
+        if (!data)
+            return UsbReturnCode_FailedAllocPool;
+        large->data = data;
+        large->capacity = capacity;
+    }
+
+    memcpy(large->data + large->size, path, len);
+    large->data[large->size + len] = 0;
+    large->size += len + 1;
+    return UsbReturnCode_Success;
+}
+
+// writes out every entry of a block.
+UsbRet __usb_pack_unpack(const uint8_t *data, const usb_pack_block_t *block, const char *local_path, usb_pack_large_t *large, usb_pack_stats_t *stats)
+{
+    size_t pos = 0;
+
+    for (uint32_t i = 0; i < block->count; i++)
+    {
+        usb_pack_entry_t entry;
+        if (block->size - pos < sizeof(entry))
+            return UsbReturnCode_BadResponse;
+        memcpy(&entry, data + pos, sizeof(entry));
+        entry.path_len = __usb_le16(entry.path_len);
+        entry.size = __usb_le64(entry.size);
+        pos += sizeof(entry);
+
+        const char *path = (const char *)data + pos;
+        const uint64_t data_size = entry.type == UsbPackEntry_File ? entry.size : 0;
+        if (entry.path_len > block->size - pos || data_size > block->size - pos - entry.path_len || !__usb_pack_path_ok(path, entry.path_len))
+            return UsbReturnCode_BadResponse;
+        pos += entry.path_len;
+
+        if (entry.type == UsbPackEntry_Large)
+        {
+            UsbRet ret = __usb_pack_add_large(large, path, entry.path_len);
+            if (usb_failed(ret))
+                return ret;
+            continue;
+        }
+
+        char *full = __usb_pack_join(local_path, path, entry.path_len);
+        if (!full)
+            return UsbReturnCode_FailedAllocPool;
+
+        UsbRet ret = UsbReturnCode_Success;
+        if (entry.type == UsbPackEntry_Dir)
+        {
+            if (mkdir(full, 0777) && errno != EEXIST)
+                ret = UsbReturnCode_FailedTouchLocalDir;
+            else
+                stats->dirs++;
+        }
+        else if (entry.type == UsbPackEntry_File)
+        {
+            FILE *f = fopen(full, "wb");
+            if (!f)
+                ret = UsbReturnCode_FailedOpenLocalFile;
+            else
+            {
+                if (fwrite(data + pos, 1, data_size, f) != data_size)
+                    ret = UsbReturnCode_FailedWriteLocalFile;
+                if (fclose(f) && usb_succeeded(ret))
+                    ret = UsbReturnCode_FailedWriteLocalFile;
+            }
+
+            if (usb_succeeded(ret))
+            {
+                stats->files++;
+                stats->packed++;
+                stats->size += data_size;
+            }
+        }
+        else
+            ret = UsbReturnCode_BadResponse;
+
+        free(full);
+        if (usb_failed(ret))
+            return ret;
+        pos += data_size;
+    }
+
+    return pos == block->size ? UsbReturnCode_Success : UsbReturnCode_BadResponse;
+}
+
+// reads blocks until the last one, the first error stops the writing but not the reading, so the link stays in step.
+UsbRet __usb_pack_read_stream(bool compressed, uint8_t *buf, const char *local_path, usb_pack_large_t *large, usb_pack_stats_t *stats)
+{
+    UsbRet result = UsbReturnCode_Success;
+
+    for (;;)
+    {
+        usb_pack_block_t block;
+        UsbRet ret = usb_read(&block, sizeof(block));
+        if (usb_failed(ret))
+            return ret;
+
+        block.size = __usb_le32(block.size);
+        block.count = __usb_le32(block.count);
+        block.result = __usb_le32(block.result);
+
+        // the framing can't be trusted past a bad header.
+        if (block.size > USB_PACK_BLOCK_SIZE)
+            return UsbReturnCode_BadResponse;
+
+        if (block.size)
+        {
+            ret = compressed ? __usb_read_blocks(buf, block.size) : usb_read(buf, block.size);
+            if (usb_failed(ret))
+                return ret;
+        }
+
+        stats->blocks++;
+        if (usb_succeeded(result))
+            result = __usb_pack_unpack(buf, &block, local_path, large, stats);
+
+        if (block.last)
+            return usb_succeeded(result) ? block.result : result;
+    }
+}
+
+
+
+/*
+*   Pack Functions.
+*/
+
+UsbRet usb_pack_copy_dir_from_host(const char *host_path, const char *local_path, uint64_t max_file_size, usb_pack_stats_t *stats)
+{
+    if (!host_path || !local_path)
+        return UsbReturnCode_EmptyField;
+
+    const size_t len = strlen(host_path);
+    if (len >= USB_FILE_NAME_MAX)
+        return UsbReturnCode_FileNameTooLarge;
+
+    // hosts that can't pack still get the pipelined tree copy.
+    if (!usb_host_has_caps(UsbCap_DirPacked))
+    {
+        usb_copy_tree_stats_t tree = {0};
+        const UsbRet ret = usb_copy_dir_from_host(host_path, local_path, NULL, &tree);
+        if (stats)
+        {
+            memset(stats, 0, sizeof(*stats));
+            stats->files = tree.files;
+            stats->dirs = tree.dirs;
+            stats->size = tree.size;
+            stats->total_ns = tree.total_ns;
+        }
+        return ret;
+    }
+
+    const uint64_t start = __usb_time_ns();
+    usb_pack_stats_t st = {0};
+    usb_pack_large_t large = {0};
+
+    if (mkdir(local_path, 0777) && errno != EEXIST)
+        return UsbReturnCode_FailedTouchLocalDir;
+
+    uint8_t *buf = usb_alloc_aligned(USB_PACK_BLOCK_SIZE);
+    if (!buf)
+        return UsbReturnCode_FailedAllocPool;
+
+    const bool compressed = usb_get_compression() != UsbCompression_None;
+    struct
+    {
+        usb_pack_request_t header;
+        char path[USB_FILE_NAME_MAX];
+    } request = { { __usb_le64(max_file_size ? max_file_size : USB_PACK_FILE_MAX), compressed, {0} }, {0} };
+    memcpy(request.path, host_path, len);
+
+    UsbRet ret = __usb_request(UsbMode_ReadDirPacked, sizeof(request.header) + len, &request, sizeof(request.header) + len);
+    if (usb_succeeded(ret))
+        ret = usb_get_result();
+    if (usb_succeeded(ret))
+        ret = __usb_pack_read_stream(compressed, buf, local_path, &large, &st);
+    usb_free_aligned(buf);
+
+    // the big files, one at a time with the tuned copier.
+    for (size_t pos = 0; usb_succeeded(ret) && pos < large.size;)
+    {
+        const char *path = large.data + pos;
+        const size_t path_len = strlen(path);
+        pos += path_len + 1;
+
+        char *host_file = __usb_pack_join(host_path, path, path_len);
+        char *local_file = __usb_pack_join(local_path, path, path_len);
+        usb_copy_stats_t copy_stats = {0};
+
+        if (!host_file || !local_file)
+            ret = UsbReturnCode_FailedAllocPool;
+        else
+            ret = usb_copy_file_from_host(host_file, local_file, NULL, &copy_stats);
+
+        if (usb_succeeded(ret))
+        {
+            st.files++;
+            st.size += copy_stats.size;
+        }
+
+        free(host_file);
+        free(local_file);
+    }
+
+    free(large.data);
+    st.total_ns = __usb_time_ns() - start;
+    if (stats)
+        *stats = st;
+    return ret;
+}
@@ -0,0 +1,368 @@
+/*
+*   TotalJustice
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nxusb.h"
+#include "nxusb_file.h"
+#include "nxusb_resume.h"
+#include "usb_internal.h"
+
+_Static_assert(sizeof(usb_file_checksum_t) == 0x18, "usb_file_checksum_t must match the host");
+_Static_assert(offsetof(usb_file_checksum_t, chunk_size) == 0x4, "usb_file_checksum_t must match the host");
+_Static_assert(offsetof(usb_file_checksum_t, size) == 0x8, "usb_file_checksum_t must match the host");
+_Static_assert(offsetof(usb_file_checksum_t, offset) == 0x10, "usb_file_checksum_t must match the host");
+
+
+// host checksums for a run of chunks, fetched USB_RESUME_CHECKSUMS_MAX at a time.
+typedef struct
+{
+    usb_file_t file;
+    size_t chunk_size;
+    uint64_t limit;         // only chunks that end at or before this are checked.
+    uint64_t first;         // index of crc[0].
+    size_t count;
+    uint32_t crc[USB_RESUME_CHECKSUMS_MAX];
+} usb_resume_batch_t;
+
+
+// sets out to the host crc of the size bytes of chunk index, returns false if there isn't one.
+bool __usb_resume_checksum(usb_resume_batch_t *batch, uint64_t index, size_t size, uint32_t *out, UsbRet *ret)
+{
+    if (index * batch->chunk_size + size > batch->limit)
+        return false;
+
+    if (index < batch->first || index >= batch->first + batch->count)
+    {
+        const uint64_t left = (batch->limit + batch->chunk_size - 1) / batch->chunk_size - index;
+        const size_t count = left < USB_RESUME_CHECKSUMS_MAX ? left : USB_RESUME_CHECKSUMS_MAX;
+
+        batch->first = index;
+        batch->count = 0;
+        *ret = usb_file_get_checksums(batch->file, batch->chunk_size, index * batch->chunk_size, batch->crc, count, &batch->count);
+        if (usb_failed(*ret))
+            return false;
+    }
+
+    if (index >= batch->first + batch->count)
+        return false;
+
+    *out = batch->crc[index - batch->first];
+    return true;
+}
+
+bool __usb_local_size(FILE *f, uint64_t *out)
+{
+    if (fseek(f, 0, SEEK_END))
+        return false;
+
+    const long size = ftell(f);
+    if (size < 0 || fseek(f, 0, SEEK_SET))
+        return false;
+
+    *out = size;
+    return true;
+}
+
+
+
+/*
+*   Checksum Functions.
+*/
+
+UsbRet usb_file_read_checked(usb_file_t file, void *out, size_t size, uint64_t offset)
+{
+    if (!out || !size)
+        return UsbReturnCode_EmptyField;
+
+    if (!usb_host_has_caps(UsbCap_Resume))
+        return UsbReturnCode_UnsupportedByHost;
+
+    UsbRet ret = __usb_file_handle_io(UsbMode_ReadFileHandleChecked, file, size, offset, NULL);
+    if (usb_failed(ret))
+        return ret;
+
+    ret = __usb_read_data(out, size, false);
+    if (usb_failed(ret))
+        return ret;
+
+    uint32_t crc;
+    ret = usb_read(&crc, sizeof(crc));
+    if (usb_failed(ret))
+        return ret;
+
+    if (__usb_le32(crc) != usb_crc32c(0, out, size))
+        return UsbReturnCode_ChecksumMismatch;
+    return UsbReturnCode_Success;
+}
+
+UsbRet usb_file_write_checked(usb_file_t file, const void *in, size_t size, uint64_t offset)
+{
+    if (!in || !size)
+        return UsbReturnCode_EmptyField;
+
+    if (!usb_host_has_caps(UsbCap_Resume))
+        return UsbReturnCode_UnsupportedByHost;
+
+    UsbRet ret = __usb_file_handle_io(UsbMode_WriteFileHandleChecked, file, size, offset, in);
+    if (usb_failed(ret))
+        return ret;
+
+    const uint32_t crc = __usb_le32(usb_crc32c(0, in, size));
+    ret = usb_write(&crc, sizeof(crc));
+    if (usb_failed(ret))
+        return ret;
+
+    return usb_get_result();
+}
+
+UsbRet usb_file_get_checksums(usb_file_t file, uint32_t chunk_size, uint64_t offset, uint32_t *out, size_t count, size_t *out_count)
+{
+    if (!out || !count || !chunk_size || !out_count)
+        return UsbReturnCode_EmptyField;
+
+    if (!usb_host_has_caps(UsbCap_Resume))
+        return UsbReturnCode_UnsupportedByHost;
+
+    if (count > USB_RESUME_CHECKSUMS_MAX)
+        count = USB_RESUME_CHECKSUMS_MAX;
+
+    const usb_file_checksum_t request = { __usb_le32(file), __usb_le32(chunk_size), __usb_le64((uint64_t)chunk_size * count), __usb_le64(offset) };
+
+    UsbRet ret = __usb_request(UsbMode_GetFileHandleChecksums, sizeof(request), &request, sizeof(request));
+    if (usb_failed(ret))
+        return ret;
+
+    ret = usb_get_result();
+    if (usb_failed(ret))
+        return ret;
+
+    uint64_t total;
+    ret = __usb_read_u64(&total);
+    if (usb_failed(ret))
+        return ret;
+
+    if (total > count)
+        return UsbReturnCode_BadResponse;
+
+    *out_count = total;
+    if (!total)
+        return UsbReturnCode_Success;
+
+    ret = usb_read(out, total * sizeof(uint32_t));
+    if (usb_failed(ret))
+        return ret;
+
+    for (uint64_t i = 0; i < total; i++)
+        out[i] = __usb_le32(out[i]);
+    return UsbReturnCode_Success;
+}
+
+UsbRet usb_file_set_size(usb_file_t file, uint64_t size)
+{
+    if (!usb_host_has_caps(UsbCap_Resume))
+        return UsbReturnCode_UnsupportedByHost;
+
+    UsbRet ret = __usb_file_handle_io(UsbMode_SetFileHandleSize, file, size, 0, NULL);
+    if (usb_failed(ret))
+        return ret;
+
+    return usb_get_result();
+}
+
+
+
+/*
+*   Resume Functions.
+*/
+
+UsbRet usb_resume_file_from_host(const char *host_path, const char *local_path, size_t chunk_size, usb_resume_stats_t *stats)
+{
+    if (!host_path || !local_path)
+        return UsbReturnCode_EmptyField;
+
+    if (!chunk_size)
+        chunk_size = USB_RESUME_CHUNK_DEFAULT;
+    else if (chunk_size > USB_RESUME_CHECKED_MAX)
+        chunk_size = USB_RESUME_CHECKED_MAX;
+
+    usb_resume_stats_t st = {0};
+    usb_file_t file;
+    UsbRet ret = usb_file_open(&file, host_path, UsbMode_OpenFileReadBytes);
+    if (usb_failed(ret))
+        return ret;
+
+    uint8_t *buf = NULL;
+    usb_resume_batch_t *batch = NULL;
+    uint64_t local_size = 0;
+
+    // keep what's there, create it if it isn't.
+    FILE *local = fopen(local_path, "r+b");
+    if (!local)
+        local = fopen(local_path, "w+b");
+    if (!local)
+    {
+        ret = UsbReturnCode_FailedOpenLocalFile;
+        goto done;
+    }
+
+    if (!__usb_local_size(local, &local_size))
+    {
+        ret = UsbReturnCode_FailedReadLocalFile;
+        goto done;
+    }
+
+    ret = usb_file_get_size(file, &st.size);
+    if (usb_failed(ret))
+        goto done;
+
+    buf = usb_alloc_aligned(chunk_size);
+    batch = calloc(1, sizeof(*batch));
+    if (!buf || !batch)
+    {
+        ret = UsbReturnCode_FailedAllocPool;
+        goto done;
+    }
+
+    batch->file = file;
+    batch->chunk_size = chunk_size;
+    batch->limit = local_size < st.size ? local_size : st.size;
+
+    for (uint64_t offset = 0, index = 0; offset < st.size; offset += chunk_size, index++)
+    {
+        const size_t todo = st.size - offset < chunk_size ? st.size - offset : chunk_size;
+
+        uint32_t crc;
+        if (__usb_resume_checksum(batch, index, todo, &crc, &ret))
+        {
+            if (!fseek(local, offset, SEEK_SET) && fread(buf, 1, todo, local) == todo && usb_crc32c(0, buf, todo) == crc)
+            {
+                st.verified += todo;
+                continue;
+            }
+        }
+        else if (usb_failed(ret))
+            goto done;
+
+        ret = usb_file_read_checked(file, buf, todo, offset);
+        if (usb_failed(ret))
+            goto done;
+
+        if (fseek(local, offset, SEEK_SET) || fwrite(buf, 1, todo, local) != todo)
+        {
+            ret = UsbReturnCode_FailedWriteLocalFile;
+            goto done;
+        }
+
+        st.transferred += todo;
+    }
+
+    // a local file longer than the host's is cut down to size.
+    if (fflush(local) || (local_size > st.size && ftruncate(fileno(local), st.size)))
+        ret = UsbReturnCode_FailedWriteLocalFile;
+
+done:
+    if (local && fclose(local) && usb_succeeded(ret))
+        ret = UsbReturnCode_FailedWriteLocalFile;
+    free(batch);
+    usb_free_aligned(buf);
+    usb_file_close(file);
+
+    if (stats)
+        *stats = st;
+    return ret;
+}
+
+UsbRet usb_resume_file_to_host(const char *local_path, const char *host_path, size_t chunk_size, usb_resume_stats_t *stats)
+{
+    if (!host_path || !local_path)
+        return UsbReturnCode_EmptyField;
+
+    if (!chunk_size)
+        chunk_size = USB_RESUME_CHUNK_DEFAULT;
+    else if (chunk_size > USB_RESUME_CHECKED_MAX)
+        chunk_size = USB_RESUME_CHECKED_MAX;
+
+    usb_resume_stats_t st = {0};
+    FILE *local = fopen(local_path, "rb");
+    if (!local)
+        return UsbReturnCode_FailedOpenLocalFile;
+
+    if (!__usb_local_size(local, &st.size))
+    {
+        fclose(local);
+        return UsbReturnCode_FailedReadLocalFile;
+    }
+
+    // opened without truncating, so what's already on the host is kept.
+    usb_file_t file;
+    UsbRet ret = usb_file_open(&file, host_path, UsbMode_OpenFileReadWriteBytes);
+    if (usb_failed(ret))
+    {
+        fclose(local);
+        return ret;
+    }
+
+    uint64_t host_size = 0;
+    uint8_t *buf = usb_alloc_aligned(chunk_size);
+    usb_resume_batch_t *batch = calloc(1, sizeof(*batch));
+    if (!buf || !batch)
+    {
+        ret = UsbReturnCode_FailedAllocPool;
+        goto done;
+    }
+
+    ret = usb_file_get_size(file, &host_size);
+    if (usb_failed(ret))
+        goto done;
+
+    batch->file = file;
+    batch->chunk_size = chunk_size;
+    batch->limit = host_size < st.size ? host_size : st.size;
+
+    for (uint64_t offset = 0, index = 0; offset < st.size; offset += chunk_size, index++)
+    {
+        const size_t todo = st.size - offset < chunk_size ? st.size - offset : chunk_size;
+
+        if (fread(buf, 1, todo, local) != todo)
+        {
+            ret = UsbReturnCode_FailedReadLocalFile;
+            goto done;
+        }
+
+        uint32_t crc;
+        if (__usb_resume_checksum(batch, index, todo, &crc, &ret) && usb_crc32c(0, buf, todo) == crc)
+        {
+            st.verified += todo;
+            continue;
+        }
+        else if (usb_failed(ret))
+            goto done;
+
+        ret = usb_file_write_checked(file, buf, todo, offset);
+        if (usb_failed(ret))
+            goto done;
+
+        st.transferred += todo;
+    }
+
+    if (host_size != st.size)
+        ret = usb_file_set_size(file, st.size);
+
+done:
+    free(batch);
+    usb_free_aligned(buf);
+    usb_file_close(file);
+    fclose(local);
+
+    if (stats)
+        *stats = st;
+    return ret;
+}
@@ -0,0 +1,195 @@
+/*
+*   TotalJustice
+*/
+
+// sha256, shared by the library and the host tools.
+// uses the sha2 instructions when the target has them, armv8 +crypto on the switch.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "nxusb_hash.h"
+
+#if defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO)
+#define USB_SHA256_ARM
+#include <arm_neon.h>
+#endif
+
+
+const uint32_t g_sha256_init[0x8] =
+{
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+const uint32_t g_sha256_k[0x40] =
+{
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2,
+};
+
+#ifdef USB_SHA256_ARM
+void __usb_sha256_blocks(uint32_t state[0x8], const uint8_t *data, size_t count)
+{
+    uint32x4_t abcd = vld1q_u32(&state[0]);
+    uint32x4_t efgh = vld1q_u32(&state[4]);
+
+    for (; count; count--, data += USB_SHA256_BLOCK_SIZE)
+    {
+        const uint32x4_t abcd_save = abcd;
+        const uint32x4_t efgh_save = efgh;
+
+        uint32x4_t msg[4];
+        for (size_t i = 0; i < 4; i++)
+            msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + i * 0x10)));
+
+        // 4 rounds at a time, the schedule for 16 rounds on is worked out as it goes.
+        for (size_t i = 0; i < 16; i++)
+        {
+            const uint32x4_t wk = vaddq_u32(msg[i & 3], vld1q_u32(&g_sha256_k[i * 4]));
+            if (i < 12)
+                msg[i & 3] = vsha256su1q_u32(vsha256su0q_u32(msg[i & 3], msg[(i + 1) & 3]), msg[(i + 2) & 3], msg[(i + 3) & 3]);
+
+            const uint32x4_t prev = abcd;
+            abcd = vsha256hq_u32(abcd, efgh, wk);
+            efgh = vsha256h2q_u32(efgh, prev, wk);
+        }
+
+        abcd = vaddq_u32(abcd, abcd_save);
+        efgh = vaddq_u32(efgh, efgh_save);
+    }
+
+    vst1q_u32(&state[0], abcd);
+    vst1q_u32(&state[4], efgh);
+}
+#else
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void __usb_sha256_blocks(uint32_t state[0x8], const uint8_t *data, size_t count)
+{
+    for (; count; count--, data += USB_SHA256_BLOCK_SIZE)
+    {
+        uint32_t w[0x40];
+        for (size_t i = 0; i < 16; i++)
+            w[i] = (uint32_t)data[i * 4] << 24 | (uint32_t)data[i * 4 + 1] << 16 | (uint32_t)data[i * 4 + 2] << 8 | data[i * 4 + 3];
+
+        for (size_t i = 16; i < 0x40; i++)
+        {
+            const uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            const uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (size_t i = 0; i < 0x40; i++)
+        {
+            const uint32_t t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + g_sha256_k[i] + w[i];
+            const uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+#endif
+
+
+
+/*
+*   Hash Functions.
+*/
+
+void usb_sha256_init(usb_sha256_t *ctx)
+{
+    memcpy(ctx->state, g_sha256_init, sizeof(g_sha256_init));
+    ctx->total = 0;
+    ctx->used = 0;
+}
+
+void usb_sha256_update(usb_sha256_t *ctx, const void *data, size_t size)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    ctx->total += size;
+
+    if (ctx->used)
+    {
+        const size_t take = USB_SHA256_BLOCK_SIZE - ctx->used < size ? USB_SHA256_BLOCK_SIZE - ctx->used : size;
+        memcpy(ctx->block + ctx->used, p, take);
+        ctx->used += take;
+        p += take;
+        size -= take;
+
+        if (ctx->used < USB_SHA256_BLOCK_SIZE)
+            return;
+        __usb_sha256_blocks(ctx->state, ctx->block, 1);
+        ctx->used = 0;
+    }
+
+    // whole blocks go straight from the caller's buffer.
+    const size_t blocks = size / USB_SHA256_BLOCK_SIZE;
+    if (blocks)
+    {
+        __usb_sha256_blocks(ctx->state, p, blocks);
+        p += blocks * USB_SHA256_BLOCK_SIZE;
+        size -= blocks * USB_SHA256_BLOCK_SIZE;
+    }
+
+    memcpy(ctx->block, p, size);
+    ctx->used = size;
+}
+
+void usb_sha256_final(usb_sha256_t *ctx, uint8_t out[USB_SHA256_SIZE])
+{
+    const uint64_t bits = ctx->total * 8;
+
+    ctx->block[ctx->used++] = 0x80;
+    if (ctx->used > USB_SHA256_BLOCK_SIZE - sizeof(bits))
+    {
+        memset(ctx->block + ctx->used, 0, USB_SHA256_BLOCK_SIZE - ctx->used);
+        __usb_sha256_blocks(ctx->state, ctx->block, 1);
+        ctx->used = 0;
+    }
+
+    memset(ctx->block + ctx->used, 0, USB_SHA256_BLOCK_SIZE - sizeof(bits) - ctx->used);
+    for (size_t i = 0; i < sizeof(bits); i++)
+        ctx->block[USB_SHA256_BLOCK_SIZE - 1 - i] = (uint8_t)(bits >> (i * 8));
+    __usb_sha256_blocks(ctx->state, ctx->block, 1);
+
+    for (size_t i = 0; i < 0x8; i++)
+    {
+        out[i * 4 + 0] = (uint8_t)(ctx->state[i] >> 24);
+        out[i * 4 + 1] = (uint8_t)(ctx->state[i] >> 16);
+        out[i * 4 + 2] = (uint8_t)(ctx->state[i] >> 8);
+        out[i * 4 + 3] = (uint8_t)(ctx->state[i]);
+    }
+}
+
+void usb_sha256(const void *data, size_t size, uint8_t out[USB_SHA256_SIZE])
+{
+    usb_sha256_t ctx;
+    usb_sha256_init(&ctx);
+    usb_sha256_update(&ctx, data, size);
+    usb_sha256_final(&ctx, out);
+}
@@ -0,0 +1,253 @@
+/*
+*   TotalJustice
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "nxusb.h"
+#include "nxusb_stats.h"
+#include "usb_internal.h"
+
+
+// the op in progress on a thread, the async dispatcher and receiver each have their own.
+typedef struct
+{
+    uint64_t start;
+    uint64_t last;          // end of the last transfer.
+    uint8_t mode;
+    bool timed;             // tagged ops are timed by the async layer instead.
+} usb_stats_op_t;
+
+bool g_stats_enabled;
+usb_stats_t g_stats;
+__thread usb_stats_op_t g_stats_op;
+
+
+void __usb_stats_add(uint64_t *counter, uint64_t value)
+{
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+uint32_t __usb_stats_bucket(uint64_t ns)
+{
+    uint32_t bucket = 0;
+    while (ns >>= 1)
+        bucket++;
+    return bucket < USB_STATS_BUCKETS ? bucket : USB_STATS_BUCKETS - 1;
+}
+
+void __usb_stats_record(uint8_t mode, uint64_t ns)
+{
+    usb_op_stats_t *op = &g_stats.ops[mode];
+    __usb_stats_add(&op->latency[__usb_stats_bucket(ns)], 1);
+    __usb_stats_add(&op->latency_ns, ns);
+
+    uint64_t max = __atomic_load_n(&op->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&op->max_ns, &max, ns, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// ends the op in progress on this thread, if it's timed here.
+void __usb_stats_end_op(void)
+{
+    if (g_stats_op.timed && g_stats_op.start)
+        __usb_stats_record(g_stats_op.mode, g_stats_op.last - g_stats_op.start);
+    g_stats_op.start = 0;
+}
+
+uint64_t __usb_stats_start(void)
+{
+    return g_stats_enabled ? __usb_time_ns() : 0;
+}
+
+// the mode is kept even while stats are off, traces tag transfers with it.
+void __usb_stats_poll(uint8_t mode, bool tagged)
+{
+    if (!g_stats_enabled)
+    {
+        g_stats_op.mode = mode;
+        return;
+    }
+
+    __usb_stats_end_op();
+    g_stats_op.mode = mode;
+    g_stats_op.timed = !tagged;
+    g_stats_op.start = g_stats_op.last = __usb_time_ns();
+    __usb_stats_add(&g_stats.ops[mode].count, 1);
+}
+
+void __usb_stats_set_op(uint8_t mode)
+{
+    if (!g_stats_enabled)
+    {
+        g_stats_op.mode = mode;
+        return;
+    }
+
+    __usb_stats_end_op();
+    g_stats_op.mode = mode;
+    g_stats_op.timed = false;
+}
+
+uint8_t __usb_stats_mode(void)
+{
+    return g_stats_op.mode;
+}
+
+void __usb_stats_transfer(bool read, size_t size, size_t moved, uint64_t start)
+{
+    if (!g_stats_enabled || !start)
+        return;
+
+    const uint64_t now = __usb_time_ns();
+    usb_op_stats_t *op = &g_stats.ops[g_stats_op.mode];
+    __usb_stats_add(&op->link_ns, now - start);
+    __usb_stats_add(read ? &op->bytes_read : &op->bytes_written, moved < size ? moved : size);
+    g_stats_op.last = now;
+
+    if (moved != size)
+    {
+        __usb_stats_add(&op->errors, 1);
+        __usb_stats_add(read ? &g_stats.short_reads : &g_stats.short_writes, 1);
+    }
+}
+
+void __usb_stats_copy(uint64_t start)
+{
+    if (g_stats_enabled && start)
+        __usb_stats_add(&g_stats.ops[g_stats_op.mode].copy_ns, __usb_time_ns() - start);
+}
+
+void __usb_stats_wait(uint64_t start)
+{
+    if (g_stats_enabled && start)
+        __usb_stats_add(&g_stats.ops[g_stats_op.mode].wait_ns, __usb_time_ns() - start);
+}
+
+void __usb_stats_latency(uint8_t mode, uint64_t start)
+{
+    if (g_stats_enabled && start)
+        __usb_stats_record(mode, __usb_time_ns() - start);
+}
+
+void __usb_stats_bounce(bool bounced)
+{
+    if (g_stats_enabled)
+        __usb_stats_add(bounced ? &g_stats.bounced : &g_stats.direct, 1);
+}
+
+void __usb_stats_pool_miss(void)
+{
+    if (g_stats_enabled)
+        __usb_stats_add(&g_stats.pool_misses, 1);
+}
+
+void __usb_stats_alloc(void)
+{
+    if (!g_stats_enabled)
+        return;
+
+    __usb_stats_add(&g_stats.allocs, 1);
+    __usb_stats_add(&g_stats.ops[g_stats_op.mode].allocs, 1);
+}
+
+
+
+/*
+*   Stats Functions.
+*/
+
+void usb_stats_enable(bool enable)
+{
+    g_stats_op.start = 0;
+    g_stats_enabled = enable;
+}
+
+bool usb_stats_enabled(void)
+{
+    return g_stats_enabled;
+}
+
+void usb_stats_reset(void)
+{
+    g_stats_op.start = 0;
+    memset(&g_stats, 0, sizeof(g_stats));
+}
+
+void usb_stats_snapshot(usb_stats_t *out)
+{
+    if (!out)
+        return;
+
+    __usb_stats_end_op();
+
+    // counters are only ever added to, so a word by word copy is as good as a lock.
+    const uint64_t *src = (const uint64_t *)&g_stats;
+    uint64_t *dst = (uint64_t *)out;
+    for (size_t i = 0; i < sizeof(g_stats) / sizeof(uint64_t); i++)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+uint64_t usb_stats_percentile(const usb_op_stats_t *op, double p)
+{
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < USB_STATS_BUCKETS; i++)
+        total += op->latency[i];
+    if (!total)
+        return 0;
+
+    const double want = p * total;
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < USB_STATS_BUCKETS; i++)
+    {
+        seen += op->latency[i];
+        if (seen && seen >= want)
+            return i + 1 < 64 ? (1ULL << (i + 1)) : UINT64_MAX;
+    }
+    return UINT64_MAX;
+}
+
+UsbRet usb_stats_dump(const char *path)
+{
+    if (!path)
+        return UsbReturnCode_EmptyField;
+
+    usb_stats_t *stats = malloc(sizeof(*stats));
+    if (!stats)
+        return UsbReturnCode_FailedAllocPool;
+    usb_stats_snapshot(stats);
+
+    FILE *f = fopen(path, "a");
+    if (!f)
+    {
+        free(stats);
+        return UsbReturnCode_FailedOpenLocalFile;
+    }
+
+    fprintf(f, "nxusb stats: allocs %llu bounced %llu direct %llu pool misses %llu short reads %llu short writes %llu\n",
+        (unsigned long long)stats->allocs, (unsigned long long)stats->bounced, (unsigned long long)stats->direct,
+        (unsigned long long)stats->pool_misses, (unsigned long long)stats->short_reads, (unsigned long long)stats->short_writes);
+    fprintf(f, "mode       count  errors  allocs        read     written   link ms   wait ms   copy ms   p50 us   p90 us   p99 us   max us\n");
+
+    for (uint32_t mode = 0; mode < USB_STATS_MODES; mode++)
+    {
+        const usb_op_stats_t *op = &stats->ops[mode];
+        if (!op->count && !op->bytes_read && !op->bytes_written)
+            continue;
+
+        fprintf(f, "0x%02X %11llu %7llu %7llu %11llu %11llu %9.1f %9.1f %9.1f %8llu %8llu %8llu %8llu\n", mode,
+            (unsigned long long)op->count, (unsigned long long)op->errors, (unsigned long long)op->allocs,
+            (unsigned long long)op->bytes_read, (unsigned long long)op->bytes_written,
+            op->link_ns / 1e6, op->wait_ns / 1e6, op->copy_ns / 1e6,
+            (unsigned long long)usb_stats_percentile(op, 0.5) / 1000, (unsigned long long)usb_stats_percentile(op, 0.9) / 1000,
+            (unsigned long long)usb_stats_percentile(op, 0.99) / 1000, (unsigned long long)op->max_ns / 1000);
+    }
+
+    fprintf(f, "\n");
+    free(stats);
+    return fclose(f) ? UsbReturnCode_FailedWriteLocalFile : UsbReturnCode_Success;
+}
@@ -0,0 +1,438 @@
+/*
+*   TotalJustice
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "nxusb.h"
+#include "nxusb_stream.h"
+
+
+/*
+*   Ring shared by the streams.
+*/
+
+typedef struct
+{
+    uint8_t *data;
+    size_t size;
+    UsbRet ret;
+} usb_stream_slot_t;
+
+typedef struct
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    // signalled on every state change, both sides wait on it.
+
+    usb_stream_slot_t slots[USB_STREAM_DEPTH_MAX];
+    uint32_t depth;
+    size_t chunk_size;
+
+    // the producer fills slots and pushes them, the consumer pops and holds one at a time.
+    // for reads the worker produces, for writes the caller does.
+    uint32_t head;          // next filled slot to hand out.
+    uint32_t filled;        // slots filled and not yet handed out.
+    bool holding;           // the consumer holds the slot before head.
+    bool done;              // the producer has finished, nothing more will be pushed.
+    bool stop;              // asks the worker to exit.
+} usb_stream_ring_t;
+
+UsbRet __usb_ring_init(usb_stream_ring_t *ring, size_t chunk_size, uint32_t depth)
+{
+    if (!chunk_size)
+        return UsbReturnCode_EmptyField;
+
+    if (depth < USB_STREAM_DEPTH_MIN)
+        depth = USB_STREAM_DEPTH_MIN;
+    if (depth > USB_STREAM_DEPTH_MAX)
+        depth = USB_STREAM_DEPTH_MAX;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->depth = depth;
+    ring->chunk_size = chunk_size;
+
+    for (uint32_t i = 0; i < depth; i++)
+    {
+        ring->slots[i].data = usb_alloc_aligned(chunk_size);
+        if (!ring->slots[i].data)
+        {
+            for (uint32_t j = 0; j < i; j++)
+                usb_free_aligned(ring->slots[j].data);
+            return UsbReturnCode_FailedAllocPool;
+        }
+    }
+
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->cond, NULL);
+    return UsbReturnCode_Success;
+}
+
+UsbRet __usb_ring_start(usb_stream_ring_t *ring, void *(*func)(void *), void *user)
+{
+    if (pthread_create(&ring->thread, NULL, func, user))
+        return UsbReturnCode_Failure;
+    return UsbReturnCode_Success;
+}
+
+void __usb_ring_free(usb_stream_ring_t *ring)
+{
+    pthread_cond_destroy(&ring->cond);
+    pthread_mutex_destroy(&ring->lock);
+
+    for (uint32_t i = 0; i < ring->depth; i++)
+        usb_free_aligned(ring->slots[i].data);
+}
+
+// stops the worker after its current transfer, then frees the ring.
+void __usb_ring_exit(usb_stream_ring_t *ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->stop = true;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+
+    pthread_join(ring->thread, NULL);
+    __usb_ring_free(ring);
+}
+
+// producer side, waits for a free slot. returns NULL if asked to stop.
+// must be called with the lock held.
+usb_stream_slot_t *__usb_ring_wait_free(usb_stream_ring_t *ring)
+{
+    while (!ring->stop && ring->filled + ring->holding == ring->depth)
+        pthread_cond_wait(&ring->cond, &ring->lock);
+
+    if (ring->stop)
+        return NULL;
+    return &ring->slots[(ring->head + ring->filled) % ring->depth];
+}
+
+// producer side, same as __usb_ring_wait_free but returns NULL instead of waiting.
+// must be called with the lock held.
+usb_stream_slot_t *__usb_ring_try_free(usb_stream_ring_t *ring)
+{
+    if (ring->filled + ring->holding == ring->depth)
+        return NULL;
+    return &ring->slots[(ring->head + ring->filled) % ring->depth];
+}
+
+// producer side, marks the slot from __usb_ring_wait_free as filled.
+// must be called with the lock held.
+void __usb_ring_push(usb_stream_ring_t *ring)
+{
+    ring->filled++;
+    pthread_cond_broadcast(&ring->cond);
+}
+
+// consumer side, gives back the held slot then waits for a filled one.
+// returns NULL once the producer is done and nothing is left.
+// must be called with the lock held.
+usb_stream_slot_t *__usb_ring_pop(usb_stream_ring_t *ring)
+{
+    if (ring->holding)
+    {
+        ring->holding = false;
+        pthread_cond_broadcast(&ring->cond);
+    }
+
+    while (!ring->filled && !ring->done)
+        pthread_cond_wait(&ring->cond, &ring->lock);
+
+    if (!ring->filled)
+        return NULL;
+
+    usb_stream_slot_t *slot = &ring->slots[ring->head];
+    ring->head = (ring->head + 1) % ring->depth;
+    ring->filled--;
+    ring->holding = true;
+    return slot;
+}
+
+// producer side, flags that nothing more will be pushed.
+void __usb_ring_finish(usb_stream_ring_t *ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->done = true;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+
+
+/*
+*   Read Stream Functions.
+*/
+
+struct usb_read_stream
+{
+    usb_stream_ring_t ring;
+    uint64_t offset;
+    uint64_t remaining;
+    UsbRet error;           // first failed read, only touched by the caller.
+};
+
+void *__usb_read_stream_thread(void *user)
+{
+    usb_read_stream_t *stream = user;
+    usb_stream_ring_t *ring = &stream->ring;
+
+    while (stream->remaining)
+    {
+        pthread_mutex_lock(&ring->lock);
+        usb_stream_slot_t *slot = __usb_ring_wait_free(ring);
+        pthread_mutex_unlock(&ring->lock);
+
+        if (!slot)
+            break;
+
+        slot->size = stream->remaining < ring->chunk_size ? stream->remaining : ring->chunk_size;
+        slot->ret = usb_read_file(slot->data, slot->size, stream->offset);
+
+        pthread_mutex_lock(&ring->lock);
+        __usb_ring_push(ring);
+        pthread_mutex_unlock(&ring->lock);
+
+        if (usb_failed(slot->ret))
+            break;
+
+        stream->offset += slot->size;
+        stream->remaining -= slot->size;
+    }
+
+    __usb_ring_finish(ring);
+    return NULL;
+}
+
+UsbRet usb_read_stream_open(usb_read_stream_t **out, uint64_t offset, uint64_t size, size_t chunk_size, uint32_t depth)
+{
+    if (!out)
+        return UsbReturnCode_EmptyField;
+
+    usb_read_stream_t *stream = calloc(1, sizeof(usb_read_stream_t));
+    if (!stream)
+        return UsbReturnCode_FailedAllocPool;
+
+    UsbRet ret = __usb_ring_init(&stream->ring, chunk_size, depth);
+    if (usb_failed(ret))
+    {
+        free(stream);
+        return ret;
+    }
+
+    stream->offset = offset;
+    stream->remaining = size;
+
+    ret = __usb_ring_start(&stream->ring, __usb_read_stream_thread, stream);
+    if (usb_failed(ret))
+    {
+        __usb_ring_free(&stream->ring);
+        free(stream);
+        return ret;
+    }
+
+    *out = stream;
+    return UsbReturnCode_Success;
+}
+
+UsbRet usb_read_stream_next(usb_read_stream_t *stream, const void **data, size_t *size)
+{
+    if (!stream || !data || !size)
+        return UsbReturnCode_EmptyField;
+
+    *data = NULL;
+    *size = 0;
+
+    // the worker stops at a failed read, so no later chunk would be a clean end.
+    if (usb_failed(stream->error))
+        return stream->error;
+
+    pthread_mutex_lock(&stream->ring.lock);
+    usb_stream_slot_t *slot = __usb_ring_pop(&stream->ring);
+    pthread_mutex_unlock(&stream->ring.lock);
+
+    if (!slot)
+        return UsbReturnCode_Success;
+
+    if (usb_failed(slot->ret))
+    {
+        stream->error = slot->ret;
+        return slot->ret;
+    }
+
+    *data = slot->data;
+    *size = slot->size;
+    return UsbReturnCode_Success;
+}
+
+void usb_read_stream_close(usb_read_stream_t *stream)
+{
+    if (!stream)
+        return;
+
+    __usb_ring_exit(&stream->ring);
+    free(stream);
+}
+
+
+
+/*
+*   Write Stream Functions.
+*/
+
+struct usb_write_stream
+{
+    usb_stream_ring_t ring;
+    uint64_t offset;
+    UsbRet error;           // first failed write, guarded by the ring lock.
+    bool acquired;          // the caller has a slot from usb_write_stream_acquire.
+};
+
+void *__usb_write_stream_thread(void *user)
+{
+    usb_write_stream_t *stream = user;
+    usb_stream_ring_t *ring = &stream->ring;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&ring->lock);
+        usb_stream_slot_t *slot = __usb_ring_pop(ring);
+        bool failed = usb_failed(stream->error);
+        pthread_mutex_unlock(&ring->lock);
+
+        if (!slot)
+            break;
+
+        // keep draining after an error so the caller never waits on a full ring.
+        if (failed)
+            continue;
+
+        UsbRet ret = usb_write_to_file(slot->data, slot->size, stream->offset);
+        stream->offset += slot->size;
+
+        if (usb_failed(ret))
+        {
+            pthread_mutex_lock(&ring->lock);
+            stream->error = ret;
+            pthread_cond_broadcast(&ring->cond);
+            pthread_mutex_unlock(&ring->lock);
+        }
+    }
+
+    return NULL;
+}
+
+UsbRet usb_write_stream_open(usb_write_stream_t **out, uint64_t offset, size_t chunk_size, uint32_t depth)
+{
+    if (!out)
+        return UsbReturnCode_EmptyField;
+
+    usb_write_stream_t *stream = calloc(1, sizeof(usb_write_stream_t));
+    if (!stream)
+        return UsbReturnCode_FailedAllocPool;
+
+    UsbRet ret = __usb_ring_init(&stream->ring, chunk_size, depth);
+    if (usb_failed(ret))
+    {
+        free(stream);
+        return ret;
+    }
+
+    stream->offset = offset;
+    stream->error = UsbReturnCode_Success;
+
+    ret = __usb_ring_start(&stream->ring, __usb_write_stream_thread, stream);
+    if (usb_failed(ret))
+    {
+        __usb_ring_free(&stream->ring);
+        free(stream);
+        return ret;
+    }
+
+    *out = stream;
+    return UsbReturnCode_Success;
+}
+
+UsbRet usb_write_stream_acquire(usb_write_stream_t *stream, void **data)
+{
+    if (!stream || !data)
+        return UsbReturnCode_EmptyField;
+
+    pthread_mutex_lock(&stream->ring.lock);
+    usb_stream_slot_t *slot = stream->acquired ? NULL : __usb_ring_try_free(&stream->ring);
+    UsbRet ret = stream->error;
+    pthread_mutex_unlock(&stream->ring.lock);
+
+    if (usb_failed(ret))
+        return ret;
+    if (!slot)
+        return UsbReturnCode_StreamFull;
+
+    stream->acquired = true;
+    *data = slot->data;
+    return UsbReturnCode_Success;
+}
+
+UsbRet usb_write_stream_commit(usb_write_stream_t *stream, size_t size)
+{
+    if (!stream || !stream->acquired || !size || size > stream->ring.chunk_size)
+        return UsbReturnCode_EmptyField;
+
+    pthread_mutex_lock(&stream->ring.lock);
+    usb_stream_slot_t *slot = __usb_ring_try_free(&stream->ring);
+    slot->size = size;
+    __usb_ring_push(&stream->ring);
+    pthread_mutex_unlock(&stream->ring.lock);
+
+    stream->acquired = false;
+    return UsbReturnCode_Success;
+}
+
+UsbRet usb_write_stream_submit(usb_write_stream_t *stream, const void *data, size_t size)
+{
+    if (!data || !size || (stream && size > stream->ring.chunk_size))
+        return UsbReturnCode_EmptyField;
+
+    void *buf;
+    UsbRet ret = usb_write_stream_acquire(stream, &buf);
+    if (usb_failed(ret))
+        return ret;
+
+    memcpy(buf, data, size);
+    return usb_write_stream_commit(stream, size);
+}
+
+UsbRet usb_write_stream_wait(usb_write_stream_t *stream)
+{
+    if (!stream)
+        return UsbReturnCode_EmptyField;
+
+    usb_stream_ring_t *ring = &stream->ring;
+
+    pthread_mutex_lock(&ring->lock);
+    while (!usb_failed(stream->error) && ring->filled + ring->holding == ring->depth)
+        pthread_cond_wait(&ring->cond, &ring->lock);
+    UsbRet ret = stream->error;
+    pthread_mutex_unlock(&ring->lock);
+
+    return ret;
+}
+
+UsbRet usb_write_stream_close(usb_write_stream_t *stream)
+{
+    if (!stream)
+        return UsbReturnCode_EmptyField;
+
+    // let the worker drain what's queued, then join it.
+    __usb_ring_finish(&stream->ring);
+    pthread_join(stream->ring.thread, NULL);
+
+    UsbRet ret = stream->error;
+    __usb_ring_free(&stream->ring);
+    free(stream);
+    return ret;
+}
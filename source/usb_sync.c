@@ -0,0 +1,387 @@
+/*
+*   TotalJustice
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "nxusb.h"
+#include "nxusb_delta.h"
+#include "nxusb_hash.h"
+#include "usb_internal.h"
+
+#define USB_SYNC_TEMP_SUFFIX ".nxusb-delta"
+
+_Static_assert(sizeof(usb_delta_sig_t) == 0x4 + USB_DELTA_STRONG_SIZE, "usb_delta_sig_t must match the host");
+_Static_assert(sizeof(usb_delta_op_t) == 0x10, "usb_delta_op_t must match the host");
+_Static_assert(offsetof(usb_delta_op_t, count) == 0x4, "usb_delta_op_t must match the host");
+_Static_assert(offsetof(usb_delta_op_t, index) == 0x8, "usb_delta_op_t must match the host");
+_Static_assert(sizeof(usb_delta_request_t) == 0x10, "usb_delta_request_t must match the host");
+_Static_assert(offsetof(usb_delta_request_t, compressed) == 0x8, "usb_delta_request_t must match the host");
+_Static_assert(sizeof(usb_delta_sig_header_t) == 0x10, "usb_delta_sig_header_t must match the host");
+_Static_assert(offsetof(usb_delta_sig_header_t, count) == 0xC, "usb_delta_sig_header_t must match the host");
+
+
+typedef struct
+{
+    bool compressed;
+    bool link_failed;       // an op didn't make it, so the stream can't be ended cleanly.
+    uint32_t block_size;
+    usb_delta_stats_t *stats;
+} usb_sync_push_t;
+
+
+UsbRet __usb_sync_read(void *user, void *out, size_t size, size_t *read)
+{
+    FILE *f = user;
+    *read = f ? fread(out, 1, size, f) : 0;
+    return f && ferror(f) ? UsbReturnCode_FailedReadLocalFile : UsbReturnCode_Success;
+}
+
+UsbRet __usb_sync_emit(void *user, const usb_delta_op_t *op, const void *data)
+{
+    usb_sync_push_t *push = user;
+    const usb_delta_op_t wire = { op->type, {0}, __usb_le32(op->count), __usb_le64(op->index) };
+
+    UsbRet ret = usb_write(&wire, sizeof(wire));
+    if (usb_succeeded(ret))
+    {
+        switch (op->type)
+        {
+            case UsbDeltaOp_Copy:
+                push->stats->copied += (uint64_t)op->count * push->block_size;
+                break;
+            case UsbDeltaOp_Literal:
+                push->stats->literal += op->count;
+                ret = push->compressed ? __usb_write_blocks(data, op->count) : usb_write(data, op->count);
+                break;
+            case UsbDeltaOp_End:
+                push->stats->size = op->index;
+                ret = usb_write(data, op->count);
+                break;
+        }
+    }
+
+    push->link_failed = usb_failed(ret);
+    return ret;
+}
+
+// sends the poll, the request and the path, the caller sends anything after that.
+UsbRet __usb_sync_request(uint8_t mode, const char *path, const usb_delta_request_t *request, size_t extra)
+{
+    if (!usb_host_has_caps(UsbCap_Delta))
+        return UsbReturnCode_UnsupportedByHost;
+
+    const size_t len = strlen(path);
+    if (len >= USB_FILE_NAME_MAX)
+        return UsbReturnCode_FileNameTooLarge;
+
+    struct
+    {
+        usb_delta_request_t header;
+        char path[USB_FILE_NAME_MAX];
+    } buf = { *request, {0} };
+    memcpy(buf.path, path, len);
+    buf.header.block_size = __usb_le32(request->block_size);
+    buf.header.count = __usb_le32(request->count);
+
+    return __usb_request(mode, sizeof(buf.header) + len + extra, &buf, sizeof(buf.header) + len);
+}
+
+// fetches the signatures of the host's copy of path, none if it doesn't have one.
+UsbRet __usb_sync_get_sigs(const char *path, uint32_t block_size, usb_delta_sig_t **out, size_t *count)
+{
+    const usb_delta_request_t request = { block_size, 0, 0, {0} };
+    *out = NULL;
+    *count = 0;
+
+    UsbRet ret = __usb_sync_request(UsbMode_GetFileSignatures, path, &request, 0);
+    if (usb_failed(ret))
+        return ret;
+
+    ret = usb_get_result();
+    if (ret == UsbReturnCode_FailedOpenFile)
+        return UsbReturnCode_Success;
+    if (usb_failed(ret))
+        return ret;
+
+    usb_delta_sig_header_t header;
+    ret = usb_read(&header, sizeof(header));
+    if (usb_failed(ret))
+        return ret;
+
+    header.file_size = __usb_le64(header.file_size);
+    header.block_size = __usb_le32(header.block_size);
+    header.count = __usb_le32(header.count);
+
+    if (header.block_size != block_size || header.count > USB_DELTA_SIGS_MAX)
+        return UsbReturnCode_BadDelta;
+
+    if (!header.count)
+        return UsbReturnCode_Success;
+
+    *out = malloc(header.count * sizeof(usb_delta_sig_t));
+    if (!*out)
+        return UsbReturnCode_FailedAllocPool;
+
+    *count = header.count;
+    ret = usb_read(*out, header.count * sizeof(usb_delta_sig_t));
+    if (usb_failed(ret))
+        return ret;
+
+    for (uint32_t i = 0; i < header.count; i++)
+        (*out)[i].weak = __usb_le32((*out)[i].weak);
+    return UsbReturnCode_Success;
+}
+
+char *__usb_sync_temp_path(const char *path)
+{
+    char *temp = malloc(strlen(path) + sizeof(USB_SYNC_TEMP_SUFFIX));
+    if (temp)
+        strcat(strcpy(temp, path), USB_SYNC_TEMP_SUFFIX);
+    return temp;
+}
+
+
+
+/*
+*   Sync Functions.
+*/
+
+UsbRet usb_sync_file_to_host(const char *local_path, const char *host_path, usb_delta_stats_t *stats)
+{
+    if (!local_path || !host_path)
+        return UsbReturnCode_EmptyField;
+
+    usb_delta_stats_t st = {0};
+    FILE *local = fopen(local_path, "rb");
+    if (!local)
+        return UsbReturnCode_FailedOpenLocalFile;
+
+    uint64_t size;
+    if (!__usb_local_size(local, &size))
+    {
+        fclose(local);
+        return UsbReturnCode_FailedReadLocalFile;
+    }
+
+    usb_delta_sig_t *sigs;
+    size_t count;
+    const uint32_t block_size = usb_delta_block_size(size);
+
+    UsbRet ret = __usb_sync_get_sigs(host_path, block_size, &sigs, &count);
+    if (usb_failed(ret))
+        goto done;
+
+    usb_sync_push_t push = { usb_get_compression() != UsbCompression_None, false, block_size, &st };
+    const usb_delta_request_t request = { block_size, 0, push.compressed, {0} };
+
+    ret = __usb_sync_request(UsbMode_ApplyFileDelta, host_path, &request, 0);
+    if (usb_failed(ret))
+        goto done;
+
+    ret = usb_delta_generate(sigs, count, block_size, __usb_sync_read, local, __usb_sync_emit, &push);
+
+    // the local file failed part way, end the stream with a hash that won't match so the host drops it.
+    if (usb_failed(ret) && !push.link_failed)
+    {
+        const uint8_t digest[USB_SHA256_SIZE] = {0};
+        const usb_delta_op_t op = { UsbDeltaOp_End, {0}, sizeof(digest), 0 };
+        if (usb_succeeded(__usb_sync_emit(&push, &op, digest)))
+            usb_get_result();
+        goto done;
+    }
+
+    if (usb_succeeded(ret))
+        ret = usb_get_result();
+
+done:
+    free(sigs);
+    fclose(local);
+
+    if (stats)
+        *stats = st;
+    return ret;
+}
+
+UsbRet usb_sync_file_from_host(const char *host_path, const char *local_path, usb_delta_stats_t *stats)
+{
+    if (!local_path || !host_path)
+        return UsbReturnCode_EmptyField;
+
+    usb_delta_stats_t st = {0};
+    usb_delta_sig_t *sigs = NULL;
+    size_t count = 0;
+    uint64_t basis_size = 0;
+    uint8_t *buf = NULL;
+    FILE *out = NULL;
+    UsbRet ret = UsbReturnCode_Success;
+
+    // the old copy is optional, without one the whole file comes over as literals.
+    FILE *basis = fopen(local_path, "rb");
+    if (basis && !__usb_local_size(basis, &basis_size))
+    {
+        fclose(basis);
+        return UsbReturnCode_FailedReadLocalFile;
+    }
+
+    char *temp = __usb_sync_temp_path(local_path);
+    const uint32_t block_size = usb_delta_block_size(basis_size);
+    const size_t max = basis_size / block_size < USB_DELTA_SIGS_MAX ? basis_size / block_size : USB_DELTA_SIGS_MAX;
+
+    buf = usb_alloc_aligned(USB_DELTA_LITERAL_MAX);
+    sigs = malloc((max ? max : 1) * sizeof(*sigs));
+    if (!temp || !buf || !sigs)
+    {
+        ret = UsbReturnCode_FailedAllocPool;
+        goto done;
+    }
+
+    if (basis)
+    {
+        ret = usb_delta_sign(__usb_sync_read, basis, block_size, sigs, max, &count);
+        if (usb_failed(ret))
+            goto done;
+    }
+
+    out = fopen(temp, "wb");
+    if (!out)
+    {
+        ret = UsbReturnCode_FailedOpenLocalFile;
+        goto done;
+    }
+
+    const bool compressed = usb_get_compression() != UsbCompression_None;
+    const usb_delta_request_t request = { block_size, count, compressed, {0} };
+
+    // only the count is needed once they're sent, so they're encoded in place.
+    for (size_t i = 0; i < count; i++)
+        sigs[i].weak = __usb_le32(sigs[i].weak);
+
+    ret = __usb_sync_request(UsbMode_GetFileDelta, host_path, &request, count * sizeof(*sigs));
+    if (usb_succeeded(ret) && count)
+        ret = usb_write(sigs, count * sizeof(*sigs));
+    if (usb_succeeded(ret))
+        ret = usb_get_result();
+    if (usb_failed(ret))
+        goto done;
+
+    usb_sha256_t sha;
+    usb_sha256_init(&sha);
+
+    for (;;)
+    {
+        usb_delta_op_t op;
+        ret = usb_read(&op, sizeof(op));
+        if (usb_failed(ret))
+            goto done;
+
+        op.count = __usb_le32(op.count);
+        op.index = __usb_le64(op.index);
+
+        if (op.type == UsbDeltaOp_End)
+        {
+            uint8_t digest[USB_SHA256_SIZE], expected[USB_SHA256_SIZE];
+            if (op.count != sizeof(expected))
+            {
+                ret = UsbReturnCode_BadDelta;
+                goto done;
+            }
+
+            ret = usb_read(expected, sizeof(expected));
+            if (usb_failed(ret))
+                goto done;
+
+            usb_sha256_final(&sha, digest);
+            if (op.index != st.size || memcmp(digest, expected, sizeof(digest)))
+                ret = UsbReturnCode_ChecksumMismatch;
+            break;
+        }
+
+        if (op.type == UsbDeltaOp_Literal)
+        {
+            if (op.count > USB_DELTA_LITERAL_MAX)
+            {
+                ret = UsbReturnCode_BadDelta;
+                goto done;
+            }
+
+            ret = compressed ? __usb_read_blocks(buf, op.count) : usb_read(buf, op.count);
+            if (usb_failed(ret))
+                goto done;
+
+            if (fwrite(buf, 1, op.count, out) != op.count)
+            {
+                ret = UsbReturnCode_FailedWriteLocalFile;
+                goto done;
+            }
+
+            usb_sha256_update(&sha, buf, op.count);
+            st.literal += op.count;
+            st.size += op.count;
+            continue;
+        }
+
+        if (op.type != UsbDeltaOp_Copy || op.index > count || op.count > count - op.index)
+        {
+            ret = UsbReturnCode_BadDelta;
+            goto done;
+        }
+
+        uint64_t left = (uint64_t)op.count * block_size;
+        if (fseek(basis, op.index * block_size, SEEK_SET))
+        {
+            ret = UsbReturnCode_FailedReadLocalFile;
+            goto done;
+        }
+
+        while (left)
+        {
+            const size_t chunk = left < USB_DELTA_LITERAL_MAX ? left : USB_DELTA_LITERAL_MAX;
+            if (fread(buf, 1, chunk, basis) != chunk)
+            {
+                ret = UsbReturnCode_FailedReadLocalFile;
+                goto done;
+            }
+
+            if (fwrite(buf, 1, chunk, out) != chunk)
+            {
+                ret = UsbReturnCode_FailedWriteLocalFile;
+                goto done;
+            }
+
+            usb_sha256_update(&sha, buf, chunk);
+            st.copied += chunk;
+            st.size += chunk;
+            left -= chunk;
+        }
+    }
+
+done:
+    if (basis)
+        fclose(basis);
+    if (out && fclose(out) && usb_succeeded(ret))
+        ret = UsbReturnCode_FailedWriteLocalFile;
+
+    // the switch's fs won't rename over a file, so the old one has to go first.
+    if (out && usb_succeeded(ret))
+    {
+        remove(local_path);
+        if (rename(temp, local_path))
+            ret = UsbReturnCode_FailedWriteLocalFile;
+    }
+    else if (out)
+        remove(temp);
+
+    free(temp);
+    free(sigs);
+    usb_free_aligned(buf);
+
+    if (stats)
+        *stats = st;
+    return ret;
+}
@@ -0,0 +1,153 @@
+/*
+*   TotalJustice
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "nxusb.h"
+#include "nxusb_trace.h"
+#include "usb_internal.h"
+
+
+#define USB_TRACE_BUFFER_SIZE 0x100000
+
+struct usb_trace
+{
+    usb_transport_t inner;
+    FILE *file;
+    char *buffer;           // stdio buffer, so records go out in large writes.
+    pthread_mutex_t lock;   // the async dispatcher and receiver transfer at the same time.
+    uint64_t start;
+    uint32_t flags;
+    bool failed;            // a record didn't make it to the file.
+};
+
+
+void __usb_trace_record(usb_trace_t *trace, uint8_t direction, const void *data, size_t size, size_t moved, uint64_t start)
+{
+    const uint64_t now = __usb_time_ns();
+    const uint64_t duration = now - start;
+
+    usb_trace_record_t record = {0};
+    record.time_ns = start - trace->start;
+    record.size = size > UINT32_MAX ? UINT32_MAX : size;
+    record.moved = moved > UINT32_MAX ? UINT32_MAX : moved;
+    record.duration_ns = duration > UINT32_MAX ? UINT32_MAX : duration;
+    record.direction = direction;
+    record.mode = __usb_stats_mode();
+    record.payload = (trace->flags & UsbTraceFlag_Payload) && moved;
+
+    pthread_mutex_lock(&trace->lock);
+    if (fwrite(&record, sizeof(record), 1, trace->file) != 1)
+        trace->failed = true;
+    if (record.payload && fwrite(data, 1, record.moved, trace->file) != record.moved)
+        trace->failed = true;
+    pthread_mutex_unlock(&trace->lock);
+}
+
+UsbRet __usb_trace_init(void *user)
+{
+    usb_trace_t *trace = user;
+    return trace->inner.init ? trace->inner.init(trace->inner.user) : UsbReturnCode_Success;
+}
+
+void __usb_trace_exit(void *user)
+{
+    usb_trace_t *trace = user;
+    if (trace->inner.exit)
+        trace->inner.exit(trace->inner.user);
+}
+
+size_t __usb_trace_read(void *user, void *out, size_t size)
+{
+    usb_trace_t *trace = user;
+    const uint64_t start = __usb_time_ns();
+    const size_t moved = trace->inner.read(trace->inner.user, out, size);
+    __usb_trace_record(trace, UsbTraceDirection_Read, out, size, moved, start);
+    return moved;
+}
+
+size_t __usb_trace_write(void *user, const void *in, size_t size)
+{
+    usb_trace_t *trace = user;
+    const uint64_t start = __usb_time_ns();
+    const size_t moved = trace->inner.write(trace->inner.user, in, size);
+    __usb_trace_record(trace, UsbTraceDirection_Write, in, size, moved, start);
+    return moved;
+}
+
+
+
+/*
+*   Trace Functions.
+*/
+
+UsbRet usb_trace_open(usb_trace_t **out, const char *path, uint32_t flags, const usb_transport_t *inner)
+{
+    if (!out || !path || !inner)
+        return UsbReturnCode_EmptyField;
+
+    usb_trace_t *trace = calloc(1, sizeof(*trace));
+    if (!trace)
+        return UsbReturnCode_FailedAllocPool;
+
+    trace->buffer = malloc(USB_TRACE_BUFFER_SIZE);
+    if (!trace->buffer)
+    {
+        free(trace);
+        return UsbReturnCode_FailedAllocPool;
+    }
+
+    trace->file = fopen(path, "wb");
+    if (!trace->file)
+    {
+        free(trace->buffer);
+        free(trace);
+        return UsbReturnCode_FailedOpenLocalFile;
+    }
+    setvbuf(trace->file, trace->buffer, _IOFBF, USB_TRACE_BUFFER_SIZE);
+
+    const usb_trace_header_t header = { USB_TRACE_MAGIC, USB_TRACE_VERSION, flags };
+    if (fwrite(&header, sizeof(header), 1, trace->file) != 1)
+    {
+        fclose(trace->file);
+        free(trace->buffer);
+        free(trace);
+        return UsbReturnCode_FailedWriteLocalFile;
+    }
+
+    trace->inner = *inner;
+    trace->flags = flags;
+    trace->start = __usb_time_ns();
+    pthread_mutex_init(&trace->lock, NULL);
+
+    *out = trace;
+    return UsbReturnCode_Success;
+}
+
+void usb_trace_transport(usb_trace_t *trace, usb_transport_t *out)
+{
+    out->init = __usb_trace_init;
+    out->exit = __usb_trace_exit;
+    out->read = __usb_trace_read;
+    out->write = __usb_trace_write;
+    out->user = trace;
+}
+
+UsbRet usb_trace_close(usb_trace_t *trace)
+{
+    if (!trace)
+        return UsbReturnCode_EmptyField;
+
+    const bool failed = fclose(trace->file) || trace->failed;
+    pthread_mutex_destroy(&trace->lock);
+    free(trace->buffer);
+    free(trace);
+
+    return failed ? UsbReturnCode_FailedWriteLocalFile : UsbReturnCode_Success;
+}
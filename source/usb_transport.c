@@ -0,0 +1,108 @@
+/*
+*   TotalJustice
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SWITCH__
+#include <switch.h>
+#else
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+#include "nxusb.h"
+
+
+#ifdef __SWITCH__
+
+/*
+*   libnx usbComms.
+*/
+
+UsbRet __usb_transport_nx_init(void *user)
+{
+    if (R_FAILED(usbCommsInitialize()))
+        return UsbReturnCode_FailedToInitComms;
+    return UsbReturnCode_Success;
+}
+
+void __usb_transport_nx_exit(void *user)
+{
+    usbCommsExit();
+}
+
+size_t __usb_transport_nx_read(void *user, void *out, size_t size)
+{
+    return usbCommsRead(out, size);
+}
+
+size_t __usb_transport_nx_write(void *user, const void *in, size_t size)
+{
+    return usbCommsWrite(in, size);
+}
+
+void usb_transport_nx(usb_transport_t *out)
+{
+    out->init = __usb_transport_nx_init;
+    out->exit = __usb_transport_nx_exit;
+    out->read = __usb_transport_nx_read;
+    out->write = __usb_transport_nx_write;
+    out->user = NULL;
+}
+
+#else
+
+/*
+*   File descriptors (socketpair, pipe, fifo).
+*/
+
+size_t __usb_transport_fd_read(void *user, void *out, size_t size)
+{
+    const usb_fd_transport_t *fds = user;
+    uint8_t *dst = out;
+    size_t done = 0;
+
+    while (done < size)
+    {
+        ssize_t ret = read(fds->read_fd, dst + done, size - done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        done += ret;
+    }
+
+    return done;
+}
+
+size_t __usb_transport_fd_write(void *user, const void *in, size_t size)
+{
+    const usb_fd_transport_t *fds = user;
+    const uint8_t *src = in;
+    size_t done = 0;
+
+    while (done < size)
+    {
+        ssize_t ret = write(fds->write_fd, src + done, size - done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        done += ret;
+    }
+
+    return done;
+}
+
+void usb_transport_fd(usb_transport_t *out, usb_fd_transport_t *fds)
+{
+    out->init = NULL;
+    out->exit = NULL;
+    out->read = __usb_transport_fd_read;
+    out->write = __usb_transport_fd_write;
+    out->user = fds;
+}
+
+#endif